@@ -0,0 +1,99 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Churn benchmark: keeps a trie at a fixed number of keys while
+// erasing and inserting random keys, and reports throughput and
+// resident memory of every cycle. A mutable trie that reclaims
+// erased states should level off instead of growing without bound.
+//
+//   churn [trie_type(1 = single, * = double)] [keys] [cycles]
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "trie.h"
+
+using namespace dutil;
+
+static std::string make_word(unsigned int *seed)
+{
+    std::string word;
+    size_t length = 4 + rand_r(seed) % 12;
+    while (word.size() < length)
+        word.push_back('a' + rand_r(seed) % 26);
+    return word;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// Returns resident set size in kilobytes.
+static long resident_size()
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    bool single = argc > 1 && argv[1][0] == '1';
+    size_t keys = argc > 2?strtoul(argv[2], NULL, 10):100000;
+    size_t cycles = argc > 3?strtoul(argv[3], NULL, 10):10;
+    unsigned int seed = 1;
+    std::vector<std::string> words;
+    size_t i, j;
+
+    trie *mtrie = trie::create_trie(single?trie::SINGLE_TRIE
+                                          :trie::DOUBLE_TRIE);
+    for (i = 0; i < keys; i++) {
+        words.push_back(make_word(&seed));
+        mtrie->insert(words[i].c_str(), words[i].size(), i);
+    }
+    printf("%s_trie, %lu keys, rss %ldK\n", single?"single":"double",
+           static_cast<unsigned long>(keys), resident_size());
+    printf("%5s %12s %12s %10s\n", "cycle", "erase/s", "insert/s", "rss");
+
+    for (i = 0; i < cycles; i++) {
+        // replace a quarter of the keys with new ones
+        size_t count = keys / 4;
+        std::vector<size_t> victims(keys);
+        for (j = 0; j < keys; j++)
+            victims[j] = j;
+        for (j = 0; j < count; j++)  // distinct victims
+            std::swap(victims[j], victims[j + rand_r(&seed) % (keys - j)]);
+        double start = now();
+        for (j = 0; j < count; j++) {
+            std::string &word = words[victims[j]];
+            mtrie->erase(trie::key_type(word.c_str(), word.size()));
+        }
+        double middle = now();
+        for (j = 0; j < count; j++) {
+            std::string &word = words[victims[j]];
+            word = make_word(&seed);
+            mtrie->insert(word.c_str(), word.size(), victims[j]);
+        }
+        double end = now();
+        printf("%5lu %12.0f %12.0f %9ldK\n", static_cast<unsigned long>(i),
+               count / (middle - start), count / (end - middle),
+               resident_size());
+    }
+    delete mtrie;
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,160 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Filter benchmark: builds one archive with a filter of keys and one
+// without, and measures lookups through trie::search and trie_engine
+// for mixes of hits and misses. Misses are keys of the same kind as
+// the hits, many of them sharing long prefixes with keys in the trie,
+// so without a filter they walk deep before failing.
+//
+//   filter [keys] [queries]
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "trie.h"
+#include "trie_engine.h"
+
+using namespace dutil;
+
+static std::string make_word(unsigned int *seed)
+{
+    static const char *hosts[] = {"www.example", "news.site", "shop.store",
+                                  "mail.host"};
+    std::string word = "http://";
+    word += hosts[rand_r(seed) % 4];
+    word += ".com/";
+    size_t length = 6 + rand_r(seed) % 16;
+    while (word.size() < length + 20)
+        word.push_back('a' + rand_r(seed) % 26);
+    return word;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// Keeps results of timed loops alive.
+static volatile size_t sink;
+
+/// Returns nanoseconds per lookup through trie::search.
+static double measure_trie(const trie *mtrie,
+                           const std::vector<std::string> &queries)
+{
+    trie::value_type value;
+    size_t found = 0;
+    double start = now();
+    for (size_t i = 0; i < queries.size(); i++)
+        found += mtrie->search(queries[i].data(), queries[i].size(), &value);
+    sink = found;
+    return (now() - start) * 1e9 / queries.size();
+}
+
+/// Returns nanoseconds per lookup through trie_engine.
+static double measure_engine(const trie_engine<flat_layout> &engine,
+                             const std::vector<std::string> &queries)
+{
+    trie::value_type value;
+    size_t found = 0;
+    double start = now();
+    for (size_t i = 0; i < queries.size(); i++)
+        found += engine.search(queries[i].data(), queries[i].size(), &value);
+    sink = found;
+    return (now() - start) * 1e9 / queries.size();
+}
+
+/// Maps an archive into memory, returns its size.
+static size_t map_archive(const char *filename, void **data)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    fstat(fd, &st);
+    *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return st.st_size;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int kRatios[] = {0, 20, 50, 80, 95, 100};
+    const char *archive = "/tmp/bench_filter";
+    const char *plain_archive = "/tmp/bench_filter_plain";
+    size_t keys = argc > 1?strtoul(argv[1], NULL, 10):500000;
+    size_t count = argc > 2?strtoul(argv[2], NULL, 10):1000000;
+    unsigned int seed = 1;
+    std::vector<std::string> words, misses;
+    std::set<std::string> seen;
+    size_t i, j;
+
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    while (words.size() < keys) {
+        std::string word = make_word(&seed);
+        if (seen.insert(word).second) {
+            mtrie->insert(word.c_str(), word.size(), words.size() + 1);
+            words.push_back(word);
+        }
+    }
+    // half of misses differ from a key in the last byte only
+    while (misses.size() < keys) {
+        std::string word = misses.size() % 2?make_word(&seed)
+                                            :words[rand_r(&seed) % keys];
+        if (misses.size() % 2 == 0)
+            word[word.size() - 1] = 'A' + rand_r(&seed) % 26;
+        if (!seen.count(word))
+            misses.push_back(word);
+    }
+    mtrie->build(plain_archive);
+    mtrie->set_archive_options(trie::ARCHIVE_FILTER);
+    mtrie->build(archive, true);
+    delete mtrie;
+
+    trie *plain = trie::create_trie(plain_archive);
+    trie *filtered = trie::create_trie(archive);
+    void *plain_data, *data;
+    size_t plain_size = map_archive(plain_archive, &plain_data);
+    size_t size = map_archive(archive, &data);
+    trie_engine<flat_layout> plain_engine(plain_data, plain_size);
+    trie_engine<flat_layout> engine(data, size);
+
+    printf("%lu keys, archive %lu bytes, %lu with filter\n",
+           static_cast<unsigned long>(keys),
+           static_cast<unsigned long>(plain_size),
+           static_cast<unsigned long>(size));
+    printf("%5s %12s %12s %12s %12s  (ns/lookup)\n", "hit%", "trie",
+           "+filter", "engine", "+filter");
+    for (i = 0; i < sizeof(kRatios) / sizeof(kRatios[0]); i++) {
+        std::vector<std::string> queries;
+        for (j = 0; j < count; j++) {
+            if (static_cast<int>(rand_r(&seed) % 100) < kRatios[i])
+                queries.push_back(words[rand_r(&seed) % keys]);
+            else
+                queries.push_back(misses[rand_r(&seed) % keys]);
+        }
+        printf("%5d %12.1f %12.1f %12.1f %12.1f\n", kRatios[i],
+               measure_trie(plain, queries), measure_trie(filtered, queries),
+               measure_engine(plain_engine, queries),
+               measure_engine(engine, queries));
+    }
+
+    munmap(plain_data, plain_size);
+    munmap(data, size);
+    delete plain;
+    delete filtered;
+    unlink(archive);
+    unlink(plain_archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
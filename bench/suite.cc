@@ -0,0 +1,526 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Benchmark suite: generates reproducible synthetic key sets and
+// measures, for both trie types, build time, archive size, exact hit
+// and miss lookups, prefix enumeration and cold versus warm loading of
+// the archive. Lookups are timed one by one to report p50/p99/p999, with
+// the cost of reading the clock measured and taken off, and throughput
+// is measured separately without the clock in the loop.
+//
+//   suite [-k keys] [-q queries] [-s seed] [-d dataset] [-j]
+//
+// -j writes JSON to stdout so that runs can be kept and compared.
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "trie.h"
+
+using namespace dutil;
+
+/// A small, fast and reproducible generator (splitmix64).
+class random_type {
+  public:
+    explicit random_type(uint64_t seed)
+        :state_(seed)
+    {
+    }
+
+    uint64_t next()
+    {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /// Returns a number in [0, n).
+    size_t below(size_t n)
+    {
+        return next() % n;
+    }
+
+    /// Returns a number in [0, 1).
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    uint64_t state_;
+};
+
+/// Draws ranks in [0, n) with probability proportional to 1 / (rank + 1).
+class zipf_type {
+  public:
+    zipf_type(size_t n, double skew)
+        :cdf_(n)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+            cdf_[i] = (sum += 1.0 / pow(i + 1.0, skew));
+        for (size_t i = 0; i < n; i++)
+            cdf_[i] /= sum;
+    }
+
+    size_t next(random_type *random) const
+    {
+        return std::lower_bound(cdf_.begin(), cdf_.end(), random->uniform())
+               - cdf_.begin();
+    }
+
+  private:
+    std::vector<double> cdf_;
+};
+
+static const char *kSyllables[] = {
+    "an", "ba", "co", "de", "el", "fi", "go", "hu", "in", "jo", "ka", "li",
+    "mo", "ne", "or", "pa", "qu", "ra", "si", "to", "un", "ve", "wa", "xi"
+};
+
+static std::string make_syllables(random_type *random, size_t count)
+{
+    std::string word;
+    for (size_t i = 0; i < count; i++)
+        word += kSyllables[random->below(sizeof(kSyllables)
+                                         / sizeof(kSyllables[0]))];
+    return word;
+}
+
+static std::string make_url(random_type *random)
+{
+    static const char *schemes[] = {"http://", "https://"};
+    static const char *tlds[] = {".com", ".net", ".org", ".cn", ".io"};
+    static zipf_type hosts(2000, 1.0);
+    random_type host(hosts.next(random) + 1);
+    std::string url = schemes[random->below(2)];
+    url += "www." + make_syllables(&host, 2 + host.below(3));
+    url += tlds[host.below(5)];
+    size_t depth = 1 + random->below(4);
+    for (size_t i = 0; i < depth; i++)
+        url += "/" + make_syllables(random, 1 + random->below(4));
+    if (random->below(3) == 0) {
+        char id[32];
+        snprintf(id, sizeof(id), "?id=%lu",
+                 static_cast<unsigned long>(random->below(1000000)));
+        url += id;
+    }
+    return url;
+}
+
+/// Appends code point ch in UTF-8.
+static void append_utf8(std::string *word, uint32_t ch)
+{
+    word->push_back(static_cast<char>(0xe0 | (ch >> 12)));
+    word->push_back(static_cast<char>(0x80 | ((ch >> 6) & 0x3f)));
+    word->push_back(static_cast<char>(0x80 | (ch & 0x3f)));
+}
+
+static std::string make_cjk(random_type *random)
+{
+    // common characters first, from the CJK unified ideographs block
+    static zipf_type chars(0x9fa5 - 0x4e00, 0.8);
+    std::string word;
+    size_t length = 2 + random->below(3);
+    for (size_t i = 0; i < length; i++)
+        append_utf8(&word, 0x4e00 + chars.next(random));
+    return word;
+}
+
+static std::string make_binary(random_type *random)
+{
+    std::string word;
+    size_t length = 4 + random->below(13);
+    for (size_t i = 0; i < length; i++)
+        word.push_back(static_cast<char>(random->below(256)));
+    return word;
+}
+
+static std::string make_ngram(random_type *random)
+{
+    static std::vector<std::string> vocabulary;
+    static zipf_type words(5000, 1.1);
+    if (vocabulary.empty()) {
+        random_type fixed(5000);
+        for (size_t i = 0; i < 5000; i++)
+            vocabulary.push_back(make_syllables(&fixed, 1 + fixed.below(4)));
+    }
+    std::string ngram;
+    size_t n = 2 + random->below(3);
+    for (size_t i = 0; i < n; i++) {
+        if (i)
+            ngram.push_back(' ');
+        ngram += vocabulary[words.next(random)];
+    }
+    return ngram;
+}
+
+typedef std::string (*generator_type)(random_type *random);
+
+typedef struct {
+    const char *name;
+    generator_type generate;
+} dataset_type;
+
+static const dataset_type kDatasets[] = {
+    {"url", make_url},
+    {"cjk", make_cjk},
+    {"binary", make_binary},
+    {"ngram", make_ngram}
+};
+
+/// Generates count distinct keys.
+static void generate_keys(const dataset_type &dataset, uint64_t seed,
+                          size_t count, std::vector<std::string> *keys,
+                          std::set<std::string> *seen)
+{
+    random_type random(seed);
+    size_t tries = 0;
+    while (keys->size() < count && tries++ < count * 20) {
+        std::string key = dataset.generate(&random);
+        if (seen->insert(key).second)
+            keys->push_back(key);
+    }
+}
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Returns nanoseconds taken by reading the clock twice.
+static uint64_t clock_overhead()
+{
+    std::vector<uint64_t> samples(10000);
+    for (size_t i = 0; i < samples.size(); i++) {
+        uint64_t start = now();
+        samples[i] = now() - start;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+/// Keeps results of timed loops alive.
+static volatile size_t sink;
+
+typedef struct {
+    double ops_per_sec;
+    double p50, p99, p999;  ///< In nanoseconds.
+    double items_per_sec;   ///< Keys enumerated, for prefix search.
+} latency_type;
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return static_cast<double>(sorted[i]);
+}
+
+static void summarize(std::vector<uint64_t> *samples, uint64_t overhead,
+                      latency_type *latency)
+{
+    for (size_t i = 0; i < samples->size(); i++)
+        (*samples)[i] = (*samples)[i] > overhead?(*samples)[i] - overhead:0;
+    std::sort(samples->begin(), samples->end());
+    latency->p50 = percentile(*samples, 0.5);
+    latency->p99 = percentile(*samples, 0.99);
+    latency->p999 = percentile(*samples, 0.999);
+}
+
+static void measure_lookup(const trie *mtrie,
+                           const std::vector<std::string> &queries,
+                           uint64_t overhead, latency_type *latency)
+{
+    std::vector<trie::key_type *> keys(queries.size());
+    std::vector<uint64_t> samples(queries.size());
+    trie::value_type value;
+    size_t i, found = 0;
+    for (i = 0; i < queries.size(); i++)
+        keys[i] = new trie::key_type(queries[i].data(), queries[i].size());
+    uint64_t start = now();
+    for (i = 0; i < keys.size(); i++)
+        found += mtrie->search(*keys[i], &value);
+    latency->ops_per_sec = keys.size() * 1e9 / std::max<uint64_t>(now()
+                                                                  - start, 1);
+    for (i = 0; i < keys.size(); i++) {
+        uint64_t t = now();
+        found += mtrie->search(*keys[i], &value);
+        samples[i] = now() - t;
+    }
+    summarize(&samples, overhead, latency);
+    latency->items_per_sec = 0;
+    for (i = 0; i < keys.size(); i++)
+        delete keys[i];
+    sink = found;
+}
+
+static void measure_prefix(const trie *mtrie,
+                           const std::vector<std::string> &prefixes,
+                           uint64_t overhead, latency_type *latency)
+{
+    std::vector<uint64_t> samples(prefixes.size());
+    trie::result_buffer result;
+    trie::key_type key;
+    size_t i, items = 0;
+    uint64_t start = now();
+    for (i = 0; i < prefixes.size(); i++) {
+        key.assign(prefixes[i].data(), prefixes[i].size());
+        result.clear();
+        items += mtrie->prefix_search(key, &result);
+    }
+    uint64_t elapsed = std::max<uint64_t>(now() - start, 1);
+    latency->ops_per_sec = prefixes.size() * 1e9 / elapsed;
+    latency->items_per_sec = items * 1e9 / elapsed;
+    for (i = 0; i < prefixes.size(); i++) {
+        key.assign(prefixes[i].data(), prefixes[i].size());
+        result.clear();
+        uint64_t t = now();
+        mtrie->prefix_search(key, &result);
+        samples[i] = now() - t;
+    }
+    summarize(&samples, overhead, latency);
+    sink = items;
+}
+
+/// Returns milliseconds to open an archive and run the first queries.
+static double measure_load(const char *archive,
+                           const std::vector<std::string> &queries,
+                           bool cold)
+{
+    if (cold) {
+        // drop the archive from page cache, it has been written back
+        int fd = open(archive, O_RDONLY);
+        if (fd >= 0) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    uint64_t start = now();
+    trie *mtrie = trie::create_trie(archive);
+    trie::value_type value;
+    for (size_t i = 0; i < queries.size() && i < 1000; i++)
+        mtrie->search(queries[i].c_str(), queries[i].size(), &value);
+    double elapsed = (now() - start) / 1e6;
+    delete mtrie;
+    return elapsed;
+}
+
+typedef struct {
+    const char *dataset;
+    const char *type;
+    size_t keys;
+    double insert_ms, build_ms;
+    size_t archive_bytes;
+    latency_type hit, miss, prefix;
+    double load_cold_ms, load_warm_ms;
+} report_type;
+
+static void print_latency(const char *name, const latency_type &latency,
+                          bool json, bool last)
+{
+    if (json) {
+        printf("      \"%s\": {\"ops_per_sec\": %.0f, \"p50_ns\": %.0f, "
+               "\"p99_ns\": %.0f, \"p999_ns\": %.0f", name,
+               latency.ops_per_sec, latency.p50, latency.p99, latency.p999);
+        if (latency.items_per_sec > 0)
+            printf(", \"keys_per_sec\": %.0f", latency.items_per_sec);
+        printf("}%s\n", last?"":",");
+    } else {
+        printf("  %-7s %12.0f/s  p50 %8.0fns  p99 %8.0fns  p999 %8.0fns",
+               name, latency.ops_per_sec, latency.p50, latency.p99,
+               latency.p999);
+        if (latency.items_per_sec > 0)
+            printf("  %.0f keys/s", latency.items_per_sec);
+        printf("\n");
+    }
+}
+
+static void print_report(const report_type &report, bool json, bool last)
+{
+    if (json) {
+        printf("    {\n");
+        printf("      \"dataset\": \"%s\", \"trie\": \"%s\", \"keys\": %lu,\n",
+               report.dataset, report.type,
+               static_cast<unsigned long>(report.keys));
+        printf("      \"insert_ms\": %.1f, \"build_ms\": %.1f, "
+               "\"archive_bytes\": %lu,\n", report.insert_ms,
+               report.build_ms,
+               static_cast<unsigned long>(report.archive_bytes));
+        printf("      \"load_cold_ms\": %.2f, \"load_warm_ms\": %.2f,\n",
+               report.load_cold_ms, report.load_warm_ms);
+        print_latency("hit", report.hit, json, false);
+        print_latency("miss", report.miss, json, false);
+        print_latency("prefix", report.prefix, json, true);
+        printf("    }%s\n", last?"":",");
+    } else {
+        printf("%s/%s: %lu keys, insert %.1fms, build %.1fms, "
+               "archive %lu bytes, load cold %.2fms warm %.2fms\n",
+               report.dataset, report.type,
+               static_cast<unsigned long>(report.keys), report.insert_ms,
+               report.build_ms,
+               static_cast<unsigned long>(report.archive_bytes),
+               report.load_cold_ms, report.load_warm_ms);
+        print_latency("hit", report.hit, json, false);
+        print_latency("miss", report.miss, json, false);
+        print_latency("prefix", report.prefix, json, false);
+    }
+}
+
+static void help_message()
+{
+    std::cout << "Usage: suite [OPTIONS]\n"
+                 "OPTIONS:\n"
+                 "        -d|--dataset NAME     url, cjk, binary or ngram "
+                 "(all by default)\n"
+                 "        -h|--help             help message\n"
+                 "        -j|--json             JSON output\n"
+                 "        -k|--keys NUMBER      keys of each dataset "
+                 "(200000)\n"
+                 "        -q|--queries NUMBER   lookups of each kind, and "
+                 "a 20th as many\n"
+                 "                              prefix searches (200000)\n"
+                 "        -s|--seed NUMBER      random seed (1)\n"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t num_keys = 200000, num_queries = 200000;
+    uint64_t seed = 1;
+    const char *only = NULL;
+    const char *archive = "/tmp/trie_bench_suite";
+    bool json = false;
+    std::vector<report_type> reports;
+    size_t i, j;
+    int c;
+
+    while (true) {
+        static struct option long_options[] =
+        {
+            {"dataset", required_argument, 0, 'd'},
+            {"help", no_argument, 0, 'h'},
+            {"json", no_argument, 0, 'j'},
+            {"keys", required_argument, 0, 'k'},
+            {"queries", required_argument, 0, 'q'},
+            {"seed", required_argument, 0, 's'},
+            {0, 0, 0, 0}
+        };
+        int option_index;
+
+        c = getopt_long(argc, argv, "d:hjk:q:s:", long_options,
+                        &option_index);
+        if (c == -1) break;
+
+        switch (c) {
+            case 'd':
+                only = optarg;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'k':
+                num_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                num_queries = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                help_message();
+                return 0;
+        }
+    }
+
+    uint64_t overhead = clock_overhead();
+    for (i = 0; i < sizeof(kDatasets) / sizeof(kDatasets[0]); i++) {
+        const dataset_type &dataset = kDatasets[i];
+        if (only && strcmp(only, dataset.name))
+            continue;
+        std::vector<std::string> keys, misses, hits, prefixes;
+        std::set<std::string> seen;
+        generate_keys(dataset, seed, num_keys, &keys, &seen);
+        // keys of the same kind but not in the set
+        generate_keys(dataset, seed + 0x5bd1e995, num_queries, &misses,
+                      &seen);
+        // hits and prefixes are skewed towards popular keys
+        random_type random(seed * 31 + 7);
+        zipf_type popular(keys.size(), 0.99);
+        for (j = 0; j < num_queries; j++) {
+            const std::string &key = keys[popular.next(&random)];
+            hits.push_back(key);
+            if (j % 20)  // enumerating costs much more than a lookup
+                continue;
+            // cut in the second half, so that a prefix enumerates
+            // some keys but not most of the set
+            prefixes.push_back(key.substr(0, key.size() / 2 + 1
+                                             + random.below(key.size()
+                                                            - key.size() / 2)));
+        }
+
+        trie::trie_type types[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+        for (j = 0; j < 2; j++) {
+            report_type report;
+            memset(&report, 0, sizeof(report));
+            report.dataset = dataset.name;
+            report.type = types[j] == trie::SINGLE_TRIE?"single":"double";
+            report.keys = keys.size();
+            trie *mtrie = trie::create_trie(types[j]);
+            uint64_t start = now();
+            for (size_t k = 0; k < keys.size(); k++)
+                mtrie->insert(keys[k].c_str(), keys[k].size(), k);
+            report.insert_ms = (now() - start) / 1e6;
+            start = now();
+            mtrie->build(archive);
+            report.build_ms = (now() - start) / 1e6;
+            delete mtrie;
+            struct stat sb;
+            if (stat(archive, &sb) == 0)
+                report.archive_bytes = sb.st_size;
+
+            report.load_cold_ms = measure_load(archive, hits, true);
+            report.load_warm_ms = measure_load(archive, hits, false);
+            mtrie = trie::create_trie(archive);
+            measure_lookup(mtrie, hits, overhead, &report.hit);
+            measure_lookup(mtrie, misses, overhead, &report.miss);
+            measure_prefix(mtrie, prefixes, overhead, &report.prefix);
+            delete mtrie;
+            reports.push_back(report);
+            if (!json)
+                print_report(report, json, false);
+        }
+    }
+    unlink(archive);
+
+    if (json) {
+        printf("{\n  \"keys\": %lu, \"queries\": %lu, \"seed\": %lu, "
+               "\"clock_overhead_ns\": %lu,\n  \"results\": [\n",
+               static_cast<unsigned long>(num_keys),
+               static_cast<unsigned long>(num_queries),
+               static_cast<unsigned long>(seed),
+               static_cast<unsigned long>(overhead));
+        for (i = 0; i < reports.size(); i++)
+            print_report(reports[i], json, i + 1 == reports.size());
+        printf("  ]\n}\n");
+    }
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -29,11 +29,24 @@
 #ifndef TRIE_H_
 #define TRIE_H_
 
+#include <stdint.h>
+
 #include <map>
+#include <string>
 #include <vector>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <new>
 #include <stdexcept>
 
+/*
+ * Define TRIE_LARGE_INDEX to use 64 bits state index, for tries with more
+ * than 2^31 states. It must be defined the same way for libtrie and for
+ * its users. Archives built with large index have their own magics and
+ * can not be loaded by the other kind.
+ */
+
 #define BEGIN_TRIE_NAMESPACE namespace dutil {
 #define END_TRIE_NAMESPACE }
 
@@ -90,8 +103,13 @@ class trie {
     /// Represents a value in double-array.
     typedef int32_t value_type;
 
+#ifdef TRIE_LARGE_INDEX
+    /// Represents a size or an index value for accessing states in double-array.
+    typedef int64_t size_type;
+#else
     /// Represents a size or an index value for accessing states in double-array.
     typedef int32_t size_type;
+#endif
 
     /// Represents a key to access trie.
     class key_type;
@@ -99,6 +117,9 @@ class trie {
     /// Represents a result set for prefix_search.
     typedef std::vector<std::pair<key_type, value_type> > result_type;
 
+    /// Represents a result set for prefix_search in one buffer.
+    class result_buffer;
+
     /// Represents a trie type.
     enum trie_type {
         UNKNOW = 0,   /**< Unknow. */
@@ -106,23 +127,88 @@ class trie {
         DOUBLE_TRIE   /**< Two Trie. */
     };
 
+    /// Represents an option of trie archive, see set_archive_options.
+    enum archive_option {
+        ARCHIVE_PACKED = 0x1, /**< Bit-packed index columns, Two Trie only. */
+        /** Filter of keys checked before searching, Two Trie only. */
+        ARCHIVE_FILTER = 0x2,
+        /**
+         * Keys only, values are not written and keys found give value 0.
+         * Two Trie and Tail Trie.
+         */
+        ARCHIVE_SET = 0x4
+    };
+
+    /// Represents an array of a trie, see stats_type.
+    typedef struct {
+        const char *name;  ///< Name of the array.
+        size_t size;       ///< Units allocated.
+        size_t used;       ///< Units in use.
+        size_t bytes;      ///< Bytes allocated.
+    } array_stats_type;
+
+    /// Represents a named count, see stats_type.
+    typedef std::pair<const char *, size_t> count_type;
+
+    /// Represents a named histogram, see stats_type.
+    typedef std::pair<const char *, std::vector<size_t> > histogram_type;
+
+    /// Represents structural statistics of a trie, see stats().
+    typedef struct {
+        size_t keys;  ///< Number of keys.
+
+        /// Arrays, such as front, rear, index and accept of a two-trie.
+        std::vector<array_stats_type> arrays;
+
+        /// Number of states by their number of children, in the trie
+        /// where keys branch, i.e. the front trie of a two-trie.
+        std::vector<size_t> out_degree;
+
+        /// Number of keys by depth of their leaves in the same trie.
+        std::vector<size_t> depth;
+
+        /// Number of distinct suffixes in the rear trie of a two-trie.
+        size_t rear_suffixes;
+
+        /// Number of keys referring to the suffixes. Each suffix is
+        /// shared by rear_references / rear_suffixes keys on average.
+        size_t rear_references;
+
+        /// Number of freed entries waiting to be reused, by list.
+        std::vector<count_type> free_lists;
+
+        /// Estimated heap bytes of builder-side structures, which are
+        /// not written to archives.
+        std::vector<count_type> heap;
+
+        /// Work counted on hot paths by all threads of the process, such
+        /// as lookups crossing into the rear trie. Empty unless libtrie
+        /// is built with TRIE_INSTRUMENT, see reset_counters().
+        std::vector<count_type> counters;
+
+        /// Work per call on hot paths, such as states visited by each
+        /// walk, with the total in counters under the same name. The
+        /// last bucket counts larger values as well.
+        std::vector<histogram_type> histograms;
+    } stats_type;
+
 
     /// Constructs a trie interface.
-    trie() {}
+    trie() :archive_options_(0) {}
 
     /**
      * Constructs a trie interface with a specified state size.
      **
      * @param size The initial size of states.
      */
-    explicit trie(size_t size) {}
+    explicit trie(size_t size) :archive_options_(0) {}
 
     /**
      * Constructs a trie interface from a archive file.
      *
      * @param filename The archive filename.
      */
-    explicit trie(const char *filename) {}
+    explicit trie(const char *filename) :archive_options_(0) {}
 
     /**
      * Stores a value_type into trie using a key_type as key.
@@ -162,6 +248,49 @@ class trie {
     virtual bool search(const char *inputs, size_t length,
                         value_type *value) const;
 
+    /**
+     * Stores a variable-length payload into trie using a key_type as key.
+     * The payload is kept in the value store of the archive and the
+     * value_type of the key refers to it. Do not mix payloads and plain
+     * value_type in one trie.
+     *
+     * @param key The key.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload.
+     */
+    virtual void insert_payload(const key_type &key,
+                                const char *payload, size_t length);
+
+    /**
+     * Retrieves a payload from trie using a key_type as key. The payload
+     * is not copied, it points into the trie (or its mmapped archive)
+     * and stays valid as long as the trie.
+     *
+     * @param key The key.
+     * @param[out] payload Pointer to the payload.
+     * @param[out] length Length of the payload.
+     * @return true if found.
+     */
+    virtual bool search_payload(const key_type &key,
+                                const char **payload, size_t *length) const;
+
+    /**
+     * Removes a key from trie. States and storage used only by the key
+     * are freed and will be reused by later insertions.
+     *
+     * @param key The key.
+     * @return true if the key was found and removed.
+     */
+    virtual bool erase(const key_type &key);
+
+    /**
+     * Removes all keys match given prefix.
+     *
+     * @param prefix The prefix.
+     * @return The number of keys removed.
+     */
+    virtual size_t erase_prefix(const key_type &prefix);
+
     /**
      * Retrieves all key-value pairs match given prefix.
      *
@@ -171,6 +300,31 @@ class trie {
      */
     virtual size_t prefix_search(const key_type &key,
                                  result_type *result) const = 0;
+
+    /**
+     * Retrieves all key-value pairs match given prefix into a
+     * result_buffer, which keeps all keys in one buffer. Reusing a
+     * result_buffer across queries saves allocations.
+     *
+     * @param key The prefix.
+     * @param[out] result Result set contains the existing keys.
+     * @return The number of elements in the result set.
+     */
+    virtual size_t prefix_search(const key_type &key,
+                                 result_buffer *result) const;
+
+    /**
+     * Retrieves all keys which are prefixes of key, the empty key and
+     * key itself included, shortest first. Tries of this library find
+     * them in one walk from the root.
+     *
+     * @param key The key.
+     * @param[out] result Result set the keys are appended to.
+     * @return The number of elements in the result set.
+     */
+    virtual size_t common_prefix_search(const key_type &key,
+                                        result_buffer *result) const;
+
     /**
      * Builds a trie archive.
      *
@@ -180,6 +334,113 @@ class trie {
      */
     virtual void build(const char *filename, bool verbose = false) = 0;
 
+    /**
+     * Sets options of the archives written by build() afterward.
+     *
+     * @param options Bitwise OR of archive_option.
+     */
+    void set_archive_options(unsigned int options)
+    {
+        archive_options_ = options;
+    }
+
+    /// Returns options of the archives written by build().
+    unsigned int archive_options() const
+    {
+        return archive_options_;
+    }
+
+    /**
+     * Reassigns the places of states so that states visited together
+     * stay together in memory. The top levels of the trie are packed
+     * first. If samples are given, hot states in these sample queries
+     * are packed before cold ones. It is a build-time pass, call it
+     * right before build().
+     *
+     * @param samples Sample queries, or NULL for breadth-first order.
+     */
+    virtual void relayout(const std::vector<std::string> *samples = NULL);
+
+    /**
+     * Remaps bytes of keys to dense codes, the most frequent byte
+     * taking the code next to the terminator, so that the children of
+     * a state spread over a narrow range of BASE offsets. Bytes not
+     * counted get codes as they are inserted. The table is written into
+     * archives and lookups translate keys through it. Keys found by
+     * prefix_search come in the order of codes instead of bytes. Call
+     * it on an empty trie. Two Trie only.
+     *
+     * @param frequency Number of occurrences of each byte in keys,
+     *                  256 entries.
+     */
+    virtual void set_alphabet(const std::vector<size_t> &frequency);
+
+    /**
+     * Remaps code points of UTF-8 keys to dense codes instead of bytes,
+     * so that a CJK character takes one or two states instead of three.
+     * The code points most frequent in samples take one code each and
+     * the others two, or three once two codes run out. Code points not
+     * in samples get codes as they are inserted, up to 65536 in all.
+     * Bytes which are not well-formed UTF-8 count as code points of
+     * their own, and a prefix ending in the middle of a character
+     * matches no key. Otherwise it is the same as set_alphabet. Two
+     * Trie only.
+     *
+     * @param samples Sample keys, or NULL to hand out codes in order of
+     *                insertion.
+     */
+    virtual void set_utf8_alphabet(
+        const std::vector<std::string> *samples = NULL);
+
+    /**
+     * Turns on or off concurrent mode. In concurrent mode, one thread
+     * may call insert while any number of threads call search and
+     * prefix_search. Readers never lock or wait for a write in
+     * progress, they retry if a write overlaps, and a reader which
+     * keeps retrying holds off the next write until it is done, so
+     * readers make progress however busy the writer is. Turn it on
+     * before sharing the trie among threads. Tries loaded from archives
+     * are always safe to be read concurrently.
+     *
+     * Each thread must use its own key_type objects, since c_str()
+     * converts into a buffer of the key.
+     *
+     * @param concurrent true to turn on concurrent mode.
+     */
+    virtual void set_concurrent(bool concurrent);
+
+    /**
+     * Takes a read-only snapshot of the trie as it is now. Arrays are
+     * shared page by page between the trie and its snapshots, and a
+     * page is duplicated only when the trie writes to it afterwards,
+     * and payloads, which are only appended, are shared as they are,
+     * so taking a snapshot costs the same however large the trie is.
+     * The first snapshot moves the arrays into shared memory once.
+     *
+     * A snapshot can be searched or built into an archive by other
+     * threads while the trie keeps changing, and may outlive the trie.
+     * Call it from the thread which writes the trie.
+     *
+     * @return The snapshot, to be deleted by the caller.
+     */
+    virtual trie *snapshot();
+
+    /**
+     * Collects structural statistics of the trie by walking all of its
+     * states, which takes time in proportion to the size of the trie.
+     * In concurrent mode, call it from the thread which writes the trie.
+     *
+     * @param[out] stats Statistics of the trie.
+     */
+    virtual void stats(stats_type *stats) const;
+
+    /**
+     * Zeroes the hot path counters reported by stats() in every thread.
+     * Counts of threads running meanwhile may be lost. Does nothing
+     * unless libtrie is built with TRIE_INSTRUMENT.
+     */
+    static void reset_counters();
+
     /**
      * Updates a trie from a formatted text file.
      *
@@ -210,12 +471,19 @@ class trie {
      * @param archive The filename of the archive.
      */
     static trie *create_trie(const char *archive);
+
+  protected:
+    /// Options of the archives written by build().
+    unsigned int archive_options_;
 };
 
 /**
  * Represents a key to access trie.
  *
- * This class can convert other data format to trie's key.
+ * This class can convert other data format to trie's key. Keys up to
+ * kInlineSize characters are stored inside the object, so short keys
+ * never allocate. A key may also borrow converted data from elsewhere
+ * without copying it, see borrow().
  */
 class trie::key_type {
   public:
@@ -228,12 +496,14 @@ class trie::key_type {
     /// Terminator character (character not in charset).
     static const char_type kTerminator = kCharsetSize;
 
+    /// Number of characters stored inside a key_type, with terminator.
+    static const size_t kInlineSize = 24;
+
     /// Constructs an empty key_type.
     key_type()
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
-    {}
+    {
+        init();
+    }
 
     /**
      * Constructs a key_type from a c-style data.
@@ -242,23 +512,20 @@ class trie::key_type {
      * @param length Length of the c-style data.
      */
     explicit key_type(const char *data, size_t length)
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
     {
+        init();
         assign(data, length);
     }
 
     /**
-     * Constructs a copy from a key.
+     * Constructs a copy from a key. A copy of a borrowing key owns
+     * its data.
      *
      * @param key The key
      */
     explicit key_type(const key_type &key)
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
     {
+        init();
         assign(key.data(), key.length());
     }
 
@@ -269,19 +536,46 @@ class trie::key_type {
      */
     const key_type &operator=(const key_type &rhs)
     {
-        assign(rhs.data(), rhs.length());
+        if (this != &rhs)
+            assign(rhs.data(), rhs.length());
         return *this;
     }
 
+#if __cplusplus >= 201103L
+    /**
+     * Constructs a key_type by taking data of a key, which is left
+     * empty.
+     *
+     * @param key The key
+     */
+    key_type(key_type &&key) noexcept
+    {
+        init();
+        take(&key);
+    }
+
+    /**
+     * Takes data of a key, which is left empty.
+     *
+     * @param rhs The key
+     */
+    key_type &operator=(key_type &&rhs) noexcept
+    {
+        if (this != &rhs)
+            take(&rhs);
+        return *this;
+    }
+#endif
+
     /**
      * Destruct a key_type.
      */
     ~key_type()
     {
-        free(data_);
-        free(cstr_);
-        data_capacity_ = 0;
-        cstr_capacity_ = 0;
+        if (buffer_ != inline_)
+            free(buffer_);
+        if (cstr_ != inline_cstr_)
+            free(cstr_);
     }
 
     /**
@@ -315,10 +609,9 @@ class trie::key_type {
     /// Appends a char_type to the end of a key_type.
     void push(char_type ch)
     {
-        if (length_ + 1 >= data_capacity_)
-            resize_data(1);
-        data_[length_++] = ch;
-        data_[length_] = kTerminator;
+        own(length_ + 2);
+        buffer_[length_++] = ch;
+        buffer_[length_] = kTerminator;
     }
 
     /**
@@ -327,16 +620,17 @@ class trie::key_type {
      */
     char_type pop()
     {
-        char_type ch;
-        ch = data_[length_--];
-        data_[length_] = kTerminator;
+        own(length_ + 1);
+        char_type ch = buffer_[--length_];
+        buffer_[length_] = kTerminator;
         return ch;
     }
 
     /// Clears a key_type.
     void clear()
     {
-        data_[0] = kTerminator;
+        data_ = buffer_;
+        buffer_[0] = kTerminator;
         length_ = 0;
     }
 
@@ -348,8 +642,15 @@ class trie::key_type {
     const char *c_str() const
     {
         size_t i;
-        if (cstr_capacity_ < data_capacity_)
-            resize_cstr();
+        if (cstr_capacity_ < length_ + 1) {
+            char *cstr = static_cast<char *>(malloc(length_ + 1));
+            if (!cstr)
+                throw std::bad_alloc();
+            if (cstr_ != inline_cstr_)
+                free(cstr_);
+            cstr_ = cstr;
+            cstr_capacity_ = length_ + 1;
+        }
         for (i = 0; data_[i] != kTerminator ; i++)
             cstr_[i] = char_out(data_[i]);
         cstr_[i] = '\0';
@@ -365,11 +666,11 @@ class trie::key_type {
     void assign(const char *data, size_t length)
     {
         size_t i;
-        if (length + 1 >= data_capacity_)
-            resize_data(length);
+        reserve(length + 1);
         for (i = 0; i < length; i++)
-            data_[i] = char_in(data[i]);
-        data_[i] = kTerminator;
+            buffer_[i] = char_in(data[i]);
+        buffer_[i] = kTerminator;
+        data_ = buffer_;
         length_ = length;
     }
 
@@ -382,45 +683,869 @@ class trie::key_type {
     void assign(const char_type *data, size_t length)
     {
         size_t i;
-        if (length + 1 >= data_capacity_)
-            resize_data(length);
+        // data may be in buffer_, which is large enough then
+        if (data < buffer_ || data >= buffer_ + capacity_)
+            reserve(length + 1);
         for (i = 0; i < length; i++)
-            data_[i] = data[i];
-        data_[i] = kTerminator;
+            buffer_[i] = data[i];
+        buffer_[i] = kTerminator;
+        data_ = buffer_;
         length_ = length;
     }
 
-  protected:
     /**
-     * Resizes the internal data buffer of a key_type.
+     * Makes a key_type refer to char_type data without copying it, until
+     * it is changed. The data must be followed by a terminator and
+     * outlive the use of the key.
      *
-     * @param size Expected size.
+     * @param data Pointer to the data, data[length] == kTerminator.
+     * @param length Length of the data.
      */
-    void resize_data(size_t size)
+    void borrow(const char_type *data, size_t length)
+    {
+        data_ = const_cast<char_type *>(data);
+        length_ = length;
+    }
+
+    /// Returns true if the key_type refers to data of others.
+    bool borrowed() const
     {
-        size_t nsize = (data_capacity_ + size + 1) * 2;
-        data_ = static_cast<char_type *>
-            (realloc(data_, nsize * sizeof(char_type)));
-        data_capacity_ = nsize;
+        return data_ != buffer_;
     }
 
+  protected:
     /**
-     * Resizes the buffer which is used to convert key_type to c-style
-     * string.
+     * Grows the internal data buffer of a key_type, keeping its
+     * content.
+     *
+     * @param size Expected size, with terminator.
      */
-    void resize_cstr() const
+    void reserve(size_t size)
     {
-        cstr_ = static_cast<char *>
-            (realloc(cstr_, data_capacity_ * sizeof(char)));
-        cstr_capacity_ = data_capacity_;
+        if (size <= capacity_)
+            return;
+        size_t nsize = capacity_ * 2 > size?capacity_ * 2:size;
+        char_type *buffer = static_cast<char_type *>
+            (malloc(nsize * sizeof(char_type)));
+        if (!buffer)
+            throw std::bad_alloc();
+        memcpy(buffer, buffer_, capacity_ * sizeof(char_type));
+        if (data_ == buffer_)
+            data_ = buffer;
+        if (buffer_ != inline_)
+            free(buffer_);
+        buffer_ = buffer;
+        capacity_ = nsize;
     }
 
   private:
+    /// Sets up an empty key_type using inline storage.
+    void init()
+    {
+        cstr_ = inline_cstr_;
+        cstr_capacity_ = kInlineSize;
+        buffer_ = inline_;
+        capacity_ = kInlineSize;
+        data_ = buffer_;
+        buffer_[0] = kTerminator;
+        length_ = 0;
+    }
+
+    /// Copies borrowed data into the buffer of size or more.
+    void own(size_t size)
+    {
+        if (data_ != buffer_) {
+            const char_type *data = data_;
+            data_ = buffer_;
+            reserve(size > length_ + 1?size:length_ + 1);
+            memcpy(buffer_, data, (length_ + 1) * sizeof(char_type));
+        } else {
+            reserve(size);
+        }
+    }
+
+    /// Takes data of key, which is left empty.
+    void take(key_type *key)
+    {
+        if (key->buffer_ != key->inline_) {
+            if (buffer_ != inline_)
+                free(buffer_);
+            buffer_ = key->buffer_;
+            capacity_ = key->capacity_;
+            data_ = key->data_;
+            length_ = key->length_;
+            key->buffer_ = key->inline_;
+            key->capacity_ = kInlineSize;
+            key->clear();
+        } else if (key->data_ != key->buffer_) {
+            borrow(key->data_, key->length_);
+            key->clear();
+        } else {
+            assign(key->data_, key->length_);
+            key->clear();
+        }
+    }
+
     mutable char *cstr_;  ///< a C-style buffer for converting.
     mutable size_t cstr_capacity_;  ///< Size of cstr_.
-    char_type *data_;  ///< Internal data buffer.
-    size_t data_capacity_;  ///< Size of data_.
+    char_type *data_;  ///< Data of the key, in buffer_ unless borrowed.
+    char_type *buffer_;  ///< Own data buffer, inline_ or on heap.
+    size_t capacity_;  ///< Size of buffer_.
     size_t length_;  ///< Length of data_.
+    char_type inline_[kInlineSize];  ///< Inline data buffer.
+    mutable char inline_cstr_[kInlineSize];  ///< Inline C-style buffer.
+};
+
+/**
+ * Represents a result set for prefix_search in one buffer.
+ *
+ * Keys are stored one after another in a single char_type buffer, each
+ * followed by a terminator, with their offsets and values in parallel
+ * arrays. Appending a key is a copy into the buffer, and clear() keeps
+ * the memory for the next query.
+ */
+class trie::result_buffer {
+  public:
+    /// Constructs an empty result_buffer.
+    result_buffer()
+    {
+        offsets_.push_back(0);
+    }
+
+    /// Returns the number of keys.
+    size_t size() const
+    {
+        return values_.size();
+    }
+
+    /// Returns true if there is no key.
+    bool empty() const
+    {
+        return values_.empty();
+    }
+
+    /// Returns data of the (i)th key, followed by a terminator.
+    const char_type *key_data(size_t i) const
+    {
+        return &keys_[offsets_[i]];
+    }
+
+    /// Returns length of the (i)th key.
+    size_t key_length(size_t i) const
+    {
+        return offsets_[i + 1] - offsets_[i] - 1;
+    }
+
+    /**
+     * Makes key borrow the (i)th key, valid until the result_buffer
+     * is changed.
+     */
+    void key(size_t i, key_type *key) const
+    {
+        key->borrow(key_data(i), key_length(i));
+    }
+
+    /// Returns the (i)th key as a string.
+    std::string key_string(size_t i) const
+    {
+        std::string key(key_length(i), '\0');
+        const char_type *p = key_data(i);
+        for (size_t j = 0; j < key.size(); j++)
+            key[j] = key_type::char_out(p[j]);
+        return key;
+    }
+
+    /// Returns value of the (i)th key.
+    value_type value(size_t i) const
+    {
+        return values_[i];
+    }
+
+    /**
+     * Appends a key. The key ends at its first terminator, if any, as
+     * keys found in a trie may be followed by one.
+     *
+     * @param data Data of the key.
+     * @param length Length of the key.
+     * @param value Value of the key.
+     */
+    void push_back(const char_type *data, size_t length, value_type value)
+    {
+        size_t i;
+        for (i = 0; i < length && data[i] != key_type::kTerminator; i++)
+            ;
+        keys_.insert(keys_.end(), data, data + i);
+        keys_.push_back(static_cast<char_type>(key_type::kTerminator));
+        offsets_.push_back(keys_.size());
+        values_.push_back(value);
+    }
+
+    /// Removes keys after the first size ones.
+    void truncate(size_t size)
+    {
+        if (size >= values_.size())
+            return;
+        keys_.resize(offsets_[size]);
+        offsets_.resize(size + 1);
+        values_.resize(size);
+    }
+
+    /// Removes all keys, keeping the memory.
+    void clear()
+    {
+        truncate(0);
+    }
+
+  private:
+    std::vector<char_type> keys_;    ///< Keys, each with a terminator.
+    std::vector<size_t> offsets_;    ///< Offsets of keys, and the end.
+    std::vector<value_type> values_; ///< Values of keys.
+};
+
+/**
+ * A set of named trie archives packed into one file.
+ *
+ * A bundle is mapped into memory only once. All tries in it share
+ * the mapping so small dictionaries share pages as well.
+ */
+class trie_bundle {
+  public:
+    /// Represents a list of archives to be packed, as (name, filename).
+    typedef std::vector<std::pair<std::string, std::string> > source_type;
+
+    /// Max length of an archive name, including the terminating zero.
+    static const size_t kMaxNameSize = 48;
+
+    /**
+     * Constructs a trie_bundle from a bundle file.
+     *
+     * @param filename The bundle filename.
+     */
+    explicit trie_bundle(const char *filename);
+
+    /// Destructs a trie_bundle and all tries in it.
+    ~trie_bundle();
+
+    /**
+     * Returns a trie by its name. The trie is owned by the bundle
+     * and is read-only.
+     *
+     * @param name Name of the archive.
+     * @return Pointer to the trie, or NULL if not found.
+     */
+    trie *get(const char *name) const;
+
+    /// Returns the number of archives in bundle.
+    size_t size() const
+    {
+        return names_.size();
+    }
+
+    /// Returns the name of the (i)th archive.
+    const char *name(size_t i) const
+    {
+        return names_[i].c_str();
+    }
+
+    /**
+     * Packs many archives into one bundle file.
+     *
+     * @param filename Filename of the bundle.
+     * @param sources Archives to be packed.
+     */
+    static void build(const char *filename, const source_type &sources);
+
+  private:
+    /// Pointer to mmapped buffer.
+    void *mmap_;
+
+    /// Length of mmapped buffer.
+    size_t mmap_size_;
+
+    /// Archive names in order of storing.
+    std::vector<std::string> names_;
+
+    /// Tries by name.
+    std::map<std::string, trie *> tries_;
+
+    /// Constructs a copy of trie_bundle.
+    trie_bundle(const trie_bundle &);
+
+    /// Updates a trie_bundle.
+    void operator=(const trie_bundle &);
+};
+
+class epoch_reclaimer;
+
+/**
+ * A handle of a trie archive which can be reloaded under live traffic.
+ *
+ * A reload maps and prewarms the new archive in the calling thread,
+ * swaps it in atomically and unmaps the old one after all readers
+ * using it have left. Readers are never blocked by a reload.
+ */
+class trie_handle {
+  public:
+    /**
+     * Pins the current trie of a handle in scope. Keep it short-lived,
+     * a reload waits for it to release the old trie.
+     */
+    class reader {
+      public:
+        /// Pins the current trie of handle.
+        explicit reader(const trie_handle &handle);
+
+        /// Releases the trie.
+        ~reader();
+
+        /// Returns the pinned trie.
+        const trie *get() const
+        {
+            return trie_;
+        }
+
+        /// Returns the pinned trie.
+        const trie *operator->() const
+        {
+            return trie_;
+        }
+
+      private:
+        const trie_handle &handle_;  ///< The handle.
+        size_t token_;               ///< Token of the read-side section.
+        const trie *trie_;           ///< The pinned trie.
+
+        /// Constructs a copy of reader.
+        reader(const reader &);
+
+        /// Updates a reader.
+        void operator=(const reader &);
+    };
+
+    /**
+     * Constructs a trie_handle from an archive file.
+     *
+     * @param filename The archive filename.
+     */
+    explicit trie_handle(const char *filename);
+
+    /// Destructs a trie_handle. No reader may be left.
+    ~trie_handle();
+
+    /**
+     * Replaces the trie by a new archive. The archive is mapped and
+     * every page is touched before it is swapped in, then sample keys
+     * are searched to warm up caches. Returns after the old archive is
+     * unmapped. Reloads from many threads are serialized.
+     *
+     * @param filename The new archive filename.
+     * @param warmup Keys to be searched before the swap, or NULL.
+     */
+    void reload(const char *filename,
+                const std::vector<std::string> *warmup = NULL);
+
+    /// Returns the number of successful reloads.
+    size_t generation() const
+    {
+        return generation_;
+    }
+
+  private:
+    /// Represents a mapped archive.
+    struct archive_type;
+
+    /// Maps, prewarms and loads an archive.
+    static archive_type *open_archive(const char *filename,
+                                      const std::vector<std::string> *warmup);
+
+    /// Unloads and unmaps an archive, see epoch_reclaimer::retire.
+    static void close_archive(void *archive);
+
+    archive_type *current_;       ///< Archive being read.
+    epoch_reclaimer *reclaimer_;  ///< Reclaimer of replaced archives.
+    int reloading_;               ///< Lock of reload.
+    size_t generation_;           ///< Number of reloads.
+
+    /// Constructs a copy of trie_handle.
+    trie_handle(const trie_handle &);
+
+    /// Updates a trie_handle.
+    void operator=(const trie_handle &);
+};
+
+/**
+ * A trie over a read-only base archive with recent changes in memory.
+ *
+ * Inserts go to a small in-memory delta trie and erasures leave
+ * tombstones there, so changes are visible at once while the base
+ * archive stays mmapped and untouched. Lookups consult the delta first
+ * and fall back to the base. compact() folds the delta into a new base
+ * archive; it may run in a background thread while other threads keep
+ * reading and writing.
+ *
+ * With a log file, every change is appended to the log before it is
+ * applied and the log is replayed on construction, so changes since
+ * the last compaction survive a crash. Compaction rotates the log.
+ *
+ * Any number of threads may search and prefix_search. Changes from
+ * many threads are serialized. Readers never wait for a change; only
+ * those overlapping a change of both the delta and its tombstones
+ * retry, as in double_trie's concurrent mode.
+ */
+class layered_trie: public trie {
+  public:
+    /**
+     * Constructs a layered_trie.
+     *
+     * @param base Filename of the base archive. If it does not exist,
+     *             the base is empty and created by the first compaction.
+     * @param log Filename of the write-ahead log, or NULL for none.
+     * @param sync true to sync the log to disk on every change.
+     */
+    explicit layered_trie(const char *base, const char *log = NULL,
+                          bool sync = false);
+
+    /// Destructs a layered_trie. No compaction may be running.
+    ~layered_trie();
+
+    using trie::insert;
+    using trie::search;
+    using trie::prefix_search;
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    bool erase(const key_type &key);
+    size_t prefix_search(const key_type &key, result_type *result) const;
+    void build(const char *filename, bool verbose = false);
+
+    /**
+     * Folds changes into a new base archive, written to a temporary file
+     * and renamed over the base. The delta is frozen and replaced by an
+     * empty one first, so only the swaps at both ends block writers.
+     * Compactions from many threads are serialized.
+     *
+     * @param verbose Display detail information while building
+     *                if sets to true.
+     */
+    void compact(bool verbose = false);
+
+    /// Returns the number of changes since the last compaction started.
+    size_t changes() const
+    {
+        return changes_;
+    }
+
+  private:
+    /// Represents the tries searched from the newest to the oldest.
+    struct layers_type;
+
+    /// Represents keys and values merged from layers.
+    typedef std::map<std::string, value_type> merged_type;
+
+    /// Searches layers. Returns true if key is found.
+    static bool search_layers(const layers_type *layers,
+                              const key_type &key, value_type *value);
+
+    /// Merges keys match prefix from the oldest layer to the newest.
+    static void merge_layers(const layers_type *layers,
+                             const key_type &prefix, merged_type *merged);
+
+    /// Builds merged keys into an archive.
+    void build_merged(const merged_type &merged, const char *filename,
+                      bool verbose) const;
+
+    /// Appends a change to the log.
+    void write_log(char op, const key_type &key, value_type value);
+
+    /**
+     * Applies changes in a log file.
+     *
+     * @return Length of the complete records, or -1 if there is no log.
+     */
+    long replay_log(const char *filename);
+
+    /// Opens the log, replaying changes left by the last run.
+    void open_log();
+
+    /// Inserts key into the delta, without logging.
+    void insert_delta(const key_type &key, value_type value);
+
+    /// Leaves a tombstone of key in the delta, without logging.
+    bool erase_delta(const key_type &key);
+
+    /// Begins a change of the delta, see double_trie::begin_write.
+    void begin_write();
+
+    /// Ends a change of the delta.
+    void end_write();
+
+    /// Retries optimistic reads of layers, see double_trie::read_section.
+    class read_section {
+      public:
+        /// Number of failed reads before holding off changes.
+        static const int kPatientReads = 8;
+
+        /// Begins reading trie.
+        explicit read_section(const layered_trie *trie);
+
+        /// Ends reading.
+        ~read_section();
+
+        /// Returns a sequence to be validated after reading.
+        uint64_t begin() const;
+
+        /**
+         * Returns true if no change overlapped the read since begin
+         * returned sequence, or notes a failed read otherwise.
+         */
+        bool validate(uint64_t sequence);
+
+      private:
+        const layered_trie *trie_;  ///< The trie being read.
+        int failures_;              ///< Number of failed reads.
+    };
+
+    /// Publishes layers and retires the old ones. Called with writing_.
+    void publish(layers_type *layers);
+
+    /// Frees retired layers, see epoch_reclaimer::retire.
+    static void delete_layers(void *layers);
+
+    /// Frees a retired trie, see epoch_reclaimer::retire.
+    static void delete_trie(void *dict);
+
+    std::string base_;            ///< Filename of the base archive.
+    std::string log_name_;        ///< Filename of the log.
+    FILE *log_;                   ///< Log, or NULL.
+    bool sync_;                   ///< Sync log on every change.
+    layers_type *layers_;         ///< Layers being read.
+    epoch_reclaimer *reclaimer_;  ///< Reclaimer of replaced layers.
+    int writing_;                 ///< Lock of changes.
+    int compacting_;              ///< Lock of compaction.
+    size_t changes_;              ///< Changes since the last compaction.
+    uint64_t sequence_;           ///< Odd while the delta is changing.
+    mutable int starving_;        ///< Readers holding off changes.
+
+    /// Constructs a copy of layered_trie.
+    layered_trie(const layered_trie &);
+
+    /// Updates a layered_trie.
+    void operator=(const layered_trie &);
+};
+
+/**
+ * A trie split into independent shards for parallel insertion.
+ *
+ * Keys are routed to shards by a stable hash, or by ranges of keys
+ * split at sampled keys so that a prefix search visits only the shards
+ * its range overlaps. Each shard is a two-trie in concurrent mode with
+ * a lock of its own: inserts into different shards run in parallel,
+ * and searches never lock.
+ *
+ * A sharded_trie is persisted as a trie_bundle of its shards, named by
+ * the routing and shard number, and of the split keys of ranges, and
+ * loaded back read-only.
+ */
+class sharded_trie: public trie {
+  public:
+    /// Represents a routing of keys to shards.
+    enum routing_type {
+        ROUTE_BY_HASH = 0,  /**< FNV-1a hash of the whole key. */
+        ROUTE_BY_PREFIX     /**< Range of keys in byte order. */
+    };
+
+    /// Represents keys and values of a batch.
+    typedef std::vector<std::pair<std::string, value_type> > batch_type;
+
+    /**
+     * Constructs an empty sharded_trie.
+     *
+     * @param shards Number of shards.
+     * @param routing Routing of keys.
+     * @param samples Keys like those to be inserted. ROUTE_BY_PREFIX
+     *                splits them into ranges of as many samples each;
+     *                without samples, ranges split the first byte evenly.
+     */
+    explicit sharded_trie(size_t shards, routing_type routing = ROUTE_BY_HASH,
+                          const std::vector<std::string> *samples = NULL);
+
+    /**
+     * Constructs a read-only sharded_trie from an archive built by
+     * build().
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit sharded_trie(const char *filename);
+
+    /// Destructs a sharded_trie.
+    ~sharded_trie();
+
+    using trie::insert;
+    using trie::search;
+    using trie::prefix_search;
+
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    bool erase(const key_type &key);
+
+    /**
+     * Retrieves all key-value pairs match given prefix from all shards,
+     * in byte order of keys.
+     */
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    void build(const char *filename, bool verbose = false);
+
+    /**
+     * Inserts a batch of keys with many threads. Keys are grouped by
+     * shard first, and each thread fills whole shards one by one.
+     *
+     * @param batch Keys and values.
+     * @param threads Number of threads, 0 for one per shard.
+     */
+    void insert_batch(const batch_type &batch, size_t threads = 0);
+
+    /**
+     * Searches a batch of keys with many threads.
+     *
+     * @param[in,out] batch Keys to be searched, and their values.
+     * @param missing Value of keys not found.
+     * @param threads Number of threads, 0 for one per shard.
+     * @return The number of keys found.
+     */
+    size_t search_batch(batch_type *batch, value_type missing,
+                        size_t threads = 0) const;
+
+    /// Returns the number of shards.
+    size_t shards() const
+    {
+        return shards_.size();
+    }
+
+    /// Returns the shard which key is routed to.
+    size_t route(const key_type &key) const;
+
+  private:
+    /// Represents a shard.
+    struct shard_type;
+
+    /// Represents a batch job.
+    struct job_type;
+
+    /// Runs a batch job in threads.
+    void run_job(job_type *job, size_t threads) const;
+
+    /// Works on shards of a batch job in a thread.
+    static void *work(void *job);
+
+    /// Splits the first byte evenly into ranges of shards.
+    void split_bytes();
+
+    std::vector<shard_type *> shards_;  ///< The shards.
+    routing_type routing_;              ///< Routing of keys.
+    std::vector<std::string> bounds_;   ///< First keys of all shards but
+                                        ///< the first, for ROUTE_BY_PREFIX.
+    trie_bundle *bundle_;               ///< Archive, or NULL if mutable.
+
+    /// Constructs a copy of sharded_trie.
+    sharded_trie(const sharded_trie &);
+
+    /// Updates a sharded_trie.
+    void operator=(const sharded_trie &);
+};
+
+/**
+ * A trie whose keys are sequences of integer words, such as indices of a
+ * vocabulary, rather than bytes.
+ *
+ * It is a double-array where a word goes by two transitions, one of its
+ * high bits and one of its low 8 bits, and code 0 ends a key. So the
+ * children of a state lie no farther apart than the vocabulary size over
+ * 256, and states pack densely even for a vocabulary of millions. Children
+ * of each state are chained, so they are enumerated without scanning the
+ * vocabulary.
+ *
+ * For an n-gram table, insert each n-gram in reverse, the newest word
+ * first, with its count or an index of its probability and backoff.
+ * Then longest_prefix() of a reversed history finds the longest suffix
+ * context in the table with one walk.
+ */
+class word_trie {
+  public:
+    /// Represents a word.
+    typedef int32_t word_type;
+
+    /// Represents a value.
+    typedef trie::value_type value_type;
+
+    /// Represents an index of states.
+    typedef trie::size_type size_type;
+
+    /// Represents a child of a state.
+    typedef struct {
+        word_type word;    ///< Word going to the child.
+        bool accept;       ///< Whether the child ends a key.
+        value_type value;  ///< Value of the key, if accept.
+    } child_type;
+
+    /// Constructs an empty word_trie.
+    word_trie();
+
+    /**
+     * Constructs a read-only word_trie from an archive built by build().
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit word_trie(const char *filename);
+
+    /// Destructs a word_trie.
+    ~word_trie();
+
+    /**
+     * Inserts a key, replacing the value if it exists.
+     *
+     * Children of a state take states as far apart as their words over
+     * 256, so it throws if they do not fit in a size_type.
+     *
+     * @param words Words of the key, none negative.
+     * @param length Number of words.
+     * @param value Value of the key.
+     */
+    void insert(const word_type *words, size_t length, value_type value);
+
+    /**
+     * Searches a key.
+     *
+     * @param words Words of the key.
+     * @param length Number of words.
+     * @param[out] value Value of the key.
+     * @return true if found.
+     */
+    bool search(const word_type *words, size_t length,
+                value_type *value) const;
+
+    /**
+     * Finds the longest non-empty prefix of words which is a key.
+     *
+     * @param words Words to go with.
+     * @param length Number of words.
+     * @param[out] value Value of the prefix found.
+     * @return Number of words of the prefix, 0 if none is a key.
+     */
+    size_t longest_prefix(const word_type *words, size_t length,
+                          value_type *value) const;
+
+    /**
+     * Enumerates children of a key prefix, in order of words.
+     *
+     * @param words Words of the prefix.
+     * @param length Number of words.
+     * @param[out] children Children of the prefix.
+     * @return Number of children, 0 if the prefix is not found.
+     */
+    size_t children(const word_type *words, size_t length,
+                    std::vector<child_type> *children) const;
+
+    /// Returns the number of keys.
+    size_t size() const
+    {
+        return keys_;
+    }
+
+    /**
+     * Saves the trie into an archive.
+     *
+     * @param filename Filename of the archive.
+     * @param verbose Prints sizes if true.
+     */
+    void build(const char *filename, bool verbose = false) const;
+
+  private:
+    /// Bits of a word going by its second transition.
+    static const int kLowBits = 8;
+
+    /// Represents a state. Free states are chained by child and sibling.
+    typedef struct {
+        size_type base;     ///< The BASE value, or value at an end of key.
+        size_type check;    ///< The CHECK value, 0 if free.
+        size_type child;    ///< Code of the first child, -1 if none.
+        size_type sibling;  ///< Code of the next sibling, -1 if none.
+    } state_type;
+
+    /// Returns the state after going from s with code, or 0 if none.
+    size_type next(size_type s, int64_t code) const
+    {
+        if (states_[s].child < 0)
+            return 0;
+        int64_t t = states_[s].base + code;
+        return (t > 1 && t < size_ && states_[t].check == s)?t:0;
+    }
+
+    /// Returns the code of high bits of a word.
+    static int64_t high_code(word_type word)
+    {
+        return (word >> kLowBits) + 1;
+    }
+
+    /// Returns the code of low bits of a word.
+    static int64_t low_code(word_type word)
+    {
+        return (word & ((1 << kLowBits) - 1)) + 1;
+    }
+
+    /// Returns the state after going from s with word, or 0 if none.
+    size_type next_word(size_type s, word_type word) const
+    {
+        if ((s = next(s, high_code(word))))
+            s = next(s, low_code(word));
+        return s;
+    }
+
+    /// Returns the state of a key prefix, or 0 if not found.
+    size_type go_forward(const word_type *words, size_t length) const;
+
+    /// Returns the state after going from s with code, creating it.
+    size_type create_transition(size_type s, int64_t code);
+
+    /// Finds a BASE for sorted codes whose states are all free.
+    size_type find_base(const std::vector<int64_t> &codes);
+
+    /// Returns the number of children of s, counting up to limit.
+    size_t count_children(size_type s, size_t limit) const;
+
+    /**
+     * Moves children of s to a BASE which also fits code, if code is
+     * not negative.
+     *
+     * @return New state of watch, which may be moved as a child of s.
+     */
+    size_type relocate(size_type s, int64_t code, size_type watch);
+
+    /// Takes a free state t for going from s with code.
+    void take_state(size_type s, size_type t, int64_t code);
+
+    /// Grows the state buffer to have at least size states.
+    void grow(int64_t size);
+
+    /// Puts state t into the free list.
+    void link_free(size_type t);
+
+    /// Takes state t out of the free list.
+    void unlink_free(size_type t);
+
+    const state_type *states_;  ///< The states.
+    size_type size_;            ///< Number of states.
+    size_t keys_;               ///< Number of keys.
+    std::vector<state_type> buffer_;  ///< States of a mutable trie.
+    void *mmap_;                ///< Mapped archive, or NULL if mutable.
+    size_t mmap_size_;          ///< Length of the mapped archive.
+    size_type probe_;           ///< Free state find_base starts from.
+    size_type used_;            ///< States after it were never taken.
+
+    /// Constructs a copy of word_trie.
+    word_trie(const word_trie &);
+
+    /// Updates a word_trie.
+    void operator=(const word_trie &);
 };
 
 
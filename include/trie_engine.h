@@ -0,0 +1,921 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_ENGINE_H_
+#define TRIE_ENGINE_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api libtrie API
+ *
+ * @{
+ */
+
+/**
+ * Reads a code point from UTF-8 data whose bytes are biased by bias. A
+ * byte which does not start a well-formed sequence reads as a code point
+ * of its own, 0x110000 plus the byte, so that any data reads and writes
+ * back as it is.
+ *
+ * @param data The data, at least one byte.
+ * @param length Length of the data.
+ * @param bias Bias of bytes, 1 for key_type data.
+ * @param[out] point The code point.
+ * @return Number of bytes read.
+ */
+template <typename T>
+inline size_t read_utf8(const T *data, size_t length, int bias,
+                        int32_t *point)
+{
+    int32_t lead = (static_cast<int32_t>(data[0]) - bias) & 0xff, cp, least;
+    size_t n, i;
+
+    if (lead < 0x80) {
+        *point = lead;
+        return 1;
+    }
+    // most CJK characters take three bytes
+    if ((lead & 0xf0) == 0xe0 && length >= 3) {
+        int32_t b1 = (static_cast<int32_t>(data[1]) - bias) & 0xff;
+        int32_t b2 = (static_cast<int32_t>(data[2]) - bias) & 0xff;
+        cp = (lead & 0x0f) << 12 | (b1 & 0x3f) << 6 | (b2 & 0x3f);
+        if ((b1 & 0xc0) == 0x80 && (b2 & 0xc0) == 0x80 && cp >= 0x800
+            && (cp < 0xd800 || cp > 0xdfff)) {
+            *point = cp;
+            return 3;
+        }
+    }
+    if ((lead & 0xe0) == 0xc0) {
+        n = 2, cp = lead & 0x1f, least = 0x80;
+    } else if ((lead & 0xf0) == 0xe0) {
+        n = 3, cp = lead & 0x0f, least = 0x800;
+    } else if ((lead & 0xf8) == 0xf0) {
+        n = 4, cp = lead & 0x07, least = 0x10000;
+    } else {
+        n = 0, cp = 0, least = 0;
+    }
+    for (i = 1; i < n && i < length; i++) {
+        int32_t byte = (static_cast<int32_t>(data[i]) - bias) & 0xff;
+        if ((byte & 0xc0) != 0x80)
+            break;
+        cp = cp << 6 | (byte & 0x3f);
+    }
+    // overlong forms and surrogates would not write back the same
+    if (n == 0 || i < n || cp < least || cp > 0x10ffff
+        || (cp >= 0xd800 && cp <= 0xdfff)) {
+        *point = 0x110000 + lead;
+        return 1;
+    }
+    *point = cp;
+    return n;
+}
+
+/**
+ * Describes Two Trie archives as written by trie::build, for readers
+ * which go without a trie object.
+ *
+ * An archive is a header, the alphabet section if any, the filter
+ * section if any, index and accept arrays or their packed columns (a
+ * set keeps links of the index only), front trie and rear trie, each a
+ * state header and states, and then payloads.
+ */
+struct two_trie_archive {
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Shortcut for trie::value_type.
+    typedef trie::value_type value_type;
+
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Option in header, set if an alphabet section follows.
+    static const int32_t kAlphabetOption = 0x10000;
+
+    /// Option in header, set if a code point section follows.
+    static const int32_t kUtf8AlphabetOption = 0x20000;
+
+    /// Number of codes other than the terminator.
+    static const int32_t kCodes = trie::key_type::kTerminator - 1;
+
+    /// Represents the header of an archive.
+    typedef struct {
+        char magic[16];  ///< Archive magic.
+        size_type index_size;  ///< Index array size.
+        size_type accept_size; ///< Accept array size.
+        size_type payload_count; ///< Number of payloads.
+        size_type payload_size;  ///< Length of payload data.
+        int32_t options;         ///< Archive options.
+        /// for 32/64bits compatible.
+        char unused[44 - 4 * sizeof(size_type)];
+    } header_type;
+
+    /// Represents the header of states of front or rear trie.
+    typedef struct {
+        size_type size;  ///< Number of states.
+        /// Unused, for 32/64 bits compatible.
+        char unused[64 - sizeof(size_type)];
+    } state_header_type;
+
+    /// Represents a state in double-array.
+    typedef struct {
+        size_type base;  ///< The BASE value.
+        size_type check; ///< The CHECK value.
+    } state_type;
+
+    /// Represents an entry of index array.
+    typedef struct {
+        value_type data;   ///< Value of the key.
+        size_type index;   ///< Entry of accept array.
+    } index_type;
+
+    /// Represents an entry of accept array.
+    typedef struct {
+        size_type accept;  ///< Accept state in rear trie.
+    } accept_type;
+
+    /// Represents the header of a packed column.
+    typedef struct {
+        int64_t base;   ///< Frame of reference, the minimum value.
+        int64_t words;  ///< Number of 64 bits words, including padding.
+        int32_t width;  ///< Bits of each value.
+        char unused[4]; ///< for 32/64 bits compatible.
+    } column_header_type;
+
+    /// Returns the magic of archives of this build.
+    static const char *magic()
+    {
+#ifdef TRIE_LARGE_INDEX
+        return "TWO_TRIE_64";
+#else
+        return "TWO_TRIE";
+#endif
+    }
+};
+
+/**
+ * Hashes the bytes of a key for key_filter, eight at a time. Bytes are
+ * biased by bias like read_utf8, so a key hashes the same as raw bytes
+ * and as key_type data.
+ *
+ * @param data The data.
+ * @param length Length of the data.
+ * @param bias Bias of bytes, 1 for key_type data.
+ * @return The hash.
+ */
+template <typename T>
+inline uint64_t filter_hash(const T *data, size_t length, int bias)
+{
+    static const uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = length * kMultiplier, word;
+    size_t i = 0, j;
+
+    for (; i + 8 <= length; i += 8) {
+        for (word = 0, j = 0; j < 8; j++)
+            word |= static_cast<uint64_t>((data[i + j] - bias) & 0xff)
+                    << (j * 8);
+        h = (h ^ word) * kMultiplier;
+        h ^= h >> 29;
+    }
+    for (word = 0, j = 0; i + j < length; j++)
+        word |= static_cast<uint64_t>((data[i + j] - bias) & 0xff)
+                << (j * 8);
+    // finalizer of MurmurHash3
+    h = (h ^ word) * kMultiplier;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+/**
+ * A blocked Bloom filter of all keys of an archive, see
+ * trie::ARCHIVE_FILTER. A key sets one bit in each of the eight words of
+ * a block of 32 bytes chosen by its hash, so checking a key reads one
+ * cache line, and the eight words are tested side by side.
+ */
+class key_filter {
+  public:
+    /// Words of 32 bits in a block.
+    static const size_t kBlockWords = 8;
+
+    /// Bits of filter for each key.
+    static const size_t kBitsPerKey = 12;
+
+    /// Represents the header of a filter section.
+    typedef struct {
+        int64_t blocks;   ///< Number of blocks.
+        int32_t padding;  ///< Bytes before blocks, to align them.
+        char unused[4];   ///< for 32/64 bits compatible.
+    } header_type;
+
+    /// Constructs an empty key_filter, which keeps nothing out.
+    key_filter() :blocks_(NULL), size_(0) {}
+
+    /// Returns true if a filter is loaded.
+    bool enabled() const
+    {
+        return blocks_ != NULL;
+    }
+
+    /**
+     * Sets up a key_filter from its section.
+     *
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section)
+    {
+        const header_type *header = static_cast<const header_type *>(section);
+        if (header->blocks <= 0 || header->padding < 0)
+            throw bad_trie_archive("file corrupted");
+        blocks_ = reinterpret_cast<const uint32_t *>(
+                      reinterpret_cast<const char *>(header + 1)
+                      + header->padding);
+        size_ = header->blocks;
+        return blocks_ + size_ * kBlockWords;
+    }
+
+    /// Returns false if a key of hash is not in the archive.
+    bool may_contain(uint64_t hash) const
+    {
+        const uint32_t *block = blocks_ + block_of(hash, size_) * kBlockWords;
+        uint32_t missing = 0;
+        for (size_t i = 0; i < kBlockWords; i++)
+            missing |= ~block[i] & bit_of(hash, i);
+        return !missing;
+    }
+
+    /// Returns the number of blocks for keys.
+    static uint64_t blocks_for(uint64_t keys)
+    {
+        return std::max<uint64_t>((keys * kBitsPerKey + 255) / 256, 1);
+    }
+
+    /// Sets bits of hash in blocks, size of them.
+    static void add(uint64_t hash, uint32_t *blocks, uint64_t size)
+    {
+        uint32_t *block = blocks + block_of(hash, size) * kBlockWords;
+        for (size_t i = 0; i < kBlockWords; i++)
+            block[i] |= bit_of(hash, i);
+    }
+
+  private:
+    /// Returns the block of a hash, by its high half.
+    static uint64_t block_of(uint64_t hash, uint64_t size)
+    {
+        return ((hash >> 32) * size) >> 32;
+    }
+
+    /// Returns the bit of a hash in the (i)th word, by its low half.
+    static uint32_t bit_of(uint64_t hash, size_t i)
+    {
+        static const uint32_t kSalts[kBlockWords] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+        };
+        return 1U << ((static_cast<uint32_t>(hash) * kSalts[i]) >> 27);
+    }
+
+    const uint32_t *blocks_;  ///< Blocks, in archive.
+    uint64_t size_;           ///< Number of blocks.
+};
+
+/**
+ * Layout of archives with index and accept arrays as they are. A layout
+ * finds the value and the accept state of an index entry, see
+ * trie_engine.
+ */
+class flat_layout {
+  public:
+    /// Shortcut for two_trie_archive::size_type.
+    typedef two_trie_archive::size_type size_type;
+
+    /// Shortcut for two_trie_archive::value_type.
+    typedef two_trie_archive::value_type value_type;
+
+    /// Constructs an empty flat_layout.
+    flat_layout() :index_(NULL), accept_(NULL) {}
+
+    /// Returns true if an archive of options has this layout.
+    static bool accepts(int32_t options)
+    {
+        return !(options & (trie::ARCHIVE_PACKED | trie::ARCHIVE_SET));
+    }
+
+    /**
+     * Sets up a flat_layout from its sections.
+     *
+     * @param section Pointer to the index array.
+     * @param header Header of the archive.
+     * @return Pointer to the end of the sections.
+     */
+    const void *load(const void *section,
+                     const two_trie_archive::header_type &header)
+    {
+        index_ = static_cast<const two_trie_archive::index_type *>(section);
+        accept_ = reinterpret_cast<const two_trie_archive::accept_type *>(
+                      index_ + header.index_size);
+        return accept_ + header.accept_size;
+    }
+
+    /// Returns the value of the (i)th index.
+    value_type data(size_type i) const
+    {
+        return index_[i].data;
+    }
+
+    /// Returns the accept state of the (i)th index.
+    size_type accept_state(size_type i) const
+    {
+        return accept_[index_[i].index].accept;
+    }
+
+  private:
+    const two_trie_archive::index_type *index_;
+    const two_trie_archive::accept_type *accept_;
+};
+
+/// Reads a column of values packed in a few bits each, see packed_layout.
+class packed_column {
+  public:
+    packed_column() :words_(NULL), base_(0), mask_(0), width_(0) {}
+
+    /// Sets up a packed_column from its section, returns its end.
+    const void *load(const void *section)
+    {
+        const two_trie_archive::column_header_type *header =
+            static_cast<const two_trie_archive::column_header_type *>(
+                section);
+        words_ = reinterpret_cast<const uint64_t *>(header + 1);
+        base_ = header->base;
+        width_ = header->width;
+        mask_ = width_ < 64?(static_cast<uint64_t>(1) << width_) - 1:~0ULL;
+        return words_ + header->words;
+    }
+
+    /// Returns the (i)th value.
+    int64_t get(int64_t i) const
+    {
+        uint64_t bit = static_cast<uint64_t>(i) * width_;
+        uint64_t w = bit >> 6, shift = bit & 63;
+        uint64_t lo = words_[w] >> shift;
+        uint64_t hi = (words_[w + 1] << 1) << (63 - shift);
+        return static_cast<int64_t>((lo | hi) & mask_) + base_;
+    }
+
+  private:
+    const uint64_t *words_;
+    int64_t base_;
+    uint64_t mask_;
+    int32_t width_;
+};
+
+/**
+ * Layout of archives with bit-packed index columns, see
+ * trie::ARCHIVE_PACKED.
+ */
+class packed_layout {
+  public:
+    /// Shortcut for two_trie_archive::size_type.
+    typedef two_trie_archive::size_type size_type;
+
+    /// Shortcut for two_trie_archive::value_type.
+    typedef two_trie_archive::value_type value_type;
+
+    /// Returns true if an archive of options has this layout.
+    static bool accepts(int32_t options)
+    {
+        return (options & (trie::ARCHIVE_PACKED | trie::ARCHIVE_SET))
+               == trie::ARCHIVE_PACKED;
+    }
+
+    /**
+     * Sets up a packed_layout from its sections.
+     *
+     * @param section Pointer to the value column.
+     * @param header Header of the archive.
+     * @return Pointer to the end of the sections.
+     */
+    const void *load(const void *section,
+                     const two_trie_archive::header_type &header)
+    {
+        section = data_.load(section);
+        section = index_.load(section);
+        return accept_.load(section);
+    }
+
+    /// Returns the value of the (i)th index.
+    value_type data(size_type i) const
+    {
+        return static_cast<value_type>(data_.get(i));
+    }
+
+    /// Returns the accept state of the (i)th index.
+    size_type accept_state(size_type i) const
+    {
+        return static_cast<size_type>(accept_.get(index_.get(i)));
+    }
+
+  private:
+    packed_column data_, index_, accept_;
+};
+
+/**
+ * Layout of set archives, see trie::ARCHIVE_SET. An index entry links
+ * straight to its accept state and has no value, so keys found give 0.
+ */
+class set_layout {
+  public:
+    /// Shortcut for two_trie_archive::size_type.
+    typedef two_trie_archive::size_type size_type;
+
+    /// Shortcut for two_trie_archive::value_type.
+    typedef two_trie_archive::value_type value_type;
+
+    /// Constructs an empty set_layout.
+    set_layout() :links_(NULL) {}
+
+    /// Returns true if an archive of options has this layout.
+    static bool accepts(int32_t options)
+    {
+        return (options & (trie::ARCHIVE_PACKED | trie::ARCHIVE_SET))
+               == trie::ARCHIVE_SET;
+    }
+
+    /**
+     * Sets up a set_layout from its section.
+     *
+     * @param section Pointer to the links.
+     * @param header Header of the archive.
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section,
+                     const two_trie_archive::header_type &header)
+    {
+        links_ = static_cast<const size_type *>(section);
+        return links_ + header.index_size;
+    }
+
+    /// Returns 0, a set keeps no value.
+    value_type data(size_type i) const
+    {
+        return 0;
+    }
+
+    /// Returns the accept state of the (i)th index.
+    size_type accept_state(size_type i) const
+    {
+        return links_[i];
+    }
+
+  private:
+    const size_type *links_;
+};
+
+/// Layout of set archives with bit-packed links, see set_layout.
+class packed_set_layout {
+  public:
+    /// Shortcut for two_trie_archive::size_type.
+    typedef two_trie_archive::size_type size_type;
+
+    /// Shortcut for two_trie_archive::value_type.
+    typedef two_trie_archive::value_type value_type;
+
+    /// Returns true if an archive of options has this layout.
+    static bool accepts(int32_t options)
+    {
+        return (options & (trie::ARCHIVE_PACKED | trie::ARCHIVE_SET))
+               == (trie::ARCHIVE_PACKED | trie::ARCHIVE_SET);
+    }
+
+    /**
+     * Sets up a packed_set_layout from its section.
+     *
+     * @param section Pointer to the link column.
+     * @param header Header of the archive.
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section,
+                     const two_trie_archive::header_type &header)
+    {
+        return links_.load(section);
+    }
+
+    /// Returns 0, a set keeps no value.
+    value_type data(size_type i) const
+    {
+        return 0;
+    }
+
+    /// Returns the accept state of the (i)th index.
+    size_type accept_state(size_type i) const
+    {
+        return static_cast<size_type>(links_.get(i));
+    }
+
+  private:
+    packed_column links_;
+};
+
+/**
+ * Alphabet of archives which keep bytes as they are. An alphabet turns
+ * bytes of a key into codes one by one with its reader, see
+ * trie_engine.
+ */
+class plain_alphabet {
+  public:
+    /// Shortcut for two_trie_archive::char_type.
+    typedef two_trie_archive::char_type char_type;
+
+    /// Returns true if an archive of options has this alphabet.
+    static bool accepts(int32_t options)
+    {
+        return !(options & (two_trie_archive::kAlphabetOption
+                            | two_trie_archive::kUtf8AlphabetOption));
+    }
+
+    /// Sets up a plain_alphabet, which has no section.
+    const void *load(const void *section)
+    {
+        return section;
+    }
+
+    /// Reads codes of a key, then terminators.
+    class reader {
+      public:
+        reader(const plain_alphabet &, const char *data, size_t length)
+            :p_(data), end_(data + length) {}
+
+        /// Returns the next code.
+        char_type next()
+        {
+            if (p_ == end_)
+                return trie::key_type::kTerminator;
+            return trie::key_type::char_in(*p_++);
+        }
+
+      private:
+        const char *p_, *end_;
+    };
+};
+
+/// Alphabet of archives with bytes remapped, see trie::set_alphabet.
+class byte_alphabet {
+  public:
+    /// Shortcut for two_trie_archive::char_type.
+    typedef two_trie_archive::char_type char_type;
+
+    /// Constructs an empty byte_alphabet.
+    byte_alphabet() :codes_(NULL) {}
+
+    /// Returns true if an archive of options has this alphabet.
+    static bool accepts(int32_t options)
+    {
+        return options & two_trie_archive::kAlphabetOption;
+    }
+
+    /**
+     * Sets up a byte_alphabet from its section, codes of all chars.
+     *
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section)
+    {
+        codes_ = static_cast<const char_type *>(section);
+        return codes_ + trie::key_type::kCharsetSize + 1;
+    }
+
+    /// Reads codes of a key, then terminators.
+    class reader {
+      public:
+        reader(const byte_alphabet &alphabet, const char *data,
+               size_t length)
+            :codes_(alphabet.codes_), p_(data), end_(data + length) {}
+
+        /// Returns the next code, 0 for a byte without a code.
+        char_type next()
+        {
+            if (p_ == end_)
+                return trie::key_type::kTerminator;
+            return codes_[trie::key_type::char_in(*p_++)];
+        }
+
+      private:
+        const char_type *codes_;
+        const char *p_, *end_;
+    };
+
+  private:
+    /// Codes of all chars, in archive.
+    const char_type *codes_;
+};
+
+/**
+ * Alphabet of archives with code points of UTF-8 keys remapped, see
+ * trie::set_utf8_alphabet. Its table is built when loaded.
+ */
+class utf8_alphabet {
+  public:
+    /// Shortcut for two_trie_archive::char_type.
+    typedef two_trie_archive::char_type char_type;
+
+    /// Constructs an empty utf8_alphabet.
+    utf8_alphabet() :singles_(0), doubles_(0) {}
+
+    /// Returns true if an archive of options has this alphabet.
+    static bool accepts(int32_t options)
+    {
+        return options & two_trie_archive::kUtf8AlphabetOption;
+    }
+
+    /**
+     * Sets up a utf8_alphabet from its section, the number of single
+     * codes and code points in order of index.
+     *
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section)
+    {
+        const int32_t *p = static_cast<const int32_t *>(section);
+        int32_t size = p[1];
+        if (size < 0 || p[0] < 0 || p[0] >= two_trie_archive::kCodes)
+            throw bad_trie_archive("file corrupted");
+        singles_ = p[0];
+        doubles_ = (two_trie_archive::kCodes - singles_ - 1) << 8;
+        pages_.assign((0x110000 + 256) >> kPageBits, -1);
+        indexes_.clear();
+        for (int32_t i = 0; i < size; i++) {
+            int32_t point = p[2 + i];
+            if (point < 0 || point >= 0x110000 + 256)
+                throw bad_trie_archive("file corrupted");
+            int32_t &page = pages_[point >> kPageBits];
+            if (page < 0) {
+                page = indexes_.size();
+                indexes_.resize(indexes_.size() + kPageSize, -1);
+            }
+            indexes_[page + (point & (kPageSize - 1))] = i;
+        }
+        return p + 2 + size + size % 2;
+    }
+
+    /// Reads codes of a key, then terminators.
+    class reader {
+      public:
+        reader(const utf8_alphabet &alphabet, const char *data,
+               size_t length)
+            :alphabet_(alphabet), p_(data), end_(data + length), high_(0),
+             low_(0) {}
+
+        /**
+         * Returns the next code, 0 for a code point without an index. A
+         * code point of two or three codes returns the rest next times.
+         */
+        char_type next()
+        {
+            int32_t point;
+            if (high_) {
+                char_type code = high_;
+                high_ = 0;
+                return code;
+            }
+            if (low_) {
+                char_type code = low_;
+                low_ = 0;
+                return code;
+            }
+            if (p_ == end_)
+                return trie::key_type::kTerminator;
+            p_ += read_utf8(p_, end_ - p_, 0, &point);
+            int32_t index = alphabet_.index(point);
+            if (index < 0)
+                return 0;
+            if (index < alphabet_.singles_)
+                return alphabet_.singles_ - index;
+            index -= alphabet_.singles_;
+            low_ = two_trie_archive::kCodes - (index & 0xff);
+            if (index < alphabet_.doubles_)
+                return two_trie_archive::kCodes - (index >> 8);
+            // the escape code, then two codes
+            index -= alphabet_.doubles_;
+            low_ = two_trie_archive::kCodes - (index & 0xff);
+            high_ = two_trie_archive::kCodes - (index >> 8);
+            return alphabet_.singles_ + 1;
+        }
+
+      private:
+        const utf8_alphabet &alphabet_;
+        const char *p_, *end_;
+        char_type high_;  ///< High code to return next, or 0.
+        char_type low_;   ///< Low code to return next, or 0.
+    };
+
+  private:
+    static const int kPageBits = 8;  ///< Bits of an offset in a page.
+    static const int32_t kPageSize = 1 << kPageBits;
+
+    /// Returns the index of a code point, or -1 if it has none.
+    int32_t index(int32_t point) const
+    {
+        int32_t page = pages_[point >> kPageBits];
+        return page < 0?-1:indexes_[page + (point & (kPageSize - 1))];
+    }
+
+    int32_t singles_;  ///< Number of code points of one code.
+    int32_t doubles_;  ///< Number of code points of two codes.
+    /// Offset in indexes_ of the page of each code point, or -1.
+    std::vector<int32_t> pages_;
+    /// Pages of index of each code point, or -1.
+    std::vector<int32_t> indexes_;
+};
+
+/**
+ * A read-only Two Trie over an archive in memory, with the archive
+ * layout, value type and alphabet fixed at compile time.
+ *
+ * trie goes through virtual calls and through front and rear tries as
+ * objects of their own. trie_engine has no virtual call, and its search
+ * reads codes, walks the front trie and then the rear trie in one
+ * function, so all of it inlines into the caller. The archive must
+ * match the layout and the alphabet, and the engine does not own it.
+ *
+ * @code
+ * int fd = open("dict.idx", O_RDONLY);
+ * fstat(fd, &st);
+ * void *archive = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ * trie_engine<flat_layout> dict(archive, st.st_size);
+ * dict.search("word", 4, &value);
+ * @endcode
+ *
+ * @param Layout flat_layout, packed_layout, set_layout or
+ *               packed_set_layout.
+ * @param Value Type values are returned as.
+ * @param Alphabet plain_alphabet, byte_alphabet or utf8_alphabet.
+ */
+template <typename Layout, typename Value = trie::value_type,
+          typename Alphabet = plain_alphabet>
+class trie_engine {
+  public:
+    /// Shortcut for two_trie_archive::char_type.
+    typedef two_trie_archive::char_type char_type;
+
+    /// Shortcut for two_trie_archive::size_type.
+    typedef two_trie_archive::size_type size_type;
+
+    /// Type of values returned.
+    typedef Value value_type;
+
+    /**
+     * Constructs a trie_engine over an archive in memory, which must
+     * outlive it.
+     *
+     * @param archive Pointer to the archive data.
+     * @param size Length of the archive data.
+     */
+    trie_engine(const void *archive, size_t size)
+    {
+        typedef two_trie_archive::header_type header_type;
+        typedef two_trie_archive::state_header_type state_header_type;
+        const char *end = static_cast<const char *>(archive) + size;
+
+        if (size < sizeof(header_type))
+            throw bad_trie_archive("file corrupted");
+        const header_type *header = static_cast<const header_type *>(archive);
+        if (strncmp(header->magic, two_trie_archive::magic(),
+                    sizeof(header->magic)))
+            throw bad_trie_archive("file corrupted");
+        if (!Layout::accepts(header->options)
+            || !Alphabet::accepts(header->options))
+            throw bad_trie_archive("archive does not match the engine");
+        const void *start = alphabet_.load(header + 1);
+        if (header->options & trie::ARCHIVE_FILTER)
+            start = filter_.load(start);
+        start = layout_.load(start, *header);
+        // front trie and rear trie
+        const state_header_type *states =
+            static_cast<const state_header_type *>(start);
+        front_ = reinterpret_cast<const two_trie_archive::state_type *>(
+                     states + 1);
+        front_size_ = states->size;
+        states = reinterpret_cast<const state_header_type *>(
+                     front_ + front_size_);
+        rear_ = reinterpret_cast<const two_trie_archive::state_type *>(
+                    states + 1);
+        if (reinterpret_cast<const char *>(rear_ + states->size) > end)
+            throw bad_trie_archive("file corrupted");
+    }
+
+    /**
+     * Searches a key, the same as trie::search.
+     *
+     * @param key Bytes of the key.
+     * @param length Length of the key.
+     * @param[out] value Value of the key if found, or NULL.
+     * @return true if found.
+     */
+    bool search(const char *key, size_t length, value_type *value) const
+    {
+        static const char_type kTerminator = trie::key_type::kTerminator;
+        // most misses end here without touching the tries
+        if (filter_.enabled()
+            && !filter_.may_contain(filter_hash(key, length, 0)))
+            return false;
+        typename Alphabet::reader reader(alphabet_, key, length);
+        char_type ch = reader.next();
+        size_type s = 1, t;
+
+        // front trie, down to the end or to a separator
+        for (;;) {
+            t = front_[s].base + ch;
+            if (t <= 0 || t >= front_size_ || front_[t].check != s)
+                break;
+            s = t;
+            if (ch == kTerminator) {
+                if (value)
+                    *value = static_cast<value_type>(
+                                 layout_.data(-front_[s].base));
+                return true;
+            }
+            ch = reader.next();
+        }
+        if (front_[s].base >= 0)
+            return false;
+        // rear trie, backward from the accept state, skipping a
+        // terminator
+        size_type i = -front_[s].base;
+        size_type r = layout_.accept_state(i);
+        t = rear_[r].check;
+        if (t > 1 && rear_[t].base + kTerminator == r)
+            r = t;
+        for (;;) {
+            t = rear_[r].check;
+            if (t <= 0 || rear_[t].base + ch != r)
+                break;
+            r = t;
+            if (ch == kTerminator)
+                break;
+            ch = reader.next();
+        }
+        if (r != 1)
+            return false;
+        if (value)
+            *value = static_cast<value_type>(layout_.data(i));
+        return true;
+    }
+
+    /// Searches a key, see search above.
+    bool search(const std::string &key, value_type *value) const
+    {
+        return search(key.data(), key.size(), value);
+    }
+
+  private:
+    Layout layout_;
+    Alphabet alphabet_;
+    key_filter filter_;
+    const two_trie_archive::state_type *front_;  ///< States of front trie.
+    size_type front_size_;                       ///< Size of front_.
+    const two_trie_archive::state_type *rear_;   ///< States of rear trie.
+};
+
+END_TRIE_NAMESPACE
+
+/** @} */
+
+#endif  // TRIE_ENGINE_H_
+
+// vim: ts=4 sw=4 ai et
@@ -31,6 +31,8 @@
 #include <limits.h>
 
 #include <iostream>
+#include <algorithm>
+#include <limits>
 #include <cstdlib>
 #include <cstdio>
 
@@ -39,6 +41,48 @@
 
 BEGIN_TRIE_NAMESPACE
 
+/// Represents the header of a trie bundle.
+typedef struct {
+    char magic[16];  ///< Bundle magic.
+    int32_t count;   ///< Number of archives.
+    char unused[44]; ///< for 32/64 bits compatible.
+} bundle_header_type;
+
+/// Represents a directory entry of a trie bundle.
+typedef struct {
+    char name[trie_bundle::kMaxNameSize];  ///< Archive name.
+    int64_t offset;  ///< Offset of the archive from start of bundle.
+    int64_t size;    ///< Length of the archive.
+} bundle_entry_type;
+
+static const char bundle_magic[16] = "TRIE_BUNDLE";
+
+/// Archives in a bundle are aligned with cache line.
+static const size_t kBundleAlignment = 64;
+
+#ifdef TRIE_LARGE_INDEX
+static const char double_magic[] = "TWO_TRIE_64";
+static const char single_magic[] = "TAIL_TRIE_64";
+static const char *other_magic[] = {"TWO_TRIE", "TAIL_TRIE"};
+#else
+static const char double_magic[] = "TWO_TRIE";
+static const char single_magic[] = "TAIL_TRIE";
+static const char *other_magic[] = {"TWO_TRIE_64", "TAIL_TRIE_64"};
+#endif
+
+static trie::trie_type find_archive_type(const char *magic, size_t length)
+{
+    if (strncmp(magic, double_magic, length) == 0)
+        return trie::DOUBLE_TRIE;
+    else if (strncmp(magic, single_magic, length) == 0)
+        return trie::SINGLE_TRIE;
+    else if (strncmp(magic, other_magic[0], length) == 0
+             || strncmp(magic, other_magic[1], length) == 0)
+        throw bad_trie_archive("archive index width mismatch");
+    else
+        return trie::UNKNOW;
+}
+
 static trie::trie_type find_archive_type(const char *archive)
 {
     FILE *fp;
@@ -46,12 +90,7 @@ static trie::trie_type find_archive_type(const char *archive)
     if ((fp = fopen(archive, "r"))) {
         size_t length = fread(magic, 1, sizeof(magic) / sizeof(char) - 1, fp);
         fclose(fp);
-        if (strncmp(magic, "TWO_TRIE", length) == 0)
-            return trie::DOUBLE_TRIE;
-        else if (strncmp(magic, "TAIL_TRIE", length) == 0)
-            return trie::SINGLE_TRIE;
-        else
-            return trie::UNKNOW;
+        return find_archive_type(magic, length);
     } else {
         throw bad_trie_archive("file error");
     }
@@ -90,6 +129,109 @@ bool trie::search(const char *inputs, size_t length,
     return search(key, value);
 }
 
+size_t trie::prefix_search(const key_type &key, result_buffer *result) const
+{
+    result_type found;
+    result_type::const_iterator it;
+
+    prefix_search(key, &found);
+    for (it = found.begin(); it != found.end(); it++)
+        result->push_back(it->first.data(), it->first.length(), it->second);
+    return result->size();
+}
+
+size_t trie::common_prefix_search(const key_type &key,
+                                  result_buffer *result) const
+{
+    const char_type *p = key.data();
+    key_type prefix;
+    value_type value;
+    size_t length = 0, i;
+
+    while (length < key.length() && p[length] != key_type::kTerminator)
+        length++;
+    for (i = 0; i <= length; i++) {
+        prefix.assign(p, i);
+        if (search(prefix, &value))
+            result->push_back(p, i, value);
+    }
+    return result->size();
+}
+
+void trie::insert_payload(const key_type &key,
+                          const char *payload, size_t length)
+{
+    throw std::runtime_error("not implement");
+}
+
+bool trie::search_payload(const key_type &key,
+                          const char **payload, size_t *length) const
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::relayout(const std::vector<std::string> *samples)
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::set_concurrent(bool concurrent)
+{
+    throw std::runtime_error("not implement");
+}
+
+trie *trie::snapshot()
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::stats(stats_type *stats) const
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::set_alphabet(const std::vector<size_t> &frequency)
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::set_utf8_alphabet(const std::vector<std::string> *samples)
+{
+    throw std::runtime_error("not implement");
+}
+
+void trie::reset_counters()
+{
+    instrument_reset();
+}
+
+bool trie::erase(const key_type &key)
+{
+    throw std::runtime_error("not implement");
+}
+
+size_t trie::erase_prefix(const key_type &prefix)
+{
+    result_type result;
+    result_type::const_iterator it;
+    key_type key;
+    size_t count = 0;
+
+    prefix_search(prefix, &result);
+    for (it = result.begin(); it != result.end(); it++) {
+        // keys in result may end with a terminator
+        const char_type *p = it->first.data();
+        size_t length = 0;
+        while (length < it->first.length()
+               && p[length] != key_type::kTerminator)
+            length++;
+        key.borrow(p, length);
+        if (erase(key))
+            count++;
+    }
+    return count;
+}
+
 void trie::read_from_text(const char *source, bool verbose)
 {
     FILE *file;
@@ -150,6 +292,1455 @@ void trie::read_from_text(const char *source, bool verbose)
     }
 }
 
+// ************************************************************************
+// * Implementation of trie bundle                                        *
+// ************************************************************************
+
+/// Constructs a read-only trie from an archive in memory.
+static trie *load_archive(char *archive, size_t size)
+{
+    if (size < 16)
+        throw bad_trie_archive("file corrupted");
+    switch (find_archive_type(archive, 15)) {
+        case trie::SINGLE_TRIE:
+            return new single_trie(archive, size);
+        case trie::DOUBLE_TRIE:
+            return new double_trie(archive, size);
+        default:
+            throw bad_trie_archive("file magic error");
+    }
+}
+
+trie_bundle::trie_bundle(const char *filename)
+    :mmap_(NULL), mmap_size_(0)
+{
+    mmap_ = map_archive(filename, &mmap_size_);
+    try {
+        char *start = static_cast<char *>(mmap_);
+        const bundle_header_type *header =
+            reinterpret_cast<bundle_header_type *>(start);
+        if (mmap_size_ < sizeof(bundle_header_type)
+            || strcmp(header->magic, bundle_magic))
+            throw bad_trie_archive("file magic error");
+        if (header->count < 0
+            || sizeof(bundle_header_type) + header->count
+               * sizeof(bundle_entry_type) > mmap_size_)
+            throw bad_trie_archive("file corrupted");
+        const bundle_entry_type *entry =
+            reinterpret_cast<const bundle_entry_type *>(header + 1);
+        for (int32_t i = 0; i < header->count; i++, entry++) {
+            if (entry->offset < 0 || entry->size < 0
+                || static_cast<size_t>(entry->offset + entry->size)
+                   > mmap_size_
+                || !memchr(entry->name, '\0', sizeof(entry->name)))
+                throw bad_trie_archive("file corrupted");
+            trie *dict = load_archive(start + entry->offset, entry->size);
+            if (tries_.find(entry->name) != tries_.end()) {
+                delete dict;
+                throw bad_trie_archive("duplicated archive name");
+            }
+            names_.push_back(entry->name);
+            tries_[entry->name] = dict;
+        }
+    } catch (...) {
+        std::map<std::string, trie *>::iterator it;
+        for (it = tries_.begin(); it != tries_.end(); it++)
+            delete it->second;
+        munmap(mmap_, mmap_size_);
+        throw;
+    }
+}
+
+trie_bundle::~trie_bundle()
+{
+    std::map<std::string, trie *>::iterator it;
+    for (it = tries_.begin(); it != tries_.end(); it++)
+        delete it->second;
+    munmap(mmap_, mmap_size_);
+}
+
+trie *trie_bundle::get(const char *name) const
+{
+    std::map<std::string, trie *>::const_iterator found(tries_.find(name));
+    if (found == tries_.end())
+        return NULL;
+    return found->second;
+}
+
+void trie_bundle::build(const char *filename, const source_type &sources)
+{
+    FILE *out;
+    bundle_header_type header;
+    std::vector<bundle_entry_type> entries(sources.size());
+    int64_t offset;
+    size_t i;
+
+    memset(&header, 0, sizeof(header));
+    snprintf(header.magic, sizeof(header.magic), "%s", bundle_magic);
+    header.count = sources.size();
+
+    // lay out the directory first
+    offset = sizeof(bundle_header_type)
+             + sources.size() * sizeof(bundle_entry_type);
+    for (i = 0; i < sources.size(); i++) {
+        struct stat sb;
+        if (sources[i].first.size() + 1 > kMaxNameSize)
+            throw bad_trie_source("archive name too long");
+        for (size_t j = 0; j < i; j++) {
+            if (sources[j].first == sources[i].first)
+                throw bad_trie_source("duplicated archive name");
+        }
+        if (find_archive_type(sources[i].second.c_str()) == trie::UNKNOW)
+            throw bad_trie_archive("file magic error");
+        if (stat(sources[i].second.c_str(), &sb) < 0)
+            throw bad_trie_archive("file error");
+        memset(&entries[i], 0, sizeof(bundle_entry_type));
+        snprintf(entries[i].name, sizeof(entries[i].name), "%s",
+                 sources[i].first.c_str());
+        offset = (offset + kBundleAlignment - 1)
+                 / kBundleAlignment * kBundleAlignment;
+        entries[i].offset = offset;
+        entries[i].size = sb.st_size;
+        offset += sb.st_size;
+    }
+
+    if (!(out = fopen(filename, "w+")))
+        throw bad_trie_archive("file error");
+    fwrite(&header, sizeof(header), 1, out);
+    if (entries.size())
+        fwrite(&entries[0], sizeof(bundle_entry_type), entries.size(), out);
+    for (i = 0; i < sources.size(); i++) {
+        FILE *in;
+        char buf[BUFSIZ];
+        size_t length;
+
+        // pad to the offset of next archive
+        while (ftell(out) < entries[i].offset)
+            fputc(0, out);
+        if (!(in = fopen(sources[i].second.c_str(), "r"))) {
+            fclose(out);
+            throw bad_trie_archive("file error");
+        }
+        while ((length = fread(buf, 1, sizeof(buf), in)) > 0)
+            fwrite(buf, 1, length, out);
+        fclose(in);
+    }
+    fclose(out);
+}
+
+// ************************************************************************
+// * Implementation of trie handle                                        *
+// ************************************************************************
+
+struct trie_handle::archive_type {
+    void *mmap;    ///< Pointer to mmapped buffer.
+    size_t size;   ///< Length of mmapped buffer.
+    trie *dict;    ///< Trie over the buffer.
+};
+
+trie_handle::reader::reader(const trie_handle &handle)
+    :handle_(handle), token_(handle.reclaimer_->enter()),
+     trie_(__atomic_load_n(&handle.current_, __ATOMIC_ACQUIRE)->dict)
+{
+}
+
+trie_handle::reader::~reader()
+{
+    handle_.reclaimer_->leave(token_);
+}
+
+trie_handle::trie_handle(const char *filename)
+    :current_(NULL), reclaimer_(NULL), reloading_(0), generation_(0)
+{
+    current_ = open_archive(filename, NULL);
+    reclaimer_ = new epoch_reclaimer();
+}
+
+trie_handle::~trie_handle()
+{
+    delete reclaimer_;  // frees archives not yet reclaimed
+    close_archive(current_);
+}
+
+trie_handle::archive_type *
+trie_handle::open_archive(const char *filename,
+                          const std::vector<std::string> *warmup)
+{
+    archive_type *archive = new archive_type();
+    archive->mmap = map_archive(filename, &archive->size);
+    try {
+        volatile const char *start = static_cast<char *>(archive->mmap);
+        char sum = 0;
+        size_t page = sysconf(_SC_PAGESIZE);
+        // fault in every page now rather than under traffic
+        madvise(archive->mmap, archive->size, MADV_WILLNEED);
+        for (size_t i = 0; i < archive->size; i += page)
+            sum ^= start[i];
+        archive->dict = load_archive(static_cast<char *>(archive->mmap),
+                                     archive->size);
+        if (warmup) {
+            std::vector<std::string>::const_iterator it;
+            for (it = warmup->begin(); it != warmup->end(); it++)
+                archive->dict->search(it->data(), it->size(), NULL);
+        }
+    } catch (...) {
+        munmap(archive->mmap, archive->size);
+        delete archive;
+        throw;
+    }
+    return archive;
+}
+
+void trie_handle::close_archive(void *ptr)
+{
+    archive_type *archive = static_cast<archive_type *>(ptr);
+    delete archive->dict;
+    munmap(archive->mmap, archive->size);
+    delete archive;
+}
+
+void trie_handle::reload(const char *filename,
+                         const std::vector<std::string> *warmup)
+{
+    archive_type *archive = open_archive(filename, warmup);
+
+    while (__sync_lock_test_and_set(&reloading_, 1))
+        sched_yield();
+    archive = __atomic_exchange_n(&current_, archive, __ATOMIC_ACQ_REL);
+    reclaimer_->retire(archive, close_archive);
+    // wait for readers of the old archive to leave
+    while (reclaimer_->pending()) {
+        usleep(1000);
+        reclaimer_->reclaim();
+    }
+    generation_++;
+    __sync_lock_release(&reloading_);
+}
+
+// ************************************************************************
+// * Implementation of layered trie                                       *
+// ************************************************************************
+
+struct layered_trie::layers_type {
+    trie *base;           ///< Base archive, or NULL if it is empty.
+    trie *frozen;         ///< Inserts being compacted, or NULL.
+    trie *frozen_erased;  ///< Tombstones being compacted, or NULL.
+    trie *delta;          ///< Inserts since the last compaction.
+    trie *erased;         ///< Tombstones since the last compaction.
+    int dirty;            ///< Nonzero once delta or erased is changed.
+};
+
+/// Represents the header of a record in log.
+typedef struct {
+    char op;              ///< '+' for insert and '-' for erase.
+    char unused[3];       ///< Padding.
+    trie::value_type value;  ///< Value of insert.
+    uint32_t length;      ///< Length of the key following the header.
+} log_record_type;
+
+/// Suffix of the log being compacted.
+static const char kOldLogSuffix[] = ".old";
+
+/// Longest key a log record may carry, so a corrupted length is caught.
+static const uint32_t kMaxLogKeyLength = 1 << 20;
+
+/// Holds a spin lock in scope.
+class spin_guard {
+  public:
+    /// Takes lock.
+    explicit spin_guard(int *lock)
+        :lock_(lock)
+    {
+        while (__sync_lock_test_and_set(lock_, 1))
+            sched_yield();
+    }
+
+    /// Releases the lock.
+    ~spin_guard()
+    {
+        __sync_lock_release(lock_);
+    }
+
+  private:
+    int *lock_;  ///< The lock.
+};
+
+/// Returns the bytes of key, which may end with a terminator.
+static std::string key_bytes(const trie::key_type &key)
+{
+    std::string bytes;
+    const trie::char_type *p = key.data();
+    size_t i;
+    for (i = 0; i < key.length() && p[i] != trie::key_type::kTerminator; i++)
+        bytes.push_back(trie::key_type::char_out(p[i]));
+    return bytes;
+}
+
+/// Creates an empty delta trie which can be read while it changes.
+static trie *create_delta()
+{
+    trie *delta = trie::create_trie(trie::DOUBLE_TRIE);
+    delta->set_concurrent(true);
+    return delta;
+}
+
+layered_trie::layered_trie(const char *base, const char *log, bool sync)
+    :base_(base), log_name_(log?log:""), log_(NULL), sync_(sync),
+     layers_(NULL), reclaimer_(NULL), writing_(0), compacting_(0),
+     changes_(0), sequence_(0), starving_(0)
+{
+    layers_ = new layers_type();
+    try {
+        if (access(base, F_OK) == 0)
+            layers_->base = trie::create_trie(base);
+        layers_->delta = create_delta();
+        layers_->erased = create_delta();
+        if (log)
+            open_log();
+    } catch (...) {
+        delete layers_->base;
+        delete layers_->delta;
+        delete layers_->erased;
+        delete_layers(layers_);
+        throw;
+    }
+    reclaimer_ = new epoch_reclaimer();
+}
+
+layered_trie::~layered_trie()
+{
+    delete reclaimer_;  // frees layers not yet reclaimed
+    delete layers_->base;
+    delete layers_->frozen;
+    delete layers_->frozen_erased;
+    delete layers_->delta;
+    delete layers_->erased;
+    delete_layers(layers_);
+    if (log_)
+        fclose(log_);
+}
+
+void layered_trie::delete_layers(void *layers)
+{
+    delete static_cast<layers_type *>(layers);
+}
+
+void layered_trie::delete_trie(void *dict)
+{
+    delete static_cast<trie *>(dict);
+}
+
+void layered_trie::begin_write()
+{
+    while (__atomic_load_n(&starving_, __ATOMIC_ACQUIRE))
+        sched_yield();
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void layered_trie::end_write()
+{
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELEASE);
+}
+
+layered_trie::read_section::read_section(const layered_trie *trie)
+    :trie_(trie), failures_(0)
+{
+}
+
+layered_trie::read_section::~read_section()
+{
+    if (failures_ >= kPatientReads)
+        __atomic_sub_fetch(&trie_->starving_, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t layered_trie::read_section::begin() const
+{
+    return __atomic_load_n(&trie_->sequence_, __ATOMIC_ACQUIRE);
+}
+
+bool layered_trie::read_section::validate(uint64_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!(sequence & 1)
+        && __atomic_load_n(&trie_->sequence_, __ATOMIC_RELAXED) == sequence)
+        return true;
+    if (++failures_ == kPatientReads)
+        __atomic_add_fetch(&trie_->starving_, 1, __ATOMIC_ACQ_REL);
+    if (failures_ >= kPatientReads)  // let the writer finish
+        sched_yield();
+    return false;
+}
+
+void layered_trie::publish(layers_type *layers)
+{
+    layers = __atomic_exchange_n(&layers_, layers, __ATOMIC_ACQ_REL);
+    reclaimer_->retire(layers, delete_layers);
+}
+
+bool layered_trie::search_layers(const layers_type *layers,
+                                 const key_type &key, value_type *value)
+{
+    if (__atomic_load_n(&layers->dirty, __ATOMIC_ACQUIRE)) {
+        if (layers->delta->search(key, value))
+            return true;
+        if (layers->erased->search(key, NULL))
+            return false;
+    }
+    if (layers->frozen) {
+        if (layers->frozen->search(key, value))
+            return true;
+        if (layers->frozen_erased->search(key, NULL))
+            return false;
+    }
+    return layers->base && layers->base->search(key, value);
+}
+
+void layered_trie::merge_layers(const layers_type *layers,
+                                const key_type &prefix, merged_type *merged)
+{
+    const trie *tries[] = {layers->base, layers->frozen_erased,
+                           layers->frozen, layers->erased, layers->delta};
+    result_type result;
+    result_type::const_iterator it;
+    size_t i;
+
+    for (i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+        if (!tries[i])
+            continue;
+        result.clear();
+        tries[i]->prefix_search(prefix, &result);
+        for (it = result.begin(); it != result.end(); it++) {
+            if (tries[i] == layers->erased
+                || tries[i] == layers->frozen_erased)
+                merged->erase(key_bytes(it->first));
+            else
+                (*merged)[key_bytes(it->first)] = it->second;
+        }
+    }
+}
+
+void layered_trie::build_merged(const merged_type &merged,
+                                const char *filename, bool verbose) const
+{
+    trie *dict = trie::create_trie(DOUBLE_TRIE);
+    merged_type::const_iterator it;
+    try {
+        for (it = merged.begin(); it != merged.end(); it++)
+            dict->insert(it->first.data(), it->first.size(), it->second);
+        dict->set_archive_options(archive_options_);
+        dict->build(filename, verbose);
+    } catch (...) {
+        delete dict;
+        throw;
+    }
+    delete dict;
+}
+
+bool layered_trie::search(const key_type &key, value_type *value) const
+{
+    epoch_guard guard(reclaimer_);
+    const layers_type *layers = __atomic_load_n(&layers_, __ATOMIC_ACQUIRE);
+    read_section section(this);
+    value_type result = 0;
+    uint64_t sequence;
+    bool found;
+    do {
+        sequence = section.begin();
+        found = search_layers(layers, key, &result);
+    } while (!section.validate(sequence));
+    if (found && value)
+        *value = result;
+    return found;
+}
+
+size_t layered_trie::prefix_search(const key_type &key,
+                                   result_type *result) const
+{
+    epoch_guard guard(reclaimer_);
+    const layers_type *layers = __atomic_load_n(&layers_, __ATOMIC_ACQUIRE);
+    merged_type merged;
+    merged_type::const_iterator it;
+    read_section section(this);
+    uint64_t sequence;
+    do {
+        sequence = section.begin();
+        merged.clear();
+        merge_layers(layers, key, &merged);
+    } while (!section.validate(sequence));
+    for (it = merged.begin(); it != merged.end(); it++) {
+        key_type found(it->first.data(), it->first.size());
+        result->push_back(std::pair<key_type, value_type>(found,
+                                                         it->second));
+    }
+    return result->size();
+}
+
+void layered_trie::insert_delta(const key_type &key, value_type value)
+{
+    layers_type *layers = layers_;
+    __atomic_store_n(&layers->dirty, 1, __ATOMIC_RELEASE);
+    // a change of one trie is seen at once, readers only retry when a
+    // tombstone goes away with it
+    if (!layers->erased->search(key, NULL)) {
+        layers->delta->insert(key, value);
+        return;
+    }
+    begin_write();
+    layers->delta->insert(key, value);
+    layers->erased->erase(key);
+    end_write();
+}
+
+bool layered_trie::erase_delta(const key_type &key)
+{
+    layers_type *layers = layers_;
+    layers_type lower = {layers->base, NULL, NULL, layers->frozen,
+                         layers->frozen_erased, layers->frozen != NULL};
+    bool fresh = layers->delta->search(key, NULL);
+    bool stale = !layers->erased->search(key, NULL)
+                 && search_layers(&lower, key, NULL);
+    if (!fresh && !stale)
+        return false;
+    __atomic_store_n(&layers->dirty, 1, __ATOMIC_RELEASE);
+    if (fresh && stale)
+        begin_write();
+    if (stale)  // hide the key in lower layers
+        layers->erased->insert(key, 0);
+    if (fresh)
+        layers->delta->erase(key);
+    if (fresh && stale)
+        end_write();
+    return true;
+}
+
+void layered_trie::insert(const key_type &key, const value_type &value)
+{
+    spin_guard guard(&writing_);
+    write_log('+', key, value);
+    insert_delta(key, value);
+    changes_++;
+}
+
+bool layered_trie::erase(const key_type &key)
+{
+    spin_guard guard(&writing_);
+    if (!search_layers(layers_, key, NULL))
+        return false;
+    write_log('-', key, 0);
+    erase_delta(key);
+    changes_++;
+    return true;
+}
+
+void layered_trie::write_log(char op, const key_type &key, value_type value)
+{
+    if (!log_)
+        return;
+    std::string bytes = key_bytes(key);
+    if (bytes.size() > kMaxLogKeyLength)
+        throw std::length_error("trie: key too long to log");
+    log_record_type record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.value = value;
+    record.length = bytes.size();
+    if (fwrite(&record, sizeof(record), 1, log_) != 1
+        || fwrite(bytes.data(), 1, bytes.size(), log_) != bytes.size()
+        || fflush(log_) != 0
+        || (sync_ && fdatasync(fileno(log_)) != 0))
+        throw std::runtime_error(std::string("can not write log ")
+                                 + log_name_);
+}
+
+long layered_trie::replay_log(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+    log_record_type record;
+    std::vector<char> bytes;
+    key_type key;
+    long length = 0;
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        // a header beyond what write_log makes is torn like a short key
+        if ((record.op != '+' && record.op != '-')
+            || record.unused[0] || record.unused[1] || record.unused[2]
+            || record.length > kMaxLogKeyLength)
+            break;
+        bytes.resize(record.length + 1);
+        if (fread(&bytes[0], 1, record.length, fp) != record.length)
+            break;  // torn by a crash
+        key.assign(&bytes[0], record.length);
+        if (record.op == '+')
+            insert_delta(key, record.value);
+        else
+            erase_delta(key);
+        length += sizeof(record) + record.length;
+        changes_++;
+    }
+    fclose(fp);
+    return length;
+}
+
+void layered_trie::open_log()
+{
+    std::string old = log_name_ + kOldLogSuffix;
+    long old_length = replay_log(old.c_str());
+    long length = replay_log(log_name_.c_str());
+
+    // drop torn records, and fold a log left by an unfinished
+    // compaction into one
+    if (old_length >= 0) {
+        if (truncate(old.c_str(), old_length) != 0)
+            throw std::runtime_error(strerror(errno));
+        if (length > 0) {
+            FILE *in = fopen(log_name_.c_str(), "r");
+            FILE *out = fopen(old.c_str(), "a");
+            std::vector<char> buffer(length);
+            bool ok = in && out
+                      && fread(&buffer[0], 1, length, in)
+                         == static_cast<size_t>(length)
+                      && fwrite(&buffer[0], 1, length, out)
+                         == static_cast<size_t>(length)
+                      && fflush(out) == 0 && fsync(fileno(out)) == 0;
+            if (in)
+                fclose(in);
+            if (out)
+                fclose(out);
+            if (!ok)
+                throw std::runtime_error(std::string("can not write log ")
+                                         + old);
+        }
+        if (rename(old.c_str(), log_name_.c_str()) != 0)
+            throw std::runtime_error(strerror(errno));
+    } else if (length >= 0) {
+        if (truncate(log_name_.c_str(), length) != 0)
+            throw std::runtime_error(strerror(errno));
+    }
+    if (!(log_ = fopen(log_name_.c_str(), "a")))
+        throw std::runtime_error(std::string("can not open log ")
+                                 + log_name_);
+}
+
+void layered_trie::build(const char *filename, bool verbose)
+{
+    spin_guard guard(&writing_);
+    merged_type merged;
+    merge_layers(layers_, key_type("", 0), &merged);
+    build_merged(merged, filename, verbose);
+}
+
+void layered_trie::compact(bool verbose)
+{
+    spin_guard guard(&compacting_);
+    std::string old = log_name_ + kOldLogSuffix;
+    layers_type *layers;
+
+    {
+        spin_guard writing(&writing_);
+        // a failed compaction leaves its frozen delta to be retried
+        if (!layers_->frozen) {
+            if (!layers_->dirty)
+                return;
+            if (log_) {
+                if (fsync(fileno(log_)) != 0
+                    || rename(log_name_.c_str(), old.c_str()) != 0)
+                    throw std::runtime_error(strerror(errno));
+                fclose(log_);
+                if (!(log_ = fopen(log_name_.c_str(), "a")))
+                    throw std::runtime_error(std::string("can not open log ")
+                                             + log_name_);
+            }
+            layers = new layers_type(*layers_);
+            layers->frozen = layers->delta;
+            layers->frozen_erased = layers->erased;
+            layers->delta = NULL;
+            layers->erased = NULL;
+            layers->dirty = 0;
+            try {
+                layers->delta = create_delta();
+                layers->erased = create_delta();
+            } catch (...) {
+                delete layers->delta;
+                delete layers;
+                throw;
+            }
+            publish(layers);
+            changes_ = 0;
+        }
+        layers = layers_;
+    }
+
+    // frozen layers and base do not change, merge them without lock
+    layers_type frozen = {layers->base, layers->frozen,
+                          layers->frozen_erased, NULL, NULL, 0};
+    merged_type merged;
+    std::string temp = base_ + ".compact";
+    merge_layers(&frozen, key_type("", 0), &merged);
+    build_merged(merged, temp.c_str(), verbose);
+    merged.clear();
+    int fd = open(temp.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0 || close(fd) != 0
+        || rename(temp.c_str(), base_.c_str()) != 0)
+        throw std::runtime_error(std::string("can not write archive ")
+                                 + base_);
+    trie *base = trie::create_trie(base_.c_str());
+
+    {
+        spin_guard writing(&writing_);
+        layers_type retired = *layers_;
+        layers = new layers_type(*layers_);
+        layers->base = base;
+        layers->frozen = NULL;
+        layers->frozen_erased = NULL;
+        // unpublish the old tries before any reclaim frees them
+        publish(layers);
+        reclaimer_->retire(retired.base, delete_trie);
+        reclaimer_->retire(retired.frozen, delete_trie);
+        reclaimer_->retire(retired.frozen_erased, delete_trie);
+        if (log_)
+            unlink(old.c_str());
+    }
+    // wait for readers of the old layers to leave
+    while (true) {
+        {
+            spin_guard writing(&writing_);
+            reclaimer_->reclaim();
+            if (!reclaimer_->pending())
+                break;
+        }
+        usleep(1000);
+    }
+}
+
+// ************************************************************************
+// * Implementation of sharded trie                                       *
+// ************************************************************************
+
+struct sharded_trie::shard_type {
+    trie *dict;            ///< Trie of the shard.
+    pthread_mutex_t lock;  ///< Lock of changes.
+    char unused[64 - (sizeof(trie *) + sizeof(pthread_mutex_t)) % 64];
+                           ///< Padding.
+};
+
+struct sharded_trie::job_type {
+    const sharded_trie *owner;  ///< The sharded_trie.
+    std::vector<std::vector<size_t> > members;  ///< Batch items by shard.
+    const batch_type *insert;   ///< Batch to be inserted, or NULL.
+    batch_type *search;         ///< Batch to be searched, or NULL.
+    value_type missing;         ///< Value of keys not found.
+    size_t next;                ///< Next shard to be taken.
+    size_t found;               ///< Number of keys found.
+    int failed;                 ///< Nonzero if a thread failed.
+};
+
+/// Names of routings in archive.
+static const char *routing_names[] = {"hash", "prefix"};
+
+/// Name of the archive of split keys in a bundle of ROUTE_BY_PREFIX.
+static const char kBoundsName[] = "prefix.bounds";
+
+/// Holds a mutex in scope.
+class mutex_guard {
+  public:
+    /// Takes lock.
+    explicit mutex_guard(pthread_mutex_t *lock)
+        :lock_(lock)
+    {
+        pthread_mutex_lock(lock_);
+    }
+
+    /// Releases the lock.
+    ~mutex_guard()
+    {
+        pthread_mutex_unlock(lock_);
+    }
+
+  private:
+    pthread_mutex_t *lock_;  ///< The lock.
+};
+
+/// Compares bytes of key with bound in byte order, as memcmp does.
+static int compare_bound(const trie::char_type *p, size_t length,
+                         const std::string &bound)
+{
+    size_t i, n = std::min(length, bound.size());
+    for (i = 0; i < n; i++) {
+        int c = static_cast<unsigned char>(trie::key_type::char_out(p[i]))
+                - static_cast<unsigned char>(bound[i]);
+        if (c)
+            return c;
+    }
+    return length < bound.size()?-1:length > bound.size();
+}
+
+sharded_trie::sharded_trie(size_t shards, routing_type routing,
+                           const std::vector<std::string> *samples)
+    :routing_(routing), bundle_(NULL)
+{
+    if (shards == 0)
+        throw std::runtime_error("sharded_trie: no shard");
+    try {
+        while (shards_.size() < shards) {
+            shard_type *shard = new shard_type();
+            pthread_mutex_init(&shard->lock, NULL);
+            shards_.push_back(shard);
+            shard->dict = trie::create_trie(DOUBLE_TRIE);
+            shard->dict->set_concurrent(true);
+        }
+    } catch (...) {
+        for (size_t i = 0; i < shards_.size(); i++) {
+            delete shards_[i]->dict;
+            pthread_mutex_destroy(&shards_[i]->lock);
+            delete shards_[i];
+        }
+        throw;
+    }
+    if (routing_ != ROUTE_BY_PREFIX)
+        return;
+    std::vector<std::string> sorted;
+    if (samples)
+        sorted = *samples;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (!sorted.empty() && sorted[0].empty())  // no key is below it
+        sorted.erase(sorted.begin());
+    if (sorted.empty()) {
+        split_bytes();
+        return;
+    }
+    // few samples leave some shards with an empty range
+    for (size_t i = 1; i < shards; i++)
+        bounds_.push_back(sorted[i * sorted.size() / shards]);
+}
+
+sharded_trie::sharded_trie(const char *filename)
+    :routing_(ROUTE_BY_HASH), bundle_(NULL)
+{
+    bundle_ = new trie_bundle(filename);
+    try {
+        size_t i;
+        if (bundle_->size() == 0)
+            throw bad_trie_archive("file corrupted");
+        for (i = 0; i < sizeof(routing_names) / sizeof(routing_names[0]); i++) {
+            if (strncmp(bundle_->name(0), routing_names[i],
+                        strlen(routing_names[i])) == 0)
+                routing_ = static_cast<routing_type>(i);
+        }
+        // archives of ROUTE_BY_PREFIX before the split keys were kept
+        // split the first byte
+        trie *bounds = routing_ == ROUTE_BY_PREFIX?bundle_->get(kBoundsName)
+                                                  :NULL;
+        size_t shards = bundle_->size() - (bounds?1:0);
+        for (i = 0; i < shards; i++) {
+            char name[trie_bundle::kMaxNameSize];
+            snprintf(name, sizeof(name), "%s.%lu", routing_names[routing_],
+                     static_cast<unsigned long>(i));
+            shard_type *shard = new shard_type();
+            pthread_mutex_init(&shard->lock, NULL);
+            shards_.push_back(shard);
+            if (!(shard->dict = bundle_->get(name)))
+                throw bad_trie_archive("file corrupted");
+        }
+        if (bounds) {
+            // a split key is kept once, valued by the number of split
+            // keys up to it
+            result_type result;
+            result_type::const_iterator it;
+            std::vector<std::pair<value_type, std::string> > counted;
+            bounds->prefix_search(key_type(), &result);
+            for (it = result.begin(); it != result.end(); it++)
+                counted.push_back(std::make_pair(it->second,
+                                                 key_bytes(it->first)));
+            std::sort(counted.begin(), counted.end());
+            for (i = 0; i < counted.size(); i++) {
+                if (counted[i].first > static_cast<value_type>(shards - 1))
+                    throw bad_trie_archive("file corrupted");
+                while (bounds_.size() < static_cast<size_t>(counted[i].first))
+                    bounds_.push_back(counted[i].second);
+            }
+            if (bounds_.size() != shards - 1)
+                throw bad_trie_archive("file corrupted");
+        } else if (routing_ == ROUTE_BY_PREFIX) {
+            split_bytes();
+        }
+    } catch (...) {
+        for (size_t i = 0; i < shards_.size(); i++) {
+            pthread_mutex_destroy(&shards_[i]->lock);
+            delete shards_[i];
+        }
+        delete bundle_;
+        throw;
+    }
+}
+
+sharded_trie::~sharded_trie()
+{
+    for (size_t i = 0; i < shards_.size(); i++) {
+        if (!bundle_)
+            delete shards_[i]->dict;
+        pthread_mutex_destroy(&shards_[i]->lock);
+        delete shards_[i];
+    }
+    delete bundle_;  // tries of archive are owned by bundle
+}
+
+void sharded_trie::split_bytes()
+{
+    // shard s starts at the first byte b with b * shards / 256 == s
+    size_t shards = shards_.size(), i;
+    for (i = 1; i < shards; i++)
+        bounds_.push_back(std::string(1, static_cast<char>(
+                                             (i * 256 + shards - 1) / shards)));
+}
+
+size_t sharded_trie::route(const key_type &key) const
+{
+    const char_type *p = key.data();
+    size_t length = 0, i;
+    while (length < key.length() && p[length] != key_type::kTerminator)
+        length++;
+    if (routing_ == ROUTE_BY_PREFIX) {
+        // the number of split keys not above key
+        size_t lo = 0, hi = bounds_.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (compare_bound(p, length, bounds_[mid]) >= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+    uint32_t hash = 2166136261U;
+    for (i = 0; i < length; i++) {
+        hash ^= static_cast<unsigned char>(key_type::char_out(p[i]));
+        hash *= 16777619U;
+    }
+    return hash % shards_.size();
+}
+
+void sharded_trie::insert(const key_type &key, const value_type &value)
+{
+    if (bundle_)
+        throw std::runtime_error("sharded_trie::insert: read-only trie");
+    shard_type *shard = shards_[route(key)];
+    mutex_guard guard(&shard->lock);
+    shard->dict->insert(key, value);
+}
+
+bool sharded_trie::search(const key_type &key, value_type *value) const
+{
+    return shards_[route(key)]->dict->search(key, value);
+}
+
+bool sharded_trie::erase(const key_type &key)
+{
+    if (bundle_)
+        throw std::runtime_error("sharded_trie::erase: read-only trie");
+    shard_type *shard = shards_[route(key)];
+    mutex_guard guard(&shard->lock);
+    return shard->dict->erase(key);
+}
+
+size_t sharded_trie::prefix_search(const key_type &key,
+                                   result_type *result) const
+{
+    std::vector<std::pair<std::string, value_type> > merged;
+    result_type found;
+    result_type::const_iterator it;
+    size_t first = 0, last = shards_.size(), i;
+
+    std::string bytes = key_bytes(key);
+    if (routing_ == ROUTE_BY_PREFIX && !bytes.empty()) {
+        // keys of prefix are below its successor, which drops trailing
+        // 0xff bytes and increments the last one
+        first = route(key);
+        while (!bytes.empty() && bytes[bytes.size() - 1] == '\xff')
+            bytes.erase(bytes.size() - 1);
+        if (!bytes.empty()) {
+            bytes[bytes.size() - 1]++;
+            last = std::lower_bound(bounds_.begin(), bounds_.end(), bytes)
+                   - bounds_.begin() + 1;
+        }
+    }
+    for (i = first; i < last; i++) {
+        found.clear();
+        shards_[i]->dict->prefix_search(key, &found);
+        for (it = found.begin(); it != found.end(); it++)
+            merged.push_back(std::make_pair(key_bytes(it->first),
+                                            it->second));
+    }
+    std::sort(merged.begin(), merged.end());
+    for (i = 0; i < merged.size(); i++) {
+        key_type sorted(merged[i].first.data(), merged[i].first.size());
+        result->push_back(std::pair<key_type, value_type>(
+                          sorted, merged[i].second));
+    }
+    return result->size();
+}
+
+void sharded_trie::build(const char *filename, bool verbose)
+{
+    if (bundle_)
+        throw std::runtime_error("sharded_trie::build: read-only trie");
+    trie_bundle::source_type sources;
+    size_t i;
+    try {
+        for (i = 0; i < shards_.size(); i++) {
+            char name[trie_bundle::kMaxNameSize];
+            snprintf(name, sizeof(name), "%s.%lu", routing_names[routing_],
+                     static_cast<unsigned long>(i));
+            sources.push_back(std::make_pair(name, std::string(filename)
+                                                   + "." + name));
+            mutex_guard guard(&shards_[i]->lock);
+            shards_[i]->dict->set_archive_options(archive_options_);
+            shards_[i]->dict->build(sources[i].second.c_str(), verbose);
+        }
+        if (!bounds_.empty()) {
+            // a split key repeated by few samples keeps its last count
+            sources.push_back(std::make_pair(kBoundsName,
+                                             std::string(filename) + "."
+                                             + kBoundsName));
+            trie *bounds = trie::create_trie(DOUBLE_TRIE);
+            try {
+                for (i = 0; i < bounds_.size(); i++)
+                    bounds->insert(bounds_[i].data(), bounds_[i].size(),
+                                   i + 1);
+                bounds->build(sources.back().second.c_str(), verbose);
+            } catch (...) {
+                delete bounds;
+                throw;
+            }
+            delete bounds;
+        }
+        trie_bundle::build(filename, sources);
+    } catch (...) {
+        for (i = 0; i < sources.size(); i++)
+            unlink(sources[i].second.c_str());
+        throw;
+    }
+    for (i = 0; i < sources.size(); i++)
+        unlink(sources[i].second.c_str());
+}
+
+void *sharded_trie::work(void *arg)
+{
+    job_type *job = static_cast<job_type *>(arg);
+    size_t s, i, found = 0;
+    key_type key;
+    try {
+        while ((s = __sync_fetch_and_add(&job->next, 1))
+               < job->members.size()) {
+            shard_type *shard = job->owner->shards_[s];
+            const std::vector<size_t> &members = job->members[s];
+            if (job->insert) {
+                mutex_guard guard(&shard->lock);
+                for (i = 0; i < members.size(); i++) {
+                    const std::string &word = (*job->insert)[members[i]].first;
+                    key.assign(word.data(), word.size());
+                    shard->dict->insert(key,
+                                        (*job->insert)[members[i]].second);
+                }
+            } else {
+                for (i = 0; i < members.size(); i++) {
+                    std::pair<std::string, value_type> &item =
+                        (*job->search)[members[i]];
+                    key.assign(item.first.data(), item.first.size());
+                    if (shard->dict->search(key, &item.second))
+                        found++;
+                    else
+                        item.second = job->missing;
+                }
+            }
+        }
+    } catch (...) {
+        __sync_fetch_and_add(&job->failed, 1);
+    }
+    __sync_fetch_and_add(&job->found, found);
+    return NULL;
+}
+
+void sharded_trie::run_job(job_type *job, size_t threads) const
+{
+    const batch_type &batch = job->insert?*job->insert:*job->search;
+    std::vector<pthread_t> workers;
+    key_type key;
+    size_t i;
+
+    job->owner = this;
+    job->members.resize(shards_.size());
+    for (i = 0; i < batch.size(); i++) {
+        key.assign(batch[i].first.data(), batch[i].first.size());
+        job->members[route(key)].push_back(i);
+    }
+    job->next = 0;
+    job->found = 0;
+    job->failed = 0;
+    if (threads == 0 || threads > shards_.size())
+        threads = shards_.size();
+    // the calling thread is one of the workers
+    for (i = 1; i < threads; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, work, job) != 0)
+            break;
+        workers.push_back(worker);
+    }
+    work(job);
+    for (i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    if (job->failed)
+        throw std::runtime_error("sharded_trie: batch failed");
+}
+
+void sharded_trie::insert_batch(const batch_type &batch, size_t threads)
+{
+    if (bundle_)
+        throw std::runtime_error("sharded_trie::insert: read-only trie");
+    job_type job;
+    job.insert = &batch;
+    job.search = NULL;
+    job.missing = 0;
+    run_job(&job, threads);
+}
+
+size_t sharded_trie::search_batch(batch_type *batch, value_type missing,
+                                  size_t threads) const
+{
+    job_type job;
+    job.insert = NULL;
+    job.search = batch;
+    job.missing = missing;
+    run_job(&job, threads);
+    return job.found;
+}
+
+// ************************************************************************
+// * Implementation of word trie                                          *
+// ************************************************************************
+
+/// Represents the header of a word trie archive.
+typedef struct {
+    char magic[16];  ///< Archive magic.
+    int64_t size;    ///< Number of states.
+    int64_t keys;    ///< Number of keys.
+    char unused[32]; ///< for 32/64 bits compatible.
+} word_header_type;
+
+#ifdef TRIE_LARGE_INDEX
+static const char word_magic[16] = "WORD_TRIE_64";
+#else
+static const char word_magic[16] = "WORD_TRIE";
+#endif
+
+/// Initial number of states of a word trie.
+static const int64_t kWordTrieSize = 1024;
+
+/// Free states tried by find_base before it appends to the end.
+static const size_t kMaxBaseProbes = 1024;
+
+static bool word_less(const word_trie::child_type &a,
+                      const word_trie::child_type &b)
+{
+    return a.word < b.word;
+}
+
+word_trie::word_trie()
+    :states_(NULL), size_(0), keys_(0), mmap_(NULL), mmap_size_(0),
+     probe_(0), used_(0)
+{
+    grow(kWordTrieSize);
+    // state 0 heads the free list, and state 1 is the root
+    unlink_free(1);
+    buffer_[1].check = -1;
+    buffer_[1].child = -1;
+    buffer_[1].sibling = -1;
+}
+
+word_trie::word_trie(const char *filename)
+    :states_(NULL), size_(0), keys_(0), mmap_(NULL), mmap_size_(0),
+     probe_(0), used_(0)
+{
+    mmap_ = map_archive(filename, &mmap_size_);
+    const word_header_type *header =
+        static_cast<const word_header_type *>(mmap_);
+    if (mmap_size_ < sizeof(word_header_type)
+        || strncmp(header->magic, word_magic, sizeof(word_magic))
+        || header->size < 2
+        || static_cast<uint64_t>(header->size)
+           > (mmap_size_ - sizeof(word_header_type)) / sizeof(state_type)) {
+        munmap(mmap_, mmap_size_);
+        throw bad_trie_archive("file corrupted");
+    }
+    states_ = reinterpret_cast<const state_type *>(header + 1);
+    size_ = header->size;
+    keys_ = header->keys;
+}
+
+word_trie::~word_trie()
+{
+    if (mmap_)
+        munmap(mmap_, mmap_size_);
+}
+
+void word_trie::grow(int64_t size)
+{
+    if (size <= size_)
+        return;
+    int64_t old = size_;
+    size = std::max<int64_t>(size, old * 2);
+    if (size > std::numeric_limits<size_type>::max())
+        throw std::runtime_error("word_trie: too many states");
+    buffer_.resize(size);
+    states_ = &buffer_[0];
+    size_ = size;
+    if (old == 0) {
+        buffer_[0].check = -1;
+        buffer_[0].child = buffer_[0].sibling = 0;
+        old = 1;
+    }
+    for (int64_t t = old; t < size; t++)
+        link_free(t);
+}
+
+void word_trie::link_free(size_type t)
+{
+    size_type last = buffer_[0].child;
+    buffer_[t].base = 0;
+    buffer_[t].check = 0;
+    buffer_[t].child = last;
+    buffer_[t].sibling = 0;
+    buffer_[last].sibling = t;
+    buffer_[0].child = t;
+}
+
+void word_trie::unlink_free(size_type t)
+{
+    if (t == probe_)
+        probe_ = buffer_[t].sibling;
+    if (t >= used_)
+        used_ = t + 1;
+    buffer_[buffer_[t].child].sibling = buffer_[t].sibling;
+    buffer_[buffer_[t].sibling].child = buffer_[t].child;
+}
+
+trie::size_type word_trie::find_base(const std::vector<int64_t> &codes)
+{
+    // start from where the last search ended, so states which fit no
+    // one are not probed over and over
+    size_type p = probe_;
+    for (size_t probes = 0; probes < kMaxBaseProbes; probes++) {
+        if (p == 0 && (p = states_[0].sibling) == 0)
+            break;
+        probe_ = p;
+        int64_t base = p - codes[0];
+        size_t i;
+        for (i = 1; i < codes.size(); i++) {
+            int64_t t = base + codes[i];
+            if (t < size_ && states_[t].check != 0)
+                break;
+        }
+        if (i == codes.size())
+            return base;
+        p = states_[p].sibling;
+    }
+    return std::max<size_type>(used_, 2) - codes[0];
+}
+
+void word_trie::take_state(size_type s, size_type t, int64_t code)
+{
+    unlink_free(t);
+    buffer_[t].base = 0;
+    buffer_[t].check = s;
+    buffer_[t].child = -1;
+    buffer_[t].sibling = buffer_[s].child;
+    buffer_[s].child = code;
+}
+
+size_t word_trie::count_children(size_type s, size_t limit) const
+{
+    size_t n = 0;
+    for (size_type c = states_[s].child; c >= 0 && n < limit;
+         c = states_[states_[s].base + c].sibling)
+        n++;
+    return n;
+}
+
+trie::size_type word_trie::relocate(size_type s, int64_t code,
+                                    size_type watch)
+{
+    std::vector<int64_t> codes;
+    size_type c, old = buffer_[s].base;
+    if (code >= 0)
+        codes.push_back(code);
+    for (c = buffer_[s].child; c >= 0; c = buffer_[old + c].sibling)
+        codes.push_back(c);
+    std::sort(codes.begin(), codes.end());
+    size_type base = find_base(codes);
+    grow(static_cast<int64_t>(base) + codes.back() + 1);
+    buffer_[s].base = base;
+    for (size_t i = 0; i < codes.size(); i++) {
+        if (codes[i] == code)
+            continue;
+        size_type from = old + codes[i], to = base + codes[i];
+        if (from == watch)
+            watch = to;
+        unlink_free(to);
+        buffer_[to] = buffer_[from];
+        // an end of key keeps a value in BASE and has no children
+        if (codes[i] > 0) {
+            for (c = buffer_[to].child; c >= 0;
+                 c = buffer_[buffer_[to].base + c].sibling)
+                buffer_[buffer_[to].base + c].check = to;
+        }
+        link_free(from);
+    }
+    return watch;
+}
+
+trie::size_type word_trie::create_transition(size_type s, int64_t code)
+{
+    size_type t = next(s, code);
+    if (t)
+        return t;
+    if (buffer_[s].child < 0) {
+        buffer_[s].base = find_base(std::vector<int64_t>(1, code));
+    } else {
+        int64_t u = buffer_[s].base + code;
+        if (u < 2) {
+            relocate(s, code, s);
+        } else if (u < size_ && buffer_[u].check != 0) {
+            // move whichever has fewer children, s may be one of them
+            size_type q = buffer_[u].check;
+            size_t n = count_children(s, kMaxBaseProbes) + 1;
+            if (q != s && count_children(q, n) < n)
+                s = relocate(q, -1, s);
+            else
+                relocate(s, code, s);
+        }
+    }
+    t = buffer_[s].base + code;
+    grow(static_cast<int64_t>(t) + 1);
+    take_state(s, t, code);
+    return t;
+}
+
+trie::size_type word_trie::go_forward(const word_type *words,
+                                      size_t length) const
+{
+    size_type s = 1;
+    for (size_t i = 0; i < length && s; i++) {
+        if (words[i] < 0)
+            return 0;
+        s = next_word(s, words[i]);
+    }
+    return s;
+}
+
+void word_trie::insert(const word_type *words, size_t length,
+                       value_type value)
+{
+    if (mmap_)
+        throw std::runtime_error("word_trie::insert: read-only trie");
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (words[i] < 0)
+            throw std::runtime_error("word_trie::insert: bad word");
+    }
+    size_type s = 1, t;
+    for (i = 0; i < length; i++)
+        s = create_transition(create_transition(s, high_code(words[i])),
+                              low_code(words[i]));
+    if (!(t = next(s, 0))) {
+        t = create_transition(s, 0);
+        keys_++;
+    }
+    buffer_[t].base = value;
+}
+
+bool word_trie::search(const word_type *words, size_t length,
+                       value_type *value) const
+{
+    size_type s = go_forward(words, length), t;
+    if (!s || !(t = next(s, 0)))
+        return false;
+    if (value)
+        *value = states_[t].base;
+    return true;
+}
+
+size_t word_trie::longest_prefix(const word_type *words, size_t length,
+                                 value_type *value) const
+{
+    size_t matched = 0;
+    size_type s = 1, t;
+    for (size_t i = 0; i < length; i++) {
+        if (words[i] < 0)
+            break;
+        if (!(s = next_word(s, words[i])))
+            break;
+        if ((t = next(s, 0))) {
+            matched = i + 1;
+            if (value)
+                *value = states_[t].base;
+        }
+    }
+    return matched;
+}
+
+size_t word_trie::children(const word_type *words, size_t length,
+                           std::vector<child_type> *children) const
+{
+    size_type s = go_forward(words, length), c, d, t, u, v;
+    children->clear();
+    if (!s)
+        return 0;
+    for (c = states_[s].child; c >= 0; c = states_[t].sibling) {
+        t = states_[s].base + c;
+        if (c == 0)
+            continue;
+        for (d = states_[t].child; d >= 0; d = states_[u].sibling) {
+            u = states_[t].base + d;
+            child_type child;
+            child.word = (c - 1) << kLowBits | (d - 1);
+            child.accept = (v = next(u, 0)) != 0;
+            child.value = child.accept?states_[v].base:0;
+            children->push_back(child);
+        }
+    }
+    std::sort(children->begin(), children->end(), word_less);
+    return children->size();
+}
+
+void word_trie::build(const char *filename, bool verbose) const
+{
+    FILE *out;
+    word_header_type header;
+    size_type size = size_;
+
+    if (!filename || !(out = fopen(filename, "w+")))
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + (filename?filename:"(null)"));
+    // free states at the end are not saved
+    while (size > 2 && states_[size - 1].check == 0)
+        size--;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, word_magic, sizeof(header.magic));
+    header.size = size;
+    header.keys = keys_;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(states_, sizeof(state_type) * size, 1, out);
+    fclose(out);
+    if (verbose) {
+        std::cerr << "keys = " << keys_ << ", states = " << size
+                  << ", total = "
+                  << sizeof(header) + sizeof(state_type) * size
+                  << std::endl;
+    }
+}
+
 END_TRIE_NAMESPACE
 
 // vim: ts=4 sw=4 ai et
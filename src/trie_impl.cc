@@ -28,6 +28,7 @@
  */
 #include <iostream>
 #include <cstdio>
+#include <queue>
 
 #include "trie_impl.h"
 
@@ -39,13 +40,26 @@
 
 BEGIN_TRIE_NAMESPACE
 
+#ifdef TRIE_LARGE_INDEX
+const char double_trie::magic_[16] = "TWO_TRIE_64";
+const char single_trie::magic_[16] = "TAIL_TRIE_64";
+#else
 const char double_trie::magic_[16] = "TWO_TRIE";
 const char single_trie::magic_[16] = "TAIL_TRIE";
+#endif
 
 // ************************************************************************
 // * Implementation of helper functions                                   *
 // ************************************************************************
 
+/// Estimates heap bytes of a node of std::set or std::map holding T.
+template<typename T>
+static size_t tree_node_size()
+{
+    // color, parent, left and right, and the allocator's own header
+    return sizeof(T) + 4 * sizeof(void *) + sizeof(size_t);
+}
+
 static const char* pretty_size(size_t size, char *buf, size_t buflen)
 {
     assert(buf);
@@ -63,10 +77,715 @@ static const char* pretty_size(size_t size, char *buf, size_t buflen)
     return buf;
 }
 
+void *map_archive(const char *filename, size_t *size)
+{
+    struct stat sb;
+    int fd, retval;
+    void *start;
+
+    if (!filename)
+        throw std::runtime_error("can not load from file (null)");
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        throw std::runtime_error(strerror(errno));
+    }
+
+    start = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+    if (start == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    *size = sb.st_size;
+
+    return start;
+}
+
+/// Describes an array from vm_resize, kept in the page before it.
+typedef struct {
+    size_t reserved;   ///< Bytes of address space for the array.
+    size_t committed;  ///< Bytes readable and writable.
+    size_t size;       ///< Bytes in use.
+    size_t dirty;      ///< Bytes ever in use, beyond which pages are zero.
+} vm_header_type;
+
+static const size_t kVmPageSize = 4096;
+static const size_t kHugePageSize = 2 << 20;
+
+static size_t vm_align(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+static vm_header_type *vm_header(void *ptr)
+{
+    return reinterpret_cast<vm_header_type *>(static_cast<char *>(ptr)
+                                              - kVmPageSize);
+}
+
+/**
+ * Reserves address space for an array, with its header page before it.
+ *
+ * @param size Size of the array in bytes.
+ * @param[out] reserved Bytes reserved for the array.
+ * @return Pointer to the array, nothing of which is committed.
+ */
+static char *vm_reserve(size_t size, size_t *reserved)
+{
+    size_t align = size < kHugePageSize / 2?kVmPageSize:kHugePageSize;
+    // leave room to double twice in place, or fall back to the size
+    size_t length = vm_align(size <= ~static_cast<size_t>(0) / 8?
+                             size * 4:size, align);
+    void *start;
+    while (true) {
+        start = mmap(NULL, length + align, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (start != MAP_FAILED)
+            break;
+        if (length == vm_align(size, align))
+            throw std::bad_alloc();
+        length = vm_align(size, align);
+    }
+    char *raw = static_cast<char *>(start);
+    char *data = reinterpret_cast<char *>(
+                 vm_align(reinterpret_cast<uintptr_t>(raw) + kVmPageSize,
+                          align));
+    // give back the slack around the header page and the array
+    if (data - kVmPageSize > raw)
+        munmap(raw, data - kVmPageSize - raw);
+    if (raw + length + align > data + length)
+        munmap(data + length, raw + align - data);
+    if (mprotect(data - kVmPageSize, kVmPageSize,
+                 PROT_READ | PROT_WRITE) < 0) {
+        munmap(data - kVmPageSize, kVmPageSize + length);
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == kHugePageSize)
+        madvise(data, length, MADV_HUGEPAGE);
+#endif
+    *reserved = length;
+    return data;
+}
+
+bool vm_extend(void *ptr, size_t size)
+{
+    vm_header_type *header = vm_header(ptr);
+    char *data = static_cast<char *>(ptr);
+    if (size > header->reserved)
+        return false;
+    if (size > header->committed) {
+        // commit whole huge pages in a range aligned with them
+        size_t align = header->reserved % kHugePageSize?
+                       kVmPageSize:kHugePageSize;
+        size_t committed = std::min(vm_align(size, align), header->reserved);
+        if (mprotect(data + header->committed, committed - header->committed,
+                     PROT_READ | PROT_WRITE) < 0)
+            throw std::bad_alloc();
+        header->committed = committed;
+    }
+    if (size > header->size && header->dirty > header->size) {
+        // units in use before shrinking are zeroed again
+        memset(data + header->size, 0,
+               std::min(size, header->dirty) - header->size);
+    }
+    header->size = size;
+    header->dirty = std::max(header->dirty, size);
+    return true;
+}
+
+void *vm_resize(void *ptr, size_t size)
+{
+    if (!size) {
+        if (ptr)
+            vm_release(ptr);
+        return NULL;
+    }
+    if (ptr && vm_extend(ptr, size))
+        return ptr;
+    size_t reserved;
+    char *data = vm_reserve(size, &reserved);
+    if (ptr) {
+        // move pages of the array without copying them, and then its
+        // header, which may be in a mapping of its own
+        size_t committed = vm_header(ptr)->committed;
+        size_t old_reserved = vm_header(ptr)->reserved;
+        if (mremap(ptr, committed, committed, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   data) == MAP_FAILED) {
+            munmap(vm_header(data), kVmPageSize + reserved);
+            throw std::bad_alloc();
+        }
+        memcpy(vm_header(data), vm_header(ptr), sizeof(vm_header_type));
+        munmap(vm_header(ptr), kVmPageSize);
+        if (old_reserved > committed)
+            munmap(static_cast<char *>(ptr) + committed,
+                   old_reserved - committed);
+    } else {
+        memset(vm_header(data), 0, sizeof(vm_header_type));
+    }
+    vm_header(data)->reserved = reserved;
+    vm_extend(data, size);
+    return data;
+}
+
+void vm_release(void *ptr)
+{
+    vm_header_type *header = vm_header(ptr);
+    munmap(header, kVmPageSize + header->reserved);
+}
+
+/// Blocks of all threads which have counted, never freed.
+static instrument_block *instrument_blocks = NULL;
+static pthread_mutex_t instrument_lock = PTHREAD_MUTEX_INITIALIZER;
+
+instrument_block *instrument_register()
+{
+    instrument_block *block = new instrument_block();
+    pthread_mutex_lock(&instrument_lock);
+    block->next = instrument_blocks;
+    instrument_blocks = block;
+    pthread_mutex_unlock(&instrument_lock);
+    return block;
+}
+
+void instrument_snapshot(trie::stats_type *stats)
+{
+#ifdef TRIE_INSTRUMENT
+    static const char *counter_names[kInstrumentCounters] = {
+        "rear crossings", "insert duplicates", "insert fronts",
+        "insert rears"
+    };
+    static const char *histogram_names[kInstrumentHistograms] = {
+        "forward states", "backward states", "find_base probes",
+        "relocate moves"
+    };
+    instrument_block sum = instrument_block();
+    size_t i, j;
+
+    pthread_mutex_lock(&instrument_lock);
+    for (instrument_block *block = instrument_blocks; block;
+         block = block->next) {
+        for (i = 0; i < kInstrumentCounters; i++)
+            sum.counters[i] += block->counters[i];
+        for (i = 0; i < kInstrumentHistograms; i++) {
+            sum.totals[i] += block->totals[i];
+            for (j = 0; j < kInstrumentBuckets; j++)
+                sum.buckets[i][j] += block->buckets[i][j];
+        }
+    }
+    pthread_mutex_unlock(&instrument_lock);
+    for (i = 0; i < kInstrumentCounters; i++)
+        stats->counters.push_back(trie::count_type(
+            counter_names[i], sum.counters[i]));
+    for (i = 0; i < kInstrumentHistograms; i++) {
+        stats->counters.push_back(trie::count_type(
+            histogram_names[i], sum.totals[i]));
+        stats->histograms.push_back(trie::histogram_type(
+            histogram_names[i],
+            std::vector<size_t>(sum.buckets[i],
+                                sum.buckets[i] + kInstrumentBuckets)));
+    }
+#endif
+}
+
+void instrument_reset()
+{
+    pthread_mutex_lock(&instrument_lock);
+    for (instrument_block *block = instrument_blocks; block;
+         block = block->next) {
+        instrument_block *next = block->next;
+        *block = instrument_block();
+        block->next = next;
+    }
+    pthread_mutex_unlock(&instrument_lock);
+}
+
+void alphabet::assign(const std::vector<size_t> &frequency)
+{
+    std::vector<std::pair<size_t, int> > order;
+    size_t i;
+
+    for (i = 0; i < frequency.size() && i < kSize - 2; i++) {
+        // sorted by descending frequency, then by byte
+        if (frequency[i])
+            order.push_back(std::make_pair(~frequency[i],
+                                           static_cast<int>(i)));
+    }
+    std::sort(order.begin(), order.end());
+    *this = alphabet();
+    enabled_ = true;
+    for (i = 0; i < order.size(); i++)
+        add(key_type::char_in(static_cast<char>(order[i].second)));
+}
+
+alphabet &alphabet::operator=(const alphabet &rhs)
+{
+    if (this != &rhs) {
+        enabled_ = rhs.enabled_;
+        next_ = rhs.next_;
+        memcpy(codes_, rhs.codes_, sizeof(codes_));
+        memcpy(letters_, rhs.letters_, sizeof(letters_));
+        singles_ = rhs.singles_;
+        delete points_;
+        points_ = rhs.points_?new code_point_table(*rhs.points_):NULL;
+    }
+    return *this;
+}
+
+void alphabet::assign_utf8(const std::vector<std::string> *samples)
+{
+    std::map<int32_t, size_t> frequency;
+    std::vector<std::pair<size_t, int32_t> > order;
+    std::map<int32_t, size_t>::const_iterator it;
+    int32_t point;
+    size_t i, j;
+
+    if (samples) {
+        for (i = 0; i < samples->size(); i++) {
+            const std::string &sample = (*samples)[i];
+            for (j = 0; j < sample.size(); frequency[point]++)
+                j += read_utf8(sample.data() + j, sample.size() - j, 0,
+                               &point);
+        }
+    }
+    // sorted by descending frequency, then by code point
+    for (it = frequency.begin(); it != frequency.end(); ++it)
+        order.push_back(std::make_pair(~it->second, it->first));
+    std::sort(order.begin(), order.end());
+    if (order.size() > static_cast<size_t>(code_point_table::kMaxSize))
+        throw std::runtime_error("alphabet: too many code points");
+    *this = alphabet();
+    enabled_ = true;
+    points_ = new code_point_table();
+    // leave two codes for as many code points again, each high code
+    // covers 256 of them, and the escape code takes the rest by three
+    int32_t room = std::min<int32_t>(std::max<size_t>(2 * order.size(), 1024),
+                                     code_point_table::kMaxSize);
+    singles_ = std::max(kCodes - 1 - (room + 255) / 256, 0);
+    for (i = 0; i < order.size(); i++)
+        points_->add(order[i].second);
+}
+
+void alphabet::add_points(const char_type *data, size_t length)
+{
+    int32_t point;
+    for (size_t i = 0; i < length; ) {
+        i += read_utf8(data + i, length - i, 1, &point);
+        if (points_->index(point) >= 0)
+            continue;
+        if (points_->size() >= code_point_table::kMaxSize)
+            throw std::runtime_error("alphabet: too many code points");
+        points_->add(point);
+    }
+}
+
+const trie::key_type &alphabet::decode_points(const key_type &key,
+                                              key_type *store) const
+{
+    const char_type *p = key.data(), *end = p + key.length();
+    store->clear();
+    while (p < end) {
+        // keys found may keep their terminator
+        if (*p == key_type::kTerminator) {
+            store->push(*p++);
+            continue;
+        }
+        int32_t index = singles_ - *p;
+        if (index < 0) {
+            // a high code with its low code, after the escape code if any
+            index = singles_;
+            if (*p == singles_ + 1) {
+                index += doubles();
+                p++;
+            }
+            if (p + 1 >= end)
+                break;
+            index += ((kCodes - p[0]) << 8) + kCodes - p[1];
+            p++;
+        }
+        p++;
+        write_utf8(points_->point(index), store);
+    }
+    return *store;
+}
+
+size_t alphabet::write(FILE *out) const
+{
+    if (!points_) {
+        fwrite(codes_, sizeof(codes_), 1, out);
+        return sizeof(codes_);
+    }
+    std::vector<int32_t> section;
+    section.push_back(singles_);
+    section.push_back(points_->size());
+    for (int32_t i = 0; i < points_->size(); i++)
+        section.push_back(points_->point(i));
+    // keep sections after it aligned
+    if (section.size() % 2)
+        section.push_back(0);
+    fwrite(&section[0], sizeof(int32_t) * section.size(), 1, out);
+    return sizeof(int32_t) * section.size();
+}
+
+const void *alphabet::load(const void *section, bool utf8)
+{
+    const char_type *codes = static_cast<const char_type *>(section);
+    *this = alphabet();
+    enabled_ = true;
+    if (utf8) {
+        const int32_t *p = static_cast<const int32_t *>(section);
+        int32_t size = p[1];
+        if (size < 0 || size > code_point_table::kMaxSize
+            || p[0] < 0 || p[0] >= kCodes)
+            throw std::runtime_error("file corrupted");
+        singles_ = p[0];
+        points_ = new code_point_table();
+        for (int32_t i = 0; i < size; i++) {
+            if (p[2 + i] < 0 || p[2 + i] >= code_point_table::kBytePoint + 256)
+                throw std::runtime_error("file corrupted");
+            points_->add(p[2 + i]);
+        }
+        return p + 2 + size + size % 2;
+    }
+    for (size_t i = 0; i < kSize; i++) {
+        codes_[i] = codes[i];
+        if (codes[i] > 0 && codes[i] < static_cast<char_type>(kSize))
+            letters_[codes[i]] = i;
+        if (codes[i] > 0 && codes[i] <= next_)
+            next_ = codes[i] - 1;
+    }
+    return codes + kSize;
+}
+
+const int32_t code_point_table::kBytePoint;
+const int32_t code_point_table::kMaxSize;
+
+code_point_table::code_point_table(const code_point_table &table)
+    :size_(0)
+{
+    memset(indexes_, 0, sizeof(indexes_));
+    memset(points_, 0, sizeof(points_));
+    for (int32_t i = 0; i < table.size(); i++)
+        add(table.point(i));
+}
+
+code_point_table::~code_point_table()
+{
+    size_t i;
+    for (i = 0; i < sizeof(indexes_) / sizeof(indexes_[0]); i++)
+        delete [] indexes_[i];
+    for (i = 0; i < sizeof(points_) / sizeof(points_[0]); i++)
+        delete [] points_[i];
+}
+
+int32_t code_point_table::add(int32_t point)
+{
+    int32_t index = size_;
+    int32_t **indexes = &indexes_[point >> kPageBits];
+    int32_t **points = &points_[index >> kPageBits];
+    if (!*indexes) {
+        int32_t *page = new int32_t[kPageMask + 1]();
+        __atomic_store_n(indexes, page, __ATOMIC_RELEASE);
+    }
+    if (!*points) {
+        int32_t *page = new int32_t[kPageMask + 1]();
+        __atomic_store_n(points, page, __ATOMIC_RELEASE);
+    }
+    (*points)[index & kPageMask] = point;
+    // readers may look up a code point while it is added
+    __atomic_store_n(&(*indexes)[point & kPageMask], index + 1,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&size_, index + 1, __ATOMIC_RELEASE);
+    return index;
+}
+
 trie::~trie()
 {
 }
 
+epoch_reclaimer::~epoch_reclaimer()
+{
+    std::vector<retired_type>::iterator it;
+    for (it = retired_.begin(); it != retired_.end(); it++)
+        it->release(it->ptr);
+}
+
+void epoch_reclaimer::reclaim()
+{
+    uint64_t epoch = epoch_;
+    size_t i, j;
+
+    // readers entered before the current epoch must have left
+    for (i = 0; i < kSlots; i++) {
+        if (__atomic_load_n(&slots_[i].count[(epoch - 1) & 1],
+                            __ATOMIC_ACQUIRE))
+            return;
+    }
+    for (i = 0, j = 0; i < retired_.size(); i++) {
+        if (retired_[i].epoch < epoch)
+            retired_[i].release(retired_[i].ptr);
+        else
+            retired_[j++] = retired_[i];
+    }
+    retired_.resize(j);
+    __atomic_store_n(&epoch_, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+// ************************************************************************
+// * Implementation of cow_array                                          *
+// ************************************************************************
+
+/// Opens an anonymous file in memory.
+static int open_shared_file()
+{
+    int fd = -1;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("libtrie", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+        char path[] = "/tmp/libtrie.XXXXXX";
+        fd = mkstemp(path);
+        if (fd >= 0)
+            unlink(path);
+    }
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    return fd;
+}
+
+cow_array::cow_array(const void *data, size_t size)
+    :data_(NULL), size_(0), fd_(-1), copy_fd_(-1), generation_(0), refs_(1)
+{
+    size_ = (size + kPageSize - 1) / kPageSize * kPageSize;
+    if (!size_)
+        size_ = kPageSize;
+    fd_ = open_shared_file();
+    try {
+        copy_fd_ = open_shared_file();
+    } catch (...) {
+        close(fd_);
+        throw;
+    }
+    void *start = MAP_FAILED;
+    if (ftruncate(fd_, size_) == 0)
+        start = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (start == MAP_FAILED) {
+        int error = errno;
+        close(fd_);
+        close(copy_fd_);
+        throw std::runtime_error(strerror(error));
+    }
+    data_ = static_cast<char *>(start);
+    memcpy(data_, data, size);
+    copied_.resize(size_ / kPageSize, 0);
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+cow_array::~cow_array()
+{
+    close(fd_);
+    close(copy_fd_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void *cow_array::grow(size_t size, epoch_reclaimer *reclaimer)
+{
+    size = (size + kPageSize - 1) / kPageSize * kPageSize;
+    if (size <= size_)
+        return data_;
+    // new pages are zero and not shared
+    if (ftruncate(fd_, size) < 0)
+        throw std::runtime_error(strerror(errno));
+    void *start;
+    if (reclaimer) {
+        start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    } else {
+        start = mremap(data_, size_, size, MREMAP_MAYMOVE);
+    }
+    if (start == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    if (reclaimer) {
+        // readers may still be reading the old mapping
+        mapping_type *old = new mapping_type;
+        old->addr = data_;
+        old->size = size_;
+        reclaimer->retire(old, unmap);
+    }
+    data_ = static_cast<char *>(start);
+    size_ = size;
+    copied_.resize(size_ / kPageSize, generation_);
+    return data_;
+}
+
+void cow_array::unmap(void *mapping)
+{
+    mapping_type *old = static_cast<mapping_type *>(mapping);
+    munmap(old->addr, old->size);
+    delete old;
+}
+
+const void *cow_array::snapshot(size_t size)
+{
+    snapshot_type item;
+    item.size = (size + kPageSize - 1) / kPageSize * kPageSize;
+    if (!item.size)
+        item.size = kPageSize;
+    assert(item.size <= size_);
+    void *start = mmap(NULL, item.size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (start == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    item.view = static_cast<char *>(start);
+    pthread_mutex_lock(&mutex_);
+    item.generation = ++generation_;
+    snapshots_.push_back(item);
+    refs_++;
+    pthread_mutex_unlock(&mutex_);
+    return item.view;
+}
+
+void cow_array::copy_page(size_t page)
+{
+    size_t copy, i;
+    pthread_mutex_lock(&mutex_);
+    if (free_copies_.empty()) {
+        copy = copy_refs_.size();
+        copy_refs_.push_back(0);
+        if (ftruncate(copy_fd_, copy_refs_.size() * kPageSize) < 0) {
+            pthread_mutex_unlock(&mutex_);
+            throw std::runtime_error(strerror(errno));
+        }
+    } else {
+        copy = free_copies_.back();
+        free_copies_.pop_back();
+    }
+    if (pwrite(copy_fd_, data_ + page * kPageSize, kPageSize,
+               copy * kPageSize) != static_cast<ssize_t>(kPageSize)) {
+        free_copies_.push_back(copy);
+        pthread_mutex_unlock(&mutex_);
+        throw std::runtime_error(strerror(errno));
+    }
+    for (i = 0; i < snapshots_.size(); i++) {
+        snapshot_type &item = snapshots_[i];
+        // taken after the last copy and long enough to hold the page
+        if (item.generation <= copied_[page]
+            || (page + 1) * kPageSize > item.size)
+            continue;
+        // readers see the same bytes before and after remapping
+        if (mmap(item.view + page * kPageSize, kPageSize, PROT_READ,
+                 MAP_SHARED | MAP_FIXED, copy_fd_, copy * kPageSize)
+            == MAP_FAILED) {
+            pthread_mutex_unlock(&mutex_);
+            throw std::runtime_error(strerror(errno));
+        }
+        item.copies.push_back(copy);
+        copy_refs_[copy]++;
+    }
+    if (!copy_refs_[copy])
+        free_copies_.push_back(copy);
+    copied_[page] = generation_;
+    pthread_mutex_unlock(&mutex_);
+}
+
+void cow_array::release_snapshot(const void *view)
+{
+    std::vector<snapshot_type>::iterator it;
+    std::vector<size_t>::const_iterator copy;
+    pthread_mutex_lock(&mutex_);
+    for (it = snapshots_.begin(); it != snapshots_.end(); it++) {
+        if (it->view == view)
+            break;
+    }
+    assert(it != snapshots_.end());
+    munmap(it->view, it->size);
+    for (copy = it->copies.begin(); copy != it->copies.end(); copy++) {
+        if (--copy_refs_[*copy] == 0) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            // give the memory back
+            fallocate(copy_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      *copy * kPageSize, kPageSize);
+#endif
+            free_copies_.push_back(*copy);
+        }
+    }
+    snapshots_.erase(it);
+    pthread_mutex_unlock(&mutex_);
+    unref();
+}
+
+void cow_array::detach(cow_array *array)
+{
+    munmap(array->data_, array->size_);
+    array->data_ = NULL;
+    array->unref();
+}
+
+void cow_array::unref()
+{
+    pthread_mutex_lock(&mutex_);
+    bool last = --refs_ == 0;
+    pthread_mutex_unlock(&mutex_);
+    if (last)
+        delete this;
+}
+
+void payload_store::snapshot(cow_snapshot *holder, payload_store *copy)
+{
+    if (!offset_cow_) {
+        if (count() == 0)
+            return;
+        // move the buffers into shared memory once
+        offset_capacity_ = sizeof(size_type) * offset_buffer_.size();
+        data_capacity_ = data_buffer_.size();
+        offset_cow_ = new cow_array(&offset_buffer_[0], offset_capacity_);
+        try {
+            data_cow_ = new cow_array(data_buffer_.empty()?NULL:
+                                      &data_buffer_[0], data_capacity_);
+        } catch (...) {
+            cow_array::detach(offset_cow_);
+            offset_cow_ = NULL;
+            throw;
+        }
+        count_ = count();
+        size_ = size();
+        offsets_ = static_cast<const size_type *>(offset_cow_->data());
+        data_ = static_cast<const char *>(data_cow_->data());
+        std::vector<size_type>().swap(offset_buffer_);
+        std::vector<char>().swap(data_buffer_);
+    }
+    // bytes before count_ and size_ never change
+    copy->offsets_ = static_cast<const size_type *>(
+                     holder->map(offset_cow_,
+                                 sizeof(size_type) * (count_ + 1)));
+    copy->data_ = static_cast<const char *>(holder->map(data_cow_, size_));
+    copy->count_ = count_;
+    copy->size_ = size_;
+}
+
+payload_store::value_type payload_store::append_shared(const char *payload,
+                                                       size_t length)
+{
+    size_t offset_size = sizeof(size_type) * (count_ + 2);
+    if (offset_size > offset_capacity_) {
+        offset_capacity_ = std::max(offset_size, offset_capacity_ * 2);
+        offsets_ = static_cast<const size_type *>(
+                   offset_cow_->grow(offset_capacity_, NULL));
+    }
+    if (size_ + length > data_capacity_) {
+        data_capacity_ = std::max(size_ + length, data_capacity_ * 2);
+        data_ = static_cast<const char *>(
+                data_cow_->grow(data_capacity_, NULL));
+    }
+    // appended bytes are past the end of every snapshot
+    memcpy(const_cast<char *>(data_) + size_, payload, length);
+    size_ += length;
+    const_cast<size_type *>(offsets_)[count_ + 1] = size_;
+    return ++count_;
+}
+
 // ************************************************************************
 // * Implementation of basic_trie                                         *
 // ************************************************************************
@@ -74,7 +793,7 @@ trie::~trie()
 basic_trie::basic_trie(size_type size,
                        trie_relocator_interface<size_type> *relocator)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(true),
-     relocator_(relocator)
+     relocator_(relocator), reclaimer_(NULL), cow_(NULL)
 {
     if (size < key_type::kCharsetSize)
         size = kDefaultStateSize;
@@ -85,15 +804,18 @@ basic_trie::basic_trie(size_type size,
 
 basic_trie::basic_trie(void *header, void *states)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+     relocator_(NULL), reclaimer_(NULL), cow_(NULL)
 {
     header_ = static_cast<header_type *>(header);
     states_ = static_cast<state_type *>(states);
+    // headers of archives and snapshots are compact
+    if (header_->size > 0)
+        max_state_ = header_->size - 1;
 }
 
 basic_trie::basic_trie(const basic_trie &trie)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+     relocator_(NULL), reclaimer_(NULL), cow_(NULL)
 {
     clone(trie);
 }
@@ -110,7 +832,11 @@ void basic_trie::clone(const basic_trie &trie)
         if (header_) {
             sanity_delete(header_);
         }
-        if (states_) {
+        if (cow_) {
+            cow_array::detach(cow_);
+            cow_ = NULL;
+            states_ = NULL;
+        } else if (states_) {
             resize(states_, 0, 0);
             states_ = NULL;  // set to NULL for next resize
         }
@@ -127,7 +853,10 @@ basic_trie::~basic_trie()
 {
     if (owner_) {
         sanity_delete(header_);
-        resize(states_, 0, 0);  // free states_
+        if (cow_)
+            cow_array::detach(cow_);
+        else
+            resize(states_, 0, 0);  // free states_
     }
 }
 
@@ -154,6 +883,7 @@ basic_trie::find_base(const char_type *inputs, const extremum_type &extremum)
         }
     }
 
+    TRIE_SAMPLE(FIND_BASE_PROBES, i - last_base_);
     last_base_ = (i > 256)?i - 255:i;
 
     return i;
@@ -166,6 +896,7 @@ basic_trie::relocate(size_type stand,
                      const extremum_type &extremum)
 {
     size_type obase, nbase, i;
+    size_t moved = 0;
     char_type targets[key_type::kCharsetSize + 1];
 
     obase = base(s);  // save old base value
@@ -188,10 +919,12 @@ basic_trie::relocate(size_type stand,
         // free old places
         set_base(obase + inputs[i], 0);
         set_check(obase + inputs[i], 0);
+        moved++;
         // create new links according old ones
     }
     // finally, set new base
     set_base(s, nbase);
+    TRIE_SAMPLE(RELOCATE_MOVES, moved);
 
     return stand;
 }
@@ -260,20 +993,41 @@ bool basic_trie::search(const key_type &key, value_type *value) const
     return true;
 }
 
+/// Appends leaves of a basic_trie with their BASE as value.
+class base_visitor: public leaf_visitor {
+  public:
+    /// Constructs a base_visitor appending to sink.
+    explicit base_visitor(result_sink *sink)
+        :sink_(sink)
+    {
+    }
+
+    bool visit(const trie::key_type &store, trie::size_type base)
+    {
+        sink_->append(store, base);
+        return true;
+    }
+
+  private:
+    result_sink *sink_;  ///< Output.
+};
+
 size_t
 basic_trie::prefix_search(const key_type &prefix, result_type *result) const
 {
     const char_type *p;
     size_type s = go_forward(1, prefix.data(), &p);
     key_type store(prefix);
-    prefix_search_aux(s, p, &store, result);
+    result_sink sink(result);
+    base_visitor visitor(&sink);
+    prefix_search_aux(s, p, &store, &visitor);
     return result->size();
 }
 
-size_t basic_trie::prefix_search_aux(size_type s,
-                                     const char_type *miss,
-                                     key_type *store,
-                                     result_type *result) const
+bool basic_trie::prefix_search_aux(size_type s,
+                                   const char_type *miss,
+                                   key_type *store,
+                                   leaf_visitor *visitor) const
 {
     char_type targets[key_type::kCharsetSize + 1];
 
@@ -282,17 +1036,205 @@ size_t basic_trie::prefix_search_aux(size_type s,
             if (miss && *miss != key_type::kTerminator && *miss != *p)
                 continue;
             size_type t = next(s, *p);
+            bool more;
             store->push(*p);
             if (!miss || *miss == key_type::kTerminator)
-                prefix_search_aux(t, miss, store, result);
+                more = prefix_search_aux(t, miss, store, visitor);
             else
-                prefix_search_aux(t, miss + 1, store, result);
+                more = prefix_search_aux(t, miss + 1, store, visitor);
             store->pop();
+            if (!more)
+                return false;
+        }
+    } else if (base(s) < 0) {  // a childless root is not a leaf
+        return visitor->visit(*store, base(s));
+    }
+    return true;
+}
+
+/// Represents a state waiting to be placed by relayout_states.
+typedef struct relayout_item {
+    size_t heat;              ///< Visiting count.
+    size_t seq;               ///< Order of discovery.
+    size_t depth;             ///< Distance from the root.
+    trie::size_type from;     ///< Original state.
+    trie::size_type to;       ///< New state.
+
+    /// Number of top levels which are placed in breadth-first order.
+    static const size_t kBreadthLevels = 3;
+
+    /**
+     * Top levels go first in breadth-first order, so they are packed
+     * into a few pages. Deeper states go in depth-first order, so a
+     * path from the top levels to a leaf stays close. Hot states go
+     * before cold ones in both.
+     */
+    bool operator<(const relayout_item &rhs) const
+    {
+        bool top = depth < kBreadthLevels;
+        bool rhs_top = rhs.depth < kBreadthLevels;
+        if (top != rhs_top)
+            return rhs_top;
+        if (heat != rhs.heat)
+            return heat < rhs.heat;
+        return top?seq > rhs.seq:seq < rhs.seq;
+    }
+} relayout_item;
+
+/**
+ * Returns the first free slot not less than i. Slots are linked to the
+ * next one when they are taken, and links are compressed on the way.
+ */
+static trie::size_type
+find_free_slot(std::vector<trie::size_type> *free, trie::size_type i)
+{
+    trie::size_type j = i;
+    while (j < static_cast<trie::size_type>(free->size()) && (*free)[j] != j)
+        j = (*free)[j];
+    while (i != j && i < static_cast<trie::size_type>(free->size())) {
+        trie::size_type k = (*free)[i];
+        (*free)[i] = j;
+        i = k;
+    }
+    return j;
+}
+
+void basic_trie::relayout_states(const std::vector<size_t> *heat,
+                                 std::vector<size_type> *mapping)
+{
+    if (!owner_)
+        throw std::runtime_error("basic_trie::relayout: read-only trie");
+
+    // Give up on the lowest free slot after so many tries, otherwise
+    // a hole that nothing fits would make every search start there.
+    static const size_t kMaxTries = 64;
+    char_type targets[key_type::kCharsetSize + 1];
+    std::priority_queue<relayout_item> queue;
+    std::vector<size_type> free;
+    size_type size = header_->size, lo = 2, max_state = 1, i;
+    size_t seq = 0, tries = 0;
+    state_type *states = resize<state_type>(NULL, 0, size);
+
+    free.resize(size);
+    for (i = 0; i < size; i++)
+        free[i] = i;
+    free[0] = free[1] = 2;  // keep slot 0 and the root
+
+    mapping->assign(header_->size, 0);
+    (*mapping)[1] = 1;
+    relayout_item root = {0, seq++, 0, 1, 1};
+    queue.push(root);
+    while (!queue.empty()) {
+        relayout_item item = queue.top();
+        queue.pop();
+        size_type num_targets = find_exist_target(item.from, targets, NULL);
+        if (!num_targets) {
+            // a leaf keeps its value
+            states[item.to].base = base(item.from);
+            continue;
+        }
+        // find the lowest free base for all targets
+        char_type min = targets[0], max = targets[num_targets - 1];
+        size_type b, f = find_free_slot(&free, std::max<size_type>(lo, 1 + min));
+        for (;; f = find_free_slot(&free, f + 1)) {
+            b = f - min;
+            if (b + max >= size) {
+                size_type nsize = grow_size(size, b + max - size + 1);
+                states = resize(states, size, nsize);
+                free.resize(nsize);
+                for (i = size; i < nsize; i++)
+                    free[i] = i;
+                size = nsize;
+            }
+            const char_type *p;
+            for (p = targets + 1; *p; p++) {
+                if (free[b + *p] != b + *p)
+                    break;
+            }
+            if (!*p)
+                break;
+            if (f == find_free_slot(&free, lo) && ++tries > kMaxTries) {
+                lo = f + 1;
+                tries = 0;
+            }
+        }
+        states[item.to].base = b;
+        for (char_type *p = targets; *p; p++) {
+            size_type t = next(item.from, *p);
+            relayout_item child = {heat && t < (size_type)heat->size()?
+                                   (*heat)[t]:0, seq++, item.depth + 1,
+                                   t, b + *p};
+            states[child.to].check = item.to;
+            free[child.to] = child.to + 1;
+            max_state = std::max(max_state, child.to);
+            (*mapping)[t] = child.to;
+            queue.push(child);
         }
+    }
+
+    if (cow_) {
+        // snapshots keep the old states
+        cow_array::detach(cow_);
+        cow_ = NULL;
     } else {
-        result->push_back(std::pair<key_type, value_type>(*store, base(s)));
+        resize(states_, header_->size, 0);  // free states_
+    }
+    states_ = states;
+    header_->size = size;
+    max_state_ = max_state;
+    last_base_ = 0;
+}
+
+void basic_trie::relayout(const std::vector<std::string> *samples)
+{
+    std::vector<size_t> heat;
+    std::vector<size_type> mapping;
+    if (samples) {
+        key_type key;
+        std::vector<std::string>::const_iterator it;
+        for (it = samples->begin(); it != samples->end(); it++) {
+            key.assign(it->data(), it->size());
+            go_forward_heat(key.data(), &heat);
+        }
     }
-    return 0;
+    relayout_states(samples?&heat:NULL, &mapping);
+}
+
+void basic_trie::collect_stats(const char *name, stats_type *stats,
+                               bool histograms,
+                               std::vector<size_type> *leaves) const
+{
+    char_type targets[key_type::kCharsetSize + 1];
+    std::vector<std::pair<size_type, size_t> > stack;  // state and depth
+    size_t used = 0;
+
+    stack.push_back(std::make_pair(1, 0));
+    while (!stack.empty()) {
+        size_type s = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        used++;
+        size_type num_targets = find_exist_target(s, targets, NULL);
+        if (histograms) {
+            if (stats->out_degree.size() <= static_cast<size_t>(num_targets))
+                stats->out_degree.resize(num_targets + 1, 0);
+            stats->out_degree[num_targets]++;
+        }
+        if (num_targets == 0 && base(s) < 0) {  // a leaf
+            if (histograms) {
+                if (stats->depth.size() <= depth)
+                    stats->depth.resize(depth + 1, 0);
+                stats->depth[depth]++;
+            }
+            if (leaves)
+                leaves->push_back(s);
+        }
+        for (char_type *p = targets; *p; p++)
+            stack.push_back(std::make_pair(next(s, *p), depth + 1));
+    }
+    array_stats_type array = {name, static_cast<size_t>(header_->size), used,
+                              sizeof(state_type) * header_->size};
+    stats->arrays.push_back(array);
 }
 
 void basic_trie::trace(size_type s) const
@@ -341,7 +1283,9 @@ void basic_trie::trace(size_type s) const
 double_trie::double_trie(size_t size)
     :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
      next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
+     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0), owner_(true),
+     packed_(false), set_(false), links_(NULL), reclaimer_(NULL),
+     sequence_(0), starving_(0), index_cow_(NULL), accept_cow_(NULL), snapshot_(NULL)
 {
     header_ = new header_type();
     memset(header_, 0, sizeof(header_type));
@@ -365,42 +1309,79 @@ double_trie::double_trie(size_t size)
 double_trie::double_trie(const char *filename)
     :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
      next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
+     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0), owner_(false),
+     packed_(false), set_(false), links_(NULL), reclaimer_(NULL),
+     sequence_(0), starving_(0), index_cow_(NULL), accept_cow_(NULL), snapshot_(NULL)
 {
-    struct stat sb;
-    int fd, retval;
-
-    if (!filename)
-        throw std::runtime_error(std::string("can not load from file ")
-                                 + filename);
+    mmap_ = map_archive(filename, &mmap_size_);
+    try {
+        load(mmap_, mmap_size_);
+    } catch (...) {
+        munmap(mmap_, mmap_size_);
+        throw;
+    }
+}
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
+double_trie::double_trie(void *archive, size_t size)
+    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
+     next_accept_(1), next_index_(1), front_relocator_(NULL),
+     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0), owner_(false),
+     packed_(false), set_(false), links_(NULL), reclaimer_(NULL),
+     sequence_(0), starving_(0), index_cow_(NULL), accept_cow_(NULL), snapshot_(NULL)
+{
+    load(archive, size);
+}
 
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
-    }
-    mmap_size_ = sb.st_size;
+double_trie::double_trie(cow_snapshot *snapshot)
+    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
+     next_accept_(1), next_index_(1), front_relocator_(NULL),
+     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0), owner_(false),
+     packed_(false), set_(false), links_(NULL), reclaimer_(NULL),
+     sequence_(0), starving_(0), index_cow_(NULL),
+     accept_cow_(NULL), snapshot_(snapshot)
+{
+}
 
+void double_trie::load(void *archive, size_t size)
+{
     void *start;
-    start = header_ = reinterpret_cast<header_type *>(mmap_);
+    if (size < sizeof(header_type))
+        throw std::runtime_error("file corrupted");
+    start = header_ = reinterpret_cast<header_type *>(archive);
     if (strcmp(header_->magic, magic_))
         throw std::runtime_error("file corrupted");
-    // load index
-    start = index_ = reinterpret_cast<index_type *>(
-                     reinterpret_cast<header_type *>(start) + 1);
-    // load accept
-    start = accept_ = reinterpret_cast<accept_type *>(
-                      reinterpret_cast<index_type *>(start)
-                      + header_->index_size);
+    start = reinterpret_cast<header_type *>(start) + 1;
+    if (header_->options & (kAlphabetOption | kUtf8AlphabetOption))
+        start = const_cast<void *>(alphabet_.load(
+                    start, header_->options & kUtf8AlphabetOption));
+    if (header_->options & ARCHIVE_FILTER)
+        start = const_cast<void *>(filter_.load(start));
+    set_ = header_->options & ARCHIVE_SET;
+    if (set_) {
+        // load links, no values nor accept entries
+        packed_ = header_->options & ARCHIVE_PACKED;
+        if (packed_) {
+            start = const_cast<void *>(index_column_.load(start));
+        } else {
+            links_ = reinterpret_cast<const size_type *>(start);
+            start = reinterpret_cast<size_type *>(start) + header_->index_size;
+        }
+    } else if (header_->options & ARCHIVE_PACKED) {
+        // load packed index and accept
+        packed_ = true;
+        start = const_cast<void *>(data_column_.load(start));
+        start = const_cast<void *>(index_column_.load(start));
+        start = const_cast<void *>(accept_column_.load(start));
+    } else {
+        // load index
+        start = index_ = reinterpret_cast<index_type *>(start);
+        // load accept
+        start = accept_ = reinterpret_cast<accept_type *>(
+                          reinterpret_cast<index_type *>(start)
+                          + header_->index_size);
+        start = reinterpret_cast<accept_type *>(start) + header_->accept_size;
+    }
     // load front trie
-    start = reinterpret_cast<accept_type *>(start) + header_->accept_size;
     lhs_ = new basic_trie(start,
                           reinterpret_cast<basic_trie::header_type *>(start)
                           + 1);
@@ -411,23 +1392,38 @@ double_trie::double_trie(const char *filename)
     rhs_ = new basic_trie(start,
                           reinterpret_cast<basic_trie::header_type *>(start)
                           + 1);
+    // load payload
+    start = reinterpret_cast<basic_trie::state_type *>
+            ((basic_trie::header_type *)start + 1)
+            + rhs_->header()->size;
+    if (header_->payload_count > 0)
+        payload_.load(start, static_cast<char *>(archive) + size,
+                      header_->payload_count, header_->payload_size);
 }
 
 
 double_trie::~double_trie()
 {
     if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
-    } else {
+        // nothing can be done if it fails, and a destructor must not throw
+        munmap(mmap_, mmap_size_);
+    } else if (owner_) {
         sanity_delete(header_);
-        resize(index_, 0, 0);  // free index_
-        resize(accept_, 0, 0);  // free accept_
+        if (index_cow_)
+            cow_array::detach(index_cow_);
+        else
+            resize(index_, 0, 0);  // free index_
+        if (accept_cow_)
+            cow_array::detach(accept_cow_);
+        else
+            resize(accept_, 0, 0);  // free accept_
         sanity_delete(front_relocator_);
         sanity_delete(rear_relocator_);
     }
+    sanity_delete(reclaimer_);
     sanity_delete(lhs_);
     sanity_delete(rhs_);
+    sanity_delete(snapshot_);  // header_, index_ and accept_ of a snapshot
 }
 
 trie::size_type
@@ -472,15 +1468,17 @@ double_trie::lhs_insert(size_type s, const char_type *inputs, value_type value)
     s = lhs_->create_transition(s, inputs[0]);
     if (*inputs == key_type::kTerminator) {
         i = find_index_entry(s);
-        index_[i].index = 0;
+        set_index_accept(i, 0);
     } else {
         i = set_link(s, rhs_append(inputs + 1));
     }
-    index_[i].data = value;
+    set_index_data(i, value);
 }
 
 void double_trie::rhs_clean_more(size_type t)
 {
+    if (t <= 1)  // never remove the root
+        return;
     if (outdegree(t) == 0 && count_referer(t) == 0) {
         assert(rhs_->check(t) > 0);
         size_type s = rhs_->prev(t);
@@ -498,7 +1496,7 @@ void double_trie::rhs_clean_more(size_type t)
                         it++)
                     set_link(*it, t);
                 assert (refer_.find(t) != refer_.end());
-                accept_[refer_[t].accept_index].accept = t;
+                set_accept_state(refer_[t].accept_index, t);
             }
             if (rhs_->base(r) > 1)
                 rhs_->set_last_base(rhs_->base(r));
@@ -517,8 +1515,8 @@ void double_trie::rhs_insert(size_type s, size_type r,
     assert(u > 0);
     assert(rhs_->check(u) > 0);
     value_type oval = index_[-lhs_->base(s)].data;
-    index_[-lhs_->base(s)].index = 0;
-    index_[-lhs_->base(s)].data = 0;
+    set_index_accept(-lhs_->base(s), 0);
+    set_index_data(-lhs_->base(s), 0);
     free_index_.push_back(-lhs_->base(s));
     // s is separator which implies base(s) < 0, so we need to set base(s) = 0
     lhs_->set_base(s, 0);
@@ -541,13 +1539,13 @@ void double_trie::rhs_insert(size_type s, size_type r,
     size_type i;
     if (*remain == key_type::kTerminator) {
         i = find_index_entry(t);
-        index_[-lhs_->base(t)].data = value;
-        index_[-lhs_->base(t)].index = 0;
+        set_index_data(-lhs_->base(t), value);
+        set_index_accept(-lhs_->base(t), 0);
     } else {
         size_type a = rhs_append(remain + 1);
         assert(rhs_->check(watcher_[0]) > 0);
         i = set_link(t, a);
-        index_[i].data = value;
+        set_index_data(i, value);
     }
 
     // R-3
@@ -558,7 +1556,7 @@ void double_trie::rhs_insert(size_type s, size_type r,
     else
         r = rhs_->next(v, key_type::kTerminator);
     i = set_link(t, r);
-    index_[i].data = oval;
+    set_index_data(i, oval);
 
     // R-4
     u = watcher_[0];
@@ -568,20 +1566,26 @@ void double_trie::rhs_insert(size_type s, size_type r,
 
 void double_trie::insert(const key_type &key, const value_type &value)
 {
+    // only changes of states are written in a write_section, readers
+    // see the old or the new value of a duplicated key
+    key_type store;
     const char_type *p;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
+    size_type s = lhs_->go_forward(1, alphabet_.add(key, &store).data(), &p);
 
     if (!p) {
         // duplicated key found
-        index_[-lhs_->base(s)].data = value;
+        TRIE_COUNT(INSERT_DUPLICATES, 1);
+        set_index_data(-lhs_->base(s), value);
         return;
     }
 
     if (!check_separator(s)) {
+        TRIE_COUNT(INSERT_FRONTS, 1);
+        write_section section(this);
         lhs_insert(s, p, value);
         return;
     }
-    assert(index_[-lhs_->base(s)].index > 0);
+    assert(index_accept(-lhs_->base(s)) > 0);
     size_type r = link_state(s);
     // skip dummy terminator
     if (rhs_->check_reverse_transition(r, key_type::kTerminator)
@@ -598,43 +1602,177 @@ void double_trie::insert(const key_type &key, const value_type &value)
             break;
         }
         if (r == 1) {  // duplicated key
-            index_[-lhs_->base(s)].data = value;
+            TRIE_COUNT(INSERT_DUPLICATES, 1);
+            set_index_data(-lhs_->base(s), value);
             return;
         }
     } while (*p++ != key_type::kTerminator);
     char_type mismatch = r - rhs_->base(rhs_->prev(r));
+    TRIE_COUNT(INSERT_REARS, 1);
+    write_section section(this);
     rhs_insert(s, r, exists_, p, mismatch, value);
     return;
 }
 
-bool double_trie::search(const key_type &key, value_type *value) const
+bool double_trie::search(const key_type &input, value_type *value) const
+{
+    if (filter_.enabled()) {
+        // keys found by prefix_search end with a terminator, which is
+        // not hashed into the filter
+        const char_type *p = input.data();
+        size_t length = 0;
+        while (length < input.length() && p[length] != key_type::kTerminator)
+            length++;
+        if (!filter_.may_contain(filter_hash(p, length, 1)))
+            return false;
+    }
+    key_type store;
+    return search_codes(alphabet_.encode(input, &store), value);
+}
+
+bool double_trie::search(const char *inputs, size_t length,
+                         value_type *value) const
 {
+    if (filter_.enabled()
+        && !filter_.may_contain(filter_hash(inputs, length, 0)))
+        return false;
+    key_type store;
+    return search_codes(alphabet_.encode(inputs, length, &store), value);
+}
+
+bool double_trie::search_codes(const key_type &key, value_type *value) const
+{
+    if (reclaimer_) {
+        epoch_guard guard(reclaimer_);
+        read_section section(this);
+        int found;
+        value_type result = 0;
+        while ((found = sync_search(key, &result, section.begin())) < 0)
+            section.retry();  // a change overlapped
+        if (found && value)
+            *value = result;
+        return found > 0;
+    }
     const char_type *p, *mismatch;
     size_type s = lhs_->go_forward(1, key.data(), &p);
     if (!p) {
         if (value)
-            *value = index_[-lhs_->base(s)].data;
+            *value = index_data(-lhs_->base(s));
         return true;
     }
     if (!check_separator(s))
         return false;
-    assert(index_[-lhs_->base(s)].index > 0);
+    assert(index_accept(-lhs_->base(s)) > 0);
+    TRIE_COUNT(REAR_CROSSINGS, 1);
     size_type r = link_state(s);
     // skip a terminator
-    if (rhs_->check_reverse_transition(r, key_type::kTerminator))
+    if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+        && rhs_->prev(r) > 1)
         r = rhs_->prev(r);
     r = rhs_->go_backward(r, p, &mismatch);
     if (r == 1) {
         if (value)
-            *value = index_[-lhs_->base(s)].data;
+            *value = index_data(-lhs_->base(s));
         return true;
     }
     return false;
 }
 
+/// Completes keys found in front trie with their rear parts.
+class double_trie::front_visitor: public leaf_visitor {
+  public:
+    /**
+     * Constructs a front_visitor.
+     *
+     * @param trie The double_trie.
+     * @param miss Rest of the prefix not matched in front trie.
+     * @param sink Output.
+     * @param sequence Sequence to be validated in concurrent mode,
+     *                 or NULL.
+     */
+    front_visitor(const double_trie *trie, const char_type *miss,
+                  result_sink *sink, const uint64_t *sequence)
+        :trie_(trie), miss_(miss), sink_(sink), sequence_(sequence)
+    {
+    }
+
+    bool visit(const key_type &store, size_type base)
+    {
+        key_.assign(store.data(), store.length());
+        if (sequence_)
+            return trie_->sync_append_rear(&key_, -base, miss_, sink_,
+                                           *sequence_);
+        trie_->append_rear(&key_, -base, miss_, sink_);
+        return true;
+    }
+
+  private:
+    const double_trie *trie_;   ///< The double_trie.
+    const char_type *miss_;     ///< Rest of the prefix.
+    result_sink *sink_;         ///< Output.
+    const uint64_t *sequence_;  ///< Sequence, or NULL.
+    key_type key_;              ///< Key being completed.
+};
+
+void double_trie::append_rear(key_type *key, size_type i,
+                              const char_type *miss, result_sink *sink) const
+{
+    if (index_accept(i) == 0) {
+        sink->append(*key, index_data(i));
+        return;
+    }
+    size_type r = accept_state(index_accept(i));
+    // skip a terminator
+    if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+        && rhs_->prev(r) > 1)
+        r = rhs_->prev(r);
+    do {
+        char_type ch = r - rhs_->base(rhs_->prev(r));
+        r = rhs_->prev(r);
+        if (miss && *miss != key_type::kTerminator) {
+            if (ch != *miss)
+                return;
+            miss++;
+        }
+        key->push(ch);
+    } while (r > 1);
+    if (miss && *miss != key_type::kTerminator)
+        return;
+    sink->append(*key, index_data(i));
+}
+
 size_t
 double_trie::prefix_search(const key_type &key, result_type *result) const
 {
+    result_sink sink(result);
+    return prefix_search_sink(key, &sink);
+}
+
+size_t
+double_trie::prefix_search(const key_type &key, result_buffer *result) const
+{
+    result_sink sink(result);
+    return prefix_search_sink(key, &sink);
+}
+
+size_t
+double_trie::prefix_search_sink(const key_type &input,
+                                result_sink *sink) const
+{
+    key_type codes;
+    const key_type &key = alphabet_.encode(input, &codes);
+    if (alphabet_.enabled())
+        sink->set_alphabet(&alphabet_);
+    if (reclaimer_) {
+        epoch_guard guard(reclaimer_);
+        read_section section(this);
+        size_t size = sink->size();
+        while (!sync_prefix_search(key, sink, section.begin())) {
+            sink->truncate(size);
+            section.retry();
+        }
+        return sink->size();
+    }
     const char_type *p;
     size_type s = lhs_->go_forward(1, key.data(), &p);
     key_type store;
@@ -644,41 +1782,522 @@ double_trie::prefix_search(const key_type &key, result_type *result) const
         store.assign(key.data(), p - key.data());
     else
         store.assign(key.data(), key.length());
-    lhs_->prefix_search_aux(s, p, &store, result);
-    result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t i = -it->second;
-        if (index_[i].index == 0) {
-            it->second = index_[i].data;
+    front_visitor visitor(this, p, sink, NULL);
+    lhs_->prefix_search_aux(s, p, &store, &visitor);
+    return sink->size();
+}
+
+size_t double_trie::common_prefix_search(const key_type &input,
+                                         result_buffer *result) const
+{
+    result_sink sink(result);
+    key_type codes, store;
+    const key_type &key = alphabet_.encode(input, &codes);
+    if (alphabet_.enabled())
+        sink.set_alphabet(&alphabet_);
+    if (reclaimer_) {
+        epoch_guard guard(reclaimer_);
+        read_section section(this);
+        size_t size = sink.size();
+        while (!sync_common_prefix_search(key, &sink, section.begin())) {
+            sink.truncate(size);
+            section.retry();
+        }
+        return sink.size();
+    }
+    const char_type *p = key.data();
+    size_type s = 1;
+    for (;;) {
+        // codes read so far are a key if a terminator follows
+        size_type t = lhs_->next(s, key_type::kTerminator);
+        if (lhs_->check_transition(s, t) && check_separator(t)) {
+            store.assign(key.data(), p - key.data());
+            sink.append(store, index_data(-lhs_->base(t)));
+        }
+        if (*p == key_type::kTerminator)
+            break;
+        t = lhs_->next(s, *p);
+        if (!lhs_->check_transition(s, t))
+            break;
+        s = t;
+        p++;
+        if (check_separator(s)) {
+            // the only key on from s ends in rear trie
+            TRIE_COUNT(REAR_CROSSINGS, 1);
+            append_common_rear(key, p, -lhs_->base(s), &sink);
+            break;
+        }
+    }
+    return sink.size();
+}
+
+void double_trie::append_common_rear(const key_type &key,
+                                     const char_type *rest, size_type i,
+                                     result_sink *sink) const
+{
+    if (index_accept(i) == 0)
+        return;
+    size_type r = accept_state(index_accept(i));
+    // skip a terminator
+    if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+        && rhs_->prev(r) > 1)
+        r = rhs_->prev(r);
+    while (r > 1) {
+        char_type ch = r - rhs_->base(rhs_->prev(r));
+        r = rhs_->prev(r);
+        if (ch == key_type::kTerminator)
+            break;
+        if (ch != *rest)
+            return;
+        rest++;
+    }
+    key_type store;
+    store.assign(key.data(), rest - key.data());
+    sink->append(store, index_data(i));
+}
+
+bool double_trie::sync_common_prefix_search(const key_type &key,
+                                            result_sink *sink,
+                                            uint64_t sequence) const
+{
+    const char_type *p = key.data();
+    key_type store;
+    size_type s = 1;
+    for (;;) {
+        size_type t = lhs_->sync_base(s) + key_type::kTerminator;
+        size_type i = -lhs_->sync_base(t);
+        if (lhs_->sync_check_transition(s, t) && i > 0) {
+            store.assign(key.data(), p - key.data());
+            sink->append(store, sync_index_data(i));
+        }
+        if (*p == key_type::kTerminator)
+            break;
+        t = lhs_->sync_base(s) + *p;
+        if (!lhs_->sync_check_transition(s, t))
+            break;
+        s = t;
+        p++;
+        if ((i = -lhs_->sync_base(s)) > 0) {
+            TRIE_COUNT(REAR_CROSSINGS, 1);
+            size_type a = sync_index_accept(i);
+            size_type r = sync_accept_state(a);
+            // skip a terminator
+            if (rhs_->sync_check_reverse_transition(r, key_type::kTerminator)
+                && rhs_->sync_check(r) > 1)
+                r = rhs_->sync_check(r);
+            while (a > 0 && r > 1) {
+                size_type u = rhs_->sync_check(r);
+                char_type ch = r - rhs_->sync_base(u);
+                // stop following states as soon as they may be torn
+                if (!validate_read(sequence))
+                    return false;
+                r = u;
+                if (ch == key_type::kTerminator) {
+                    store.assign(key.data(), p - key.data());
+                    sink->append(store, sync_index_data(i));
+                    break;
+                }
+                if (ch != *p)
+                    break;
+                p++;
+            }
+            break;
+        }
+    }
+    return validate_read(sequence);
+}
+
+int double_trie::sync_search(const key_type &key, value_type *value,
+                             uint64_t sequence) const
+{
+    const char_type *p, *mismatch;
+    size_type s = lhs_->sync_go_forward(1, key.data(), &p);
+    size_type i = -lhs_->sync_base(s);
+    bool found = false;
+    if (!p) {
+        *value = sync_index_data(i);
+        found = true;
+    } else if (i > 0) {
+        TRIE_COUNT(REAR_CROSSINGS, 1);
+        size_type r = sync_accept_state(sync_index_accept(i));
+        // skip a terminator
+        if (rhs_->sync_check_reverse_transition(r, key_type::kTerminator)
+            && rhs_->sync_check(r) > 1)
+            r = rhs_->sync_check(r);
+        if (rhs_->sync_go_backward(r, p, &mismatch) == 1) {
+            *value = sync_index_data(i);
+            found = true;
+        }
+    }
+    if (!validate_read(sequence))
+        return -1;
+    return found?1:0;
+}
+
+bool double_trie::sync_collect(size_type s, const char_type *miss,
+                               key_type *store, leaf_visitor *visitor,
+                               uint64_t sequence) const
+{
+    size_type base = lhs_->sync_base(s);
+    bool leaf = true;
+
+    // stop following states as soon as they may be torn by a change
+    if (!validate_read(sequence))
+        return false;
+    for (char_type ch = 1; base > 0 && ch < key_type::kCharsetSize + 1; ch++) {
+        if (!lhs_->sync_check_transition(s, base + ch))
             continue;
+        leaf = false;
+        if (miss && *miss != key_type::kTerminator && *miss != ch)
+            continue;
+        store->push(ch);
+        if (!sync_collect(base + ch,
+                          (!miss || *miss == key_type::kTerminator)?
+                          miss:miss + 1, store, visitor, sequence))
+            return false;
+        store->pop();
+    }
+    if (leaf && base < 0)
+        return visitor->visit(*store, base);
+    return true;
+}
+
+bool double_trie::sync_append_rear(key_type *key, size_type i,
+                                   const char_type *miss, result_sink *sink,
+                                   uint64_t sequence) const
+{
+    size_type a = sync_index_accept(i);
+    if (a == 0) {
+        sink->append(*key, sync_index_data(i));
+        return true;
+    }
+    size_type r = sync_accept_state(a);
+    // skip a terminator
+    if (rhs_->sync_check_reverse_transition(r, key_type::kTerminator)
+        && rhs_->sync_check(r) > 1)
+        r = rhs_->sync_check(r);
+    while (r > 1) {
+        size_type t = rhs_->sync_check(r);
+        char_type ch = r - rhs_->sync_base(t);
+        if (!validate_read(sequence))
+            return false;
+        r = t;
+        if (miss && *miss != key_type::kTerminator) {
+            if (ch != *miss)
+                return true;
+            miss++;
         }
-        const char_type *miss = p;
-        bool fail = false;
-        size_type r = accept_[index_[i].index].accept;
+        key->push(ch);
+    }
+    if (!miss || *miss == key_type::kTerminator)
+        sink->append(*key, sync_index_data(i));
+    return true;
+}
+
+bool double_trie::sync_prefix_search(const key_type &key, result_sink *sink,
+                                     uint64_t sequence) const
+{
+    const char_type *p;
+    size_type s = lhs_->sync_go_forward(1, key.data(), &p);
+    key_type store;
+    if (lhs_->sync_check_reverse_transition(s, key_type::kTerminator))
+        s = lhs_->sync_check(s);
+    if (p)
+        store.assign(key.data(), p - key.data());
+    else
+        store.assign(key.data(), key.length());
+    front_visitor visitor(this, p, sink, &sequence);
+    if (!sync_collect(s, p, &store, &visitor, sequence))
+        return false;
+    return validate_read(sequence);
+}
+
+bool double_trie::erase(const key_type &key)
+{
+    if (!owner_)
+        throw std::runtime_error("double_trie::erase: read-only trie");
+    key_type store;
+    const char_type *p, *mismatch;
+    size_type s = lhs_->go_forward(1, alphabet_.encode(key, &store).data(),
+                                   &p);
+    if (!check_separator(s))
+        return false;
+    size_type i = -lhs_->base(s);
+    if (p && !index_[i].index)
+        return false;
+    // a key ending in front trie may still be linked to a rear state
+    size_type u = index_[i].index?link_state(s):0;
+    if (u) {
+        size_type r = u;
         // skip a terminator
-        if (rhs_->check_reverse_transition(r, key_type::kTerminator))
+        if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+            && rhs_->prev(r) > 1)
             r = rhs_->prev(r);
-        do {
-            char_type ch = r - rhs_->base(rhs_->prev(r));
-            r = rhs_->prev(r);
-            if (miss && *miss != key_type::kTerminator) {
-                if (!rhs_->check_transition(r, rhs_->next(r, *miss))) {
-                    fail = true;
-                    break;
-                }
-                miss++;
+        if (p && rhs_->go_backward(r, p, &mismatch) != 1)
+            return false;
+    }
+    write_section section(this);
+    if (u) {
+        // unlink from the accept state and clean rear trie if unused
+        refer_[u].referer.erase(s);
+        if (refer_[u].referer.empty()) {
+            if (outdegree(u) == 0) {
+                size_type v = rhs_->prev(u);
+                remove_accept_state(u);
+                rhs_clean_more(v);
+            } else {  // still on the way of other suffixes
+                free_accept_entry(u);
             }
-            it->first.push(ch);
-        } while (r > 1);
-        if (fail || (miss && *miss != key_type::kTerminator)) {
-            --it;
-            result->erase(it + 1);
+        }
+    }
+    set_index_data(i, 0);
+    set_index_accept(i, 0);
+    free_index_.push_back(i);
+    lhs_->remove_leaf(s);
+    return true;
+}
+
+void double_trie::stats(stats_type *stats) const
+{
+    std::vector<size_type> leaves;
+    std::vector<bool> accepts;
+    size_t i;
+
+    *stats = stats_type();
+    lhs_->collect_stats("front", stats, true, &leaves);
+    rhs_->collect_stats("rear", stats, false, NULL);
+    stats->keys = leaves.size();
+    // a set links to rear states, count those instead of accept entries
+    accepts.resize(set_?rhs_->header()->size:header_->accept_size, false);
+    for (i = 0; i < leaves.size(); i++) {
+        size_type a = set_?index_link(-lhs_->base(leaves[i]))
+                          :index_accept(-lhs_->base(leaves[i]));
+        if (a <= 0 || static_cast<size_t>(a) >= accepts.size())
             continue;
+        stats->rear_references++;
+        if (!accepts[a]) {
+            accepts[a] = true;
+            stats->rear_suffixes++;
         }
-        it->second = index_[i].data;
     }
+    array_stats_type index = {"index",
+                              static_cast<size_t>(header_->index_size),
+                              leaves.size(),
+                              sizeof(index_type) * header_->index_size};
+    array_stats_type accept = {"accept",
+                               static_cast<size_t>(header_->accept_size),
+                               stats->rear_suffixes,
+                               sizeof(accept_type) * header_->accept_size};
+    if (set_) {
+        index.bytes = packed_?static_cast<size_t>(index_column_.width())
+                              * header_->index_size / 8
+                             :sizeof(size_type) * header_->index_size;
+    } else if (packed_) {
+        index.bytes = (static_cast<size_t>(data_column_.width())
+                       + index_column_.width()) * header_->index_size / 8;
+        accept.bytes = static_cast<size_t>(accept_column_.width())
+                       * header_->accept_size / 8;
+    }
+    stats->arrays.push_back(index);
+    stats->arrays.push_back(accept);
+    if (payload_.count() > 0) {
+        array_stats_type payload = {"payload",
+                                    static_cast<size_t>(payload_.count()),
+                                    static_cast<size_t>(payload_.count()),
+                                    payload_store::section_size(
+                                        payload_.count(), payload_.size())};
+        stats->arrays.push_back(payload);
+    }
+    stats->free_lists.push_back(count_type("index", free_index_.size()));
+    stats->free_lists.push_back(count_type("accept", free_accept_.size()));
+    instrument_snapshot(stats);
+    if (owner_) {
+        size_t referers = 0;
+        std::map<size_type, refer_type>::const_iterator it;
+        for (it = refer_.begin(); it != refer_.end(); it++)
+            referers += it->second.referer.size();
+        stats->heap.push_back(count_type("refer",
+            refer_.size() * tree_node_size<std::pair<size_type, refer_type> >()
+            + referers * tree_node_size<size_type>()));
+        stats->heap.push_back(count_type("free lists",
+            (free_index_.size() + free_accept_.size()) * sizeof(size_type)));
+        stats->heap.push_back(count_type("exists",
+            exists_.capacity() * sizeof(char_type)));
+        stats->heap.push_back(count_type("payload",
+            payload_.size() + sizeof(size_type) * (payload_.count() + 1)));
+    }
+}
 
-    return result->size();
+trie *double_trie::snapshot()
+{
+    if (!owner_)
+        throw std::runtime_error("double_trie::snapshot: read-only trie");
+    if (!index_cow_) {
+        // move index_ and accept_ into shared memory
+        index_cow_ = new cow_array(index_, sizeof(index_type)
+                                           * header_->index_size);
+        accept_cow_ = new cow_array(accept_, sizeof(accept_type)
+                                             * header_->accept_size);
+        index_type *index = index_;
+        accept_type *accept = accept_;
+        __atomic_store_n(&index_, static_cast<index_type *>(
+                         index_cow_->data()), __ATOMIC_RELEASE);
+        __atomic_store_n(&accept_, static_cast<accept_type *>(
+                         accept_cow_->data()), __ATOMIC_RELEASE);
+        if (reclaimer_) {
+            reclaimer_->retire(index, vm_release);
+            reclaimer_->retire(accept, vm_release);
+        } else {
+            resize(index, header_->index_size, 0);
+            resize(accept, header_->accept_size, 0);
+        }
+    }
+    cow_snapshot *holder = new cow_snapshot();
+    double_trie *copy = new double_trie(holder);
+    try {
+        copy->header_ = static_cast<header_type *>(
+                        holder->keep(header_, sizeof(header_type)));
+        copy->header_->index_size = next_index_;
+        copy->header_->accept_size = next_accept_;
+        copy->index_ = static_cast<index_type *>(
+                       holder->map(index_cow_,
+                                   sizeof(index_type) * next_index_));
+        copy->accept_ = static_cast<accept_type *>(
+                        holder->map(accept_cow_,
+                                    sizeof(accept_type) * next_accept_));
+        copy->lhs_ = lhs_->snapshot(holder);
+        copy->rhs_ = rhs_->snapshot(holder);
+        payload_.snapshot(holder, &copy->payload_);
+    } catch (...) {
+        delete copy;
+        throw;
+    }
+    copy->next_index_ = next_index_;
+    copy->next_accept_ = next_accept_;
+    copy->alphabet_ = alphabet_;
+    copy->set_archive_options(archive_options_);
+    return copy;
+}
+
+void double_trie::set_concurrent(bool concurrent)
+{
+    if (!owner_)  // archives are read-only
+        return;
+    if (concurrent && !reclaimer_) {
+        reclaimer_ = new epoch_reclaimer();
+    } else if (!concurrent && reclaimer_) {
+        sanity_delete(reclaimer_);
+    }
+    lhs_->set_reclaimer(reclaimer_);
+    rhs_->set_reclaimer(reclaimer_);
+}
+
+void double_trie::set_alphabet(const std::vector<size_t> &frequency)
+{
+    if (!owner_)
+        throw std::runtime_error("double_trie::set_alphabet: read-only trie");
+    if (next_index_ > 1)
+        throw std::runtime_error("double_trie::set_alphabet: not empty");
+    alphabet_.assign(frequency);
+}
+
+void double_trie::set_utf8_alphabet(const std::vector<std::string> *samples)
+{
+    if (!owner_)
+        throw std::runtime_error("double_trie::set_utf8_alphabet: "
+                                 "read-only trie");
+    if (next_index_ > 1)
+        throw std::runtime_error("double_trie::set_utf8_alphabet: not empty");
+    alphabet_.assign_utf8(samples);
+}
+
+void double_trie::relayout(const std::vector<std::string> *samples)
+{
+    std::vector<size_t> front_heat, rear_heat;
+    std::vector<size_type> front, rear;
+    size_type i;
+
+    if (!owner_)
+        throw std::runtime_error("double_trie::relayout: read-only trie");
+    if (reclaimer_)
+        throw std::runtime_error("double_trie::relayout: concurrent mode");
+    if (samples) {
+        key_type key, store;
+        std::vector<std::string>::const_iterator it;
+        rear_heat.resize(rhs_->header()->size);
+        for (it = samples->begin(); it != samples->end(); it++) {
+            key.assign(it->data(), it->size());
+            size_type s = lhs_->go_forward_heat(
+                              alphabet_.encode(key, &store).data(),
+                              &front_heat);
+            if (check_separator(s) && index_[-lhs_->base(s)].index > 0) {
+                for (size_type r = link_state(s); r > 1; r = rhs_->prev(r))
+                    rear_heat[r]++;
+            }
+        }
+    }
+    lhs_->relayout_states(samples?&front_heat:NULL, &front);
+    rhs_->relayout_states(samples?&rear_heat:NULL, &rear);
+
+    // fix all references to the moved states
+    for (i = 1; i < next_accept_; i++) {
+        if (accept_[i].accept > 0)
+            set_accept_state(i, rear[accept_[i].accept]);
+    }
+    std::map<size_type, refer_type> refer;
+    std::map<size_type, refer_type>::const_iterator mit;
+    for (mit = refer_.begin(); mit != refer_.end(); mit++) {
+        if (mit->first <= 0 || !rear[mit->first])
+            continue;
+        refer_type &entry = refer[rear[mit->first]];
+        entry.accept_index = mit->second.accept_index;
+        std::set<size_type>::const_iterator it;
+        for (it = mit->second.referer.begin();
+             it != mit->second.referer.end();
+             it++)
+            entry.referer.insert(front[*it]);
+    }
+    refer_.swap(refer);
+    watcher_[0] = 0;
+    watcher_[1] = 0;
+}
+
+void double_trie::insert_payload(const key_type &key,
+                                 const char *payload, size_t length)
+{
+    insert(key, payload_.append(payload, length));
+}
+
+bool double_trie::search_payload(const key_type &key,
+                                 const char **payload, size_t *length) const
+{
+    value_type value;
+    if (!search(key, &value))
+        return false;
+    return payload_.get(value, payload, length);
+}
+
+size_t double_trie::write_filter(FILE *out) const
+{
+    static const char zeros[64] = {0};
+    key_filter::header_type header;
+    result_buffer keys;
+    size_t i;
+
+    prefix_search(key_type(), &keys);
+    memset(&header, 0, sizeof(header));
+    header.blocks = key_filter::blocks_for(keys.size());
+    // blocks start at a cache line of the archive
+    long offset = ftell(out) + sizeof(header);
+    header.padding = (64 - offset % 64) % 64;
+    std::vector<uint32_t> blocks(header.blocks * key_filter::kBlockWords);
+    for (i = 0; i < keys.size(); i++)
+        key_filter::add(filter_hash(keys.key_data(i), keys.key_length(i), 1),
+                        &blocks[0], header.blocks);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(zeros, header.padding, 1, out);
+    fwrite(&blocks[0], sizeof(uint32_t) * blocks.size(), 1, out);
+    return sizeof(header) + header.padding + sizeof(uint32_t) * blocks.size();
 }
 
 void double_trie::build(const char *filename, bool verbose)
@@ -689,12 +2308,60 @@ void double_trie::build(const char *filename, bool verbose)
         throw std::runtime_error(std::string("can not save to file ")
                                  + filename);
 
+    if ((archive_options_ & ARCHIVE_SET) && payload_.count() > 0)
+        throw std::runtime_error("double_trie::build: a set keeps no payload");
     if ((out = fopen(filename, "w+"))) {
         header_->index_size = next_index_;
         header_->accept_size = next_accept_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(index_, sizeof(index_type) * header_->index_size, 1, out);
-        fwrite(accept_, sizeof(accept_type) * header_->accept_size, 1, out);
+        header_->payload_count = payload_.count();
+        header_->payload_size = payload_.size();
+        header_->options = archive_options_
+                           & (ARCHIVE_PACKED | ARCHIVE_FILTER | ARCHIVE_SET);
+        if (alphabet_.enabled())
+            header_->options |= alphabet_.utf8()?kUtf8AlphabetOption
+                                                :kAlphabetOption;
+        header_type header = *header_;
+        if (header.options & ARCHIVE_SET)
+            header.accept_size = 0;
+        fwrite(&header, sizeof(header_type), 1, out);
+        if (alphabet_.enabled())
+            alphabet_.write(out);
+        size_t size[6];
+        size[5] = (header_->options & ARCHIVE_FILTER)?write_filter(out):0;
+        if (header_->options & ARCHIVE_SET) {
+            // index links straight to accept states, values are dropped
+            std::vector<size_type> links;
+            size_type i;
+            for (i = 0; i < header_->index_size; i++) {
+                size_type a = index_[i].index;
+                links.push_back(a > 0?accept_[a].accept:0);
+            }
+            if (header_->options & ARCHIVE_PACKED) {
+                std::vector<int64_t> column(links.begin(), links.end());
+                size[0] = packed_array::write(column, out);
+            } else {
+                size[0] = sizeof(size_type) * links.size();
+                fwrite(&links[0], size[0], 1, out);
+            }
+            size[1] = 0;
+        } else if (header_->options & ARCHIVE_PACKED) {
+            std::vector<int64_t> data, index, accept;
+            size_type i;
+            for (i = 0; i < header_->index_size; i++) {
+                data.push_back(index_[i].data);
+                index.push_back(index_[i].index);
+            }
+            for (i = 0; i < header_->accept_size; i++)
+                accept.push_back(accept_[i].accept);
+            size[0] = packed_array::write(data, out);
+            size[0] += packed_array::write(index, out);
+            size[1] = packed_array::write(accept, out);
+        } else {
+            size[0] = sizeof(index_type) * header_->index_size;
+            size[1] = sizeof(accept_type) * header_->accept_size;
+            fwrite(index_, size[0], 1, out);
+            fwrite(accept_, size[1], 1, out);
+        }
         fwrite(lhs_->compact_header(),
                sizeof(basic_trie::header_type), 1, out);
         fwrite(lhs_->states(), sizeof(basic_trie::state_type)
@@ -703,16 +2370,18 @@ void double_trie::build(const char *filename, bool verbose)
                sizeof(basic_trie::header_type), 1, out);
         fwrite(rhs_->states(), sizeof(basic_trie::state_type)
                                * rhs_->compact_header()->size, 1, out);
+        if (payload_.count() > 0)
+            payload_.write(out);
         fclose(out);
         if (verbose) {
             char buf[256];
-            size_t size[4];
-            size[0] = sizeof(index_type) * header_->index_size;
-            size[1] = sizeof(accept_type) * header_->accept_size;
             size[2] = sizeof(basic_trie::state_type)
                       * lhs_->compact_header()->size;
             size[3] = sizeof(basic_trie::state_type)
                       * rhs_->compact_header()->size;
+            size[4] = payload_.count()?
+                      payload_store::section_size(payload_.count(),
+                                                  payload_.size()):0;
 
             std::cerr << "index = "
                       << pretty_size(size[0], buf, sizeof(buf));
@@ -722,9 +2391,14 @@ void double_trie::build(const char *filename, bool verbose)
                       << pretty_size(size[2], buf, sizeof(buf));
             std::cerr << ", rear = "
                       << pretty_size(size[3], buf, sizeof(buf));
+            std::cerr << ", payload = "
+                      << pretty_size(size[4], buf, sizeof(buf));
+            if (size[5])
+                std::cerr << ", filter = "
+                          << pretty_size(size[5], buf, sizeof(buf));
             std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1] + size[2] + size[3],
-                                     buf, sizeof(buf))
+                      << pretty_size(size[0] + size[1] + size[2] + size[3]
+                                     + size[4] + size[5], buf, sizeof(buf))
                       << std::endl;
         }
     }
@@ -736,7 +2410,8 @@ void double_trie::build(const char *filename, bool verbose)
 
 single_trie::single_trie(size_t size)
     :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+     mmap_(NULL), mmap_size_(0), owner_(true), set_(false),
+     suffix_cow_(NULL), snapshot_(NULL)
 {
     trie_ = new basic_trie(size);
     header_ = new header_type();
@@ -747,33 +2422,45 @@ single_trie::single_trie(size_t size)
 
 single_trie::single_trie(const char *filename)
     :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+     mmap_(NULL), mmap_size_(0), owner_(false), set_(false),
+     suffix_cow_(NULL), snapshot_(NULL)
 {
-    struct stat sb;
-    int fd, retval;
-
-    if (!filename)
-        throw std::runtime_error(std::string("can not load from file ")
-                                 + filename);
+    memset(&common_, 0, sizeof(common_));
+    mmap_ = map_archive(filename, &mmap_size_);
+    try {
+        load(mmap_, mmap_size_);
+    } catch (...) {
+        munmap(mmap_, mmap_size_);
+        throw;
+    }
+}
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
+single_trie::single_trie(void *archive, size_t size)
+    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
+     mmap_(NULL), mmap_size_(0), owner_(false), set_(false),
+     suffix_cow_(NULL), snapshot_(NULL)
+{
+    memset(&common_, 0, sizeof(common_));
+    load(archive, size);
+}
 
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
-    }
-    mmap_size_ = sb.st_size;
+single_trie::single_trie(cow_snapshot *snapshot)
+    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
+     mmap_(NULL), mmap_size_(0), owner_(false), set_(false),
+     suffix_cow_(NULL), snapshot_(snapshot)
+{
+    memset(&common_, 0, sizeof(common_));
+}
 
+void single_trie::load(void *archive, size_t size)
+{
     void *start;
-    start = header_ = reinterpret_cast<header_type *>(mmap_);
+    if (size < sizeof(header_type))
+        throw std::runtime_error("file corrupted");
+    start = header_ = reinterpret_cast<header_type *>(archive);
     if (strcmp(header_->magic, magic_))
         throw std::runtime_error("file corrupted");
+    set_ = header_->options & ARCHIVE_SET;
     // load suffix
     suffix_ = reinterpret_cast<suffix_type *>(
               reinterpret_cast<header_type *>(start) + 1);
@@ -782,35 +2469,124 @@ single_trie::single_trie(const char *filename)
     trie_ = new basic_trie(start,
                           reinterpret_cast<basic_trie::header_type *>(start)
                           + 1);
+    // load payload
+    start = reinterpret_cast<basic_trie::state_type *>
+            ((basic_trie::header_type *)start + 1)
+            + trie_->header()->size;
+    if (header_->payload_count > 0)
+        payload_.load(start, static_cast<char *>(archive) + size,
+                      header_->payload_count, header_->payload_size);
 }
 
 
 single_trie::~single_trie()
 {
     if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
-    } else {
+        // nothing can be done if it fails, and a destructor must not throw
+        munmap(mmap_, mmap_size_);
+    } else if (owner_) {
         sanity_delete(header_);
-        resize(suffix_, 0, 0);   // free suffix_
+        if (suffix_cow_)
+            cow_array::detach(suffix_cow_);
+        else
+            resize(suffix_, 0, 0);   // free suffix_
         resize(common_.data, 0, 0);  // free common_.data
     }
     sanity_delete(trie_);
+    sanity_delete(snapshot_);  // header_ and suffix_ of a snapshot
+}
+
+void single_trie::stats(stats_type *stats) const
+{
+    std::vector<size_type> leaves;
+    // suffix_[0] is never used, a set keeps a terminator in suffix_[1]
+    size_t used = set_?2:1, i;
+
+    *stats = stats_type();
+    trie_->collect_stats("trie", stats, true, &leaves);
+    stats->keys = leaves.size();
+    for (i = 0; i < leaves.size(); i++) {
+        size_type s = leaves[i], start = -trie_->base(s), end = start;
+        // a key ending in trie keeps only its value in suffix
+        if (s - trie_->base(trie_->prev(s)) != key_type::kTerminator) {
+            while (suffix_[end] != key_type::kTerminator)
+                end++;
+            end++;
+        }
+        used += end - start + (set_?0:1);  // and the value
+    }
+    array_stats_type suffix = {"suffix",
+                               static_cast<size_t>(header_->suffix_size),
+                               used,
+                               sizeof(suffix_type) * header_->suffix_size};
+    stats->arrays.push_back(suffix);
+    if (payload_.count() > 0) {
+        array_stats_type payload = {"payload",
+                                    static_cast<size_t>(payload_.count()),
+                                    static_cast<size_t>(payload_.count()),
+                                    payload_store::section_size(
+                                        payload_.count(), payload_.size())};
+        stats->arrays.push_back(payload);
+    }
+    stats->free_lists.push_back(count_type("suffix", free_suffix_.size()));
+    instrument_snapshot(stats);
+    if (owner_) {
+        typedef std::pair<size_type, size_type> run_type;
+        stats->heap.push_back(count_type("free suffix",
+            free_suffix_.size() * tree_node_size<run_type>()
+            + free_run_.size() * tree_node_size<run_type>()));
+        stats->heap.push_back(count_type("common", common_.size));
+        stats->heap.push_back(count_type("payload",
+            payload_.size() + sizeof(size_type) * (payload_.count() + 1)));
+    }
+}
+
+trie *single_trie::snapshot()
+{
+    if (!owner_)
+        throw std::runtime_error("single_trie::snapshot: read-only trie");
+    if (!suffix_cow_) {
+        // move suffix_ into shared memory
+        suffix_cow_ = new cow_array(suffix_, sizeof(suffix_type)
+                                             * header_->suffix_size);
+        resize(suffix_, header_->suffix_size, 0);
+        suffix_ = static_cast<suffix_type *>(suffix_cow_->data());
+    }
+    cow_snapshot *holder = new cow_snapshot();
+    single_trie *copy = new single_trie(holder);
+    try {
+        copy->header_ = static_cast<header_type *>(
+                        holder->keep(header_, sizeof(header_type)));
+        copy->header_->suffix_size = next_suffix_;
+        copy->suffix_ = static_cast<suffix_type *>(
+                        holder->map(suffix_cow_,
+                                    sizeof(suffix_type) * next_suffix_));
+        copy->trie_ = trie_->snapshot(holder);
+        payload_.snapshot(holder, &copy->payload_);
+    } catch (...) {
+        delete copy;
+        throw;
+    }
+    copy->next_suffix_ = next_suffix_;
+    return copy;
 }
 
 void single_trie::insert_suffix(size_type s,
                                 const char_type *inputs,
                                 value_type value)
 {
-    trie_->set_base(s, -next_suffix_);
     const char_type *p = inputs;
+    while (*p++ != key_type::kTerminator) {
+        // empty
+    }
+    // +1 for value
+    size_type start = alloc_suffix(p - inputs + 1);
+    trie_->set_base(s, -start);
+    p = inputs;
     do {
-        // +1 for value
-        if (next_suffix_ + 1 >= header_->suffix_size)
-            resize_suffix(next_suffix_ + 1);
-        suffix_[next_suffix_++] = *p;
+        set_suffix(start++, *p);
     } while (*p++ != key_type::kTerminator);
-    suffix_[next_suffix_++] = value;
+    set_suffix(start, value);
 }
 
 void single_trie::create_branch(size_type s,
@@ -818,7 +2594,7 @@ void single_trie::create_branch(size_type s,
                                 value_type value)
 {
     basic_trie::extremum_type extremum = {0, 0};
-    size_type start = -trie_->base(s);
+    size_type start = -trie_->base(s), origin = start;
 
     // find common string
     const char_type *p = inputs;
@@ -841,7 +2617,7 @@ void single_trie::create_branch(size_type s,
     // terminator
     if (i > 0 && common_.data[i - 1] == key_type::kTerminator) {
         // duplicated key
-        suffix_[start] = value;
+        set_suffix(start, value);
         return;
     }
 
@@ -857,12 +2633,15 @@ void single_trie::create_branch(size_type s,
     // create twig for old suffix
     size_type t = trie_->create_transition(s, suffix_[start]);
     trie_->set_base(t, -(start + 1));
+    // the common part and the mismatch moved into trie
+    free_suffix(origin, start - origin + 1);
 
     // create twig for new suffix
     t = trie_->create_transition(s, *p);
     if (*p == key_type::kTerminator) {
-        trie_->set_base(t, -next_suffix_);
-        suffix_[next_suffix_++] = value;
+        size_type offset = alloc_suffix(1);
+        trie_->set_base(t, -offset);
+        set_suffix(offset, value);
     } else {
         insert_suffix(t, p + 1, value);
     }
@@ -878,13 +2657,14 @@ void single_trie::insert(const key_type &key, const value_type &value)
             create_branch(s, p, value);
         } else {
             // duplicated key
-            suffix_[-trie_->base(s)] = value;
+            set_suffix(-trie_->base(s), value);
         }
     } else {
         s = trie_->create_transition(s, *p);
         if (*p == key_type::kTerminator) {
-            trie_->set_base(s, -next_suffix_);
-            suffix_[next_suffix_++] = value;
+            size_type offset = alloc_suffix(1);
+            trie_->set_base(s, -offset);
+            set_suffix(offset, value);
         } else {
             insert_suffix(s, p + 1, value);
         }
@@ -904,14 +2684,81 @@ bool single_trie::search(const key_type &key, value_type *value) const
             } while (*p++ != key_type::kTerminator);
         }
         if (value)
-            *value = suffix_[start];
+            *value = set_?0:suffix_[start];
         return true;
     }
     return false;
 }
 
+/// Completes keys found in trie with their suffixes.
+class single_trie::suffix_visitor: public leaf_visitor {
+  public:
+    /**
+     * Constructs a suffix_visitor.
+     *
+     * @param trie The single_trie.
+     * @param miss Rest of the prefix not matched in trie.
+     * @param sink Output.
+     */
+    suffix_visitor(const single_trie *trie, const char_type *miss,
+                   result_sink *sink)
+        :trie_(trie), miss_(miss), sink_(sink)
+    {
+    }
+
+    bool visit(const key_type &store, size_type base)
+    {
+        key_.assign(store.data(), store.length());
+        trie_->append_suffix(&key_, -base, miss_, sink_);
+        return true;
+    }
+
+  private:
+    const single_trie *trie_;  ///< The single_trie.
+    const char_type *miss_;    ///< Rest of the prefix.
+    result_sink *sink_;        ///< Output.
+    key_type key_;             ///< Key being completed.
+};
+
+void single_trie::append_suffix(key_type *key, size_type start,
+                                const char_type *miss,
+                                result_sink *sink) const
+{
+    if (key->length() > 0
+        && key->data()[key->length() - 1] == key_type::kTerminator) {
+        sink->append(*key, set_?0:suffix_[start]);
+        return;
+    }
+    for (; suffix_[start] != key_type::kTerminator; start++) {
+        if (miss && *miss != key_type::kTerminator) {
+            if (*miss != suffix_[start])
+                return;
+            miss++;
+        }
+        key->push(suffix_[start]);
+    }
+    if (miss && *miss != key_type::kTerminator)
+        return;
+    sink->append(*key, set_?0:suffix_[start + 1]);
+}
+
 size_t
 single_trie::prefix_search(const key_type &key, result_type *result) const
+{
+    result_sink sink(result);
+    return prefix_search_sink(key, &sink);
+}
+
+size_t
+single_trie::prefix_search(const key_type &key, result_buffer *result) const
+{
+    result_sink sink(result);
+    return prefix_search_sink(key, &sink);
+}
+
+size_t
+single_trie::prefix_search_sink(const key_type &key,
+                                result_sink *sink) const
 {
     const char_type *p;
     size_type s = trie_->go_forward(1, key.data(), &p);
@@ -922,35 +2769,112 @@ single_trie::prefix_search(const key_type &key, result_type *result) const
         store.assign(key.data(), p - key.data());
     else
         store.assign(key.data(), key.length());
-    trie_->prefix_search_aux(s, p, &store, result);
-    result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t start = -it->second;
-        const char_type *miss = p;
-        bool fail = false;
-        if (it->first.data()[it->first.length() - 1]
-            == key_type::kTerminator) {
-            it->second = suffix_[start];
-            continue;
-        }
-        for (; suffix_[start] != key_type::kTerminator; start++) {
-            if (miss && *miss != key_type::kTerminator) {
-                if (*miss != suffix_[start]) {
-                    fail = true;
-                    break;
-                }
-                miss++;
-            }
-            it->first.push(suffix_[start]);
+    suffix_visitor visitor(this, p, sink);
+    trie_->prefix_search_aux(s, p, &store, &visitor);
+    return sink->size();
+}
+
+size_t single_trie::common_prefix_search(const key_type &key,
+                                         result_buffer *result) const
+{
+    result_sink sink(result);
+    const char_type *p = key.data();
+    key_type store;
+    size_type s = 1;
+    while (trie_->base(s) >= 0) {
+        // chars read so far are a key if a terminator follows
+        size_type t = trie_->next(s, key_type::kTerminator);
+        if (trie_->check_transition(s, t)) {
+            store.assign(key.data(), p - key.data());
+            sink.append(store, set_?0:suffix_[-trie_->base(t)]);
         }
-        if (fail || (miss && *miss != key_type::kTerminator)) {
-            --it;
-            result->erase(it + 1);
+        if (*p == key_type::kTerminator)
+            return sink.size();
+        t = trie_->next(s, *p);
+        if (!trie_->check_transition(s, t))
+            return sink.size();
+        s = t;
+        p++;
+    }
+    // the only key on from s ends with the suffix
+    size_type start = -trie_->base(s);
+    for (; suffix_[start] != key_type::kTerminator; start++, p++) {
+        if (suffix_[start] != *p)
+            return sink.size();
+    }
+    store.assign(key.data(), p - key.data());
+    sink.append(store, set_?0:suffix_[start + 1]);
+    return sink.size();
+}
+
+bool single_trie::erase(const key_type &key)
+{
+    if (!owner_)
+        throw std::runtime_error("single_trie::erase: read-only trie");
+    const char_type *p;
+    size_type s = trie_->go_forward(1, key.data(), &p);
+    if (trie_->base(s) >= 0)
+        return false;
+    size_type start = -trie_->base(s), end = start;
+    if (p) {
+        do {
+            if (*p != suffix_[end++])
+                return false;
+        } while (*p++ != key_type::kTerminator);
+    }
+    // suffix_[end] holds the value
+    free_suffix(start, end - start + 1);
+    trie_->remove_leaf(s);
+    return true;
+}
+
+void single_trie::relayout(const std::vector<std::string> *samples)
+{
+    if (!owner_)
+        throw std::runtime_error("single_trie::relayout: read-only trie");
+    trie_->relayout(samples);
+}
+
+void single_trie::insert_payload(const key_type &key,
+                                 const char *payload, size_t length)
+{
+    insert(key, payload_.append(payload, length));
+}
+
+bool single_trie::search_payload(const key_type &key,
+                                 const char **payload, size_t *length) const
+{
+    value_type value;
+    if (!search(key, &value))
+        return false;
+    return payload_.get(value, payload, length);
+}
+
+void single_trie::compact_set(std::vector<suffix_type> *suffix,
+                              std::vector<basic_trie::state_type> *states)
+    const
+{
+    std::vector<size_type> leaves;
+    stats_type stats;
+    size_t i;
+
+    states->assign(trie_->states(),
+                   trie_->states() + trie_->compact_header()->size);
+    // suffix[0] is never used, keys ending in trie share suffix[1]
+    suffix->assign(2, 0);
+    (*suffix)[1] = key_type::kTerminator;
+    trie_->collect_stats("trie", &stats, false, &leaves);
+    for (i = 0; i < leaves.size(); i++) {
+        size_type s = leaves[i], start = -trie_->base(s);
+        if (s - trie_->base(trie_->prev(s)) == key_type::kTerminator) {
+            (*states)[s].base = -1;
             continue;
         }
-        it->second = suffix_[start + 1];
+        (*states)[s].base = -static_cast<size_type>(suffix->size());
+        do {
+            suffix->push_back(suffix_[start]);
+        } while (suffix_[start++] != key_type::kTerminator);
     }
-    return result->size();
 }
 
 void single_trie::build(const char *filename, bool verbose)
@@ -961,28 +2885,56 @@ void single_trie::build(const char *filename, bool verbose)
         throw std::runtime_error(std::string("can not save to file ")
                                  + filename);
 
+    if ((archive_options_ & ARCHIVE_SET) && payload_.count() > 0)
+        throw std::runtime_error("single_trie::build: a set keeps no payload");
     if ((out = fopen(filename, "w+"))) {
         snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
         header_->suffix_size = next_suffix_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(suffix_, sizeof(suffix_type) * header_->suffix_size, 1, out);
-        fwrite(trie_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(trie_->states(), sizeof(basic_trie::state_type)
-                               * trie_->compact_header()->size, 1, out);
+        header_->payload_count = payload_.count();
+        header_->payload_size = payload_.size();
+        header_->options = archive_options_ & ARCHIVE_SET;
+        size_t size[3];
+        if (header_->options & ARCHIVE_SET) {
+            std::vector<suffix_type> suffix;
+            std::vector<basic_trie::state_type> states;
+            compact_set(&suffix, &states);
+            header_type header = *header_;
+            header.suffix_size = suffix.size();
+            fwrite(&header, sizeof(header_type), 1, out);
+            size[0] = sizeof(suffix_type) * suffix.size();
+            fwrite(&suffix[0], size[0], 1, out);
+            fwrite(trie_->compact_header(),
+                   sizeof(basic_trie::header_type), 1, out);
+            fwrite(&states[0], sizeof(basic_trie::state_type)
+                               * states.size(), 1, out);
+        } else {
+            size[0] = sizeof(suffix_type) * header_->suffix_size;
+            fwrite(header_, sizeof(header_type), 1, out);
+            fwrite(suffix_, size[0], 1, out);
+            fwrite(trie_->compact_header(),
+                   sizeof(basic_trie::header_type), 1, out);
+            fwrite(trie_->states(), sizeof(basic_trie::state_type)
+                                   * trie_->compact_header()->size, 1, out);
+        }
+        if (payload_.count() > 0)
+            payload_.write(out);
 
         fclose(out);
         if (verbose) {
             char buf[256];
-            size_t size[2];
-            size[0] = sizeof(suffix_type) * header_->suffix_size;
             size[1] = sizeof(basic_trie::state_type)
                       * trie_->compact_header()->size;
+            size[2] = payload_.count()?
+                      payload_store::section_size(payload_.count(),
+                                                  payload_.size()):0;
 
             std::cerr << "suffix = " << pretty_size(size[0], buf, sizeof(buf));
             std::cerr << ", trie = " << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", payload = "
+                      << pretty_size(size[2], buf, sizeof(buf));
             std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1], buf, sizeof(buf))
+                      << pretty_size(size[0] + size[1] + size[2],
+                                     buf, sizeof(buf))
                       << std::endl;
         }
     }
@@ -44,6 +44,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <cstring>
 #include <cstdio>
@@ -56,12 +58,14 @@
 #include <map>
 #include <set>
 #include <deque>
+#include <limits>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "trie.h"
+#include "trie_engine.h"
 
 BEGIN_TRIE_NAMESPACE
 
@@ -92,11 +96,110 @@ template<typename T> class trie_relocator_interface {
     /// @todo Disallow copy constructor and operator =.
 };
 
+/*
+ * Define TRIE_INSTRUMENT to count work on hot paths, like states visited
+ * by walks and slots probed by find_base. Every thread counts into its
+ * own block, and stats() reports the sums of all blocks. Without it,
+ * TRIE_COUNT and TRIE_SAMPLE compile to nothing.
+ */
+
+/// Represents a hot path counter, see TRIE_COUNT.
+enum instrument_counter {
+    REAR_CROSSINGS = 0,   /**< Lookups going on in the rear trie. */
+    INSERT_DUPLICATES,    /**< Inserts of keys already stored. */
+    INSERT_FRONTS,        /**< Inserts branching in the front trie. */
+    INSERT_REARS,         /**< Inserts splitting a suffix in rear trie. */
+    kInstrumentCounters
+};
+
+/// Represents a hot path histogram, see TRIE_SAMPLE.
+enum instrument_histogram {
+    FORWARD_STATES = 0,   /**< States visited by go_forward. */
+    BACKWARD_STATES,      /**< States visited by go_backward. */
+    FIND_BASE_PROBES,     /**< Bases tried by find_base. */
+    RELOCATE_MOVES,       /**< States moved by relocate. */
+    kInstrumentHistograms
+};
+
+/// Number of buckets of a histogram.
+static const size_t kInstrumentBuckets = 64;
+
+/// Represents the counts of a thread.
+struct instrument_block {
+    size_t counters[kInstrumentCounters];
+    size_t totals[kInstrumentHistograms];
+    size_t buckets[kInstrumentHistograms][kInstrumentBuckets];
+    instrument_block *next;  ///< Block of another thread.
+};
+
+/// Allocates a block for the calling thread and makes it reported.
+instrument_block *instrument_register();
+
+/// Returns the block of the calling thread.
+inline instrument_block *instrument_thread_block()
+{
+    static __thread instrument_block *block = NULL;
+    if (!block)
+        block = instrument_register();
+    return block;
+}
+
+/// Adds sums of all blocks to stats.
+void instrument_snapshot(trie::stats_type *stats);
+
+/// Zeroes all blocks.
+void instrument_reset();
+
+#ifdef TRIE_INSTRUMENT
+/// Adds n to a counter of the calling thread.
+#define TRIE_COUNT(counter, n) \
+    (instrument_thread_block()->counters[counter] += (n))
+/// Adds a value to a histogram of the calling thread.
+#define TRIE_SAMPLE(histogram, value) do { \
+        size_t value_ = (value); \
+        instrument_block *block_ = instrument_thread_block(); \
+        block_->totals[histogram] += value_; \
+        block_->buckets[histogram][std::min(value_, \
+                                            kInstrumentBuckets - 1)]++; \
+    } while (0)
+#else
+#define TRIE_COUNT(counter, n) ((void)0)
+#define TRIE_SAMPLE(histogram, value) ((void)sizeof(value))
+#endif
+
+/**
+ * Resizes an array in reserved address space.
+ *
+ * An array is placed in a range of address space reserved ahead of
+ * its size, aligned with huge pages once it is large. Growing commits
+ * more of the range in place, and growing past the range moves its
+ * pages to a larger one with mremap(2). Either way existing units are
+ * never copied, and new units are zero pages from the kernel.
+ *
+ * @param ptr Pointer to the array, or NULL to allocate one.
+ * @param size Expected size in bytes, or zero to free ptr.
+ * @return Pointer to the array, which may have moved.
+ */
+void *vm_resize(void *ptr, size_t size);
+
+/**
+ * Grows an array from vm_resize without moving it, so that readers
+ * may go on reading it.
+ *
+ * @param ptr Pointer to the array.
+ * @param size Expected size in bytes.
+ * @return false if the reserved range is too small.
+ */
+bool vm_extend(void *ptr, size_t size);
+
+/// Frees an array from vm_resize.
+void vm_release(void *ptr);
+
 /**
  * Resizes a buffer.
- * This function is a wrapper of realloc(3). If ptr is NULL, it will allocate
+ * This function is a wrapper of vm_resize. If ptr is NULL, it will allocate
  * a new buffer. If new_size is zero and ptr is not NULL, It frees ptr.
- * In addition, this function sets all newly allocated units to zero.
+ * In addition, all newly allocated units are zero.
  *
  * @param ptr Pointer to the buffer.
  * @param old_size Original size of the buffer.
@@ -106,33 +209,1062 @@ template<typename T> class trie_relocator_interface {
 template<typename T>
 T* resize(T *ptr, size_t old_size, size_t new_size)
 {
-    T *new_block = reinterpret_cast<T *>(realloc(ptr, new_size * sizeof(T)));
-    if (new_size && ptr) {
-        memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
-    } else if (new_size) {
-        memset(new_block, 0, new_size * sizeof(T));
-    }
-    return new_block;
-#if 0
-    if (ptr) {
-        if (!new_size) {
-            delete []ptr;
-            return NULL;
-        } else {
-            T *new_block = new T[new_size];
-            std::copy(ptr, ptr + old_size, new_block);
-            delete []ptr;
-            memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
-            return new_block;
+    return static_cast<T *>(vm_resize(ptr, new_size * sizeof(T)));
+}
+
+/**
+ * Returns a new buffer size for growing a buffer by at least size units.
+ * The buffer is doubled and aligned with 4k, but never exceeds the
+ * maximum of trie::size_type.
+ *
+ * @param old_size Original size of the buffer.
+ * @param size Number of units needed at least.
+ * @return The new size.
+ */
+inline trie::size_type grow_size(trie::size_type old_size,
+                                 trie::size_type size)
+{
+    const uint64_t limit = std::numeric_limits<trie::size_type>::max();
+    uint64_t nsize = (((static_cast<uint64_t>(old_size) * 2 + size)
+                       >> 12) + 1) << 12;
+    if (static_cast<uint64_t>(old_size) + size > limit)
+        throw std::length_error("trie: too many states, "
+                                "build with TRIE_LARGE_INDEX");
+    return std::min(nsize, limit);
+}
+
+/**
+ * Maps an archive file into memory for reading.
+ *
+ * @param filename Filename of the archive.
+ * @param[out] size Length of the mapped region.
+ * @return Pointer to the mapped region.
+ */
+void *map_archive(const char *filename, size_t *size);
+
+/**
+ * A frozen array of integers bit-packed with the minimal width.
+ *
+ * Values are stored as their distance from the minimum value (frame of
+ * reference) using just enough bits for the maximum distance. The
+ * packed words are followed by a padding word so that a value can be
+ * decoded with two loads and no branch.
+ */
+class packed_array {
+  public:
+    /// Represents information about a packed_array in archive.
+    typedef struct {
+        int64_t base;   ///< Frame of reference, the minimum value.
+        int64_t words;  ///< Number of 64 bits words, including padding.
+        int32_t width;  ///< Bits of each value.
+        char unused[4]; ///< for 32/64 bits compatible.
+    } header_type;
+
+    /// Constructs an empty packed_array.
+    packed_array()
+        :words_(NULL), base_(0), mask_(0), width_(0)
+    {}
+
+    /**
+     * Sets up a packed_array using an archive section in memory.
+     *
+     * @param section Pointer to the section.
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section)
+    {
+        const header_type *header = static_cast<const header_type *>(section);
+        words_ = reinterpret_cast<const uint64_t *>(header + 1);
+        base_ = header->base;
+        width_ = header->width;
+        mask_ = width_ < 64?(static_cast<uint64_t>(1) << width_) - 1:~0ULL;
+        return words_ + header->words;
+    }
+
+    /// Returns the (i)th value.
+    int64_t get(size_t i) const
+    {
+        uint64_t bit = static_cast<uint64_t>(i) * width_;
+        uint64_t w = bit >> 6, shift = bit & 63;
+        uint64_t lo = words_[w] >> shift;
+        uint64_t hi = (words_[w + 1] << 1) << (63 - shift);
+        return static_cast<int64_t>((lo | hi) & mask_) + base_;
+    }
+
+    /// Returns bits of each value.
+    int32_t width() const
+    {
+        return width_;
+    }
+
+    /**
+     * Packs values and writes them as an archive section.
+     *
+     * @param values Values to be packed.
+     * @param out Where to write.
+     * @return Length of the section.
+     */
+    static size_t write(const std::vector<int64_t> &values, FILE *out)
+    {
+        header_type header;
+        uint64_t range = 0;
+        size_t i;
+
+        memset(&header, 0, sizeof(header));
+        header.base = values.empty()?0:values[0];
+        for (i = 1; i < values.size(); i++)
+            header.base = std::min(header.base, values[i]);
+        for (i = 0; i < values.size(); i++)
+            range |= static_cast<uint64_t>(values[i] - header.base);
+        while (header.width < 64 && (range >> header.width))
+            header.width++;
+        size_t bits = values.size() * header.width;
+        // at least one data word and one padding word
+        std::vector<uint64_t> words(std::max<size_t>((bits + 63) / 64, 1)
+                                    + 1, 0);
+        for (i = 0; i < values.size(); i++) {
+            uint64_t v = static_cast<uint64_t>(values[i] - header.base);
+            size_t bit = i * header.width, w = bit >> 6, shift = bit & 63;
+            words[w] |= v << shift;
+            if (shift + header.width > 64)
+                words[w + 1] |= v >> (64 - shift);
+        }
+        header.words = words.size();
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(&words[0], sizeof(uint64_t) * words.size(), 1, out);
+        return sizeof(header) + sizeof(uint64_t) * words.size();
+    }
+
+  private:
+    const uint64_t *words_;  ///< Packed words.
+    int64_t base_;           ///< Frame of reference.
+    uint64_t mask_;          ///< Mask of width_ bits.
+    int32_t width_;          ///< Bits of each value.
+};
+
+/**
+ * Epoch-based reclamation of objects replaced by a writer while readers
+ * may still hold pointers to them.
+ *
+ * Readers announce themselves in one of kSlots counters, picked by their
+ * thread id, under the parity of the current epoch. The writer retires
+ * replaced objects tagged with the current epoch, and advances the epoch
+ * only when no reader is left under the parity of the previous one. An
+ * object is freed once its epoch is older than the current one, so no
+ * reader can still be reading it. Readers never wait for the writer.
+ */
+class epoch_reclaimer {
+  public:
+    /// Number of reader counters.
+    static const size_t kSlots = 64;
+
+    /// Constructs an epoch_reclaimer.
+    epoch_reclaimer()
+        :epoch_(1)
+    {
+        memset(slots_, 0, sizeof(slots_));
+    }
+
+    /// Frees all retired objects. No reader may be left.
+    ~epoch_reclaimer();
+
+    /**
+     * Enters a read-side critical section.
+     *
+     * @return A token to be passed to leave().
+     */
+    size_t enter()
+    {
+        size_t slot = (reinterpret_cast<uintptr_t>(
+                       reinterpret_cast<void *>(pthread_self()))
+                       * 0x9e3779b97f4a7c15ULL >> 32) % kSlots;
+        while (true) {
+            uint64_t epoch = __atomic_load_n(&epoch_, __ATOMIC_ACQUIRE);
+            __sync_fetch_and_add(&slots_[slot].count[epoch & 1], 1);
+            if (__atomic_load_n(&epoch_, __ATOMIC_ACQUIRE) == epoch)
+                return slot << 1 | (epoch & 1);
+            // the epoch moved on before we were counted, retry
+            __sync_fetch_and_sub(&slots_[slot].count[epoch & 1], 1);
         }
+    }
+
+    /// Leaves a read-side critical section.
+    void leave(size_t token)
+    {
+        __sync_fetch_and_sub(&slots_[token >> 1].count[token & 1], 1);
+    }
+
+    /// Represents a function which frees a retired object.
+    typedef void (*release_function)(void *);
+
+    /**
+     * Retires an object. Writer only.
+     *
+     * @param ptr The object which readers may still be reading.
+     * @param release Function to free it, free by default.
+     */
+    void retire(void *ptr, release_function release = free)
+    {
+        retired_type item = {epoch_, ptr, release};
+        retired_.push_back(item);
+        reclaim();
+    }
+
+    /// Frees objects that no reader can reach. Writer only.
+    void reclaim();
+
+    /// Returns the number of objects waiting to be freed.
+    size_t pending() const
+    {
+        return retired_.size();
+    }
+
+  private:
+    /// Represents reader counters on a cache line of its own.
+    typedef struct {
+        long count[2];  ///< Readers under an even or odd epoch.
+        char unused[64 - 2 * sizeof(long)];  ///< Padding.
+    } slot_type;
+
+    /// Represents a retired object.
+    typedef struct {
+        uint64_t epoch;            ///< Epoch when it was retired.
+        void *ptr;                 ///< The object.
+        release_function release;  ///< Function to free it.
+    } retired_type;
+
+    slot_type slots_[kSlots];  ///< Reader counters.
+    uint64_t epoch_;           ///< Current epoch.
+
+    /// Retired objects.
+    std::vector<retired_type> retired_;
+};
+
+/**
+ * RAII guard of a read-side critical section of epoch_reclaimer.
+ */
+class epoch_guard {
+  public:
+    /// Enters a critical section of reclaimer.
+    explicit epoch_guard(epoch_reclaimer *reclaimer)
+        :reclaimer_(reclaimer), token_(reclaimer->enter())
+    {}
+
+    /// Leaves the critical section.
+    ~epoch_guard()
+    {
+        reclaimer_->leave(token_);
+    }
+
+  private:
+    epoch_reclaimer *reclaimer_;  ///< Guarded reclaimer.
+    size_t token_;                ///< Token returned by enter.
+};
+
+/**
+ * An array in shared memory whose pages can be shared with read-only
+ * snapshots.
+ *
+ * The array lives in an anonymous file mapped by the writer. A snapshot
+ * is one more read-only mapping of the same file, so it is taken in
+ * constant time. Before the writer changes a page which is still shared
+ * with some snapshots, touch() copies the page into a second file and
+ * remaps those snapshots onto the copy, so snapshots never see a change.
+ * Each page records the generation of its last copy: a page is shared
+ * if a snapshot was taken after that.
+ *
+ * A cow_array is reference counted. The trie which owns the array and
+ * each snapshot hold a reference, so a snapshot may outlive its trie.
+ */
+class cow_array {
+  public:
+    /// Size of pages shared between the array and snapshots.
+    static const size_t kPageSize = 4096;
+
+    /**
+     * Constructs a cow_array with a copy of data.
+     *
+     * @param data Data of the array.
+     * @param size Length of data in bytes.
+     */
+    cow_array(const void *data, size_t size);
+
+    /// Returns the array.
+    void *data() const
+    {
+        return data_;
+    }
+
+    /**
+     * Grows the array. New bytes are zero. The array may move; the old
+     * mapping is retired to reclaimer, or moved at once without one.
+     *
+     * @param size New length in bytes.
+     * @param reclaimer Reclaimer of the old mapping, or NULL.
+     * @return The array.
+     */
+    void *grow(size_t size, epoch_reclaimer *reclaimer);
+
+    /**
+     * Maps a read-only snapshot of the first size bytes of the array.
+     * Writer only.
+     *
+     * @param size Length of the snapshot in bytes.
+     * @return The snapshot, to be passed to release_snapshot().
+     */
+    const void *snapshot(size_t size);
+
+    /**
+     * Unmaps a snapshot and drops its reference to the array. It may be
+     * called by any thread.
+     *
+     * @param view The snapshot.
+     */
+    void release_snapshot(const void *view);
+
+    /**
+     * Drops the reference of the owner, which must not touch the array
+     * any more. Snapshots still mapped keep their pages.
+     *
+     * @param array The cow_array.
+     */
+    static void detach(cow_array *array);
+
+    /// Copies the page at p before it is changed, if it is shared.
+    void touch(const void *p)
+    {
+        size_t page = (static_cast<const char *>(p) - data_) / kPageSize;
+        if (copied_[page] != generation_)
+            copy_page(page);
+    }
+
+  private:
+    /// Represents a snapshot.
+    typedef struct {
+        char *view;                  ///< Read-only mapping.
+        size_t size;                 ///< Length of the mapping.
+        uint64_t generation;         ///< Generation when it was taken.
+        std::vector<size_t> copies;  ///< Copies it is mapped to.
+    } snapshot_type;
+
+    /// Represents a mapping retired by grow().
+    typedef struct {
+        void *addr;   ///< Start of the mapping.
+        size_t size;  ///< Length of the mapping.
+    } mapping_type;
+
+    ~cow_array();
+
+    /// Copies a shared page and remaps snapshots sharing it.
+    void copy_page(size_t page);
+
+    /// Drops a reference, and deletes the cow_array on the last one.
+    void unref();
+
+    /// Unmaps a mapping retired by grow().
+    static void unmap(void *mapping);
+
+    char *data_;   ///< The array mapped by the writer.
+    size_t size_;  ///< Length of the array, in whole pages.
+    int fd_;       ///< File of the array.
+    int copy_fd_;  ///< File of copied pages.
+
+    uint64_t generation_;           ///< Number of snapshots taken.
+    std::vector<uint64_t> copied_;  ///< Generation of the last copy.
+    std::vector<snapshot_type> snapshots_;  ///< Snapshots mapped.
+
+    std::vector<size_t> copy_refs_;  ///< Snapshots mapped to each copy.
+    std::vector<size_t> free_copies_;  ///< Copies no longer used.
+
+    size_t refs_;            ///< Owner and snapshots.
+    pthread_mutex_t mutex_;  ///< Guards snapshots and references.
+
+    cow_array(const cow_array &);
+    void operator=(const cow_array &);
+};
+
+/**
+ * Memory held by a snapshot of a trie: read-only views of cow_arrays
+ * and private copies of headers. All of them are released when the
+ * cow_snapshot is deleted.
+ */
+class cow_snapshot {
+  public:
+    /// Constructs an empty cow_snapshot.
+    cow_snapshot()
+    {
+    }
+
+    /// Releases views and copies.
+    ~cow_snapshot()
+    {
+        size_t i;
+        for (i = 0; i < views_.size(); i++)
+            views_[i].first->release_snapshot(views_[i].second);
+        for (i = 0; i < copies_.size(); i++)
+            free(copies_[i]);
+    }
+
+    /**
+     * Maps a view of an array.
+     *
+     * @param array The array.
+     * @param size Length of the view in bytes.
+     * @return The view.
+     */
+    void *map(cow_array *array, size_t size)
+    {
+        const void *view = array->snapshot(size);
+        views_.push_back(std::make_pair(array, view));
+        return const_cast<void *>(view);
+    }
+
+    /**
+     * Keeps a private copy of data.
+     *
+     * @param data The data.
+     * @param size Length of the data in bytes.
+     * @return The copy.
+     */
+    void *keep(const void *data, size_t size)
+    {
+        void *copy = malloc(size);
+        if (!copy)
+            throw std::bad_alloc();
+        memcpy(copy, data, size);
+        copies_.push_back(copy);
+        return copy;
+    }
+
+  private:
+    /// Views of arrays.
+    std::vector<std::pair<cow_array *, const void *> > views_;
+    /// Private copies.
+    std::vector<void *> copies_;
+
+    cow_snapshot(const cow_snapshot &);
+    void operator=(const cow_snapshot &);
+};
+
+/**
+ * A store of variable-length payloads.
+ *
+ * Payloads are appended one after another into a data buffer and
+ * addressed by an offset table. A payload is referred by its value,
+ * which is its sequence number plus one so that it is always
+ * greater than zero. In archive, the offset table and the data buffer
+ * are stored one by one.
+ *
+ * The first snapshot moves both buffers into cow_arrays. Payloads are
+ * only appended, so a snapshot maps the buffers as they are and keeps
+ * just the count and size it saw.
+ */
+class payload_store {
+  public:
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Shortcut for trie::value_type.
+    typedef trie::value_type value_type;
+
+    /// Constructs an empty payload_store.
+    payload_store()
+        :offsets_(NULL), data_(NULL), count_(0), size_(0),
+         offset_cow_(NULL), data_cow_(NULL), offset_capacity_(0),
+         data_capacity_(0)
+    {
+        offset_buffer_.push_back(0);
+    }
+
+    /// Destructs a payload_store, snapshots keep the buffers they share.
+    ~payload_store()
+    {
+        if (offset_cow_) {
+            cow_array::detach(offset_cow_);
+            cow_array::detach(data_cow_);
+        }
+    }
+
+    /**
+     * Sets up a payload_store using an archive section in memory.
+     *
+     * @param section Pointer to the section.
+     * @param end End of the archive.
+     * @param count Number of payloads in the section.
+     * @param size Length of payload data in the section.
+     */
+    void load(const void *section, const void *end, size_type count,
+              size_type size)
+    {
+        if (count < 0 || size < 0 || section > end
+            || section_size(count, size)
+               > static_cast<size_t>(static_cast<const char *>(end)
+                                     - static_cast<const char *>(section)))
+            throw std::runtime_error("file corrupted");
+        offsets_ = static_cast<const size_type *>(section);
+        data_ = reinterpret_cast<const char *>(offsets_ + count + 1);
+        count_ = count;
+        size_ = size;
+    }
+
+    /**
+     * Appends a payload.
+     *
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload.
+     * @return The value refers to the payload.
+     */
+    value_type append(const char *payload, size_t length)
+    {
+        assert(!offsets_ || offset_cow_);
+        check_room(length);
+        if (offset_cow_)
+            return append_shared(payload, length);
+        data_buffer_.insert(data_buffer_.end(), payload, payload + length);
+        offset_buffer_.push_back(data_buffer_.size());
+        return offset_buffer_.size() - 1;
+    }
+
+    /**
+     * Retrieves a payload by its value.
+     *
+     * @param value The value refers to the payload.
+     * @param[out] payload Pointer to the payload.
+     * @param[out] length Length of the payload.
+     * @return true if value refers to a payload.
+     */
+    bool get(value_type value, const char **payload, size_t *length) const
+    {
+        const size_type *offsets = offsets_?offsets_:&offset_buffer_[0];
+        const char *data = offsets_?data_:
+                           (data_buffer_.empty()?NULL:&data_buffer_[0]);
+        if (value < 1 || value > count())
+            return false;
+        if (payload)
+            *payload = data + offsets[value - 1];
+        if (length)
+            *length = offsets[value] - offsets[value - 1];
+        return true;
+    }
+
+    /// Returns the number of payloads.
+    size_type count() const
+    {
+        return offsets_?count_:offset_buffer_.size() - 1;
+    }
+
+    /// Returns the length of payload data.
+    size_type size() const
+    {
+        return offsets_?size_:data_buffer_.size();
+    }
+
+    /// Returns the length of the archive section.
+    static size_t section_size(size_type count, size_type size)
+    {
+        return sizeof(size_type) * (count + 1) + size;
+    }
+
+    /**
+     * Sets up copy as a read-only snapshot of the payloads appended so
+     * far, sharing the buffers. Writer only.
+     *
+     * @param holder Holder of the views of copy.
+     * @param copy An empty payload_store.
+     */
+    void snapshot(cow_snapshot *holder, payload_store *copy);
+
+    /// Writes the archive section to out.
+    void write(FILE *out) const
+    {
+        const size_type *offsets = offsets_?offsets_:&offset_buffer_[0];
+        const char *data = offsets_?data_:
+                           (data_buffer_.empty()?NULL:&data_buffer_[0]);
+        fwrite(offsets, sizeof(size_type) * (count() + 1), 1, out);
+        if (size())
+            fwrite(data, size(), 1, out);
+    }
+
+  private:
+    /// Offset table in archive or shared memory, or NULL.
+    const size_type *offsets_;
+    const char *data_;          ///< Payload data in archive or shared memory.
+    size_type count_;           ///< Number of payloads in offsets_.
+    size_type size_;            ///< Length of payload data in data_.
+
+    /// Offset table while building.
+    std::vector<size_type> offset_buffer_;
+
+    /// Payload data while building.
+    std::vector<char> data_buffer_;
+
+    cow_array *offset_cow_;     ///< Offset table after the first snapshot.
+    cow_array *data_cow_;       ///< Payload data after the first snapshot.
+    size_t offset_capacity_;    ///< Bytes of offset_cow_.
+    size_t data_capacity_;      ///< Bytes of data_cow_.
+
+    /// Appends a payload into shared memory.
+    value_type append_shared(const char *payload, size_t length);
+
+    /**
+     * Throws std::length_error if a payload of length would take offsets
+     * or values past their maximum.
+     */
+    void check_room(size_t length) const
+    {
+        const uint64_t limit = std::numeric_limits<size_type>::max();
+        if (static_cast<uint64_t>(size()) + length > limit
+            || static_cast<uint64_t>(count()) + 1
+               > static_cast<uint64_t>(std::numeric_limits<value_type>::max()))
+            throw std::length_error("trie: too much payload data, "
+                                    "build with TRIE_LARGE_INDEX");
+    }
+
+    payload_store(const payload_store &);
+    void operator=(const payload_store &);
+};
+
+/**
+ * Grows an array which may be read concurrently. The new array is
+ * published before its new size, so a reader loading the size before
+ * the pointer never indexes past the end. An array on heap is grown in
+ * place if its reserved range allows, otherwise it is copied and the old
+ * one is retired to reclaimer. Without a reclaimer this is the same as
+ * resize.
+ *
+ * @param ptr Pointer to the array.
+ * @param size Pointer to the size of the array.
+ * @param new_size New size of the array.
+ * @param reclaimer Reclaimer of the old array, or NULL.
+ * @param cow Shared memory holding the array, or NULL if it is on heap.
+ */
+template<typename T, typename S>
+void grow_array(T **ptr, S *size, S new_size, epoch_reclaimer *reclaimer,
+                cow_array *cow = NULL)
+{
+    if (cow) {
+        T *block = static_cast<T *>(cow->grow(sizeof(T) * new_size,
+                                              reclaimer));
+        __atomic_store_n(ptr, block, __ATOMIC_RELEASE);
+        __atomic_store_n(size, new_size, __ATOMIC_RELEASE);
+        return;
+    }
+    if (!reclaimer) {
+        *ptr = resize(*ptr, *size, new_size);
+        *size = new_size;
+        return;
+    }
+    if (*ptr && vm_extend(*ptr, sizeof(T) * new_size)) {
+        // grown in place, readers go on with the same array
+        __atomic_store_n(size, new_size, __ATOMIC_RELEASE);
+        return;
+    }
+    T *old = *ptr;
+    T *block = resize(static_cast<T *>(NULL), 0, new_size);
+    if (old)
+        memcpy(block, old, sizeof(T) * *size);
+    __atomic_store_n(ptr, block, __ATOMIC_RELEASE);
+    __atomic_store_n(size, new_size, __ATOMIC_RELEASE);
+    reclaimer->retire(old, vm_release);
+}
+
+/**
+ * Writes a code point read by read_utf8 back into a key.
+ *
+ * @param point The code point.
+ * @param[out] key Key to append to.
+ */
+inline void write_utf8(int32_t point, trie::key_type *key)
+{
+    if (point < 0x80 || point >= 0x110000) {
+        key->push((point & 0xff) + 1);
+    } else if (point < 0x800) {
+        key->push((0xc0 | point >> 6) + 1);
+        key->push((0x80 | (point & 0x3f)) + 1);
+    } else if (point < 0x10000) {
+        key->push((0xe0 | point >> 12) + 1);
+        key->push((0x80 | (point >> 6 & 0x3f)) + 1);
+        key->push((0x80 | (point & 0x3f)) + 1);
     } else {
-        T *new_block = new T[new_size];
-        memset(new_block, 0, new_size * sizeof(T));
-        return new_block;
+        key->push((0xf0 | point >> 18) + 1);
+        key->push((0x80 | (point >> 12 & 0x3f)) + 1);
+        key->push((0x80 | (point >> 6 & 0x3f)) + 1);
+        key->push((0x80 | (point & 0x3f)) + 1);
     }
-#endif
 }
 
+/**
+ * A two-way table between code points and dense indexes, in order of
+ * adding. Both ways are paged by 256 entries, so a table is as large as
+ * the code points it has, and a page once published never moves, so
+ * readers may look up while a writer adds.
+ */
+class code_point_table {
+  public:
+    /// Code point of byte 0 which does not start a well-formed sequence.
+    static const int32_t kBytePoint = 0x110000;
+
+    /// Max number of code points.
+    static const int32_t kMaxSize = 65536;
+
+    /// Constructs an empty code_point_table.
+    code_point_table() :size_(0)
+    {
+        memset(indexes_, 0, sizeof(indexes_));
+        memset(points_, 0, sizeof(points_));
+    }
+
+    /// Constructs a copy of table.
+    code_point_table(const code_point_table &table);
+
+    /// Destructs a code_point_table.
+    ~code_point_table();
+
+    /// Returns the number of code points.
+    int32_t size() const
+    {
+        return __atomic_load_n(&size_, __ATOMIC_ACQUIRE);
+    }
+
+    /// Returns the index of a code point, or -1 if it has none.
+    int32_t index(int32_t point) const
+    {
+        const int32_t *page = __atomic_load_n(&indexes_[point >> kPageBits],
+                                              __ATOMIC_ACQUIRE);
+        return page?page[point & kPageMask] - 1:-1;
+    }
+
+    /// Returns the code point of an index.
+    int32_t point(int32_t index) const
+    {
+        const int32_t *page = __atomic_load_n(&points_[index >> kPageBits],
+                                              __ATOMIC_ACQUIRE);
+        return page[index & kPageMask];
+    }
+
+    /// Adds a code point which has no index, returns its index.
+    int32_t add(int32_t point);
+
+  private:
+    static const int kPageBits = 8;  ///< Bits of an offset in a page.
+    static const int32_t kPageMask = (1 << kPageBits) - 1;
+
+    int32_t size_;  ///< Number of code points.
+    /// Pages of index plus one of each code point.
+    int32_t *indexes_[(kBytePoint >> kPageBits) + 1];
+    /// Pages of code point of each index.
+    int32_t *points_[kMaxSize >> kPageBits];
+
+    /// Updates a code_point_table.
+    void operator=(const code_point_table &);
+};
+
+/**
+ * A table remapping bytes of keys to dense codes, see trie::set_alphabet.
+ *
+ * Codes are handed out downward from the one below kTerminator, so
+ * that the codes in use and the terminator share a narrow range of BASE
+ * offsets. Keys are encoded when they enter a trie and decoded when
+ * they are found. A byte without a code never matches.
+ *
+ * Remapping code points of UTF-8 keys instead, see
+ * trie::set_utf8_alphabet, the most frequent ones take one code each
+ * and the others two, a high code above the single ones and then any
+ * code. The lowest code above the single ones escapes to two any codes
+ * more, for code points beyond those. A code point without an index
+ * never matches either.
+ */
+class alphabet {
+  public:
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Shortcut for trie::key_type.
+    typedef trie::key_type key_type;
+
+    /// Number of entries of the table.
+    static const size_t kSize = key_type::kCharsetSize + 1;
+
+    /// Number of codes other than the terminator.
+    static const int32_t kCodes = key_type::kTerminator - 1;
+
+    /// Constructs a disabled alphabet, which leaves keys as they are.
+    alphabet()
+        :enabled_(false), next_(key_type::kTerminator - 1), singles_(0),
+         points_(NULL)
+    {
+        memset(codes_, 0, sizeof(codes_));
+        memset(letters_, 0, sizeof(letters_));
+        codes_[key_type::kTerminator] = key_type::kTerminator;
+        letters_[key_type::kTerminator] = key_type::kTerminator;
+    }
+
+    /// Constructs a copy of an alphabet.
+    alphabet(const alphabet &rhs) :points_(NULL)
+    {
+        *this = rhs;
+    }
+
+    /// Copies from an alphabet.
+    alphabet &operator=(const alphabet &rhs);
+
+    /// Destructs an alphabet.
+    ~alphabet()
+    {
+        delete points_;
+    }
+
+    /// Returns true if keys are remapped.
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    /// Returns true if code points of UTF-8 keys are remapped.
+    bool utf8() const
+    {
+        return points_ != NULL;
+    }
+
+    /**
+     * Hands out codes to bytes by their frequency, the most frequent
+     * first. Bytes not counted are left without codes until added.
+     *
+     * @param frequency Number of occurrences of each byte.
+     */
+    void assign(const std::vector<size_t> &frequency);
+
+    /**
+     * Hands out codes to code points of UTF-8 keys by their frequency in
+     * samples, the most frequent first. Code points not in samples are
+     * left without codes until added.
+     *
+     * @param samples Sample keys, or NULL.
+     */
+    void assign_utf8(const std::vector<std::string> *samples);
+
+    /// Returns the code of a char, handing out one if it has none.
+    char_type add(char_type ch)
+    {
+        if (!codes_[ch]) {
+            letters_[next_] = ch;
+            // readers may look up a code while it is added
+            __atomic_store_n(&codes_[ch], next_--, __ATOMIC_RELEASE);
+        }
+        return codes_[ch];
+    }
+
+    /// Returns key in codes, adding missing ones, using store if needed.
+    const key_type &add(const key_type &key, key_type *store)
+    {
+        if (!enabled_)
+            return key;
+        if (points_) {
+            add_points(key.data(), key.length());
+            return encode(key, store);
+        }
+        store->clear();
+        for (size_t i = 0; i < key.length(); i++)
+            store->push(add(key.data()[i]));
+        return *store;
+    }
+
+    /// Returns key in codes, using store if needed.
+    const key_type &encode(const key_type &key, key_type *store) const
+    {
+        if (!enabled_)
+            return key;
+        if (points_)
+            return encode_points(key.data(), key.length(), 1, store);
+        store->clear();
+        for (size_t i = 0; i < key.length(); i++)
+            store->push(__atomic_load_n(&codes_[key.data()[i]],
+                                        __ATOMIC_ACQUIRE));
+        return *store;
+    }
+
+    /**
+     * Returns bytes in codes, in store. It never allocates unless the
+     * codes are longer than the inline buffer of store.
+     */
+    const key_type &encode(const char *data, size_t length,
+                           key_type *store) const
+    {
+        if (points_)
+            return encode_points(data, length, 0, store);
+        if (!enabled_) {
+            store->assign(data, length);
+            return *store;
+        }
+        store->clear();
+        for (size_t i = 0; i < length; i++)
+            store->push(__atomic_load_n(&codes_[key_type::char_in(data[i])],
+                                        __ATOMIC_ACQUIRE));
+        return *store;
+    }
+
+    /// Returns key in codes back in chars, using store if needed.
+    const key_type &decode(const key_type &key, key_type *store) const
+    {
+        if (!enabled_)
+            return key;
+        if (points_)
+            return decode_points(key, store);
+        store->clear();
+        for (size_t i = 0; i < key.length(); i++)
+            store->push(letters_[key.data()[i]]);
+        return *store;
+    }
+
+    /**
+     * Writes the table into an archive, codes of all chars, or the
+     * number of single codes and code points in order of index.
+     *
+     * @return Size of the section.
+     */
+    size_t write(FILE *out) const;
+
+    /**
+     * Loads the table from an archive.
+     *
+     * @param section The section written by write().
+     * @param utf8 True if code points are remapped.
+     * @return Pointer to the end of the section.
+     */
+    const void *load(const void *section, bool utf8);
+
+  private:
+    /// Adds code points of key data without indexes.
+    void add_points(const char_type *data, size_t length);
+
+    /// Returns code points of data in codes, in store.
+    template <typename T>
+    const key_type &encode_points(const T *data, size_t length, int bias,
+                                  key_type *store) const
+    {
+        int32_t point;
+        store->clear();
+        for (size_t i = 0; i < length; ) {
+            i += read_utf8(data + i, length - i, bias, &point);
+            int32_t index = points_->index(point);
+            if (index < 0) {
+                store->push(0);
+            } else if (index < singles_) {
+                store->push(singles_ - index);
+            } else {
+                index -= singles_;
+                if (index >= doubles()) {
+                    store->push(singles_ + 1);
+                    index -= doubles();
+                }
+                store->push(kCodes - (index >> 8));
+                store->push(kCodes - (index & 0xff));
+            }
+        }
+        return *store;
+    }
+
+    /// Returns the number of code points taking two codes.
+    int32_t doubles() const
+    {
+        return (kCodes - singles_ - 1) << 8;
+    }
+
+    /// Returns codes of code points back in chars, in store.
+    const key_type &decode_points(const key_type &key,
+                                  key_type *store) const;
+
+    bool enabled_;              ///< True if keys are remapped.
+    char_type next_;            ///< Code to be handed out next.
+    char_type codes_[kSize];    ///< Code of each char, 0 if none.
+    char_type letters_[kSize];  ///< Char of each code.
+    int32_t singles_;           ///< Code points taking one code.
+    code_point_table *points_;  ///< Code points, or NULL for bytes.
+};
+
+/**
+ * Output of a prefix search, either a result_type or a result_buffer.
+ */
+class result_sink {
+  public:
+    /// Shortcut for trie::key_type.
+    typedef trie::key_type key_type;
+
+    /// Shortcut for trie::value_type.
+    typedef trie::value_type value_type;
+
+    /// Constructs a result_sink appending to result.
+    explicit result_sink(trie::result_type *result)
+        :result_(result), buffer_(NULL), alphabet_(NULL)
+    {
+    }
+
+    /// Constructs a result_sink appending to buffer.
+    explicit result_sink(trie::result_buffer *buffer)
+        :result_(NULL), buffer_(buffer), alphabet_(NULL)
+    {
+    }
+
+    /// Makes keys appended afterward be decoded from codes of alphabet.
+    void set_alphabet(const alphabet *alphabet)
+    {
+        alphabet_ = alphabet;
+    }
+
+    /// Appends a key and its value.
+    void append(const key_type &key, value_type value)
+    {
+        const key_type &found = alphabet_?alphabet_->decode(key, &decoded_)
+                                         :key;
+        if (result_)
+            result_->push_back(std::pair<key_type, value_type>(found,
+                                                               value));
+        else
+            buffer_->push_back(found.data(), found.length(), value);
+    }
+
+    /// Returns the number of keys.
+    size_t size() const
+    {
+        return result_?result_->size():buffer_->size();
+    }
+
+    /// Removes keys after the first size ones.
+    void truncate(size_t size)
+    {
+        if (result_)
+            result_->erase(result_->begin() + size, result_->end());
+        else
+            buffer_->truncate(size);
+    }
+
+  private:
+    trie::result_type *result_;    ///< Result set, or NULL.
+    trie::result_buffer *buffer_;  ///< Result buffer, or NULL.
+    const alphabet *alphabet_;     ///< Alphabet of keys, or NULL.
+    key_type decoded_;             ///< Key being decoded.
+};
+
+/**
+ * Receives leaves found by basic_trie::prefix_search_aux.
+ */
+class leaf_visitor {
+  public:
+    /// Destructs a leaf_visitor.
+    virtual ~leaf_visitor()
+    {
+    }
+
+    /**
+     * Visits a leaf.
+     *
+     * @param store Inputs from the root to the leaf.
+     * @param base BASE of the leaf.
+     * @return false to stop searching.
+     */
+    virtual bool visit(const trie::key_type &store, trie::size_type base) = 0;
+};
+
 /// A double-array with basic operations.
 class basic_trie: public trie
 {
@@ -151,7 +1283,8 @@ class basic_trie: public trie
      */
     typedef struct {
         size_type size;  ///< Size of state buffer
-        char unused[60]; ///< Unused, for 32/64 bits compatible.
+        /// Unused, for 32/64 bits compatible.
+        char unused[64 - sizeof(size_type)];
     } header_type;
 
     /**
@@ -208,6 +1341,45 @@ class basic_trie: public trie
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
     size_t prefix_search(const key_type &prefix, result_type *result) const;
+    void relayout(const std::vector<std::string> *samples = NULL);
+
+    /**
+     * Rebuilds the state buffer by visiting states from the root, hot
+     * states first and in breadth-first order otherwise. Children of
+     * each state are placed at the lowest free BASE, so the states
+     * visited first are packed together.
+     *
+     * @param heat Visiting count of each state, or NULL.
+     * @param[out] mapping New index of each original state, zero for
+     *                     unused states.
+     */
+    void relayout_states(const std::vector<size_t> *heat,
+                         std::vector<size_type> *mapping);
+
+    /**
+     * Goes forward from the root with inputs like go_forward does and
+     * increases the heat of every arrived state.
+     *
+     * @param inputs Inputs to go with.
+     * @param[out] heat Visiting count of each state.
+     * @return The last arrived state.
+     */
+    size_type go_forward_heat(const char_type *inputs,
+                              std::vector<size_t> *heat) const
+    {
+        size_type s = 1;
+        const char_type *p = inputs;
+        heat->resize(header_->size);
+        (*heat)[s]++;
+        do {
+            size_type t = next(s, *p);
+            if (!check_transition(s, t))
+                break;
+            s = t;
+            (*heat)[s]++;
+        } while (*p++ != key_type::kTerminator);
+        return s;
+    }
 
     void build(const char *filename, bool verbose)
     {
@@ -222,18 +1394,18 @@ class basic_trie: public trie
     }
 
     /**
-     * Retrieves all key-value pairs match given prefix from state s.
+     * Visits all leaves under state s whose inputs match given prefix.
      *
      * @param s Start state.
      * @param p Mismatch character buffer.
      * @param[out] store Temporary storage for found keys.
-     * @param[out] result Result set.
-     * @return The number of elements in the result set.
+     * @param visitor Visitor of leaves.
+     * @return false if the visitor stops searching.
      */
-    size_t prefix_search_aux(size_type s,
-                             const char_type *p,
-                             key_type *store,
-                             result_type *result) const;
+    bool prefix_search_aux(size_type s,
+                           const char_type *p,
+                           key_type *store,
+                           leaf_visitor *visitor) const;
 
     /**
      * Creates a new tranisition from state s with input char_type.
@@ -284,6 +1456,37 @@ class basic_trie: public trie
         last_base_ = base;
     }
 
+    /**
+     * Frees a state, so find_base can hand it out again.
+     *
+     * @param s The state.
+     */
+    void free_state(size_type s)
+    {
+        set_base(s, 0);
+        set_check(s, 0);
+        // let find_base look back as far as s
+        if (s - key_type::kCharsetSize - 1 < last_base_)
+            last_base_ = std::max<size_type>(s - key_type::kCharsetSize - 1,
+                                             0);
+    }
+
+    /**
+     * Frees a leaf state and its ancestors which have no transition
+     * left. The root is never freed.
+     *
+     * @param s The leaf state.
+     */
+    void remove_leaf(size_type s)
+    {
+        char_type targets[key_type::kCharsetSize + 1];
+        do {
+            size_type t = prev(s);
+            free_state(s);
+            s = t;
+        } while (s > 1 && !find_exist_target(s, targets, NULL));
+    }
+
     /**
      * Sets a new state relocator.
      *
@@ -294,6 +1497,122 @@ class basic_trie: public trie
         relocator_ = relocator;
     }
 
+    /**
+     * Sets a reclaimer which retires states replaced by resizing, so
+     * they can be read by sync_* methods in other threads.
+     *
+     * @param reclaimer The reclaimer, or NULL to free them at once.
+     */
+    void set_reclaimer(epoch_reclaimer *reclaimer)
+    {
+        reclaimer_ = reclaimer;
+    }
+
+    /**
+     * Takes a read-only snapshot of the states. Writer only.
+     *
+     * @param holder Holder of the memory of the snapshot.
+     * @return The snapshot, which does not own its memory.
+     */
+    basic_trie *snapshot(cow_snapshot *holder)
+    {
+        assert(owner_);
+        if (!cow_) {
+            // move states into shared memory
+            cow_array *cow = new cow_array(states_, sizeof(state_type)
+                                                    * header_->size);
+            state_type *old = states_;
+            __atomic_store_n(&states_, static_cast<state_type *>(cow->data()),
+                             __ATOMIC_RELEASE);
+            cow_ = cow;
+            if (reclaimer_)
+                reclaimer_->retire(old, vm_release);
+            else
+                resize(old, header_->size, 0);
+        }
+        void *header = holder->keep(compact_header(), sizeof(header_type));
+        void *states = holder->map(cow_, sizeof(state_type)
+                                         * (max_state_ + 1));
+        return new basic_trie(header, states);
+    }
+
+    /**
+     * Returns base of state s while a writer may be resizing states.
+     * Returns 0 if s is out of range.
+     */
+    size_type sync_base(size_type s) const
+    {
+        size_type size = __atomic_load_n(&header_->size, __ATOMIC_ACQUIRE);
+        const state_type *states = __atomic_load_n(&states_,
+                                                   __ATOMIC_ACQUIRE);
+        return (s > 0 && s < size)?states[s].base:0;
+    }
+
+    /**
+     * Returns check of state s while a writer may be resizing states.
+     * Returns 0 if s is out of range.
+     */
+    size_type sync_check(size_type s) const
+    {
+        size_type size = __atomic_load_n(&header_->size, __ATOMIC_ACQUIRE);
+        const state_type *states = __atomic_load_n(&states_,
+                                                   __ATOMIC_ACQUIRE);
+        return (s > 0 && s < size)?states[s].check:0;
+    }
+
+    /// Same as check_transition, but safe to be called by readers.
+    bool sync_check_transition(size_type s, size_type t) const
+    {
+        return s > 0 && sync_check(t) == s;
+    }
+
+    /// Same as check_reverse_transition, but safe to be called by readers.
+    bool sync_check_reverse_transition(size_type s, char_type ch) const
+    {
+        size_type t = sync_check(s);
+        return sync_base(t) + ch == s && sync_check_transition(t, s);
+    }
+
+    /// Same as go_forward, but safe to be called by readers.
+    size_type sync_go_forward(size_type s,
+                              const char_type *inputs,
+                              const char_type **mismatch) const
+    {
+        const char_type *p = inputs;
+        do {
+            size_type t = sync_base(s) + *p;
+            if (!sync_check_transition(s, t)) {
+                *mismatch = p;
+                TRIE_SAMPLE(FORWARD_STATES, p - inputs);
+                return s;
+            }
+            s = t;
+        } while (*p++ != key_type::kTerminator);
+        *mismatch = NULL;
+        TRIE_SAMPLE(FORWARD_STATES, p - inputs);
+        return s;
+    }
+
+    /// Same as go_backward, but safe to be called by readers.
+    size_type sync_go_backward(size_type s,
+                               const char_type *inputs,
+                               const char_type **mismatch) const
+    {
+        const char_type *p = inputs;
+        do {
+            size_type t = sync_check(s);
+            if (sync_base(t) + *p != s || !sync_check_transition(t, s)) {
+                *mismatch = p;
+                TRIE_SAMPLE(BACKWARD_STATES, p - inputs);
+                return s;
+            }
+            s = t;
+        } while (*p++ != key_type::kTerminator);
+        *mismatch = NULL;
+        TRIE_SAMPLE(BACKWARD_STATES, p - inputs);
+        return s;
+    }
+
     /// Get the BASE value of state s.
     size_type base(size_type s) const
     {
@@ -309,6 +1628,8 @@ class basic_trie: public trie
     /// Set a new BASE value of state s.
     void set_base(size_type s, size_type val)
     {
+        if (cow_)
+            cow_->touch(&states_[s]);
         states_[s].base = val;
         if (s > max_state_)
             max_state_ = s;
@@ -317,7 +1638,11 @@ class basic_trie: public trie
     /// Set a new CHECK value of state s.
     void set_check(size_type s, size_type val)
     {
+        if (cow_)
+            cow_->touch(&states_[s]);
         states_[s].check = val;
+        if (s > max_state_)
+            max_state_ = s;
     }
 
     /// Gets next state from s with input ch.
@@ -346,11 +1671,13 @@ class basic_trie: public trie
             size_type t = next(s, *p);
             if (!check_transition(s, t)) {
                 *mismatch = p;
+                TRIE_SAMPLE(FORWARD_STATES, p - inputs);
                 return s;
             }
             s = t;
         } while (*p++ != key_type::kTerminator);
         *mismatch = NULL;
+        TRIE_SAMPLE(FORWARD_STATES, p - inputs);
         return s;
     }
 
@@ -390,13 +1717,15 @@ class basic_trie: public trie
         const char_type *p = inputs;
         do {
             size_type t = prev(s);
-            if (!check_transition(t, next(t, *p))) {
+            if (next(t, *p) != s || !check_transition(t, s)) {
                 *mismatch = p;
+                TRIE_SAMPLE(BACKWARD_STATES, p - inputs);
                 return s;
             }
             s = t;
         } while (*p++ != key_type::kTerminator);
         *mismatch = NULL;
+        TRIE_SAMPLE(BACKWARD_STATES, p - inputs);
         return s;
     }
 
@@ -435,6 +1764,18 @@ class basic_trie: public trie
         return owner_;
     }
 
+    /**
+     * Walks all states reachable from the root and appends statistics
+     * of the states to stats.
+     *
+     * @param name Name of the states array.
+     * @param[out] stats Statistics, whose out_degree and depth are
+     *                   counted too if histograms is true.
+     * @param[out] leaves Leaf states, or NULL.
+     */
+    void collect_stats(const char *name, stats_type *stats, bool histograms,
+                       std::vector<size_type> *leaves) const;
+
     /// Returns true if there is a transition from s to t.
     bool check_transition(size_type s, size_type t) const
     {
@@ -469,10 +1810,8 @@ class basic_trie: public trie
     /// Resizes state buffer.
     void resize_state(size_type size)
     {
-        // align with 4k
-        size_type nsize = (((header_->size * 2 + size) >> 12) + 1) << 12;
-        states_ = resize(states_, header_->size, nsize);
-        header_->size = nsize;
+        size_type nsize = grow_size(header_->size, size);
+        grow_array(&states_, &header_->size, nsize, reclaimer_, cow_);
     }
 
     /**
@@ -516,6 +1855,12 @@ class basic_trie: public trie
     /// Relocator for notifying state changing.
     trie_relocator_interface<size_type> *relocator_;
 
+    /// Reclaimer of replaced states_ in concurrent mode.
+    epoch_reclaimer *reclaimer_;
+
+    /// Shared memory holding states_ once a snapshot is taken.
+    cow_array *cow_;
+
     /// @see compact_header().
     mutable header_type compact_header_;
 };
@@ -573,12 +1918,7 @@ class double_trie: public trie {
     /**
      * Represents some information about double_trie.
      */
-    typedef struct {
-        char magic[16];  ///< Archive magic.
-        size_type index_size;  ///< Index array size.
-        size_type accept_size; ///< Accept array size.
-        char unused[40]; ///< for 32/64bits compatible.
-    } header_type;
+    typedef two_trie_archive::header_type header_type;
 
     /**
      * Constructs a double_trie.
@@ -594,13 +1934,39 @@ class double_trie: public trie {
      */
     explicit double_trie(const char *filename);
 
+    /**
+     * Constructs a double_trie using an archive already in memory. The
+     * memory is not owned by the double_trie and must outlive it.
+     *
+     * @param archive Pointer to the archive data.
+     * @param size Length of the archive data.
+     */
+    double_trie(void *archive, size_t size);
+
     /// Destructs a double_trie.
     ~double_trie();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
+    size_t prefix_search(const key_type &key, result_buffer *result) const;
+    size_t common_prefix_search(const key_type &key,
+                                result_buffer *result) const;
     void build(const char *filename, bool verbose = false);
+    void relayout(const std::vector<std::string> *samples = NULL);
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    void set_concurrent(bool concurrent);
+    bool erase(const key_type &key);
+    trie *snapshot();
+    void stats(stats_type *stats) const;
+    void set_alphabet(const std::vector<size_t> &frequency);
+    void set_utf8_alphabet(const std::vector<std::string> *samples = NULL);
+
+    /// Searches bytes without a key_type of them in between.
+    bool search(const char *inputs, size_t length, value_type *value) const;
 
     /// Returns a pointer to front trie.
     const basic_trie *front_trie() const
@@ -623,34 +1989,44 @@ class double_trie: public trie {
         fprintf(stderr, "========================================");
         fprintf(stderr, "\nSEQ     |");
         for (i = istart; i < dsize && i < header_->index_size; i++)
-            fprintf(stderr, "%4u ", i);
+            fprintf(stderr, "%4ld ", static_cast<long>(i));
         fprintf(stderr, "\nDATA    |");
         for (i = istart; i < dsize && i < header_->index_size; i++)
-            fprintf(stderr, "%4d ", index_[i].data);
+            fprintf(stderr, "%4d ", index_data(i));
         fprintf(stderr, "\nINDEX   |");
         for (i = istart; i < dsize && i < header_->index_size; i++)
-            fprintf(stderr, "%4d ", index_[i].index);
+            fprintf(stderr, "%4ld ", static_cast<long>(index_accept(i)));
         fprintf(stderr, "\nCOUNT   |");
         for (i = astart; i < dsize && i < header_->accept_size; i++)
-            fprintf(stderr, "%4lu ", count_referer(accept_[i].accept));
+            fprintf(stderr, "%4lu ", count_referer(accept_state(i)));
         fprintf(stderr, "\nACCEPT  |");
         for (i = astart; i < dsize && i < header_->accept_size; i++)
-            fprintf(stderr, "%4d ", accept_[i].accept);
+            fprintf(stderr, "%4ld ", static_cast<long>(accept_state(i)));
         fprintf(stderr, "\n========================================\n");
         std::set<size_type>::const_iterator it;
         std::map<size_type, refer_type>::const_iterator mit;
         for (mit = refer_.begin(); mit != refer_.end(); mit++) {
-            fprintf(stderr, "%4d: ", mit->first);
+            fprintf(stderr, "%4ld: ", static_cast<long>(mit->first));
             for (it = mit->second.referer.begin();
                  it != mit->second.referer.end();
                  it++)
-                fprintf(stderr, "%4d ", *it);
+                fprintf(stderr, "%4ld ", static_cast<long>(*it));
             fprintf(stderr, "\n");
         }
         fprintf(stderr, "========================================\n");
     }
 
   protected:
+    /// Sets up all pointers from an archive in memory.
+    void load(void *archive, size_t size);
+
+    /**
+     * Writes a filter of all keys as an archive section, see key_filter.
+     *
+     * @return Size of the section.
+     */
+    size_t write_filter(FILE *out) const;
+
     /// Appends inputs to rear trie.
     size_type rhs_append(const char_type *inputs);
 
@@ -699,9 +2075,273 @@ class double_trie: public trie {
     /// Returns a accept state of a given separated state.
     size_type link_state(size_type s) const
     {
-        return accept_[index_[-lhs_->base(s)].index].accept;
+        if (set_)
+            return index_link(-lhs_->base(s));
+        return accept_state(index_accept(-lhs_->base(s)));
+    }
+
+    /// Returns the value of the (i)th index, 0 in a set archive.
+    value_type index_data(size_type i) const
+    {
+        if (set_)
+            return 0;
+        return packed_?data_column_.get(i):index_[i].data;
+    }
+
+    /**
+     * Returns the accept entry of the (i)th index. A set archive has no
+     * accept entries, its (i)th index stands for its own entry.
+     */
+    size_type index_accept(size_type i) const
+    {
+        if (set_)
+            return index_link(i)?i:0;
+        return packed_?index_column_.get(i):index_[i].index;
+    }
+
+    /// Returns the accept state of the (i)th accept entry.
+    size_type accept_state(size_type i) const
+    {
+        if (set_)
+            return index_link(i);
+        return packed_?accept_column_.get(i):accept_[i].accept;
+    }
+
+    /// Returns the accept state linked from the (i)th index of a set.
+    size_type index_link(size_type i) const
+    {
+        return packed_?index_column_.get(i):links_[i];
+    }
+
+    /// Sets the value of the (i)th index.
+    void set_index_data(size_type i, value_type data)
+    {
+        if (index_cow_)
+            index_cow_->touch(&index_[i]);
+        index_[i].data = data;
+    }
+
+    /// Sets the accept entry of the (i)th index.
+    void set_index_accept(size_type i, size_type accept)
+    {
+        if (index_cow_)
+            index_cow_->touch(&index_[i]);
+        index_[i].index = accept;
+    }
+
+    /// Sets the accept state of the (i)th accept entry.
+    void set_accept_state(size_type i, size_type s)
+    {
+        if (accept_cow_)
+            accept_cow_->touch(&accept_[i]);
+        accept_[i].accept = s;
+    }
+
+    /**
+     * Returns the value of the (i)th index while a writer may be
+     * resizing index_. Returns 0 if i is out of range.
+     */
+    value_type sync_index_data(size_type i) const
+    {
+        size_type size = __atomic_load_n(&header_->index_size,
+                                         __ATOMIC_ACQUIRE);
+        const index_type *index = __atomic_load_n(&index_, __ATOMIC_ACQUIRE);
+        return (i > 0 && i < size)?index[i].data:0;
+    }
+
+    /// Same as sync_index_data, but returns the accept entry.
+    size_type sync_index_accept(size_type i) const
+    {
+        size_type size = __atomic_load_n(&header_->index_size,
+                                         __ATOMIC_ACQUIRE);
+        const index_type *index = __atomic_load_n(&index_, __ATOMIC_ACQUIRE);
+        return (i > 0 && i < size)?index[i].index:0;
+    }
+
+    /// Same as sync_index_data, but returns the accept state.
+    size_type sync_accept_state(size_type i) const
+    {
+        size_type size = __atomic_load_n(&header_->accept_size,
+                                         __ATOMIC_ACQUIRE);
+        const accept_type *accept = __atomic_load_n(&accept_,
+                                                    __ATOMIC_ACQUIRE);
+        return (i > 0 && i < size)?accept[i].accept:0;
+    }
+
+    /**
+     * Marks the beginning of a change in concurrent mode. Readers
+     * overlapping the change will see an odd or another sequence. The
+     * change waits for readers which keep failing to finish first.
+     */
+    void begin_write()
+    {
+        if (reclaimer_) {
+            while (__atomic_load_n(&starving_, __ATOMIC_ACQUIRE))
+                sched_yield();
+            __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+    }
+
+    /// Marks the end of a change in concurrent mode.
+    void end_write()
+    {
+        if (reclaimer_) {
+            __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELEASE);
+            if (reclaimer_->pending())
+                reclaimer_->reclaim();
+        }
+    }
+
+    /// Brackets a change with begin_write and end_write.
+    class write_section {
+      public:
+        /// Begins a change of trie.
+        explicit write_section(double_trie *trie)
+            :trie_(trie)
+        {
+            trie_->begin_write();
+        }
+
+        /// Ends the change.
+        ~write_section()
+        {
+            trie_->end_write();
+        }
+
+      private:
+        double_trie *trie_;  ///< The trie being changed.
+    };
+
+    /**
+     * Retries optimistic reads in concurrent mode. Readers never wait
+     * for a change in progress; a reader which failed kPatientReads
+     * times holds off the next change until it is done, so readers make
+     * progress however busy the writer is.
+     */
+    class read_section {
+      public:
+        /// Number of failed reads before holding off changes.
+        static const int kPatientReads = 8;
+
+        /// Begins reading trie.
+        explicit read_section(const double_trie *trie)
+            :trie_(trie), failures_(0)
+        {
+        }
+
+        /// Ends reading.
+        ~read_section()
+        {
+            if (failures_ >= kPatientReads)
+                __atomic_sub_fetch(&trie_->starving_, 1, __ATOMIC_RELEASE);
+        }
+
+        /// Returns a sequence to be validated after reading.
+        uint64_t begin() const
+        {
+            return __atomic_load_n(&trie_->sequence_, __ATOMIC_ACQUIRE);
+        }
+
+        /// Notes a read which failed validation.
+        void retry()
+        {
+            if (++failures_ == kPatientReads)
+                __atomic_add_fetch(&trie_->starving_, 1, __ATOMIC_ACQ_REL);
+            if (failures_ >= kPatientReads)  // let the writer finish
+                sched_yield();
+        }
+
+      private:
+        const double_trie *trie_;  ///< The trie being read.
+        int failures_;             ///< Number of failed reads.
+    };
+
+    /**
+     * Returns true if nothing changed since read_section::begin returns
+     * sequence and no change was in progress then.
+     */
+    bool validate_read(uint64_t sequence) const
+    {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return !(sequence & 1)
+               && __atomic_load_n(&sequence_, __ATOMIC_RELAXED) == sequence;
     }
 
+    /// Searches a key already in codes of alphabet_.
+    bool search_codes(const key_type &key, value_type *value) const;
+
+    /**
+     * Searches once in concurrent mode.
+     *
+     * @return 1 if found, 0 if not found and -1 if a retry is needed.
+     */
+    int sync_search(const key_type &key, value_type *value,
+                    uint64_t sequence) const;
+
+    /**
+     * Collects keys in the subtree of front trie state s in concurrent
+     * mode, the same as prefix_search_aux.
+     *
+     * @return false if a retry is needed.
+     */
+    bool sync_collect(size_type s, const char_type *miss, key_type *store,
+                      leaf_visitor *visitor, uint64_t sequence) const;
+
+    /**
+     * Prefix-searches once in concurrent mode.
+     *
+     * @return false if a retry is needed.
+     */
+    bool sync_prefix_search(const key_type &key, result_sink *sink,
+                            uint64_t sequence) const;
+
+    /// Completes keys found in front trie, see prefix_search.
+    class front_visitor;
+
+    /// Prefix-searches into sink.
+    size_t prefix_search_sink(const key_type &key, result_sink *sink) const;
+
+    /**
+     * Appends the rear part of a separated state to key, and appends
+     * key to sink if it matches the rest of the prefix.
+     *
+     * @param key Key found in front trie.
+     * @param i Index of the separated state.
+     * @param miss Rest of the prefix.
+     * @param sink Output.
+     */
+    void append_rear(key_type *key, size_type i, const char_type *miss,
+                     result_sink *sink) const;
+
+    /**
+     * Does append_rear in concurrent mode.
+     *
+     * @return false if a retry is needed.
+     */
+    bool sync_append_rear(key_type *key, size_type i, const char_type *miss,
+                          result_sink *sink, uint64_t sequence) const;
+
+    /**
+     * Appends the key of the (i)th index to sink if its rear part is a
+     * prefix of the rest of key, see common_prefix_search.
+     *
+     * @param key Key being searched.
+     * @param rest Rest of key not matched in front trie.
+     * @param i Index of the separated state.
+     * @param sink Output.
+     */
+    void append_common_rear(const key_type &key, const char_type *rest,
+                            size_type i, result_sink *sink) const;
+
+    /**
+     * Does common_prefix_search once in concurrent mode.
+     *
+     * @return false if a retry is needed.
+     */
+    bool sync_common_prefix_search(const key_type &key, result_sink *sink,
+                                   uint64_t sequence) const;
+
     /**
       * Sets a accept state for a separated state.
       *
@@ -714,11 +2354,11 @@ class double_trie: public trie {
 
         if (refer_.find(t) != refer_.end() && refer_[t].referer.size()) {
             i = find_index_entry(s);
-            index_[i].index = refer_[t].accept_index;
+            set_index_accept(i, refer_[t].accept_index);
         } else {
             i = find_index_entry(s);
             size_type acc = find_accept_entry(i);
-            accept_[acc].accept = t;
+            set_accept_state(acc, t);
             assert(acc > 0 && acc < header_->accept_size);
             refer_[t].accept_index = acc;
         }
@@ -753,10 +2393,11 @@ class double_trie: public trie {
                 ++next_index_;
             }
             if (next >= header_->index_size) {
-                size_type nsize = (((next * 2) >> 12) + 1) << 12;
-                index_ = resize(index_, header_->index_size, nsize);
+                size_type nsize = grow_size(header_->index_size,
+                                            next - header_->index_size + 1);
+                grow_array(&index_, &header_->index_size, nsize, reclaimer_,
+                           index_cow_);
                 assert(index_[next].index == 0);
-                header_->index_size = nsize;
             }
             lhs_->set_base(s, -next);
         }
@@ -780,11 +2421,12 @@ class double_trie: public trie {
                 ++next_accept_;
             }
             if (next >= header_->accept_size) {
-                size_type nsize = (((next * 2) >> 12) + 1) << 12;
-                accept_ = resize(accept_, header_->accept_size, nsize);
-                header_->accept_size = nsize;
+                size_type nsize = grow_size(header_->accept_size,
+                                            next - header_->accept_size + 1);
+                grow_array(&accept_, &header_->accept_size, nsize,
+                           reclaimer_, accept_cow_);
             }
-            index_[i].index = next;
+            set_index_accept(i, next);
         }
         return index_[i].index;
     }
@@ -857,7 +2499,7 @@ class double_trie: public trie {
     void relocate_rear(size_type s, size_type t)
     {
         if (refer_.find(s) != refer_.end()) {
-            accept_[refer_[s].accept_index].accept = t;
+            set_accept_state(refer_[s].accept_index, t);
             refer_[t] = refer_[s];
             free_accept_entry(s);
         }
@@ -877,7 +2519,7 @@ class double_trie: public trie {
             if (s > 0 && count_referer(s) == 0) {
                 if (refer_[s].accept_index < header_->accept_size) {
                     if (refer_[s].accept_index > 0) {
-                        accept_[refer_[s].accept_index].accept = 0;
+                        set_accept_state(refer_[s].accept_index, 0);
                         free_accept_.push_back(refer_[s].accept_index);
                     }
                 }
@@ -887,16 +2529,14 @@ class double_trie: public trie {
     }
 
   private:
+    /// Constructs an empty snapshot holding memory in snapshot.
+    explicit double_trie(cow_snapshot *snapshot);
+
     /// Represents a separated state index.
-    typedef struct {
-        size_type accept;
-    } accept_type;
+    typedef two_trie_archive::accept_type accept_type;
 
     /// Represents a index to accept_type.
-    typedef struct {
-        value_type data;
-        size_type index;
-    } index_type;
+    typedef two_trie_archive::index_type index_type;
 
     /// Represents a back reference from accept state to
     /// separated state.
@@ -920,6 +2560,9 @@ class double_trie: public trie {
     /// Accept state back reference.
     std::map<size_type, refer_type> refer_;
 
+    /// Variable-length payloads.
+    payload_store payload_;
+
     /// Temporary buffer for storing exising char_types while inserting.
     std::vector<char_type> exists_;
 
@@ -944,8 +2587,51 @@ class double_trie: public trie {
     /// Length of mmapped buffer
     size_t mmap_size_;
 
+    /// Ownership of header_, index_ and accept_.
+    bool owner_;
+
+    /// True if index_ and accept_ are bit-packed in archive.
+    bool packed_;
+
+    /// True if the archive keeps keys only, see ARCHIVE_SET.
+    bool set_;
+
+    /// Accept states linked from each index, in a flat set archive.
+    const size_type *links_;
+
+    /// Reclaimer of replaced arrays, non-NULL in concurrent mode.
+    epoch_reclaimer *reclaimer_;
+
+    /// Sequence of changes, odd while a change is in progress.
+    uint64_t sequence_;
+
+    /// Number of readers holding off changes, see read_section.
+    mutable int starving_;
+
+    /// Bit-packed columns of index_ and accept_.
+    packed_array data_column_, index_column_, accept_column_;
+
+    /// Codes of bytes in keys, if remapped.
+    alphabet alphabet_;
+
+    /// Filter of keys of the archive, if loaded with one.
+    key_filter filter_;
+
+    /// Shared memory holding index_ and accept_ once a snapshot is taken.
+    cow_array *index_cow_, *accept_cow_;
+
+    /// Memory of a snapshot, non-NULL if this is a snapshot.
+    cow_snapshot *snapshot_;
+
     /// Archive magic.
     static const char magic_[16];
+
+    /// Option in archive header, set if an alphabet section follows.
+    static const int32_t kAlphabetOption = two_trie_archive::kAlphabetOption;
+
+    /// Option in archive header, set if a code point section follows.
+    static const int32_t kUtf8AlphabetOption =
+        two_trie_archive::kUtf8AlphabetOption;
 };
 
 /**
@@ -963,7 +2649,11 @@ class single_trie: public trie
     typedef struct {
         char magic[16];  ///< Archive magic.
         size_type suffix_size;  ///< Size of suffix buffer.
-        char unused[44];  ///< for 32/64 bits compatible.
+        size_type payload_count; ///< Number of payloads.
+        size_type payload_size;  ///< Length of payload data.
+        int32_t options;  ///< Archive options, see archive_option.
+        /// for 32/64 bits compatible.
+        char unused[44 - 3 * sizeof(size_type)];
     } header_type;
 
     /**
@@ -993,13 +2683,33 @@ class single_trie: public trie
      */
     explicit single_trie(const char *filename);
 
+    /**
+     * Constructs a single_trie using an archive already in memory. The
+     * memory is not owned by the single_trie and must outlive it.
+     *
+     * @param archive Pointer to the archive data.
+     * @param size Length of the archive data.
+     */
+    single_trie(void *archive, size_t size);
+
     /// Destructs a single_trie.
     ~single_trie();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
+    size_t prefix_search(const key_type &key, result_buffer *result) const;
+    size_t common_prefix_search(const key_type &key,
+                                result_buffer *result) const;
     void build(const char *filename, bool verbose);
+    void relayout(const std::vector<std::string> *samples = NULL);
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    bool erase(const key_type &key);
+    trie *snapshot();
+    void stats(stats_type *stats) const;
 
     /// Returns a pointer to the trie of single_trie.
     const basic_trie *trie()
@@ -1019,17 +2729,21 @@ class single_trie: public trie
         size_type i;
         for (i = start; i < header_->suffix_size && i < count; i++) {
             if (suffix_[i] == key_type::kTerminator)
-                fprintf(stderr, "[%d:#]", i);
+                fprintf(stderr, "[%ld:#]", static_cast<long>(i));
             else if (isgraph(key_type::char_out(suffix_[i])))
-                fprintf(stderr, "[%d:%c]",
-                        i, key_type::char_out(suffix_[i]));
+                fprintf(stderr, "[%ld:%c]", static_cast<long>(i),
+                        key_type::char_out(suffix_[i]));
             else
-                fprintf(stderr, "[%d:%x]", i, suffix_[i]);
+                fprintf(stderr, "[%ld:%lx]", static_cast<long>(i),
+                        static_cast<long>(suffix_[i]));
         }
         printf("\n");
     }
 
   protected:
+    /// Sets up all pointers from an archive in memory.
+    void load(void *archive, size_t size);
+
     /**
      * Resizes suffix to expected size
      *
@@ -1037,10 +2751,17 @@ class single_trie: public trie
      */
     void resize_suffix(size_type size)
     {
-        // align with 4k
-        size_type nsize = (((header_->suffix_size * 2 + size) >> 12) + 1) << 12;
-        suffix_ = resize(suffix_, header_->suffix_size, nsize);
-        header_->suffix_size = nsize;
+        size_type nsize = grow_size(header_->suffix_size, size);
+        grow_array(&suffix_, &header_->suffix_size, nsize,
+                   static_cast<epoch_reclaimer *>(NULL), suffix_cow_);
+    }
+
+    /// Sets the (i)th element of suffix.
+    void set_suffix(size_type i, suffix_type val)
+    {
+        if (suffix_cow_)
+            suffix_cow_->touch(&suffix_[i]);
+        suffix_[i] = val;
     }
 
     /**
@@ -1065,6 +2786,77 @@ class single_trie: public trie
      */
     void insert_suffix(size_type s, const char_type *inputs, value_type value);
 
+    /**
+     * Allocates a run of suffix, reusing freed runs first.
+     *
+     * @param length Length of the run.
+     * @return Offset of the run.
+     */
+    size_type alloc_suffix(size_type length)
+    {
+        std::set<std::pair<size_type, size_type> >::iterator
+            found(free_suffix_.lower_bound(std::make_pair(length, 0)));
+        size_type offset;
+        if (found != free_suffix_.end()) {
+            size_type rest = found->first - length;
+            offset = found->second;
+            free_suffix_.erase(found);
+            free_run_.erase(offset);
+            if (rest > 0)
+                add_free_run(offset + length, rest);
+            return offset;
+        }
+        if (next_suffix_ + length >= header_->suffix_size)
+            resize_suffix(next_suffix_ + length);
+        offset = next_suffix_;
+        next_suffix_ += length;
+        return offset;
+    }
+
+    /**
+     * Frees a run of suffix. Adjacent free runs are merged so that
+     * churn does not break suffix into pieces too small to reuse.
+     *
+     * @param offset Offset of the run.
+     * @param length Length of the run.
+     */
+    void free_suffix(size_type offset, size_type length)
+    {
+        if (length == 0)
+            return;
+        std::map<size_type, size_type>::iterator it;
+        it = free_run_.find(offset + length);
+        if (it != free_run_.end()) {  // merge the following run
+            length += it->second;
+            remove_free_run(it);
+        }
+        it = free_run_.lower_bound(offset);
+        if (it != free_run_.begin()
+            && (--it)->first + it->second == offset) {  // and the previous
+            offset = it->first;
+            length += it->second;
+            remove_free_run(it);
+        }
+        if (offset + length == next_suffix_)
+            next_suffix_ = offset;
+        else
+            add_free_run(offset, length);
+    }
+
+    /// Records a free run of suffix in both indexes.
+    void add_free_run(size_type offset, size_type length)
+    {
+        free_run_[offset] = length;
+        free_suffix_.insert(std::make_pair(length, offset));
+    }
+
+    /// Forgets a free run of suffix in both indexes.
+    void remove_free_run(std::map<size_type, size_type>::iterator run)
+    {
+        free_suffix_.erase(std::make_pair(run->second, run->first));
+        free_run_.erase(run);
+    }
+
     /**
      * Creates a branch in trie. This function creates a branch in trie
      * when there are common part between newly inserting key and an
@@ -1076,12 +2868,51 @@ class single_trie: public trie
      */
     void create_branch(size_type s, const char_type *inputs, value_type value);
 
+    /// Completes keys found in trie, see prefix_search.
+    class suffix_visitor;
+
+    /// Prefix-searches into sink.
+    size_t prefix_search_sink(const key_type &key, result_sink *sink) const;
+
+    /**
+     * Appends the suffix starting at start to key, and appends key to
+     * sink if it matches the rest of the prefix.
+     *
+     * @param key Key found in trie.
+     * @param start Offset of the suffix.
+     * @param miss Rest of the prefix.
+     * @param sink Output.
+     */
+    void append_suffix(key_type *key, size_type start, const char_type *miss,
+                       result_sink *sink) const;
+
+    /**
+     * Compacts trie and suffix into a set archive. Values are dropped,
+     * so each suffix keeps its chars and terminator only, and keys
+     * ending in trie share the terminator at offset 1.
+     *
+     * @param[out] suffix Suffix of the set.
+     * @param[out] states States of the set.
+     */
+    void compact_set(std::vector<suffix_type> *suffix,
+                     std::vector<basic_trie::state_type> *states) const;
+
   private:
+    /// Constructs an empty snapshot holding memory in snapshot.
+    explicit single_trie(cow_snapshot *snapshot);
+
     basic_trie *trie_;      ///< Pointer to trie.
     suffix_type *suffix_;   ///< Pointer to suffix.
     header_type *header_;   ///< Pointer to header
     size_type next_suffix_; ///< Next available suffix
 
+    /// Freed runs of suffix, as (length, offset) for best fit.
+    std::set<std::pair<size_type, size_type> > free_suffix_;
+    /// Freed runs of suffix, as (offset, length) for merging.
+    std::map<size_type, size_type> free_run_;
+
+    payload_store payload_; ///< Variable-length payloads.
+
     /**
      * Temporary buffer to store common part betwee newly
      * inserting key and an existing one
@@ -1090,6 +2921,14 @@ class single_trie: public trie
 
     void *mmap_;
     size_t mmap_size_;
+    bool owner_;  ///< Ownership of header_, suffix_ and common_.
+    bool set_;    ///< True if the archive keeps keys only.
+
+    /// Shared memory holding suffix_ once a snapshot is taken.
+    cow_array *suffix_cow_;
+
+    /// Memory of a snapshot, non-NULL if this is a snapshot.
+    cow_snapshot *snapshot_;
 
     /// Archive magic
     static const char magic_[16];
@@ -0,0 +1,424 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#include "trie.h"
+#include "trie_server.h"
+
+using namespace dutil;
+
+/// Bytes of responses pending on a connection before it stops reading.
+static const size_t kHighWater = 4 << 20;
+
+/// Represents a client connection, owned by one worker.
+typedef struct {
+    int fd;
+    std::string input;     ///< Bytes received, from consumed on.
+    size_t consumed;       ///< Bytes of input handled.
+    std::string output;    ///< Responses, from written on.
+    size_t written;        ///< Bytes of output sent.
+    uint32_t events;       ///< Events being waited for.
+} connection_type;
+
+/// Represents a worker thread running its own event loop.
+typedef struct {
+    const trie *dict;
+    int epoll_fd;
+    pthread_t thread;
+} worker_type;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+    stopping = 1;
+}
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/// Appends the answer of a query to a response.
+static void answer(const trie *dict, int op, const char *query,
+                   uint32_t length, trie::key_type *key,
+                   trie::result_buffer *result, std::string *output)
+{
+    trie::value_type value;
+    size_t i;
+
+    result->clear();
+    if (op == EXACT_QUERY) {
+        if (dict->search(query, length, &value)) {
+            put_uint32(output, 1);
+            put_uint32(output, value);
+        } else {
+            put_uint32(output, 0);
+        }
+        return;
+    }
+    key->assign(query, length);
+    if (op == PREFIX_QUERY) {
+        dict->prefix_search(*key, result);
+    } else {
+        // a prefix of the query is shorter, so they come in byte order
+        dict->common_prefix_search(*key, result);
+    }
+    put_uint32(output, result->size());
+    for (i = 0; i < result->size(); i++) {
+        put_uint32(output, result->value(i));
+        put_uint32(output, result->key_length(i));
+        const trie::char_type *p = result->key_data(i);
+        for (size_t j = 0; j < result->key_length(i); j++)
+            output->push_back(trie::key_type::char_out(p[j]));
+    }
+}
+
+/**
+ * Answers a request of a frame.
+ *
+ * @return false if the request is malformed.
+ */
+static bool handle_request(const trie *dict, const char *frame, size_t size,
+                           trie::key_type *key, trie::result_buffer *result,
+                           std::string *output)
+{
+    if (size < 5)
+        return false;
+    int op = static_cast<unsigned char>(frame[0]);
+    uint32_t count = get_uint32(frame + 1);
+    if (op < EXACT_QUERY || op > COMMON_PREFIX_QUERY)
+        return false;
+    size_t start = output->size(), offset = 5;
+    put_uint32(output, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        if (size - offset < 4)
+            return false;
+        uint32_t length = get_uint32(frame + offset);
+        offset += 4;
+        if (size - offset < length)
+            return false;
+        answer(dict, op, frame + offset, length, key, result, output);
+        offset += length;
+    }
+    if (offset != size)
+        return false;
+    uint32_t response = output->size() - start - 4;
+    for (size_t i = 0; i < 4; i++)
+        (*output)[start + i] = static_cast<char>(response >> (i * 8));
+    return true;
+}
+
+/// Sends pending output, returns false on error.
+static bool flush_output(connection_type *conn)
+{
+    while (conn->written < conn->output.size()) {
+        ssize_t n = send(conn->fd, conn->output.data() + conn->written,
+                         conn->output.size() - conn->written, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->written += n;
+    }
+    conn->output.clear();
+    conn->written = 0;
+    return true;
+}
+
+/// Answers complete requests received, returns false on a malformed one.
+static bool handle_input(const trie *dict, connection_type *conn,
+                         trie::key_type *key, trie::result_buffer *result)
+{
+    while (conn->output.size() - conn->written < kHighWater) {
+        size_t available = conn->input.size() - conn->consumed;
+        if (available < 4)
+            break;
+        const char *frame = conn->input.data() + conn->consumed;
+        size_t size = get_uint32(frame);
+        if (size > kMaxFrameSize)
+            return false;
+        if (available - 4 < size)
+            break;
+        if (!handle_request(dict, frame + 4, size, key, result,
+                            &conn->output))
+            return false;
+        conn->consumed += 4 + size;
+    }
+    if (conn->consumed > conn->input.size() / 2) {
+        conn->input.erase(0, conn->consumed);
+        conn->consumed = 0;
+    }
+    return true;
+}
+
+/// Tells if a complete request, or a malformed one, is buffered.
+static bool has_request(const connection_type *conn)
+{
+    size_t available = conn->input.size() - conn->consumed;
+    if (available < 4)
+        return false;
+    size_t size = get_uint32(conn->input.data() + conn->consumed);
+    return size > kMaxFrameSize || available - 4 >= size;
+}
+
+/// Reads what has arrived, returns false on error or end of stream.
+static bool read_input(connection_type *conn)
+{
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            conn->input.append(buffer, n);
+            if (static_cast<size_t>(n) < sizeof(buffer))
+                return true;
+        } else if (n == 0) {
+            return false;
+        } else if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
+
+static void close_connection(worker_type *worker, connection_type *conn)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    delete conn;
+}
+
+static void *run_worker(void *arg)
+{
+    worker_type *worker = static_cast<worker_type *>(arg);
+    trie::key_type key;
+    trie::result_buffer result;
+    epoll_event events[64];
+
+    for (;;) {
+        int n = epoll_wait(worker->epoll_fd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            connection_type *conn =
+                static_cast<connection_type *>(events[i].data.ptr);
+            bool ok = true;
+            // a connection over the high water is not read until drained
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                ok = read_input(conn);
+            if (ok && (events[i].events & EPOLLOUT))
+                ok = flush_output(conn);
+            // requests left over the high water are answered once the
+            // output drains, as no event may come for them
+            while (ok) {
+                ok = handle_input(worker->dict, conn, &key, &result)
+                     && flush_output(conn);
+                if (!conn->output.empty() || !has_request(conn))
+                    break;
+            }
+            if (!ok) {
+                close_connection(worker, conn);
+                continue;
+            }
+            bool pending = conn->written < conn->output.size();
+            uint32_t wanted = pending?EPOLLOUT:EPOLLIN;
+            if (pending && conn->output.size() - conn->written < kHighWater)
+                wanted |= EPOLLIN;
+            if (wanted != conn->events) {
+                epoll_event event;
+                event.events = wanted;
+                event.data.ptr = conn;
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+                conn->events = wanted;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int listen_on(const char *address)
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    int one = 1;
+
+    if (!parse_address(address, &storage, &length)) {
+        std::cerr << "bad address " << address << "." << std::endl;
+        exit(1);
+    }
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        if (storage.ss_family == AF_UNIX)
+            unlink(address);
+        else
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&storage), length)
+        || listen(fd, SOMAXCONN)) {
+        std::cerr << "can not listen on " << address << ": "
+                  << strerror(errno) << std::endl;
+        exit(1);
+    }
+    return fd;
+}
+
+static void help_message()
+{
+    std::cout << "Usage: trie_server [OPTIONS] archive\n"
+                 "Serves queries on an archive of libxtree\n"
+                 "OPTIONS:\n"
+                 "        -a|--address ADDRESS  listen on ADDRESS, a Unix socket\n"
+                 "                              path or [HOST:]PORT of TCP\n"
+                 "        -h|--help             help message\n"
+                 "        -n|--name NAME        use archive NAME in a bundle\n"
+                 "        -T|--threads NUMBER   worker threads\n"
+                 "        -v|--verbose          verbose\n"
+                 "\n"
+                 "Report bugs to jianing.yang@alibaba-inc.com\n"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *address = NULL, *name = NULL;
+    size_t threads = 1, i;
+    bool verbose = false;
+    trie_bundle *bundle = NULL;
+    trie *dict;
+
+    if (argc < 2) {
+        help_message();
+        exit(0);
+    }
+
+    while (true) {
+        static struct option long_options[] =
+        {
+            {"address", 1, 0, 'a'},
+            {"help", 0, 0, 'h'},
+            {"name", 1, 0, 'n'},
+            {"threads", 1, 0, 'T'},
+            {"verbose", 0, 0, 'v'},
+            {0, 0, 0, 0}
+        };
+        int option_index;
+        int c = getopt_long(argc, argv, "a:hn:T:v", long_options,
+                            &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'a':
+                address = optarg;
+                break;
+            case 'h':
+                help_message();
+                exit(0);
+            case 'n':
+                name = optarg;
+                break;
+            case 'T':
+                threads = strtoul(optarg, NULL, 10);
+                if (threads < 1) {
+                    std::cerr << "threads must be positive." << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'v':
+                verbose = true;
+                break;
+        }
+    }
+    if (optind >= argc || !address) {
+        help_message();
+        exit(1);
+    }
+
+    try {
+        if (name) {
+            bundle = new trie_bundle(argv[optind]);
+            if (!(dict = bundle->get(name))) {
+                std::cerr << name << " not found in bundle." << std::endl;
+                exit(1);
+            }
+        } else {
+            dict = trie::create_trie(argv[optind]);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    int listen_fd = listen_on(address);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // workers share the mapped archive, each with connections of its own,
+    // and leave stop signals to interrupt accept of this thread
+    std::vector<worker_type> workers(threads);
+    sigset_t signals, saved;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &saved);
+    for (i = 0; i < threads; i++) {
+        workers[i].dict = dict;
+        if ((workers[i].epoll_fd = epoll_create(64)) < 0) {
+            std::cerr << "epoll_create: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        int error = pthread_create(&workers[i].thread, NULL, run_worker,
+                                   &workers[i]);
+        if (error) {
+            std::cerr << "pthread_create: " << strerror(error) << std::endl;
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (verbose)
+        std::cerr << "listening on " << address << " with " << threads
+                  << " threads" << std::endl;
+
+    for (i = 0; !stopping; ) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                std::cerr << "accept: " << strerror(errno) << std::endl;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_nonblocking(fd);
+        connection_type *conn = new connection_type();
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        i = (i + 1) % threads;
+    }
+
+    // workers are left running, the process exits with them
+    close(listen_fd);
+    if (strchr(address, '/'))
+        unlink(address);
+    if (verbose)
+        std::cerr << "stopped." << std::endl;
+    exit(0);
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,109 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+#ifndef TRIE_SERVER_H_
+#define TRIE_SERVER_H_
+
+/*
+ * Protocol of trie_server.
+ *
+ * A connection carries frames, each a 32 bits little-endian size followed
+ * by that many bytes. A client may send any number of requests without
+ * waiting, and responses come back in the order of requests.
+ *
+ *   request  := size op:u8 count:u32 query{count}
+ *   query    := length:u32 byte{length}
+ *   response := size answer{count}
+ *   answer   := n:u32 value:i32{n}                    (exact query)
+ *             | n:u32 (value:i32 length:u32 byte{length}){n}
+ *                                                     (other queries)
+ *
+ * An exact answer has at most one value. Prefix and common-prefix answers
+ * carry the keys found, in the order of the trie. The server closes a
+ * connection on a malformed request.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <cstdlib>
+#include <string>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/// Represents a kind of query of trie_server.
+enum server_query_type {
+    EXACT_QUERY = 1,         /**< Value of the key. */
+    PREFIX_QUERY,            /**< Keys starting with the key. */
+    COMMON_PREFIX_QUERY      /**< Keys which the key starts with. */
+};
+
+/// Max size of a frame, larger requests are refused.
+static const size_t kMaxFrameSize = 64 << 20;
+
+/// Appends a 32 bits little-endian integer.
+inline void put_uint32(std::string *buffer, uint32_t number)
+{
+    char bytes[4] = {static_cast<char>(number),
+                     static_cast<char>(number >> 8),
+                     static_cast<char>(number >> 16),
+                     static_cast<char>(number >> 24)};
+    buffer->append(bytes, sizeof(bytes));
+}
+
+/// Reads a 32 bits little-endian integer.
+inline uint32_t get_uint32(const char *bytes)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(bytes);
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+/**
+ * Parses a server address, a Unix socket path if it contains a '/',
+ * otherwise [HOST:]PORT of TCP where HOST defaults to 127.0.0.1.
+ *
+ * @return false if the address is malformed.
+ */
+inline bool parse_address(const char *address, sockaddr_storage *storage,
+                          socklen_t *length)
+{
+    memset(storage, 0, sizeof(*storage));
+    if (strchr(address, '/')) {
+        sockaddr_un *un = reinterpret_cast<sockaddr_un *>(storage);
+        if (strlen(address) >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address);
+        *length = sizeof(*un);
+        return true;
+    }
+    sockaddr_in *in = reinterpret_cast<sockaddr_in *>(storage);
+    std::string host("127.0.0.1");
+    const char *port = strrchr(address, ':');
+    if (port) {
+        host.assign(address, port - address);
+        port++;
+    } else {
+        port = address;
+    }
+    char *end;
+    long number = strtol(port, &end, 10);
+    if (*end || number <= 0 || number > 65535
+        || inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1)
+        return false;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(static_cast<uint16_t>(number));
+    *length = sizeof(*in);
+    return true;
+}
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_SERVER_H_
+
+// vim: ts=4 sw=4 ai et
@@ -1,23 +1,121 @@
 // Copyright Jianing Yang <jianingy.yang@gmail.com>
+#include <ctype.h>
 #include <limits.h>
 #include <errno.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
 #include <iostream>
+#include <fstream>
 #include <stdexcept>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <deque>
 
 #include "trie.h"
+#include "trie_server.h"
 
 using namespace dutil;
 
+static trie *
+open_trie(const char *index, const char *name, trie_bundle **bundle)
+{
+    trie *mtrie;
+    *bundle = NULL;
+    if (name) {
+        *bundle = new trie_bundle(index);
+        if (!(mtrie = (*bundle)->get(name))) {
+            std::cerr << name << " not found in bundle." << std::endl;
+            delete *bundle;
+            exit(1);
+        }
+    } else {
+        mtrie = trie::create_trie(index);
+    }
+    return mtrie;
+}
+
+static void
+print_histogram(const char *title, const std::vector<size_t> &histogram)
+{
+    std::cout << title << ":";
+    for (size_t i = 0; i < histogram.size(); i++) {
+        if (histogram[i])
+            std::cout << " " << i << ":" << histogram[i];
+    }
+    std::cout << std::endl;
+}
+
 static void *
-query_trie(const char *query, const char *index, bool prefix, bool verbose)
+stats_trie(const char *index, const char *name)
+{
+    trie_bundle *bundle;
+    trie *mtrie = open_trie(index, name, &bundle);
+    trie::stats_type stats;
+    size_t i, total = 0;
+    char line[256];
+
+    mtrie->stats(&stats);
+    std::cout << "keys: " << stats.keys << std::endl;
+    snprintf(line, sizeof(line), "%-8s %12s %12s %7s %14s",
+             "array", "size", "used", "fill", "bytes");
+    std::cout << line << std::endl;
+    for (i = 0; i < stats.arrays.size(); i++) {
+        const trie::array_stats_type &array = stats.arrays[i];
+        snprintf(line, sizeof(line), "%-8s %12lu %12lu %6.2f%% %14lu",
+                 array.name, static_cast<unsigned long>(array.size),
+                 static_cast<unsigned long>(array.used),
+                 array.size?100.0 * array.used / array.size:0.0,
+                 static_cast<unsigned long>(array.bytes));
+        std::cout << line << std::endl;
+        total += array.bytes;
+    }
+    std::cout << "total bytes: " << total << std::endl;
+    if (stats.rear_suffixes) {
+        snprintf(line, sizeof(line), "rear sharing: %lu keys on %lu "
+                 "suffixes, %.2f keys per suffix",
+                 static_cast<unsigned long>(stats.rear_references),
+                 static_cast<unsigned long>(stats.rear_suffixes),
+                 static_cast<double>(stats.rear_references)
+                 / stats.rear_suffixes);
+        std::cout << line << std::endl;
+    }
+    std::cout << "free lists:";
+    for (i = 0; i < stats.free_lists.size(); i++)
+        std::cout << " " << stats.free_lists[i].first << ":"
+                  << stats.free_lists[i].second;
+    std::cout << std::endl;
+    if (!stats.heap.empty()) {
+        std::cout << "builder heap bytes:";
+        for (i = 0; i < stats.heap.size(); i++)
+            std::cout << " " << stats.heap[i].first << ":"
+                      << stats.heap[i].second;
+        std::cout << std::endl;
+    }
+    print_histogram("out-degree", stats.out_degree);
+    print_histogram("depth", stats.depth);
+    if (bundle)
+        delete bundle;
+    else
+        delete mtrie;
+    exit(0);
+}
+
+static void *
+query_trie(const char *query, const char *index, const char *name,
+           bool prefix, bool verbose)
 {
     int retval = 0;
     trie::value_type value;
-    trie *mtrie = trie::create_trie(index);
+    trie_bundle *bundle;
+    trie *mtrie = open_trie(index, name, &bundle);
     trie::key_type key(query, strlen(query));
     if (prefix) {
         trie::result_type result;
@@ -33,15 +131,474 @@ query_trie(const char *query, const char *index, bool prefix, bool verbose)
             retval = 1;
         }
     }
-    delete mtrie;
+    if (bundle)
+        delete bundle;
+    else
+        delete mtrie;
     exit(retval);
 }
 
+/// Number of queries read and answered at a time.
+static const size_t kBatchSize = 65536;
+
+/// Max length of a length-prefixed query, longer ones are refused.
+static const size_t kMaxQueryLength = 1 << 20;
+
+/// Represents a query as offset and length in the batch storage.
+typedef std::pair<size_t, size_t> query_type;
+
+/// Hands batches to worker threads which live through all batches.
+typedef struct {
+    pthread_barrier_t start;            ///< Passed when a batch is ready.
+    pthread_barrier_t finish;           ///< Passed when it is answered.
+    bool finished;                      ///< No batch is left.
+    void *(*answer)(void *);            ///< Answers a slice of a batch.
+} batch_feed_type;
+
+/// Represents a slice of a batch answered by one thread.
+typedef struct {
+    batch_feed_type *feed;
+    const trie *dict;
+    int fd;                             ///< Connection to server, if any.
+    const std::string *storage;
+    const std::vector<query_type> *queries;
+    size_t begin, end;
+    int op;                             ///< A server_query_type.
+    size_t batch;                       ///< Queries per request.
+    size_t depth;                       ///< Requests in flight.
+    std::string output;
+    std::vector<uint64_t> latencies;    ///< Of requests, in nanoseconds.
+} batch_job_type;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void append_number(std::string *output, long number)
+{
+    char buf[32];
+    int length = snprintf(buf, sizeof(buf), "%ld", number);
+    output->append(buf, length);
+}
+
+static void *answer_queries(void *arg)
+{
+    batch_job_type *job = static_cast<batch_job_type *>(arg);
+    trie::key_type key;
+    trie::result_buffer result;
+    trie::value_type value;
+    std::string &output = job->output;
+
+    output.clear();
+    for (size_t i = job->begin; i < job->end; i++) {
+        const query_type &query = (*job->queries)[i];
+        const char *data = job->storage->data() + query.first;
+        key.assign(data, query.second);
+        if (job->op == EXACT_QUERY) {
+            if (job->dict->search(key, &value))
+                append_number(&output, value);
+            else
+                output.push_back('-');
+            output.push_back('\n');
+            continue;
+        }
+        // results of a prefix end with an empty line
+        result.clear();
+        if (job->op == PREFIX_QUERY) {
+            job->dict->prefix_search(key, &result);
+        } else {
+            job->dict->common_prefix_search(key, &result);
+        }
+        for (size_t j = 0; j < result.size(); j++) {
+            append_number(&output, result.value(j));
+            output.push_back(' ');
+            output.append(result.key_string(j));
+            output.push_back('\n');
+        }
+        output.push_back('\n');
+    }
+    return NULL;
+}
+
+/**
+ * Decodes a response of trie_server into lines as answer_queries does.
+ *
+ * @return false if the response is malformed.
+ */
+static bool decode_response(const char *frame, size_t size, int op,
+                            size_t count, std::string *output)
+{
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (size - offset < 4)
+            return false;
+        uint32_t n = get_uint32(frame + offset);
+        offset += 4;
+        if (op == EXACT_QUERY) {
+            if (n > 1 || size - offset < 4 * n)
+                return false;
+            if (n)
+                append_number(output, static_cast<int32_t>(
+                                          get_uint32(frame + offset)));
+            else
+                output->push_back('-');
+            output->push_back('\n');
+            offset += 4 * n;
+            continue;
+        }
+        for (uint32_t j = 0; j < n; j++) {
+            if (size - offset < 8)
+                return false;
+            int32_t value = get_uint32(frame + offset);
+            uint32_t length = get_uint32(frame + offset + 4);
+            offset += 8;
+            if (size - offset < length)
+                return false;
+            append_number(output, value);
+            output->push_back(' ');
+            output->append(frame + offset, length);
+            output->push_back('\n');
+            offset += length;
+        }
+        output->push_back('\n');
+    }
+    return offset == size;
+}
+
+/**
+ * Sends a slice of a batch to trie_server, keeping up to depth requests
+ * in flight, and decodes the responses in order.
+ */
+static void *ask_server(void *arg)
+{
+    batch_job_type *job = static_cast<batch_job_type *>(arg);
+    std::string request, input;
+    size_t sent = 0, next = job->begin;
+    // start time and number of queries of requests in flight
+    std::deque<std::pair<uint64_t, size_t> > flight;
+    char buffer[65536];
+
+    job->output.clear();
+    job->latencies.clear();
+    while (next < job->end || !flight.empty()) {
+        while (flight.size() < job->depth && next < job->end) {
+            size_t count = std::min(job->batch, job->end - next);
+            size_t start = request.size();
+            put_uint32(&request, 0);
+            request.push_back(static_cast<char>(job->op));
+            put_uint32(&request, count);
+            for (size_t i = next; i < next + count; i++) {
+                const query_type &query = (*job->queries)[i];
+                put_uint32(&request, query.second);
+                request.append(job->storage->data() + query.first,
+                               query.second);
+            }
+            uint32_t size = request.size() - start - 4;
+            for (size_t i = 0; i < 4; i++)
+                request[start + i] = static_cast<char>(size >> (i * 8));
+            flight.push_back(std::make_pair(now(), count));
+            next += count;
+        }
+        struct pollfd event = {job->fd, POLLIN, 0};
+        if (sent < request.size())
+            event.events |= POLLOUT;
+        if (poll(&event, 1, -1) < 0)
+            continue;
+        if (event.revents & POLLOUT) {
+            ssize_t n = send(job->fd, request.data() + sent,
+                             request.size() - sent, MSG_NOSIGNAL);
+            if (n > 0 && (sent += n) == request.size()) {
+                request.clear();
+                sent = 0;
+            }
+        }
+        if (!(event.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        ssize_t n = recv(job->fd, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            std::cerr << "connection closed by server." << std::endl;
+            exit(1);
+        }
+        if (n > 0)
+            input.append(buffer, n);
+        size_t consumed = 0;
+        while (input.size() - consumed >= 4) {
+            size_t size = get_uint32(input.data() + consumed);
+            if (input.size() - consumed - 4 < size)
+                break;
+            if (!decode_response(input.data() + consumed + 4, size, job->op,
+                                 flight.front().second, &job->output)) {
+                std::cerr << "malformed response." << std::endl;
+                exit(1);
+            }
+            job->latencies.push_back(now() - flight.front().first);
+            flight.pop_front();
+            consumed += 4 + size;
+        }
+        input.erase(0, consumed);
+    }
+    return NULL;
+}
+
+static int connect_server(const char *address)
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    int one = 1;
+
+    if (!parse_address(address, &storage, &length)) {
+        std::cerr << "bad address " << address << "." << std::endl;
+        exit(1);
+    }
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0
+        || connect(fd, reinterpret_cast<sockaddr *>(&storage), length)) {
+        std::cerr << "can not connect to " << address << ": "
+                  << strerror(errno) << std::endl;
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Reads up to kBatchSize queries, either one per line or each after
+ * its length as a 32 bits little-endian integer.
+ *
+ * @return false if there is nothing more to read.
+ */
+static bool read_batch(FILE *in, bool length_prefixed, std::string *storage,
+                       std::vector<query_type> *queries)
+{
+    static char *line = NULL;
+    static size_t capacity = 0;
+
+    storage->clear();
+    queries->clear();
+    while (queries->size() < kBatchSize) {
+        if (length_prefixed) {
+            unsigned char header[4];
+            if (fread(header, sizeof(header), 1, in) != 1)
+                break;
+            size_t length = get_uint32(reinterpret_cast<char *>(header));
+            if (length > kMaxQueryLength) {
+                std::cerr << "query of " << length << " bytes is too long."
+                          << std::endl;
+                exit(1);
+            }
+            size_t offset = storage->size();
+            storage->resize(offset + length);
+            if (length && fread(&(*storage)[offset], length, 1, in) != 1) {
+                std::cerr << "truncated query." << std::endl;
+                exit(1);
+            }
+            queries->push_back(query_type(offset, length));
+        } else {
+            ssize_t length = getline(&line, &capacity, in);
+            if (length < 0)
+                break;
+            if (length > 0 && line[length - 1] == '\n')
+                length--;
+            queries->push_back(query_type(storage->size(), length));
+            storage->append(line, length);
+        }
+    }
+    return !queries->empty();
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)] / 1e3;
+}
+
+/// Answers slices of batches fed to a worker thread until finished.
+static void *feed_worker(void *arg)
+{
+    batch_job_type *job = static_cast<batch_job_type *>(arg);
+    batch_feed_type *feed = job->feed;
+    for (;;) {
+        pthread_barrier_wait(&feed->start);
+        if (feed->finished)
+            break;
+        feed->answer(job);
+        pthread_barrier_wait(&feed->finish);
+    }
+    return NULL;
+}
+
+/**
+ * Answers queries of a file by an archive, or by trie_server at server
+ * with one connection per thread, and reports throughput and latency
+ * of requests of the server.
+ */
 static void *
-build_trie(const char *source, const char *index, trie::trie_type type, bool verbose)
+stream_trie(const char *query_file, const char *index, const char *name,
+            const char *server, int op, bool length_prefixed,
+            size_t threads, size_t batch, size_t depth)
+{
+    trie_bundle *bundle = NULL;
+    trie *mtrie = server?NULL:open_trie(index, name, &bundle);
+    FILE *in = strcmp(query_file, "-")?fopen(query_file, "r"):stdin;
+    std::string storage;
+    std::vector<query_type> queries;
+    std::vector<batch_job_type> jobs(threads);
+    std::vector<pthread_t> workers(threads);
+    std::vector<uint64_t> latencies;
+    batch_feed_type feed;
+    static char out_buffer[1 << 20];
+    size_t i, total = 0;
+
+    if (!in) {
+        std::cerr << "can not open " << query_file << std::endl;
+        exit(1);
+    }
+    feed.finished = false;
+    feed.answer = server?ask_server:answer_queries;
+    pthread_barrier_init(&feed.start, NULL, threads);
+    pthread_barrier_init(&feed.finish, NULL, threads);
+    // archives are safe to be read by many threads, and the calling
+    // thread answers the first slice of every batch
+    for (i = 0; i < threads; i++) {
+        jobs[i].feed = &feed;
+        jobs[i].dict = mtrie;
+        jobs[i].fd = server?connect_server(server):-1;
+        jobs[i].storage = &storage;
+        jobs[i].queries = &queries;
+        jobs[i].op = op;
+        jobs[i].batch = batch;
+        jobs[i].depth = depth;
+        int error = i > 0?pthread_create(&workers[i], NULL, feed_worker,
+                                         &jobs[i]):0;
+        if (error) {
+            std::cerr << "can not create thread: " << strerror(error)
+                      << std::endl;
+            exit(1);
+        }
+    }
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    uint64_t start = now();
+    while (read_batch(in, length_prefixed, &storage, &queries)) {
+        size_t step = (queries.size() + threads - 1) / threads;
+        for (i = 0; i < threads; i++) {
+            jobs[i].begin = std::min(queries.size(), i * step);
+            jobs[i].end = std::min(queries.size(), (i + 1) * step);
+        }
+        pthread_barrier_wait(&feed.start);
+        feed.answer(&jobs[0]);
+        pthread_barrier_wait(&feed.finish);
+        for (i = 0; i < threads; i++) {
+            fwrite(jobs[i].output.data(), 1, jobs[i].output.size(), stdout);
+            latencies.insert(latencies.end(), jobs[i].latencies.begin(),
+                             jobs[i].latencies.end());
+        }
+        total += queries.size();
+    }
+    feed.finished = true;
+    pthread_barrier_wait(&feed.start);
+    for (i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    pthread_barrier_destroy(&feed.start);
+    pthread_barrier_destroy(&feed.finish);
+    fflush(stdout);
+    double seconds = (now() - start) / 1e9;
+    if (server) {
+        char line[256];
+        std::sort(latencies.begin(), latencies.end());
+        snprintf(line, sizeof(line), "%lu queries in %.3fs, %.0f queries/s, "
+                 "%.0f requests/s\nrequest latency: p50 %.1fus  p90 %.1fus  "
+                 "p99 %.1fus  p999 %.1fus  max %.1fus",
+                 static_cast<unsigned long>(total), seconds,
+                 total / seconds, latencies.size() / seconds,
+                 percentile(latencies, 0.5), percentile(latencies, 0.9),
+                 percentile(latencies, 0.99), percentile(latencies, 0.999),
+                 percentile(latencies, 1.0));
+        std::cerr << line << std::endl;
+        for (i = 0; i < threads; i++)
+            close(jobs[i].fd);
+    }
+    if (in != stdin)
+        fclose(in);
+    if (bundle)
+        delete bundle;
+    else
+        delete mtrie;
+    exit(0);
+}
+
+static void
+read_samples(const char *filename, std::vector<std::string> *samples)
+{
+    std::ifstream log(filename);
+    std::string line;
+    if (!log.is_open()) {
+        std::cerr << "can not open " << filename << std::endl;
+        exit(1);
+    }
+    while (getline(log, line))
+        samples->push_back(line);
+}
+
+/// Counts bytes of keys in a source, in the format of read_from_text.
+static void
+count_bytes(const char *source, std::vector<size_t> *frequency)
+{
+    FILE *file = fopen(source, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    if (!file) {
+        std::cerr << "can not open " << source << std::endl;
+        exit(1);
+    }
+    frequency->assign(256, 0);
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        char *p = line, *end = line + length;
+        // skip the value and spaces before the key
+        while (p < end && !isspace(*p))
+            p++;
+        while (p < end && isspace(*p))
+            p++;
+        if (end > p && end[-1] == '\n')
+            end--;
+        for (; p < end; p++)
+            (*frequency)[static_cast<unsigned char>(*p)]++;
+    }
+    free(line);
+    fclose(file);
+}
+
+static void *
+build_trie(const char *source, const char *index, trie::trie_type type,
+           bool relayout, const char *layout_log, unsigned int options,
+           bool alphabet, bool verbose)
 {
     trie *mtrie = trie::create_trie(type);
+    mtrie->set_archive_options(options);
+    if (alphabet) {
+        std::vector<size_t> frequency;
+        if (type != trie::DOUBLE_TRIE) {
+            std::cerr << "alphabet is for two-trie only." << std::endl;
+            exit(1);
+        }
+        count_bytes(source, &frequency);
+        mtrie->set_alphabet(frequency);
+    }
     mtrie->read_from_text(source, verbose);
+    if (relayout || layout_log) {
+        std::vector<std::string> samples;
+        if (layout_log)
+            read_samples(layout_log, &samples);
+        if (verbose)
+            std::cerr << "relayout..." << std::endl;
+        mtrie->relayout(layout_log?&samples:NULL);
+    }
     if (verbose)
         std::cerr << "writing to disk..." << std::endl;
     mtrie->build(index, verbose);
@@ -51,16 +608,55 @@ build_trie(const char *source, const char *index, trie::trie_type type, bool ver
     exit(0);
 }
 
+static void *
+build_bundle(const trie_bundle::source_type &sources, const char *index,
+             bool verbose)
+{
+    trie_bundle::build(index, sources);
+    if (verbose) {
+        trie_bundle bundle(index);
+        for (size_t i = 0; i < bundle.size(); i++)
+            std::cerr << "bundled " << bundle.name(i) << std::endl;
+    }
+    exit(0);
+}
+
 static void help_message()
 {
     std::cout << "Usage: trie_tool [OPTIONS] archive\n"
                  "Utility to manage archive of libxtree \n"
                  "OPTIONS:\n"
+                 "        -a|--alphabet         remap bytes of keys by frequency\n"
+                 "                              in SOURCE, two-trie only\n"
                  "        -b|--build SOURCE     build from SOURCE\n"
+                 "        -B|--bundle NAME=ARCHIVE\n"
+                 "                              pack ARCHIVE into a bundle as NAME\n"
+                 "        -C|--common-prefix    common-prefix mode query, finds keys\n"
+                 "                              which are prefixes of query\n"
+                 "        -D|--depth NUMBER     requests in flight for --server\n"
+                 "        -F|--filter           add a filter of keys to two-trie\n"
+                 "                              archive, for fast misses\n"
+                 "        -f|--query-file FILE  lookup every line of FILE, or stdin\n"
+                 "                              if FILE is -, and write one line\n"
+                 "                              for each (- if not found)\n"
                  "        -h|--help             help message\n"
+                 "        -k|--batch NUMBER     queries per request for --server\n"
+                 "        -K|--set              keep keys only, values are dropped\n"
+                 "                              and found keys give 0\n"
+                 "        -l|--layout-log LOG   relayout guided by queries in LOG\n"
+                 "        -L|--length-prefixed  queries in FILE are each after its\n"
+                 "                              length in 4 bytes little-endian\n"
+                 "        -n|--name NAME        use archive NAME in a bundle\n"
                  "        -q|--query QUERY      lookup QUERY in archive\n"
                  "        -p|--prefix           prefix mode query\n"
+                 "        -P|--packed           bit-pack index of two-trie\n"
+                 "        -r|--relayout         relayout states for locality\n"
+                 "        -s|--stats            show structural statistics\n"
+                 "        -S|--server ADDRESS   send --query-file to trie_server\n"
+                 "                              and report its throughput\n"
                  "        -t|--type TYPE        archive type\n"
+                 "        -T|--threads NUMBER   threads or connections for\n"
+                 "                              --query-file\n"
                  "        -v|--verbose          verbose\n\n"
                  "SOURCE FORMAT:\n"
                  "        value word\n\n"
@@ -75,45 +671,133 @@ static void help_message()
 int main(int argc, char *argv[])
 {
     int c;
-    const char *index = NULL, *source = NULL, *query = NULL;
+    const char *index = NULL, *source = NULL, *query = NULL, *name = NULL;
+    trie_bundle::source_type bundle;
     trie::trie_type type = trie::DOUBLE_TRIE;
     bool verbose = false;
     bool prefix = false;
+    bool relayout = false;
+    bool alphabet = false;
+    unsigned int options = 0;
+    const char *layout_log = NULL;
     bool dump = false;
+    bool stats = false;
+    const char *query_file = NULL;
+    bool length_prefixed = false;
+    size_t threads = 1;
+    const char *server = NULL;
+    bool common_prefix = false;
+    size_t batch = 16, depth = 8;
 
     while (true) {
         static struct option long_options[] =
         {
+            {"alphabet", no_argument, 0, 'a'},
             {"build", required_argument, 0, 'b'},
+            {"bundle", required_argument, 0, 'B'},
+            {"common-prefix", no_argument, 0, 'C'},
+            {"depth", required_argument, 0, 'D'},
             {"dump", no_argument, 0, 'd'},
+            {"filter", no_argument, 0, 'F'},
+            {"query-file", required_argument, 0, 'f'},
             {"help", no_argument, 0, 'h'},
+            {"batch", required_argument, 0, 'k'},
+            {"set", no_argument, 0, 'K'},
+            {"length-prefixed", no_argument, 0, 'L'},
+            {"layout-log", required_argument, 0, 'l'},
+            {"name", required_argument, 0, 'n'},
             {"prefix", no_argument, 0, 'p'},
+            {"packed", no_argument, 0, 'P'},
             {"query", required_argument, 0, 'q'},
+            {"relayout", no_argument, 0, 'r'},
+            {"server", required_argument, 0, 'S'},
+            {"stats", no_argument, 0, 's'},
             {"type", required_argument, 0, 't'},
+            {"threads", required_argument, 0, 'T'},
             {"verbose", no_argument, 0, 'v'},
             {0, 0, 0, 0}
         };
         int option_index;
 
-        c = getopt_long(argc, argv, "b:dhpq:t:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "ab:B:CdD:f:Fhk:Kl:Ln:pPq:rsS:t:T:v", long_options, &option_index);
         if (c == -1) break;
 
         switch (c) {
             case 'h':
                 help_message();
                 return 0;
+            case 'a':
+                alphabet = true;
+                break;
             case 'b':
                 source = optarg;
                 break;
+            case 'B':
+                if (const char *eq = strchr(optarg, '=')) {
+                    bundle.push_back(std::make_pair(
+                        std::string(optarg, eq - optarg),
+                        std::string(eq + 1)));
+                } else {
+                    help_message();
+                    exit(0);
+                }
+                break;
+            case 'C':
+                common_prefix = true;
+                break;
             case 'd':
                 dump = true;
                 break;
+            case 'D':
+                depth = strtoul(optarg, NULL, 10);
+                if (depth < 1) {
+                    help_message();
+                    exit(0);
+                }
+                break;
+            case 'f':
+                query_file = optarg;
+                break;
+            case 'F':
+                options |= trie::ARCHIVE_FILTER;
+                break;
+            case 'k':
+                batch = strtoul(optarg, NULL, 10);
+                if (batch < 1) {
+                    help_message();
+                    exit(0);
+                }
+                break;
+            case 'K':
+                options |= trie::ARCHIVE_SET;
+                break;
+            case 'l':
+                layout_log = optarg;
+                break;
+            case 'L':
+                length_prefixed = true;
+                break;
+            case 'n':
+                name = optarg;
+                break;
             case 'p':
                 prefix = true;
                 break;
+            case 'P':
+                options |= trie::ARCHIVE_PACKED;
+                break;
             case 'q':
                 query = optarg;
                 break;
+            case 'r':
+                relayout = true;
+                break;
+            case 's':
+                stats = true;
+                break;
+            case 'S':
+                server = optarg;
+                break;
             case 't':
                 switch (atoi(optarg)) {
                     case 1:
@@ -127,20 +811,40 @@ int main(int argc, char *argv[])
                         exit(0);
                 }
                 break;
+            case 'T':
+                threads = strtoul(optarg, NULL, 10);
+                if (threads < 1) {
+                    help_message();
+                    exit(0);
+                }
+                break;
             case 'v':
                 verbose = true;
                 break;
         }
     }
 
+    int op = common_prefix?COMMON_PREFIX_QUERY
+             :prefix?PREFIX_QUERY:EXACT_QUERY;
+    if (server && query_file)
+        stream_trie(query_file, NULL, NULL, server, op, length_prefixed,
+                    threads, batch, depth);
     if (optind < argc) {
         index = argv[optind];
         if (source)
-            build_trie(source, index, type, verbose);
+            build_trie(source, index, type, relayout, layout_log, options,
+                       alphabet, verbose);
+        else if (!bundle.empty())
+            build_bundle(bundle, index, verbose);
+        else if (stats)
+            stats_trie(index, name);
+        else if (query_file)
+            stream_trie(query_file, index, name, NULL, op, length_prefixed,
+                        threads, batch, depth);
         else if (query)
-            query_trie(query, index, prefix, verbose);
+            query_trie(query, index, name, prefix, verbose);
         else if (dump)
-            query_trie("", index, true, verbose);
+            query_trie("", index, name, true, verbose);
     }
     help_message();
 
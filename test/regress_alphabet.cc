@@ -0,0 +1,137 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 30000;
+
+static std::string make_word(size_t seed)
+{
+    static const char letters[] = "etaoinshrdlu";
+    std::string word;
+    do {
+        word.push_back(letters[seed % 12]);
+        seed /= 12;
+    } while (seed);
+    return word;
+}
+
+/// Returns size of a file.
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st)?0:st.st_size;
+}
+
+static bool check_trie(const trie *mtrie, size_t words)
+{
+    size_t i;
+    trie::value_type value;
+    for (i = 0; i < words; i++) {
+        std::string word = make_word(i);
+        if (!mtrie->search(word.c_str(), word.size(), &value)
+            || value != static_cast<trie::value_type>(i + 1)) {
+            printf("\nTEST FAILED on '%s'!\n", word.c_str());
+            return false;
+        }
+    }
+    // 'z' has no code, 'x' has one given by insert
+    if (mtrie->search("ez", 2, &value)
+        || !mtrie->search("tax", 3, &value) || value != 7) {
+        printf("\nTEST FAILED on bytes without codes!\n");
+        return false;
+    }
+    // found keys are decoded back into bytes
+    trie::result_buffer result;
+    std::set<std::string> found, expected;
+    mtrie->prefix_search(trie::key_type("ta", 2), &result);
+    for (i = 0; i < result.size(); i++)
+        found.insert(result.key_string(i));
+    for (i = 0; i < words; i++)
+        if (make_word(i).compare(0, 2, "ta") == 0)
+            expected.insert(make_word(i));
+    expected.insert("tax");
+    if (found != expected) {
+        printf("\nTEST FAILED on prefix 'ta', %lu != %lu!\n",
+               static_cast<unsigned long>(found.size()),
+               static_cast<unsigned long>(expected.size()));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_alphabet";
+    const char *plain_archive = "/tmp/regress_alphabet_plain";
+    std::vector<size_t> frequency(256);
+    size_t i, j;
+
+    printf("libxtree regress testing (alphabet)\n");
+    printf("===================================\n");
+
+    for (i = 0; i < kWords; i++) {
+        std::string word = make_word(i);
+        for (j = 0; j < word.size(); j++)
+            frequency[static_cast<unsigned char>(word[j])]++;
+    }
+    trie *plain = trie::create_trie(trie::DOUBLE_TRIE);
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->set_alphabet(frequency);
+    for (i = 0; i < kWords; i++) {
+        std::string word = make_word(i);
+        plain->insert(word.c_str(), word.size(), i + 1);
+        mtrie->insert(word.c_str(), word.size(), i + 1);
+    }
+    mtrie->insert("tax", 3, 7);
+    if (!check_trie(mtrie, kWords))
+        exit(0);
+    printf(".");
+
+    // the table goes with the archive and snapshots
+    trie *snapshot = mtrie->snapshot();
+    if (!check_trie(snapshot, kWords))
+        exit(0);
+    delete snapshot;
+    mtrie->build(archive);
+    plain->build(plain_archive);
+    delete mtrie;
+    mtrie = trie::create_trie(archive);
+    if (!check_trie(mtrie, kWords))
+        exit(0);
+    delete mtrie;
+    printf(".");
+
+    // codes pack states closer
+    if (file_size(archive) >= file_size(plain_archive)) {
+        printf("\nTEST FAILED on density, %lu >= %lu!\n",
+               static_cast<unsigned long>(file_size(archive)),
+               static_cast<unsigned long>(file_size(plain_archive)));
+        exit(0);
+    }
+    printf(".");
+
+    // only an empty trie can be remapped
+    try {
+        plain->set_alphabet(frequency);
+        printf("\nTEST FAILED on non-empty trie!\n");
+        exit(0);
+    } catch (const std::runtime_error &e) {
+    }
+    delete plain;
+    unlink(archive);
+    unlink(plain_archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
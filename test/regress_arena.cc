@@ -0,0 +1,108 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 7);
+        seed /= 7;
+    } while (seed);
+    return word;
+}
+
+/// Checks a result_buffer holds the same keys as a result_type.
+static bool check_prefix(const trie *mtrie, const char *prefix,
+                         trie::result_buffer *buffer)
+{
+    trie::key_type key(prefix, strlen(prefix)), borrowed;
+    trie::result_type result;
+    size_t i;
+    mtrie->prefix_search(key, &result);
+    buffer->clear();
+    if (mtrie->prefix_search(key, buffer) != result.size()) {
+        printf("\nTEST FAILED on prefix '%s' %lu != %lu!\n", prefix,
+               static_cast<unsigned long>(buffer->size()),
+               static_cast<unsigned long>(result.size()));
+        return false;
+    }
+    for (i = 0; i < result.size(); i++) {
+        buffer->key(i, &borrowed);
+        if (buffer->key_string(i) != result[i].first.c_str()
+            || strcmp(borrowed.c_str(), result[i].first.c_str()) != 0
+            || buffer->value(i) != result[i].second) {
+            printf("\nTEST FAILED on prefix '%s' at '%s'!\n", prefix,
+                   result[i].first.c_str());
+            return false;
+        }
+        if (buffer->key_string(i).compare(0, strlen(prefix), prefix) != 0) {
+            printf("\nTEST FAILED on prefix '%s' got '%s'!\n", prefix,
+                   buffer->key_string(i).c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    trie::trie_type type[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *prefixes[] = {"", "a", "b", "cd", "gfe", "aaaaa", "x"};
+    size_t i, j;
+
+    printf("libxtree regress testing (arena)\n");
+    printf("================================\n");
+
+    for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        trie::result_buffer buffer;
+        printf("type %d: ", type[i]);
+        for (j = 0; j < kWords; j++)
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j);
+
+        // one buffer reused across queries
+        for (j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++) {
+            if (!check_prefix(mtrie, prefixes[j], &buffer))
+                exit(0);
+        }
+        printf(".");
+
+        // results are appended after existing ones
+        trie::key_type key("b", 1);
+        buffer.clear();
+        size_t first = mtrie->prefix_search(key, &buffer);
+        if (mtrie->prefix_search(key, &buffer) != first * 2
+            || buffer.key_string(0) != buffer.key_string(first)) {
+            printf("\nTEST FAILED on appending!\n");
+            exit(0);
+        }
+        buffer.truncate(first);
+        if (buffer.size() != first || !check_prefix(mtrie, "b", &buffer))
+            exit(0);
+        printf(".");
+
+        // concurrent mode
+        if (type[i] == trie::DOUBLE_TRIE) {
+            mtrie->set_concurrent(true);
+            for (j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++) {
+                if (!check_prefix(mtrie, prefixes[j], &buffer))
+                    exit(0);
+            }
+        }
+        delete mtrie;
+        printf(". ok\n");
+    }
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
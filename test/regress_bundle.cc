@@ -0,0 +1,72 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+int main(int argc, char *argv[])
+{
+    size_t i, j;
+    trie::value_type val;
+    trie::key_type key;
+    const char *dict[][8] = {
+        {"baby", "bachelor", "back", "badge", "badger", "badness", "bcs", NULL},
+        {"in", "inspiration", "instant", "instrument", NULL},
+        {NULL}
+    };
+    const char *name[] = {"english", "words"};
+    trie::trie_type type[] = {trie::DOUBLE_TRIE, trie::SINGLE_TRIE};
+    const char *archive[] = {"/tmp/regress_bundle.0", "/tmp/regress_bundle.1"};
+    const char *bundle_file = "/tmp/regress_bundle";
+    trie_bundle::source_type sources;
+
+    printf("libxtree regress testing (bundle)\n");
+    printf("=================================\n");
+
+    for (i = 0; dict[i][0]; i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], strlen(dict[i][j]));
+            mtrie->insert(key, i * 100 + j + 1);
+        }
+        mtrie->build(archive[i]);
+        delete mtrie;
+        sources.push_back(std::make_pair(std::string(name[i]),
+                                         std::string(archive[i])));
+    }
+    trie_bundle::build(bundle_file, sources);
+
+    trie_bundle bundle(bundle_file);
+    if (bundle.size() != 2 || bundle.get("nothing")) {
+        printf("\nTEST FAILED on bundle directory!\n");
+        exit(0);
+    }
+    for (i = 0; dict[i][0]; i++) {
+        trie *mtrie = bundle.get(name[i]);
+        printf("%s: ", bundle.name(i));
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], strlen(dict[i][j]));
+            if (mtrie && mtrie->search(key, &val)
+                && val == static_cast<trie::value_type>(i * 100 + j + 1)) {
+                printf("[%d] ", val);
+            } else {
+                printf("\nTEST FAILED on '%s'!\n", dict[i][j]);
+                exit(0);
+            }
+        }
+        printf("\n");
+    }
+
+    for (i = 0; dict[i][0]; i++)
+        unlink(archive[i]);
+    unlink(bundle_file);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 #include "trie_impl.h"
 
 #define length(x) (strlen(x))
@@ -186,6 +187,38 @@ int main()
         }
         printf("\n");
     }
+
+/* relayout */
+    printf("\nrelayout\n");
+    printf("----------\n");
+    for (i = 0; dict[i][0]; i++) {
+        trie *ttrie[2] = {new single_trie(), new double_trie()};
+        std::vector<std::string> samples;
+        printf("wordset %lu: ", i);
+        for (j = 0; dict[i][j]; j++)
+            samples.push_back(dict[i][j]);
+        for (size_t k = 0; k < 2; k++) {
+            // insert the first half, relayout, then insert the rest
+            for (j = 0; dict[i][j]; j++) {
+                if (j == samples.size() / 2)
+                    ttrie[k]->relayout(k?&samples:NULL);
+                key.assign(dict[i][j], length(dict[i][j]));
+                ttrie[k]->insert(key, signed_value(j, i));
+            }
+            ttrie[k]->relayout(k?NULL:&samples);
+            for (j = 0; dict[i][j]; j++) {
+                key.assign(dict[i][j], length(dict[i][j]));
+                if (ttrie[k]->search(key, &val) && val == signed_value(j, i)) {
+                    printf("[%d] ", val);
+                } else {
+                    printf("\nTEST FAILED on '%s' = %d!\n", dict[i][j], val);
+                    exit(0);
+                }
+            }
+            delete ttrie[k];
+        }
+        printf("\n");
+    }
 }
 
 // vim: ts=4 sw=4 ai et
@@ -0,0 +1,131 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static const char *archive = "/tmp/regress_common";
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 5);
+        seed /= 5;
+    } while (seed);
+    return word;
+}
+
+/// Checks common_prefix_search against search of every prefix.
+static bool check_common(const trie *dict, const char *name)
+{
+    trie::result_buffer result, expect;
+    trie::value_type value;
+    size_t i, j;
+
+    for (i = 0; i < kWords * 2; i += 7) {
+        // queries go past keys, and some bytes are multibyte UTF-8
+        std::string query = make_word(i) + (i % 3?"\xe4\xb8\xad":"e");
+        trie::key_type key(query.data(), query.size());
+        expect.clear();
+        for (j = 0; j <= query.size(); j++)
+            if (dict->search(query.data(), j, &value))
+                expect.push_back(key.data(), j, value);
+        result.clear();
+        size_t count = dict->common_prefix_search(key, &result);
+        bool same = count == expect.size() && result.size() == count;
+        for (j = 0; same && j < count; j++)
+            same = result.key_string(j) == expect.key_string(j)
+                   && result.value(j) == expect.value(j);
+        if (!same) {
+            printf("\nTEST FAILED on '%s' of %s, %lu != %lu keys!\n",
+                   query.c_str(), name, static_cast<unsigned long>(count),
+                   static_cast<unsigned long>(expect.size()));
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Inserts words, the empty key and words of CJK characters.
+static void insert_words(trie *dict)
+{
+    for (size_t i = 0; i < kWords; i++) {
+        std::string word = make_word(i);
+        if (i % 5 == 0)
+            word += "\xe4\xb8\xad";
+        dict->insert(word.data(), word.size(), i + 1);
+    }
+    dict->insert("", 0, -1);
+}
+
+int main(int argc, char *argv[])
+{
+    trie::trie_type types[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *names[] = {"tail trie", "two trie"};
+    std::vector<std::string> samples;
+    size_t i;
+
+    printf("libxtree regress testing (common prefix)\n");
+    printf("========================================\n");
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        trie *dict = trie::create_trie(types[i]);
+        insert_words(dict);
+        if (!check_common(dict, names[i]))
+            exit(0);
+        dict->build(archive);
+        delete dict;
+        dict = trie::create_trie(archive);
+        if (!check_common(dict, names[i]))
+            exit(0);
+        delete dict;
+        printf(".");
+    }
+
+    // codes of alphabets, concurrent mode, packed and set archives
+    for (i = 0; i < kWords; i += 11)
+        samples.push_back(make_word(i));
+    for (i = 0; i < 4; i++) {
+        trie *dict = trie::create_trie(trie::DOUBLE_TRIE);
+        if (i == 0)
+            dict->set_alphabet(std::vector<size_t>(256, 1));
+        else if (i == 1)
+            dict->set_utf8_alphabet(&samples);
+        else if (i == 2)
+            dict->set_concurrent(true);
+        insert_words(dict);
+        if (!check_common(dict, "two trie"))
+            exit(0);
+        dict->set_archive_options(i == 3?trie::ARCHIVE_SET
+                                        :trie::ARCHIVE_PACKED);
+        dict->build(archive);
+        delete dict;
+        dict = trie::create_trie(archive);
+        if (!check_common(dict, "two trie archive"))
+            exit(0);
+        delete dict;
+        printf(".");
+    }
+
+    // tries without a walk of their own search every prefix
+    layered_trie *layered = new layered_trie(archive);
+    insert_words(layered);
+    if (!check_common(layered, "layered trie"))
+        exit(0);
+    delete layered;
+    unlink(archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
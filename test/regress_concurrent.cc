@@ -0,0 +1,151 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <sched.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 50000;
+static const size_t kReaders = 4;
+
+static trie *mtrie;
+static size_t inserted;  // number of words visible to readers
+static size_t failed;
+static int writing;      // nonzero while the writer keeps inserting
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 23);
+        seed /= 23;
+    } while (seed);
+    return word;
+}
+
+static void *reader(void *arg)
+{
+    unsigned int seed = reinterpret_cast<size_t>(arg);
+    size_t round = 0, after = 0;
+    while (true) {
+        size_t n = __atomic_load_n(&inserted, __ATOMIC_ACQUIRE);
+        // keep reading a while after the writer finishes
+        if (n == kWords && ++after > 10000)
+            break;
+        if (n == 0)
+            continue;
+        size_t i = rand_r(&seed) % n;
+        std::string word = make_word(i);
+        trie::key_type key(word.c_str(), word.size());
+        trie::value_type value;
+        if (!mtrie->search(key, &value) || value != (trie::value_type)i) {
+            printf("TEST FAILED on '%s'!\n", word.c_str());
+            __sync_fetch_and_add(&failed, 1);
+            break;
+        }
+        // never inserted
+        trie::key_type missing("zz0", 3);
+        if (mtrie->search(missing, &value)) {
+            printf("TEST FAILED on 'zz0'!\n");
+            __sync_fetch_and_add(&failed, 1);
+            break;
+        }
+        if (++round % 64 == 0) {
+            size_t length = std::min<size_t>(2, word.size());
+            trie::key_type prefix(word.c_str(), length);
+            trie::result_type result;
+            mtrie->prefix_search(prefix, &result);
+            trie::result_type::const_iterator it;
+            for (it = result.begin(); it != result.end(); it++) {
+                if (make_word(it->second) != it->first.c_str()) {
+                    printf("TEST FAILED on prefix of '%s'!\n",
+                           word.c_str());
+                    __sync_fetch_and_add(&failed, 1);
+                    return NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/// Counts searches done while the writer is busy.
+static void *counter(void *arg)
+{
+    size_t *done = static_cast<size_t *>(arg);
+    trie::value_type value;
+    size_t i = 0;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        std::string word = make_word(i++ % kWords);
+        trie::key_type key(word.c_str(), word.size());
+        if (!mtrie->search(key, &value)) {
+            printf("TEST FAILED on '%s' while writing!\n", word.c_str());
+            __sync_fetch_and_add(&failed, 1);
+            break;
+        }
+        __atomic_store_n(done, *done + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t readers[kReaders];
+    size_t i;
+
+    printf("libxtree regress testing (concurrent)\n");
+    printf("=====================================\n");
+
+    mtrie = trie::create_trie(trie::DOUBLE_TRIE, 1024);
+    mtrie->set_concurrent(true);
+    for (i = 0; i < kReaders; i++)
+        pthread_create(&readers[i], NULL, reader, (void *)(i + 1));
+    for (i = 0; i < kWords; i++) {
+        std::string word = make_word(i);
+        trie::key_type key(word.c_str(), word.size());
+        mtrie->insert(key, i);
+        __atomic_store_n(&inserted, i + 1, __ATOMIC_RELEASE);
+        if (i % 256 == 0)  // let readers in on a single cpu
+            sched_yield();
+    }
+    for (i = 0; i < kReaders; i++)
+        pthread_join(readers[i], NULL);
+
+    // readers make progress while the writer never stops
+    size_t done[kReaders] = {0};
+    writing = 1;
+    for (i = 0; i < kReaders; i++)
+        pthread_create(&readers[i], NULL, counter, &done[i]);
+    bool progress = false;
+    for (i = kWords; !progress && !failed && i < kWords * 40; i++) {
+        std::string word = make_word(i);
+        trie::key_type key(word.c_str(), word.size());
+        mtrie->insert(key, i);
+        progress = true;
+        for (size_t j = 0; j < kReaders; j++)
+            progress = progress
+                       && __atomic_load_n(&done[j], __ATOMIC_ACQUIRE) >= 1000;
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < kReaders; i++)
+        pthread_join(readers[i], NULL);
+    if (!progress && !failed) {
+        printf("TEST FAILED on progress of readers!\n");
+        failed++;
+    }
+    delete mtrie;
+    if (!failed)
+        printf("%lu words, %lu readers: ok\n",
+               static_cast<unsigned long>(kWords),
+               static_cast<unsigned long>(kReaders));
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
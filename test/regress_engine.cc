@@ -0,0 +1,145 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_engine.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static std::string make_word(size_t seed)
+{
+    // two bytes of a CJK character between letters
+    static const char *letters[] = {"a", "e", "o", "st", "\xe4\xb8\x80",
+                                    "\xe4\xb8\x8a", "\xe5\xa4\xa7"};
+    std::string word;
+    do {
+        word += letters[seed % 7];
+        seed /= 7;
+    } while (seed);
+    return word;
+}
+
+/// Represents an archive mapped into memory.
+typedef struct {
+    void *data;
+    size_t size;
+} mapped_type;
+
+static mapped_type map_archive(const char *filename)
+{
+    struct stat st;
+    mapped_type mapped;
+    int fd = open(filename, O_RDONLY);
+    fstat(fd, &st);
+    mapped.size = st.st_size;
+    mapped.data = mmap(NULL, mapped.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return mapped;
+}
+
+/// Checks engine against the trie of the same archive.
+template <typename Engine>
+static bool check_engine(const trie *mtrie, const mapped_type &mapped,
+                         const char *name)
+{
+    Engine engine(mapped.data, mapped.size);
+    trie::value_type expected;
+    typename Engine::value_type value;
+
+    for (size_t i = 0; i < kWords * 2; i++) {
+        // missing words too, and prefixes cut in a character
+        std::string word = make_word(i);
+        if (i >= kWords)
+            word.resize(word.size() - 1);
+        bool found = mtrie->search(word.c_str(), word.size(), &expected);
+        if (engine.search(word, &value) != found
+            || (found && value
+                != static_cast<typename Engine::value_type>(expected))
+            || (i < kWords && !found)) {
+            printf("\nTEST FAILED on %s, word %lu!\n", name,
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    if (engine.search("", 0, &value) || engine.search("zz", 2, NULL)) {
+        printf("\nTEST FAILED on %s, missing words!\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_engine";
+    std::vector<std::string> samples;
+    std::vector<size_t> frequency(256, 1);
+    size_t i, j;
+
+    printf("libxtree regress testing (engine)\n");
+    printf("=================================\n");
+
+    for (i = 0; i < kWords; i++)
+        samples.push_back(make_word(i));
+    for (j = 0; j < 4; j++) {
+        trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+        if (j == 1)
+            mtrie->set_archive_options(trie::ARCHIVE_PACKED);
+        else if (j == 2)
+            mtrie->set_alphabet(frequency);
+        else if (j == 3)
+            mtrie->set_utf8_alphabet(&samples);
+        for (i = 0; i < kWords; i++)
+            mtrie->insert(samples[i].c_str(), samples[i].size(), i + 1);
+        mtrie->build(archive);
+        delete mtrie;
+        // an engine reads the archive as the trie loaded from it does
+        mtrie = trie::create_trie(archive);
+        mapped_type mapped = map_archive(archive);
+        bool ok;
+        if (j == 0)
+            ok = check_engine<trie_engine<flat_layout> >(mtrie, mapped,
+                                                         "flat");
+        else if (j == 1)
+            ok = check_engine<trie_engine<packed_layout, uint32_t> >(
+                     mtrie, mapped, "packed");
+        else if (j == 2)
+            ok = check_engine<trie_engine<flat_layout, trie::value_type,
+                                          byte_alphabet> >(
+                     mtrie, mapped, "alphabet");
+        else
+            ok = check_engine<trie_engine<flat_layout, trie::value_type,
+                                          utf8_alphabet> >(
+                     mtrie, mapped, "utf8");
+        if (!ok)
+            exit(0);
+        // an engine of another layout or alphabet refuses the archive
+        try {
+            if (j == 0)
+                trie_engine<packed_layout> engine(mapped.data, mapped.size);
+            else
+                trie_engine<flat_layout> engine(mapped.data, mapped.size);
+            printf("\nTEST FAILED on a mismatched engine!\n");
+            exit(0);
+        } catch (const bad_trie_archive &e) {
+        }
+        munmap(mapped.data, mapped.size);
+        delete mtrie;
+        printf(".");
+    }
+    unlink(archive);
+    printf(" ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,137 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 5000;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 7);
+        seed /= 7;
+    } while (seed);
+    return word;
+}
+
+static bool check_word(const trie *mtrie, size_t i, bool present,
+                       trie::value_type expect)
+{
+    std::string word = make_word(i);
+    trie::key_type key(word.c_str(), word.size());
+    trie::value_type value;
+    bool found = mtrie->search(key, &value);
+    if (found != present || (found && value != expect)) {
+        printf("\nTEST FAILED on '%s'!\n", word.c_str());
+        return false;
+    }
+    return true;
+}
+
+static off_t archive_size(trie *mtrie, const char *archive)
+{
+    struct stat sb;
+    mtrie->build(archive);
+    stat(archive, &sb);
+    return sb.st_size;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t i, j, round;
+    trie::trie_type type[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *archive = "/tmp/regress_erase";
+
+    printf("libxtree regress testing (erase)\n");
+    printf("================================\n");
+
+    for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        off_t size[2];
+        printf("type %d: ", type[i]);
+        for (j = 0; j < kWords; j++)
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j);
+        size[0] = archive_size(mtrie, archive);
+
+        std::vector<trie::value_type> expect(kWords);
+        for (j = 0; j < kWords; j++)
+            expect[j] = j;
+        for (round = 0; round < 5; round++) {
+            // erase every other word
+            for (j = round % 2; j < kWords; j += 2) {
+                trie::key_type key(make_word(j).c_str(), make_word(j).size());
+                if (!mtrie->erase(key) || mtrie->erase(key)) {
+                    printf("\nTEST FAILED on erasing '%s'!\n",
+                           make_word(j).c_str());
+                    exit(0);
+                }
+            }
+            for (j = 0; j < kWords; j++) {
+                if (!check_word(mtrie, j, j % 2 != round % 2, expect[j]))
+                    exit(0);
+            }
+            // put them back with new values
+            for (j = round % 2; j < kWords; j += 2) {
+                expect[j] = j + round + 1;
+                mtrie->insert(make_word(j).c_str(), make_word(j).size(),
+                              expect[j]);
+            }
+            for (j = 0; j < kWords; j++) {
+                if (!check_word(mtrie, j, true, expect[j]))
+                    exit(0);
+            }
+            printf(".");
+        }
+
+        // churn should not make the trie grow much
+        size[1] = archive_size(mtrie, archive);
+        if (size[1] > size[0] * 3 / 2) {
+            printf("\nTEST FAILED on size %ld > %ld!\n",
+                   static_cast<long>(size[1]), static_cast<long>(size[0]));
+            exit(0);
+        }
+
+        trie::key_type prefix("ab", 2);
+        trie::result_type result;
+        size_t count = mtrie->prefix_search(prefix, &result);
+        if (count == 0 || mtrie->erase_prefix(prefix) != count) {
+            printf("\nTEST FAILED on erasing prefix 'ab'!\n");
+            exit(0);
+        }
+        result.clear();
+        if (mtrie->prefix_search(prefix, &result) != 0) {
+            printf("\nTEST FAILED on prefix 'ab' after erasing!\n");
+            exit(0);
+        }
+        for (j = 0; j < kWords; j++) {
+            std::string word = make_word(j);
+            if (!check_word(mtrie, j, word.compare(0, 2, "ab") != 0,
+                            expect[j]))
+                exit(0);
+        }
+        // erase everything
+        trie::key_type empty("", 0);
+        mtrie->erase_prefix(empty);
+        for (j = 0; j < kWords; j++) {
+            if (!check_word(mtrie, j, false, 0))
+                exit(0);
+        }
+        printf(" size %ld -> %ld\n", static_cast<long>(size[0]),
+               static_cast<long>(size[1]));
+        delete mtrie;
+    }
+    unlink(archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,149 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_engine.h"
+
+using namespace dutil;
+
+static const size_t kWords = 50000;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 13);
+        seed /= 13;
+    } while (seed);
+    return word + "ing";
+}
+
+/// Checks keys are all found and misses are not.
+static bool check_trie(const trie *mtrie, const char *name)
+{
+    trie::value_type value;
+    for (size_t i = 0; i < kWords * 2; i++) {
+        std::string word = make_word(i);
+        bool found = mtrie->search(word.c_str(), word.size(), &value);
+        if (found != (i < kWords) || (found && value != static_cast<
+                trie::value_type>(i + 1))
+            || mtrie->search(trie::key_type(word.c_str(), word.size()),
+                             NULL) != found) {
+            printf("\nTEST FAILED on %s, word %lu!\n", name,
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_filter";
+    const char *plain_archive = "/tmp/regress_filter_plain";
+    trie::value_type value;
+    struct stat st;
+    size_t i;
+
+    printf("libxtree regress testing (filter)\n");
+    printf("=================================\n");
+
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < kWords; i++)
+        mtrie->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+    mtrie->build(plain_archive);
+    mtrie->set_archive_options(trie::ARCHIVE_FILTER);
+    mtrie->build(archive);
+    delete mtrie;
+
+    // no key is filtered out, with or without an alphabet
+    mtrie = trie::create_trie(archive);
+    if (!check_trie(mtrie, "filter"))
+        exit(0);
+    // keys found by prefix search end with a terminator and are found
+    trie::result_type result;
+    mtrie->prefix_search(trie::key_type("ab", 2), &result);
+    for (trie::result_type::const_iterator it = result.begin();
+         it != result.end(); it++) {
+        if (!mtrie->search(it->first, &value) || value != it->second) {
+            printf("\nTEST FAILED on found key '%s'!\n",
+                   it->first.c_str());
+            exit(0);
+        }
+    }
+    if (result.empty()) {
+        printf("\nTEST FAILED on prefix search!\n");
+        exit(0);
+    }
+    delete mtrie;
+    std::vector<size_t> frequency(256, 1);
+    mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->set_alphabet(frequency);
+    for (i = 0; i < kWords; i++)
+        mtrie->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+    mtrie->set_archive_options(trie::ARCHIVE_FILTER | trie::ARCHIVE_PACKED);
+    mtrie->build("/tmp/regress_filter_alphabet");
+    delete mtrie;
+    mtrie = trie::create_trie("/tmp/regress_filter_alphabet");
+    if (!check_trie(mtrie, "alphabet"))
+        exit(0);
+    delete mtrie;
+    unlink("/tmp/regress_filter_alphabet");
+    printf(".");
+
+    // most misses are kept out by the filter
+    int fd = open(archive, O_RDONLY);
+    fstat(fd, &st);
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    key_filter filter;
+    filter.load(static_cast<two_trie_archive::header_type *>(data) + 1);
+    size_t passed = 0;
+    for (i = kWords; i < kWords * 11; i++)
+        passed += filter.may_contain(filter_hash(make_word(i).c_str(),
+                                                 make_word(i).size(), 0));
+    if (passed > kWords * 10 / 50) {
+        printf("\nTEST FAILED on false positives, %lu of %lu!\n",
+               static_cast<unsigned long>(passed),
+               static_cast<unsigned long>(kWords * 10));
+        exit(0);
+    }
+    printf(".");
+
+    // an engine checks the filter too
+    trie_engine<flat_layout> engine(data, st.st_size);
+    for (i = 0; i < kWords * 2; i++) {
+        std::string word = make_word(i);
+        if (engine.search(word, &value) != (i < kWords)) {
+            printf("\nTEST FAILED on engine, word %lu!\n",
+                   static_cast<unsigned long>(i));
+            exit(0);
+        }
+    }
+    munmap(data, st.st_size);
+    printf(".");
+
+    // a trie without the option writes no filter
+    stat(plain_archive, &st);
+    size_t plain_size = st.st_size;
+    stat(archive, &st);
+    if (static_cast<size_t>(st.st_size) <= plain_size) {
+        printf("\nTEST FAILED on size!\n");
+        exit(0);
+    }
+    unlink(archive);
+    unlink(plain_archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,115 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+static const size_t kThreads = 4;
+
+static trie *mtrie;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 7);
+        seed /= 7;
+    } while (seed);
+    return word + "ness";
+}
+
+/// Returns a counter by name, or -1 if not found.
+static long counter(const trie::stats_type &stats, const char *name)
+{
+    for (size_t i = 0; i < stats.counters.size(); i++)
+        if (!strcmp(stats.counters[i].first, name))
+            return stats.counters[i].second;
+    return -1;
+}
+
+/// Returns the number of samples of a histogram by name.
+static size_t samples(const trie::stats_type &stats, const char *name)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < stats.histograms.size(); i++) {
+        if (strcmp(stats.histograms[i].first, name))
+            continue;
+        for (size_t j = 0; j < stats.histograms[i].second.size(); j++)
+            total += stats.histograms[i].second[j];
+    }
+    return total;
+}
+
+static void *searcher(void *arg)
+{
+    trie::value_type value;
+    for (size_t i = 0; i < kWords; i++)
+        mtrie->search(make_word(i).c_str(), make_word(i).size(), &value);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    trie::stats_type stats;
+    pthread_t threads[kThreads];
+    size_t i;
+
+    printf("libxtree regress testing (instrument)\n");
+    printf("=====================================\n");
+
+    // building relocates states and probes bases
+    mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < kWords; i++)
+        mtrie->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+    mtrie->insert(make_word(0).c_str(), make_word(0).size(), 1);
+    mtrie->stats(&stats);
+    if (counter(stats, "insert fronts") + counter(stats, "insert rears")
+        != static_cast<long>(kWords)
+        || counter(stats, "insert duplicates") != 1
+        || samples(stats, "find_base probes") == 0
+        || samples(stats, "relocate moves") == 0
+        || counter(stats, "find_base probes")
+           < static_cast<long>(samples(stats, "find_base probes"))) {
+        printf("\nTEST FAILED on inserts!\n");
+        exit(0);
+    }
+    printf(".");
+
+    // counts of all threads are summed
+    trie::reset_counters();
+    for (i = 0; i < kThreads; i++)
+        pthread_create(&threads[i], NULL, searcher, NULL);
+    for (i = 0; i < kThreads; i++)
+        pthread_join(threads[i], NULL);
+    mtrie->stats(&stats);
+    // each search walks forward once, and backward if it crosses
+    if (samples(stats, "forward states") != kThreads * kWords
+        || counter(stats, "rear crossings") <= 0
+        || samples(stats, "backward states")
+           != static_cast<size_t>(counter(stats, "rear crossings"))
+        || counter(stats, "insert fronts") != 0) {
+        printf("\nTEST FAILED on searches!\n");
+        exit(0);
+    }
+    printf(".");
+
+    trie::reset_counters();
+    mtrie->stats(&stats);
+    if (counter(stats, "forward states") != 0
+        || samples(stats, "backward states") != 0) {
+        printf("\nTEST FAILED on reset!\n");
+        exit(0);
+    }
+    delete mtrie;
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
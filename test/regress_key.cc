@@ -0,0 +1,101 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static bool check_key(const trie::key_type &key, const std::string &expect)
+{
+    if (key.length() != expect.size() || expect != key.c_str()
+        || key.data()[key.length()] != trie::key_type::kTerminator) {
+        printf("\nTEST FAILED on '%s' != '%s'!\n", key.c_str(),
+               expect.c_str());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t length;
+
+    printf("libxtree regress testing (key)\n");
+    printf("==============================\n");
+
+    // around the inline size
+    for (length = 0; length < trie::key_type::kInlineSize * 3; length++) {
+        std::string word;
+        while (word.size() < length)
+            word.push_back('a' + word.size() % 26);
+        trie::key_type key(word.data(), word.size());
+        trie::key_type copy(key);
+        trie::key_type pushed;
+        for (size_t i = 0; i < word.size(); i++)
+            pushed.push(trie::key_type::char_in(word[i]));
+        if (!check_key(key, word) || !check_key(copy, word)
+            || !check_key(pushed, word))
+            exit(0);
+        if (length > 0) {
+            if (pushed.pop() != trie::key_type::char_in(word[length - 1])
+                || !check_key(pushed, word.substr(0, length - 1)))
+                exit(0);
+        }
+        copy = pushed;
+        if (!check_key(copy, pushed.c_str()))
+            exit(0);
+        // assign from itself
+        copy.assign(copy.data(), copy.length() / 2);
+        if (!check_key(copy, word.substr(0, (length ? length - 1 : 0) / 2)))
+            exit(0);
+#if __cplusplus >= 201103L
+        trie::key_type moved(std::move(key));
+        if (!check_key(moved, word) || !check_key(key, ""))
+            exit(0);
+        key = std::move(moved);
+        if (!check_key(key, word) || !check_key(moved, ""))
+            exit(0);
+#endif
+    }
+    printf(".");
+
+    // a borrowing key refers to data until it is changed
+    trie::key_type owner("borrowed", 8), view;
+    view.borrow(owner.data(), 6);
+    if (!view.borrowed() || view.data() != owner.data())
+        exit(0);
+    trie::key_type copy(view);
+    if (copy.borrowed() || !check_key(copy, "borrow"))
+        exit(0);
+    view.push(trie::key_type::char_in('s'));
+    if (view.borrowed() || !check_key(view, "borrows")
+        || !check_key(owner, "borrowed"))
+        exit(0);
+    printf(".");
+
+    // keys in a trie
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    std::string tail(100, 'x');
+    const char *words[] = {"a", "ab", "abcdefghijklmnopqrstuvwxyz", "b"};
+    for (length = 0; length < sizeof(words) / sizeof(words[0]); length++) {
+        mtrie->insert(words[length], strlen(words[length]), length);
+        mtrie->insert((words[length] + tail).c_str(),
+                      strlen(words[length]) + tail.size(), length + 10);
+    }
+    trie::key_type prefix("a", 1);
+    trie::result_type result;
+    if (mtrie->prefix_search(prefix, &result) != 6
+        || mtrie->erase_prefix(prefix) != 6
+        || mtrie->search("b", 1, NULL) != true)
+        exit(0);
+    delete mtrie;
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
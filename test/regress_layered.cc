@@ -0,0 +1,281 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static const char *base = "/tmp/regress_layered";
+static const char *log = "/tmp/regress_layered.log";
+
+typedef std::map<std::string, trie::value_type> expect_type;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 13);
+        seed /= 13;
+    } while (seed);
+    return word;
+}
+
+static bool check_words(const trie *mtrie, const expect_type &expect)
+{
+    size_t i;
+    for (i = 0; i < kWords * 2; i++) {
+        std::string word = make_word(i);
+        expect_type::const_iterator it = expect.find(word);
+        trie::key_type key(word.c_str(), word.size());
+        trie::value_type value;
+        bool found = mtrie->search(key, &value);
+        if (found != (it != expect.end())
+            || (found && value != it->second)) {
+            printf("\nTEST FAILED on '%s'!\n", word.c_str());
+            return false;
+        }
+    }
+    // prefix search merges all layers
+    trie::key_type prefix("b", 1);
+    trie::result_type result;
+    size_t count = 0;
+    mtrie->prefix_search(prefix, &result);
+    for (expect_type::const_iterator it = expect.begin();
+         it != expect.end(); it++)
+        count += it->first[0] == 'b';
+    if (result.size() != count) {
+        printf("\nTEST FAILED on prefix 'b' %lu != %lu!\n",
+               static_cast<unsigned long>(result.size()),
+               static_cast<unsigned long>(count));
+        return false;
+    }
+    return true;
+}
+
+/// Changes a third of the words, some of them in base.
+static void change_words(trie *mtrie, expect_type *expect, size_t round)
+{
+    size_t i;
+    for (i = round; i < kWords * 2; i += 3) {
+        std::string word = make_word(i);
+        if (i % 2) {
+            mtrie->insert(word.c_str(), word.size(), i + round);
+            (*expect)[word] = i + round;
+        } else {
+            trie::key_type key(word.c_str(), word.size());
+            bool found = expect->erase(word) > 0;
+            if (mtrie->erase(key) != found) {
+                printf("\nTEST FAILED on erasing '%s'!\n", word.c_str());
+                exit(0);
+            }
+        }
+    }
+}
+
+static void *compactor(void *arg)
+{
+    static_cast<layered_trie *>(arg)->compact();
+    return NULL;
+}
+
+static const size_t kReaders = 2;
+
+static const layered_trie *reading;  // trie of counter
+static const expect_type *stable;    // words not changed while reading
+static int writing;                  // nonzero while the writer churns
+static size_t failed;
+
+/// Counts searches of stable words done while the writer is busy.
+static void *counter(void *arg)
+{
+    size_t *done = static_cast<size_t *>(arg);
+    expect_type::const_iterator it = stable->begin();
+    trie::value_type value;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        if (++it == stable->end())
+            it = stable->begin();
+        trie::key_type key(it->first.c_str(), it->first.size());
+        if (!reading->search(key, &value) || value != it->second) {
+            printf("\nTEST FAILED on '%s' while writing!\n",
+                   it->first.c_str());
+            __sync_fetch_and_add(&failed, 1);
+            break;
+        }
+        __atomic_store_n(done, *done + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t i;
+    expect_type expect;
+
+    printf("libxtree regress testing (layered)\n");
+    printf("==================================\n");
+
+    unlink(base);
+    unlink(log);
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < kWords; i++) {
+        mtrie->insert(make_word(i).c_str(), make_word(i).size(), i);
+        expect[make_word(i)] = i;
+    }
+    mtrie->build(base);
+    delete mtrie;
+
+    layered_trie *layered = new layered_trie(base, log);
+    if (!check_words(layered, expect))
+        exit(0);
+    change_words(layered, &expect, 0);
+    if (!check_words(layered, expect))
+        exit(0);
+    printf(".");
+
+    // compact in background while changing
+    pthread_t thread;
+    pthread_create(&thread, NULL, compactor, layered);
+    change_words(layered, &expect, 1);
+    pthread_join(thread, NULL);
+    if (!check_words(layered, expect))
+        exit(0);
+    printf(".");
+
+    // the log keeps changes since compaction
+    change_words(layered, &expect, 2);
+    delete layered;
+    layered = new layered_trie(base, log);
+    if (!check_words(layered, expect))
+        exit(0);
+    printf(".");
+
+    // a torn record at the end of log is dropped
+    delete layered;
+    FILE *fp = fopen(log, "a");
+    fwrite("+\0\0\0", 4, 1, fp);
+    fclose(fp);
+    layered = new layered_trie(base, log);
+    change_words(layered, &expect, 3);
+    delete layered;
+    layered = new layered_trie(base, log);
+    if (!check_words(layered, expect))
+        exit(0);
+    printf(".");
+
+    // erasing a missing key logs nothing
+    struct stat before, after;
+    trie::key_type missing("zzzzzz", 6);
+    stat(log, &before);
+    if (layered->erase(missing)) {
+        printf("\nTEST FAILED on erasing a missing key!\n");
+        exit(0);
+    }
+    stat(log, &after);
+    if (after.st_size != before.st_size) {
+        printf("\nTEST FAILED on log of a missing key!\n");
+        exit(0);
+    }
+
+    // corrupted headers are dropped like a torn tail, before their key
+    // is read
+    struct {
+        char op;
+        char unused[3];
+        trie::value_type value;
+        uint32_t length;
+    } header;
+    for (int i = 0; i < 2; i++) {
+        delete layered;
+        memset(&header, 0, sizeof(header));
+        header.op = i?'?':'+';
+        header.length = i?3:0xfffffff0;
+        fp = fopen(log, "a");
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite("abc", 3, 1, fp);
+        fclose(fp);
+        layered = new layered_trie(base, log);
+        stat(log, &after);
+        if (after.st_size != before.st_size
+            || !check_words(layered, expect)) {
+            printf("\nTEST FAILED on a corrupted log header!\n");
+            exit(0);
+        }
+    }
+    printf(".");
+
+    // prefix search appends and counts the whole result
+    trie::result_type result;
+    size_t count = layered->prefix_search(trie::key_type("b", 1), &result);
+    if (layered->prefix_search(trie::key_type("c", 1), &result)
+        != result.size() || result.size() <= count) {
+        printf("\nTEST FAILED on counting prefix search!\n");
+        exit(0);
+    }
+    printf(".");
+
+    // readers make progress while the writer keeps erasing and inserting
+    // keys of base, which changes delta and tombstones together
+    for (i = 0; i < 1000; i++)
+        layered->insert(("z" + make_word(i)).c_str(), make_word(i).size() + 1,
+                        i);
+    layered->compact();
+    pthread_t readers[kReaders];
+    size_t done[kReaders] = {0};
+    bool progress = false;
+    reading = layered;
+    stable = &expect;
+    writing = 1;
+    for (i = 0; i < kReaders; i++)
+        pthread_create(&readers[i], NULL, counter, &done[i]);
+    for (i = 0; !progress && !failed && i < kWords * 40; i++) {
+        std::string word = "z" + make_word(i % 1000);
+        if (i / 1000 % 2 == 0)
+            layered->erase(trie::key_type(word.c_str(), word.size()));
+        else
+            layered->insert(word.c_str(), word.size(), i);
+        progress = true;
+        for (size_t j = 0; j < kReaders; j++)
+            progress = progress
+                       && __atomic_load_n(&done[j], __ATOMIC_ACQUIRE) >= 1000;
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < kReaders; i++)
+        pthread_join(readers[i], NULL);
+    if (failed)
+        exit(0);
+    if (!progress) {
+        printf("\nTEST FAILED on progress of readers!\n");
+        exit(0);
+    }
+    for (i = 0; i < 1000; i++) {
+        std::string word = "z" + make_word(i);
+        layered->erase(trie::key_type(word.c_str(), word.size()));
+    }
+    printf(".");
+
+    // everything folds into base
+    layered->compact();
+    delete layered;
+    unlink(log);
+    layered = new layered_trie(base, NULL);
+    if (layered->changes() != 0 || !check_words(layered, expect))
+        exit(0);
+    delete layered;
+    printf(". ok\n");
+
+    unlink(base);
+    unlink(log);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
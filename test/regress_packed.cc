@@ -0,0 +1,85 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 13);
+        seed /= 13;
+    } while (seed);
+    return word;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t i, j, n = 20000;
+    const char *archive[] = {"/tmp/regress_packed.0", "/tmp/regress_packed.1"};
+    std::vector<std::string> words;
+    trie::value_type value[2];
+
+    printf("libxtree regress testing (packed)\n");
+    printf("=================================\n");
+
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < n; i++) {
+        words.push_back(make_word(i * 7919));
+        trie::key_type key(words[i].c_str(), words[i].size());
+        // values spread over a wide and signed range
+        mtrie->insert(key, static_cast<trie::value_type>(i * 977) - 5000);
+    }
+    mtrie->build(archive[0]);
+    mtrie->set_archive_options(trie::ARCHIVE_PACKED);
+    mtrie->build(archive[1]);
+    delete mtrie;
+
+    trie *plain = trie::create_trie(archive[0]);
+    trie *packed = trie::create_trie(archive[1]);
+    for (i = 0; i < n + 100; i++) {
+        std::string word = make_word(i * 7919 + (i >= n?1:0));
+        trie::key_type key(word.c_str(), word.size());
+        bool found[2];
+        found[0] = plain->search(key, &value[0]);
+        found[1] = packed->search(key, &value[1]);
+        if (found[0] != found[1] || (found[0] && value[0] != value[1])) {
+            printf("TEST FAILED on '%s'!\n", word.c_str());
+            exit(0);
+        }
+    }
+    printf("search: %lu keys\n", static_cast<unsigned long>(n));
+    for (i = 0; i < 13; i++) {
+        std::string word(1, 'a' + i);
+        trie::key_type key(word.c_str(), word.size());
+        trie::result_type result[2];
+        plain->prefix_search(key, &result[0]);
+        packed->prefix_search(key, &result[1]);
+        if (result[0].size() != result[1].size()) {
+            printf("TEST FAILED on prefix '%s'!\n", word.c_str());
+            exit(0);
+        }
+        for (j = 0; j < result[0].size(); j++) {
+            if (result[0][j].second != result[1][j].second) {
+                printf("TEST FAILED on prefix '%s'!\n", word.c_str());
+                exit(0);
+            }
+        }
+    }
+    printf("prefix_search: ok\n");
+    delete plain;
+    delete packed;
+    unlink(archive[0]);
+    unlink(archive[1]);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
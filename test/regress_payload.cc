@@ -0,0 +1,89 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static bool check_payload(const trie *mtrie, const char *word)
+{
+    const char *payload;
+    size_t length;
+    std::string expect = std::string("<") + word + ">";
+    trie::key_type key(word, strlen(word));
+    if (!mtrie->search_payload(key, &payload, &length))
+        return false;
+    return std::string(payload, length) == expect;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t i, j;
+    const char *dict[] = {"baby", "bachelor", "back", "badge", "badger",
+                          "badness", "bcs", "", NULL};
+    trie::trie_type type[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *archive = "/tmp/regress_payload";
+
+    printf("libxtree regress testing (payload)\n");
+    printf("==================================\n");
+
+    for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        printf("type %d: ", type[i]);
+        for (j = 0; dict[j]; j++) {
+            std::string payload = std::string("<") + dict[j] + ">";
+            trie::key_type key(dict[j], strlen(dict[j]));
+            mtrie->insert_payload(key, payload.data(), payload.size());
+        }
+        for (j = 0; dict[j]; j++) {
+            if (!check_payload(mtrie, dict[j])) {
+                printf("\nTEST FAILED on '%s'!\n", dict[j]);
+                exit(0);
+            }
+        }
+        mtrie->build(archive);
+        delete mtrie;
+
+        mtrie = trie::create_trie(archive);
+        for (j = 0; dict[j]; j++) {
+            if (check_payload(mtrie, dict[j])) {
+                printf("[%s] ", dict[j]);
+            } else {
+                printf("\nTEST FAILED on '%s' (archive)!\n", dict[j]);
+                exit(0);
+            }
+        }
+        if (check_payload(mtrie, "bad")) {
+            printf("\nTEST FAILED on 'bad' (archive)!\n");
+            exit(0);
+        }
+        delete mtrie;
+
+        // payloads past the end of a truncated archive are refused
+        FILE *fp = fopen(archive, "r+");
+        fseek(fp, 0, SEEK_END);
+        if (ftruncate(fileno(fp), ftell(fp) - 1) != 0) {
+            printf("\nTEST FAILED on truncating archive!\n");
+            exit(0);
+        }
+        fclose(fp);
+        try {
+            mtrie = trie::create_trie(archive);
+            delete mtrie;
+            printf("\nTEST FAILED on truncated payloads!\n");
+            exit(0);
+        } catch (const std::exception &e) {
+        }
+        printf("\n");
+    }
+    unlink(archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
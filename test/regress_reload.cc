@@ -0,0 +1,104 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kReaders = 4;
+static const size_t kReloads = 20;
+
+static const char *dict[] = {"baby", "bachelor", "back", "badge", "badger",
+                             "badness", "bcs", NULL};
+static const char *archive[] = {"/tmp/regress_reload.0",
+                                "/tmp/regress_reload.1"};
+static trie_handle *handle;
+static int stop;
+static size_t failed;
+
+static void *reader(void *arg)
+{
+    size_t i = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        trie_handle::reader pinned(*handle);
+        trie::value_type first, value;
+        const char *word = dict[i++ % 7];
+        // all words come from the same archive while pinned
+        if (!pinned->search("baby", 4, &first)
+            || !pinned->search(word, strlen(word), &value)
+            || value / 100 != first / 100) {
+            printf("TEST FAILED on '%s'!\n", word);
+            __sync_fetch_and_add(&failed, 1);
+            break;
+        }
+        if (i % 16 == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t readers[kReaders];
+    std::vector<std::string> warmup;
+    size_t i, j;
+
+    printf("libxtree regress testing (reload)\n");
+    printf("=================================\n");
+
+    for (i = 0; i < 2; i++) {
+        trie *mtrie = trie::create_trie(i?trie::SINGLE_TRIE:trie::DOUBLE_TRIE);
+        for (j = 0; dict[j]; j++)
+            mtrie->insert(dict[j], strlen(dict[j]), (i + 1) * 100 + j);
+        mtrie->build(archive[i]);
+        delete mtrie;
+    }
+    for (j = 0; dict[j]; j++)
+        warmup.push_back(dict[j]);
+
+    handle = new trie_handle(archive[0]);
+    for (i = 0; i < kReaders; i++)
+        pthread_create(&readers[i], NULL, reader, NULL);
+    for (i = 0; i < kReloads; i++) {
+        handle->reload(archive[(i + 1) % 2], &warmup);
+        sched_yield();
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < kReaders; i++)
+        pthread_join(readers[i], NULL);
+
+    {
+        trie::value_type value;
+        trie_handle::reader pinned(*handle);
+        if (handle->generation() != kReloads
+            || !pinned->search("bcs", 3, &value) || value != 106) {
+            printf("TEST FAILED after reloads!\n");
+            failed++;
+        }
+    }
+    try {
+        handle->reload("/tmp/regress_reload.none");
+        printf("TEST FAILED on missing archive!\n");
+        failed++;
+    } catch (const std::exception &e) {
+        // the old archive is kept
+    }
+    delete handle;
+    if (!failed)
+        printf("%lu reloads, %lu readers: ok\n",
+               static_cast<unsigned long>(kReloads),
+               static_cast<unsigned long>(kReaders));
+    unlink(archive[0]);
+    unlink(archive[1]);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,321 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_server.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+// bytes of pending responses the server stops reading at
+static const size_t kHighWater = 4 << 20;
+
+static const char *archive = "/tmp/regress_server";
+static const char *address = "/tmp/regress_server.sock";
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 7);
+        seed /= 7;
+    } while (seed);
+    return word;
+}
+
+/// Connects to the server, waiting for it to listen.
+static int connect_server()
+{
+    sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, address);
+    for (int i = 0; i < 500; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&un), sizeof(un)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    printf("\nTEST FAILED on connecting to server!\n");
+    exit(0);
+}
+
+static void send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0)
+            return;  // closed by server
+        sent += n;
+    }
+}
+
+/// Reads exactly size bytes, returns false if the connection closes or
+/// nothing arrives for 5 seconds.
+static bool recv_all(int fd, char *buffer, size_t size)
+{
+    size_t got = 0;
+    while (got < size) {
+        pollfd event = {fd, POLLIN, 0};
+        if (poll(&event, 1, 5000) != 1)
+            return false;
+        ssize_t n = recv(fd, buffer + got, size - got, 0);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+/// Appends a request of queries.
+static void put_request(std::string *request, int op,
+                        const std::vector<std::string> &queries)
+{
+    std::string frame;
+    frame.push_back(static_cast<char>(op));
+    put_uint32(&frame, queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        put_uint32(&frame, queries[i].size());
+        frame += queries[i];
+    }
+    put_uint32(request, frame.size());
+    *request += frame;
+}
+
+/// Appends the answer the server is expected to give.
+static void put_expected(const trie *dict, int op, const std::string &query,
+                         std::string *answer)
+{
+    trie::value_type value;
+    if (op == EXACT_QUERY) {
+        if (dict->search(query.data(), query.size(), &value)) {
+            put_uint32(answer, 1);
+            put_uint32(answer, value);
+        } else {
+            put_uint32(answer, 0);
+        }
+        return;
+    }
+    std::vector<std::pair<std::string, trie::value_type> > found;
+    if (op == PREFIX_QUERY) {
+        trie::result_buffer result;
+        dict->prefix_search(trie::key_type(query.data(), query.size()),
+                            &result);
+        for (size_t i = 0; i < result.size(); i++)
+            found.push_back(std::make_pair(result.key_string(i),
+                                           result.value(i)));
+    } else {
+        for (size_t i = 1; i <= query.size(); i++)
+            if (dict->search(query.data(), i, &value))
+                found.push_back(std::make_pair(query.substr(0, i), value));
+    }
+    put_uint32(answer, found.size());
+    for (size_t i = 0; i < found.size(); i++) {
+        put_uint32(answer, found[i].second);
+        put_uint32(answer, found[i].first.size());
+        *answer += found[i].first;
+    }
+}
+
+/// Reads responses and checks them against expected in order.
+static bool check_responses(int fd, const std::vector<std::string> &expected)
+{
+    for (size_t i = 0; i < expected.size(); i++) {
+        char header[4];
+        if (!recv_all(fd, header, sizeof(header))) {
+            printf("\nTEST FAILED on response %lu!\n",
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+        std::string response(get_uint32(header), '\0');
+        if ((response.size() && !recv_all(fd, &response[0], response.size()))
+            || response != expected[i]) {
+            printf("\nTEST FAILED on answer %lu!\n",
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Sends requests of all ops at once and checks responses in order.
+static bool check_answers(const trie *dict)
+{
+    int ops[] = {EXACT_QUERY, PREFIX_QUERY, COMMON_PREFIX_QUERY};
+    std::string request;
+    std::vector<std::string> expected;
+    size_t i, j, k;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        for (j = 0; j < kWords * 2; j += 997) {
+            std::vector<std::string> queries;
+            std::string answer;
+            for (k = j; k < j + 16; k++) {
+                std::string word = make_word(k);
+                // short prefixes for prefix queries, misses for others
+                if (ops[i] == PREFIX_QUERY)
+                    word.resize(std::min<size_t>(word.size(), 4));
+                else if (k % 3 == 0)
+                    word += "h";
+                queries.push_back(word);
+                put_expected(dict, ops[i], word, &answer);
+            }
+            put_request(&request, ops[i], queries);
+            expected.push_back(answer);
+        }
+    }
+    // an empty request has an empty response
+    put_request(&request, EXACT_QUERY, std::vector<std::string>());
+    expected.push_back("");
+
+    int fd = connect_server();
+    send_all(fd, request);
+    bool ok = check_responses(fd, expected);
+    close(fd);
+    return ok;
+}
+
+/**
+ * Pipelines requests whose responses are far over the high water of
+ * the server, sending from another process while reading.
+ */
+static bool check_pipelined(const trie *dict)
+{
+    std::string request;
+    std::vector<std::string> expected;
+    size_t i, total = 0;
+
+    for (i = 0; total < 5 * kHighWater; i++) {
+        std::vector<std::string> queries(1, std::string(1, 'a' + i % 7));
+        std::string answer;
+        put_expected(dict, PREFIX_QUERY, queries[0], &answer);
+        put_request(&request, PREFIX_QUERY, queries);
+        expected.push_back(answer);
+        total += answer.size();
+    }
+    int fd = connect_server();
+    pid_t pid = fork();
+    if (pid == 0) {
+        send_all(fd, request);
+        _exit(0);
+    }
+    bool ok = check_responses(fd, expected);
+    close(fd);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+/// Checks the server closes the connection of a malformed request.
+static bool check_closed(const std::string &request, const char *name)
+{
+    int fd = connect_server();
+    char buffer[256];
+    send_all(fd, request);
+    pollfd event = {fd, POLLIN, 0};
+    if (poll(&event, 1, 5000) != 1 || recv(fd, buffer, sizeof(buffer), 0)) {
+        printf("\nTEST FAILED on %s!\n", name);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = argc > 1?argv[1]:"src/trie_server";
+    size_t i;
+
+    printf("libxtree regress testing (server)\n");
+    printf("=================================\n");
+
+    trie *dict = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < kWords; i++)
+        dict->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+    dict->build(archive);
+    delete dict;
+    dict = trie::create_trie(archive);
+
+    unlink(address);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(server, server, "-a", address, "-T", "2", archive,
+              static_cast<char *>(NULL));
+        printf("\nTEST FAILED on running %s!\n", server);
+        _exit(1);
+    }
+
+    // exact, prefix and common-prefix answers match the library
+    if (!check_answers(dict))
+        exit(0);
+    printf(".");
+
+    // buffered requests are answered after a drain of the output
+    if (!check_pipelined(dict))
+        exit(0);
+    printf(".");
+
+    // malformed frames close the connection only
+    std::string request;
+    put_uint32(&request, 3);
+    request += std::string("\x01\x00\x00", 3);
+    if (!check_closed(request, "a short frame"))
+        exit(0);
+    request.clear();
+    put_uint32(&request, kMaxFrameSize + 1);
+    if (!check_closed(request, "an oversized frame"))
+        exit(0);
+    request.clear();
+    put_uint32(&request, 5);
+    request.push_back(9);
+    put_uint32(&request, 0);
+    if (!check_closed(request, "an unknown op"))
+        exit(0);
+    request.clear();
+    put_uint32(&request, 9);
+    request.push_back(EXACT_QUERY);
+    put_uint32(&request, 1);
+    put_uint32(&request, 100);
+    if (!check_closed(request, "an oversized query"))
+        exit(0);
+    request.clear();
+    put_uint32(&request, 5);
+    request.push_back(EXACT_QUERY);
+    put_uint32(&request, 0xffffffff);
+    if (!check_closed(request, "a wrong count"))
+        exit(0);
+    printf(".");
+
+    // and the server keeps answering
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0 || !check_answers(dict)) {
+        printf("\nTEST FAILED on server after malformed frames!\n");
+        exit(0);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("\nTEST FAILED on stopping server!\n");
+        exit(0);
+    }
+    delete dict;
+    unlink(archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,196 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <set>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_engine.h"
+
+using namespace dutil;
+
+static const size_t kWords = 30000;
+
+/// Returns a word, some of them prefixes of others.
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    size_t n = seed / 2;
+    do {
+        word.push_back('a' + n % 11);
+        n /= 11;
+    } while (n);
+    if (seed % 2 == 0)
+        return word + static_cast<char>('m' + seed / 2 % 13);
+    return seed % 16 == 1?word:word + "q";
+}
+
+/// Returns size of a file.
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st)?0:st.st_size;
+}
+
+/// Returns keys of all results of a prefix search.
+static std::set<std::string> prefix_keys(const trie *mtrie,
+                                         const std::string &prefix)
+{
+    trie::result_buffer result;
+    std::set<std::string> keys;
+    mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                         &result);
+    for (size_t i = 0; i < result.size(); i++) {
+        if (result.value(i) != 0)
+            keys.insert("#value");
+        keys.insert(result.key_string(i));
+    }
+    return keys;
+}
+
+/// Checks a set answers as the trie it was built from, with value 0.
+static bool check_set(const trie *set, const trie *plain, const char *name)
+{
+    trie::value_type value;
+    size_t i;
+    for (i = 0; i < kWords * 2; i++) {
+        // misses too, cut or grown from keys
+        std::string word = make_word(i % kWords);
+        if (i >= kWords)
+            word += i % 2?"z":"";
+        if (i >= kWords && i % 2 == 0)
+            word.resize(word.size() - 1);
+        bool found = plain->search(word.c_str(), word.size(), NULL);
+        value = 1;
+        if (set->search(word.c_str(), word.size(), &value) != found
+            || (found && value != 0)
+            || set->search(trie::key_type(word.c_str(), word.size()), NULL)
+               != found
+            || (i < kWords && !found)) {
+            printf("\nTEST FAILED on %s, word %lu!\n", name,
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    const char *prefixes[] = {"", "a", "ba", "cab"};
+    for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        std::set<std::string> keys = prefix_keys(set, prefixes[i]);
+        std::set<std::string> expected = prefix_keys(plain, prefixes[i]);
+        expected.erase("#value");
+        if (keys != expected || keys.empty()) {
+            printf("\nTEST FAILED on %s, prefix %s!\n", name, prefixes[i]);
+            return false;
+        }
+    }
+    trie::stats_type set_stats, plain_stats;
+    set->stats(&set_stats);
+    plain->stats(&plain_stats);
+    if (set_stats.keys != plain_stats.keys) {
+        printf("\nTEST FAILED on %s, stats!\n", name);
+        return false;
+    }
+    return true;
+}
+
+/// Checks an engine of layout finds all keys of a set archive.
+template <typename Layout>
+static bool check_engine(const char *filename, const char *name)
+{
+    struct stat st;
+    bool ok = true;
+    trie::value_type value;
+    int fd = open(filename, O_RDONLY);
+    fstat(fd, &st);
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    trie_engine<Layout> engine(data, st.st_size);
+    for (size_t i = 0; i < kWords && ok; i++) {
+        value = 1;
+        ok = engine.search(make_word(i), &value) && value == 0
+             && !engine.search(make_word(i) + "z", NULL);
+    }
+    // a layout with values refuses a set
+    try {
+        trie_engine<flat_layout> flat(data, st.st_size);
+        ok = false;
+    } catch (const bad_trie_archive &e) {
+    }
+    munmap(data, st.st_size);
+    if (!ok)
+        printf("\nTEST FAILED on %s engine!\n", name);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_set";
+    const char *plain_archive = "/tmp/regress_set_plain";
+    static const unsigned int kOptions[] = {0, trie::ARCHIVE_PACKED,
+                                            trie::ARCHIVE_FILTER};
+    size_t i, j;
+
+    printf("libxtree regress testing (set)\n");
+    printf("==============================\n");
+
+    for (j = 0; j < 4; j++) {
+        trie::trie_type type = j == 0?trie::SINGLE_TRIE:trie::DOUBLE_TRIE;
+        unsigned int options = j == 0?0:kOptions[j - 1];
+        trie *mtrie = trie::create_trie(type);
+        for (i = 0; i < kWords; i++)
+            mtrie->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+        // erased keys leave nothing behind in a set
+        mtrie->insert("gone", 4, 7);
+        mtrie->erase(trie::key_type("gone", 4));
+        mtrie->set_archive_options(options);
+        mtrie->build(plain_archive);
+        mtrie->set_archive_options(options | trie::ARCHIVE_SET);
+        mtrie->build(archive);
+        delete mtrie;
+
+        trie *plain = trie::create_trie(plain_archive);
+        trie *set = trie::create_trie(archive);
+        if (!check_set(set, plain, j == 0?"tail":"two"))
+            exit(0);
+        delete plain;
+        delete set;
+        if (file_size(archive) >= file_size(plain_archive)) {
+            printf("\nTEST FAILED on size, %lu >= %lu!\n",
+                   static_cast<unsigned long>(file_size(archive)),
+                   static_cast<unsigned long>(file_size(plain_archive)));
+            exit(0);
+        }
+        if ((j == 1 || j == 3) && !check_engine<set_layout>(archive, "set"))
+            exit(0);
+        if (j == 2 && !check_engine<packed_set_layout>(archive, "packed"))
+            exit(0);
+        printf(".");
+    }
+
+    // payloads are values, a set has none
+    for (j = 0; j < 2; j++) {
+        trie *mtrie = trie::create_trie(j?trie::DOUBLE_TRIE
+                                         :trie::SINGLE_TRIE);
+        mtrie->insert_payload(trie::key_type("word", 4), "payload", 7);
+        mtrie->set_archive_options(trie::ARCHIVE_SET);
+        try {
+            mtrie->build(archive);
+            printf("\nTEST FAILED on payload!\n");
+            exit(0);
+        } catch (const std::runtime_error &e) {
+        }
+        delete mtrie;
+    }
+    unlink(archive);
+    unlink(plain_archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
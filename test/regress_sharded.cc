@@ -0,0 +1,168 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 40000;
+static const size_t kWriters = 4;
+
+typedef std::map<std::string, trie::value_type> expect_type;
+
+static sharded_trie *sharded;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 17);
+        seed /= 17;
+    } while (seed);
+    return word;
+}
+
+static bool check_words(const sharded_trie *dict, const expect_type &expect)
+{
+    sharded_trie::batch_type batch;
+    size_t i;
+    for (i = 0; i < kWords; i++)
+        batch.push_back(std::make_pair(make_word(i), 0));
+    size_t found = dict->search_batch(&batch, -1, 3);
+    if (found != expect.size()) {
+        printf("\nTEST FAILED on found %lu != %lu!\n",
+               static_cast<unsigned long>(found),
+               static_cast<unsigned long>(expect.size()));
+        return false;
+    }
+    for (i = 0; i < batch.size(); i++) {
+        expect_type::const_iterator it = expect.find(batch[i].first);
+        trie::value_type value;
+        if (batch[i].second != (it == expect.end()?-1:it->second)
+            || dict->search(batch[i].first.c_str(), batch[i].first.size(),
+                            &value) != (it != expect.end())) {
+            printf("\nTEST FAILED on '%s'!\n", batch[i].first.c_str());
+            return false;
+        }
+    }
+    // prefix search is merged from shards in order
+    const char *prefixes[] = {"", "b", "ca"};
+    for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        trie::key_type prefix(prefixes[i], strlen(prefixes[i]));
+        trie::result_type result;
+        dict->prefix_search(prefix, &result);
+        expect_type::const_iterator it = expect.lower_bound(prefixes[i]);
+        size_t j;
+        for (j = 0; j < result.size(); j++, it++) {
+            if (it == expect.end() || it->first != result[j].first.c_str()
+                || it->second != result[j].second) {
+                printf("\nTEST FAILED on prefix '%s'!\n", prefixes[i]);
+                return false;
+            }
+        }
+        if (it != expect.end()
+            && it->first.compare(0, strlen(prefixes[i]), prefixes[i]) == 0) {
+            printf("\nTEST FAILED on prefix '%s' missing '%s'!\n",
+                   prefixes[i], it->first.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *writer(void *arg)
+{
+    size_t id = reinterpret_cast<size_t>(arg), i;
+    for (i = kWords / 2 + id; i < kWords; i += kWriters)
+        sharded->insert(make_word(i).c_str(), make_word(i).size(), i);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    sharded_trie::routing_type routing[] = {sharded_trie::ROUTE_BY_HASH,
+                                            sharded_trie::ROUTE_BY_PREFIX};
+    const char *archive = "/tmp/regress_sharded";
+    size_t i, j;
+
+    printf("libxtree regress testing (sharded)\n");
+    printf("==================================\n");
+
+    // ranges split at samples spread text keys over all shards
+    std::vector<std::string> samples;
+    for (j = 0; j < kWords; j += 97)
+        samples.push_back(make_word(j));
+    const bool sampled[] = {false, true};
+    for (i = 0; i < 2; i++) {
+        std::vector<size_t> load(16, 0);
+        sharded = new sharded_trie(16, sharded_trie::ROUTE_BY_PREFIX,
+                                   sampled[i]?&samples:NULL);
+        for (j = 0; j < kWords; j++)
+            load[sharded->route(trie::key_type(make_word(j).c_str(),
+                                               make_word(j).size()))]++;
+        delete sharded;
+        size_t most = *std::max_element(load.begin(), load.end());
+        if ((most <= kWords / 8) != sampled[i]) {
+            printf("\nTEST FAILED on %lu keys of a shard!\n",
+                   static_cast<unsigned long>(most));
+            exit(0);
+        }
+    }
+
+    for (i = 0; i < sizeof(routing) / sizeof(routing[0]); i++) {
+        expect_type expect;
+        sharded_trie::batch_type batch;
+        printf("routing %d: ", routing[i]);
+        sharded = new sharded_trie(7, routing[i], &samples);
+
+        // batch inserts
+        for (j = 0; j < kWords / 2; j++) {
+            batch.push_back(std::make_pair(make_word(j), j));
+            expect[make_word(j)] = j;
+        }
+        sharded->insert_batch(batch, 4);
+        if (!check_words(sharded, expect))
+            exit(0);
+        printf(".");
+
+        // inserts from many threads
+        pthread_t threads[kWriters];
+        for (j = 0; j < kWriters; j++)
+            pthread_create(&threads[j], NULL, writer,
+                           reinterpret_cast<void *>(j));
+        for (j = 0; j < kWriters; j++)
+            pthread_join(threads[j], NULL);
+        for (j = kWords / 2; j < kWords; j++)
+            expect[make_word(j)] = j;
+        for (j = 0; j < kWords; j += 5) {
+            trie::key_type key(make_word(j).c_str(), make_word(j).size());
+            sharded->erase(key);
+            expect.erase(make_word(j));
+        }
+        if (!check_words(sharded, expect))
+            exit(0);
+        printf(".");
+
+        // one archive of all shards
+        sharded->build(archive);
+        delete sharded;
+        sharded = new sharded_trie(archive);
+        if (sharded->shards() != 7 || !check_words(sharded, expect))
+            exit(0);
+        delete sharded;
+        printf(". ok\n");
+    }
+    unlink(archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,185 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 11);
+        seed /= 11;
+    } while (seed);
+    return word;
+}
+
+/// Checks words [0, count) have values expect and others are missing.
+static bool check_words(const trie *mtrie, size_t count,
+                        const std::vector<trie::value_type> &expect)
+{
+    size_t i;
+    for (i = 0; i < expect.size(); i++) {
+        std::string word = make_word(i);
+        trie::key_type key(word.c_str(), word.size());
+        trie::value_type value;
+        bool found = mtrie->search(key, &value);
+        bool present = i < count && expect[i] != 0;
+        if (found != present || (found && value != expect[i])) {
+            printf("\nTEST FAILED on '%s'!\n", word.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    const trie *snapshot;
+    const std::vector<trie::value_type> *expect;
+    size_t count;
+    bool ok;
+} reader_type;
+
+static void *reader(void *arg)
+{
+    reader_type *r = static_cast<reader_type *>(arg);
+    size_t round;
+    r->ok = true;
+    for (round = 0; round < 5 && r->ok; round++)
+        r->ok = check_words(r->snapshot, r->count, *r->expect);
+    return NULL;
+}
+
+/// Checks words [0, count) have their payloads and others are missing.
+static bool check_payloads(const trie *mtrie, size_t count)
+{
+    size_t i, length;
+    const char *payload;
+    for (i = 0; i < kWords; i++) {
+        std::string word = make_word(i);
+        trie::key_type key(word.c_str(), word.size());
+        bool found = mtrie->search_payload(key, &payload, &length);
+        if (found != (i < count)
+            || (found && std::string(payload, length) != word + word)) {
+            printf("\nTEST FAILED on payload of '%s'!\n", word.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t i, j;
+    trie::trie_type type[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *archive = "/tmp/regress_snapshot";
+
+    printf("libxtree regress testing (snapshot)\n");
+    printf("===================================\n");
+
+    for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        std::vector<trie::value_type> expect(kWords), before;
+        printf("type %d: ", type[i]);
+        for (j = 0; j < kWords / 2; j++) {
+            expect[j] = j + 1;
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j + 1);
+        }
+
+        // changes after a snapshot are invisible to it
+        trie *first = mtrie->snapshot();
+        before = expect;
+        for (j = 0; j < kWords / 2; j += 3) {
+            trie::key_type key(make_word(j).c_str(), make_word(j).size());
+            mtrie->erase(key);
+            expect[j] = 0;
+        }
+        for (j = 1; j < kWords / 2; j += 3) {
+            expect[j] = j + 7;
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j + 7);
+        }
+        for (j = kWords / 2; j < kWords; j++) {
+            expect[j] = j + 1;
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j + 1);
+        }
+        if (!check_words(first, kWords / 2, before)
+            || !check_words(mtrie, kWords, expect))
+            exit(0);
+        printf(".");
+
+        // a snapshot read by another thread while the writer goes on
+        trie *second = mtrie->snapshot();
+        delete first;
+        std::vector<trie::value_type> middle = expect;
+        reader_type r = {second, &middle, kWords, false};
+        pthread_t thread;
+        pthread_create(&thread, NULL, reader, &r);
+        for (j = 0; j < kWords; j += 2) {
+            expect[j] = j + 11;
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j + 11);
+        }
+        pthread_join(thread, NULL);
+        if (!r.ok || !check_words(mtrie, kWords, expect))
+            exit(0);
+        printf(".");
+
+        // a snapshot builds the same archive as the trie it was taken
+        trie *third = mtrie->snapshot();
+        third->build(archive);
+        trie *loaded = trie::create_trie(archive);
+        if (!check_words(loaded, kWords, expect))
+            exit(0);
+        delete loaded;
+        printf(".");
+
+        // snapshots outlive the trie
+        delete mtrie;
+        if (!check_words(second, kWords, middle)
+            || !check_words(third, kWords, expect))
+            exit(0);
+        delete second;
+        delete third;
+        printf(".");
+
+        // payloads appended after a snapshot are invisible to it
+        mtrie = trie::create_trie(type[i]);
+        for (j = 0; j < kWords / 2; j++) {
+            std::string word = make_word(j);
+            mtrie->insert_payload(trie::key_type(word.c_str(), word.size()),
+                                  (word + word).data(), word.size() * 2);
+        }
+        first = mtrie->snapshot();
+        for (j = kWords / 2; j < kWords; j++) {
+            std::string word = make_word(j);
+            mtrie->insert_payload(trie::key_type(word.c_str(), word.size()),
+                                  (word + word).data(), word.size() * 2);
+        }
+        second = mtrie->snapshot();
+        delete mtrie;
+        if (!check_payloads(first, kWords / 2)
+            || !check_payloads(second, kWords))
+            exit(0);
+        second->build(archive);
+        loaded = trie::create_trie(archive);
+        if (!check_payloads(loaded, kWords))
+            exit(0);
+        delete loaded;
+        delete first;
+        delete second;
+        printf(". ok\n");
+    }
+    unlink(archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,117 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+static const size_t kWords = 20000;
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 5);
+        seed /= 5;
+    } while (seed);
+    return word + "tion";
+}
+
+static size_t sum(const std::vector<size_t> &histogram)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < histogram.size(); i++)
+        total += histogram[i];
+    return total;
+}
+
+static bool check_stats(const trie *mtrie, size_t keys)
+{
+    trie::stats_type stats;
+    mtrie->stats(&stats);
+    if (stats.keys != keys || sum(stats.depth) != keys
+        || stats.out_degree.empty() || stats.out_degree[0] != keys) {
+        printf("\nTEST FAILED on %lu keys != %lu!\n",
+               static_cast<unsigned long>(stats.keys),
+               static_cast<unsigned long>(keys));
+        return false;
+    }
+    for (size_t i = 0; i < stats.arrays.size(); i++) {
+        if (stats.arrays[i].used > stats.arrays[i].size
+            || stats.arrays[i].bytes == 0) {
+            printf("\nTEST FAILED on array %s!\n", stats.arrays[i].name);
+            return false;
+        }
+    }
+    // every key shares a suffix "tion" in rear trie
+    if (stats.rear_references > 0
+        && stats.rear_references < stats.rear_suffixes * 2) {
+        printf("\nTEST FAILED on rear sharing %lu / %lu!\n",
+               static_cast<unsigned long>(stats.rear_references),
+               static_cast<unsigned long>(stats.rear_suffixes));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    trie::trie_type type[] = {trie::SINGLE_TRIE, trie::DOUBLE_TRIE};
+    const char *archive = "/tmp/regress_stats";
+    size_t i, j;
+
+    printf("libxtree regress testing (stats)\n");
+    printf("================================\n");
+
+    for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+        trie *mtrie = trie::create_trie(type[i]);
+        printf("type %d: ", type[i]);
+        for (j = 0; j < kWords; j++)
+            mtrie->insert(make_word(j).c_str(), make_word(j).size(), j);
+        if (!check_stats(mtrie, kWords))
+            exit(0);
+        // hot path counters are not built in
+        trie::stats_type plain;
+        mtrie->stats(&plain);
+        if (!plain.counters.empty() || !plain.histograms.empty()) {
+            printf("\nTEST FAILED on counters!\n");
+            exit(0);
+        }
+        printf(".");
+
+        // erased keys go to free lists
+        for (j = 0; j < kWords; j += 2) {
+            trie::key_type key(make_word(j).c_str(), make_word(j).size());
+            mtrie->erase(key);
+        }
+        trie::stats_type stats;
+        mtrie->stats(&stats);
+        if (!check_stats(mtrie, kWords / 2) || stats.free_lists.empty()
+            || stats.free_lists[0].second == 0 || stats.heap.empty()) {
+            printf("\nTEST FAILED on free lists!\n");
+            exit(0);
+        }
+        printf(".");
+
+        // an archive has the same keys and no builder-side structures
+        mtrie->build(archive);
+        delete mtrie;
+        mtrie = trie::create_trie(archive);
+        mtrie->stats(&stats);
+        if (!check_stats(mtrie, kWords / 2) || !stats.heap.empty()) {
+            printf("\nTEST FAILED on archive!\n");
+            exit(0);
+        }
+        delete mtrie;
+        printf(". ok\n");
+    }
+    unlink(archive);
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,165 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_server.h"
+
+using namespace dutil;
+
+// more queries than a batch of trietool
+static const size_t kQueries = 150000;
+
+static const char *archive = "/tmp/regress_tool";
+static const char *lines = "/tmp/regress_tool.lines";
+static const char *prefixed = "/tmp/regress_tool.prefixed";
+
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    do {
+        word.push_back('a' + seed % 11);
+        seed /= 11;
+    } while (seed);
+    return word;
+}
+
+/// Runs command, returns its output and sets status to its exit code.
+static std::string run(const std::string &command, int *status)
+{
+    std::string output;
+    char buffer[65536];
+    size_t n;
+    FILE *pipe = popen(command.c_str(), "r");
+    while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+        output.append(buffer, n);
+    int code = pclose(pipe);
+    *status = WIFEXITED(code)?WEXITSTATUS(code):-1;
+    return output;
+}
+
+/// Checks output of trietool has a line of each query as trie::search.
+static bool check_output(const trie *dict,
+                         const std::vector<std::string> &queries,
+                         const std::string &command)
+{
+    std::string expected;
+    trie::value_type value;
+    char buf[32];
+    int status;
+
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (dict->search(queries[i].data(), queries[i].size(), &value)) {
+            snprintf(buf, sizeof(buf), "%ld", static_cast<long>(value));
+            expected += buf;
+        } else {
+            expected += "-";
+        }
+        expected += "\n";
+    }
+    std::string output = run(command, &status);
+    if (status != 0 || output != expected) {
+        printf("\nTEST FAILED on '%s', %lu != %lu bytes!\n", command.c_str(),
+               static_cast<unsigned long>(output.size()),
+               static_cast<unsigned long>(expected.size()));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string tool = argc > 1?argv[1]:"src/trietool";
+    std::vector<std::string> queries;
+    std::string data;
+    size_t i;
+    int status;
+
+    printf("libxtree regress testing (tool)\n");
+    printf("===============================\n");
+
+    // keys with bytes only a length prefix can carry
+    trie *dict = trie::create_trie(trie::DOUBLE_TRIE);
+    for (i = 0; i < kQueries / 2; i++)
+        dict->insert(make_word(i).c_str(), make_word(i).size(), i + 1);
+    dict->insert("new\nline", 8, 7);
+    dict->insert(std::string("nul\0byte", 8).data(), 8, 8);
+    dict->build(archive);
+    delete dict;
+    dict = trie::create_trie(archive);
+
+    // lines, half of them missing, and an empty one
+    for (i = 0; i < kQueries; i++)
+        queries.push_back(make_word(i * 7));
+    queries.push_back("");
+    for (i = 0; i < queries.size(); i++)
+        data += queries[i] + "\n";
+    FILE *out = fopen(lines, "w");
+    fwrite(data.data(), 1, data.size(), out);
+    fclose(out);
+    if (!check_output(dict, queries, tool + " -f " + lines + " " + archive)
+        || !check_output(dict, queries,
+                         tool + " -T 3 -f " + lines + " " + archive)
+        || !check_output(dict, queries,
+                         tool + " -T 4 -f - " + archive + " < " + lines))
+        exit(0);
+    printf(".");
+
+    // length-prefixed queries may hold any bytes
+    queries.push_back("new\nline");
+    queries.push_back(std::string("nul\0byte", 8));
+    data.clear();
+    for (i = 0; i < queries.size(); i++) {
+        put_uint32(&data, queries[i].size());
+        data += queries[i];
+    }
+    out = fopen(prefixed, "w");
+    fwrite(data.data(), 1, data.size(), out);
+    fclose(out);
+    if (!check_output(dict, queries,
+                      tool + " -L -f " + prefixed + " " + archive)
+        || !check_output(dict, queries,
+                         tool + " -L -T 3 -f " + prefixed + " " + archive))
+        exit(0);
+    printf(".");
+
+    // a length beyond reason is refused, and so is a truncated query
+    data.clear();
+    put_uint32(&data, 0xffffffff);
+    data += "abc";
+    out = fopen(prefixed, "w");
+    fwrite(data.data(), 1, data.size(), out);
+    fclose(out);
+    std::string output = run(tool + " -L -f " + prefixed + " " + archive
+                             + " 2>&1", &status);
+    if (status != 1 || output.find("too long") == std::string::npos) {
+        printf("\nTEST FAILED on a long length prefix!\n");
+        exit(0);
+    }
+    data.clear();
+    put_uint32(&data, 10);
+    data += "abc";
+    out = fopen(prefixed, "w");
+    fwrite(data.data(), 1, data.size(), out);
+    fclose(out);
+    run(tool + " -L -f " + prefixed + " " + archive + " 2>/dev/null",
+        &status);
+    if (status != 1) {
+        printf("\nTEST FAILED on a truncated query!\n");
+        exit(0);
+    }
+    delete dict;
+    unlink(archive);
+    unlink(lines);
+    unlink(prefixed);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,233 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <set>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_engine.h"
+
+using namespace dutil;
+
+static const size_t kWords = 30000;
+
+/// Appends a code point in UTF-8.
+static void append_utf8(int point, std::string *word)
+{
+    if (point < 0x80) {
+        word->push_back(point);
+    } else if (point < 0x800) {
+        word->push_back(0xc0 | point >> 6);
+        word->push_back(0x80 | (point & 0x3f));
+    } else if (point < 0x10000) {
+        word->push_back(0xe0 | point >> 12);
+        word->push_back(0x80 | (point >> 6 & 0x3f));
+        word->push_back(0x80 | (point & 0x3f));
+    } else {
+        word->push_back(0xf0 | point >> 18);
+        word->push_back(0x80 | (point >> 12 & 0x3f));
+        word->push_back(0x80 | (point >> 6 & 0x3f));
+        word->push_back(0x80 | (point & 0x3f));
+    }
+}
+
+/// Returns a word of CJK characters, common ones far more often.
+static std::string make_word(size_t seed)
+{
+    std::string word;
+    size_t length = 2 + seed % 3;
+    seed = seed * 2654435761u;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t r = (seed >> 8) % 4000;
+        append_utf8(0x4e00 + r * r / 4000, &word);
+    }
+    // some words mix in latin letters
+    if (length == 4)
+        word += "ab";
+    return word;
+}
+
+/// Returns size of a file.
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st)?0:st.st_size;
+}
+
+static bool check_trie(const trie *mtrie, const std::vector<std::string> &words)
+{
+    size_t i;
+    trie::value_type value;
+    for (i = 0; i < words.size(); i++) {
+        if (!mtrie->search(words[i].c_str(), words[i].size(), &value)
+            || value != static_cast<trie::value_type>(i + 1)
+            || !mtrie->search(trie::key_type(words[i].c_str(),
+                                             words[i].size()), &value)
+            || value != static_cast<trie::value_type>(i + 1)) {
+            printf("\nTEST FAILED on word %lu!\n",
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    // found keys are decoded back into UTF-8
+    std::string prefix = words[0].substr(0, 3);
+    trie::result_buffer result;
+    std::set<std::string> found, expected;
+    mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                         &result);
+    for (i = 0; i < result.size(); i++)
+        found.insert(result.key_string(i));
+    for (i = 0; i < words.size(); i++)
+        if (words[i].compare(0, prefix.size(), prefix) == 0)
+            expected.insert(words[i]);
+    if (found != expected || found.empty()) {
+        printf("\nTEST FAILED on prefix, %lu != %lu!\n",
+               static_cast<unsigned long>(found.size()),
+               static_cast<unsigned long>(expected.size()));
+        return false;
+    }
+    // a prefix ending in the middle of a character matches nothing
+    result.clear();
+    mtrie->prefix_search(trie::key_type(prefix.data(), 2), &result);
+    if (result.size() != 0) {
+        printf("\nTEST FAILED on a broken prefix!\n");
+        return false;
+    }
+    return true;
+}
+
+/// Checks an engine over archive against words.
+static bool check_engine(const char *archive,
+                         const std::vector<std::string> &words)
+{
+    std::ifstream in(archive, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    std::vector<uint64_t> aligned(data.size() / 8 + 1);
+    memcpy(&aligned[0], data.data(), data.size());
+    trie_engine<flat_layout, trie::value_type, utf8_alphabet>
+        engine(&aligned[0], data.size());
+    trie::value_type value;
+    for (size_t i = 0; i < words.size(); i++) {
+        if (!engine.search(words[i], &value)
+            || value != static_cast<trie::value_type>(i + 1)) {
+            printf("\nTEST FAILED on engine, word %lu!\n",
+                   static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_utf8";
+    const char *plain_archive = "/tmp/regress_utf8_plain";
+    std::vector<std::string> words, samples;
+    std::set<std::string> seen;
+    size_t i;
+
+    printf("libxtree regress testing (utf8)\n");
+    printf("===============================\n");
+
+    for (i = 0; words.size() < kWords; i++) {
+        std::string word = make_word(i);
+        if (seen.insert(word).second)
+            words.push_back(word);
+    }
+    // words added later have characters and bytes not in samples
+    samples.assign(words.begin(), words.end());
+    words.push_back("\xe9\xbe\x98\xe9\xbe\x98");
+    words.push_back("\xf0\x9f\x98\x80 emoji");
+    words.push_back("bad \xff\xe4\xb8 bytes \xc0\xaf");
+
+    trie *plain = trie::create_trie(trie::DOUBLE_TRIE);
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->set_utf8_alphabet(&samples);
+    for (i = 0; i < words.size(); i++) {
+        plain->insert(words[i].c_str(), words[i].size(), i + 1);
+        mtrie->insert(words[i].c_str(), words[i].size(), i + 1);
+    }
+    if (!check_trie(mtrie, words))
+        exit(0);
+    printf(".");
+
+    // paths are shorter, so the front trie takes fewer states
+    trie::stats_type plain_stats, stats;
+    plain->stats(&plain_stats);
+    mtrie->stats(&stats);
+    if (stats.arrays[0].used >= plain_stats.arrays[0].used) {
+        printf("\nTEST FAILED on states, %lu >= %lu!\n",
+               static_cast<unsigned long>(stats.arrays[0].used),
+               static_cast<unsigned long>(plain_stats.arrays[0].used));
+        exit(0);
+    }
+    printf(".");
+
+    // the table goes with the archive and snapshots
+    trie *snapshot = mtrie->snapshot();
+    if (!check_trie(snapshot, words))
+        exit(0);
+    delete snapshot;
+    mtrie->build(archive);
+    plain->build(plain_archive);
+    delete mtrie;
+    mtrie = trie::create_trie(archive);
+    if (!check_trie(mtrie, words))
+        exit(0);
+    delete mtrie;
+    if (file_size(archive) >= file_size(plain_archive)) {
+        printf("\nTEST FAILED on size, %lu >= %lu!\n",
+               static_cast<unsigned long>(file_size(archive)),
+               static_cast<unsigned long>(file_size(plain_archive)));
+        exit(0);
+    }
+    printf(".");
+
+    // only an empty trie can be remapped
+    try {
+        plain->set_utf8_alphabet(&samples);
+        printf("\nTEST FAILED on non-empty trie!\n");
+        exit(0);
+    } catch (const std::runtime_error &e) {
+    }
+    delete plain;
+    printf(".");
+
+    // code points not in samples take one, two and then three codes,
+    // up to all CJK characters
+    std::vector<std::string> cjk;
+    for (i = 0; i < 0x5200; i++) {
+        std::string word;
+        append_utf8(0x4e00 + i, &word);
+        if (i % 2)
+            append_utf8(0x4e00 + i * 31 % 0x5200, &word);
+        cjk.push_back(word);
+    }
+    mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->set_utf8_alphabet();
+    for (i = 0; i < cjk.size(); i++)
+        mtrie->insert(cjk[i].c_str(), cjk[i].size(), i + 1);
+    if (!check_trie(mtrie, cjk))
+        exit(0);
+    mtrie->build(archive);
+    delete mtrie;
+    mtrie = trie::create_trie(archive);
+    if (!check_trie(mtrie, cjk) || !check_engine(archive, cjk))
+        exit(0);
+    delete mtrie;
+    unlink(archive);
+    unlink(plain_archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
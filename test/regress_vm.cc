@@ -0,0 +1,89 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_impl.h"
+
+using namespace dutil;
+
+/// Checks units [0, keep) are their indexes and [keep, size) are zero.
+static bool check_array(const uint32_t *array, size_t keep, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (array[i] != (i < keep?i:0)) {
+            printf("\nTEST FAILED at %lu of %lu!\n",
+                   static_cast<unsigned long>(i),
+                   static_cast<unsigned long>(size));
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t kHuge = 2 << 20;
+    uint32_t *array = NULL;
+    size_t size = 0, i;
+
+    printf("libxtree regress testing (vm)\n");
+    printf("=============================\n");
+
+    // grows in place and across reserved ranges, keeping units
+    for (size_t nsize = 1000; nsize < (64 << 20) / sizeof(uint32_t);
+         nsize = nsize * 3) {
+        array = resize(array, size, nsize);
+        if (!check_array(array, size, nsize))
+            exit(0);
+        for (i = size; i < nsize; i++)
+            array[i] = i;
+        size = nsize;
+    }
+    if (reinterpret_cast<uintptr_t>(array) % kHuge) {
+        printf("\nTEST FAILED on alignment!\n");
+        exit(0);
+    }
+    printf(".");
+
+    // units beyond a shrunk size are zero when grown again
+    array = resize(array, size, size / 2);
+    array = resize(array, size / 2, size);
+    if (!check_array(array, size / 2, size))
+        exit(0);
+    printf(".");
+
+    // grows without moving until the reserved range runs out
+    uint32_t *start = array;
+    size_t keep = size / 2;
+    while (vm_extend(array, sizeof(uint32_t) * size * 2))
+        size *= 2;
+    if (array != start || !check_array(array, keep, size))
+        exit(0);
+    resize(array, size, 0);
+    printf(".");
+
+    // tries on top of it
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    char word[16];
+    for (i = 0; i < 100000; i++) {
+        snprintf(word, sizeof(word), "%lu", static_cast<unsigned long>(i * 7));
+        mtrie->insert(word, strlen(word), i);
+    }
+    for (i = 0; i < 100000; i++) {
+        trie::value_type value;
+        snprintf(word, sizeof(word), "%lu", static_cast<unsigned long>(i * 7));
+        if (!mtrie->search(word, strlen(word), &value) || value != (int)i) {
+            printf("\nTEST FAILED on '%s'!\n", word);
+            exit(0);
+        }
+    }
+    delete mtrie;
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,159 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <unistd.h>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include "trie.h"
+
+using namespace dutil;
+
+typedef std::vector<word_trie::word_type> ngram_type;
+typedef std::map<ngram_type, word_trie::value_type> table_type;
+
+static const size_t kVocabulary = 200000;
+static const size_t kSentences = 20000;
+static const size_t kOrder = 3;
+
+static unsigned long seed = 7;
+
+/// Returns a word, small ones far more often like in a text.
+static word_trie::word_type random_word()
+{
+    seed = seed * 1103515245 + 12345;
+    unsigned long r = (seed >> 8) % kVocabulary;
+    return static_cast<word_trie::word_type>(r * r / kVocabulary);
+}
+
+/// Inserts n-grams of sentences in reverse, the newest word first.
+static void make_table(word_trie *dict, table_type *table)
+{
+    for (size_t i = 0; i < kSentences; i++) {
+        ngram_type sentence;
+        for (size_t j = 0; j < 8; j++)
+            sentence.push_back(random_word());
+        for (size_t end = 1; end <= sentence.size(); end++) {
+            ngram_type ngram;
+            for (size_t n = 1; n <= kOrder && n <= end; n++) {
+                ngram.push_back(sentence[end - n]);
+                dict->insert(&ngram[0], ngram.size(), ++(*table)[ngram]);
+            }
+        }
+    }
+}
+
+static bool check_table(const word_trie *dict, const table_type &table)
+{
+    word_trie::value_type value;
+    table_type::const_iterator it;
+    std::vector<word_trie::child_type> children;
+
+    if (dict->size() != table.size()) {
+        printf("\nTEST FAILED on size %lu != %lu!\n",
+               static_cast<unsigned long>(dict->size()),
+               static_cast<unsigned long>(table.size()));
+        return false;
+    }
+    for (it = table.begin(); it != table.end(); ++it) {
+        if (!dict->search(&it->first[0], it->first.size(), &value)
+            || value != it->second) {
+            printf("\nTEST FAILED on search!\n");
+            return false;
+        }
+    }
+    // children of the root are all unigrams, in order of words
+    size_t i = 0;
+    dict->children(NULL, 0, &children);
+    for (it = table.begin(); it != table.end(); ++it) {
+        if (it->first.size() != 1)
+            continue;
+        if (i >= children.size() || children[i].word != it->first[0]
+            || !children[i].accept || children[i].value != it->second) {
+            printf("\nTEST FAILED on children!\n");
+            return false;
+        }
+        i++;
+    }
+    if (i != children.size()) {
+        printf("\nTEST FAILED on children!\n");
+        return false;
+    }
+    // backoff finds the longest suffix context with one walk
+    for (i = 0; i < 1000; i++) {
+        ngram_type reversed;
+        for (size_t n = 0; n < kOrder + 1; n++)
+            reversed.push_back(random_word());
+        size_t expected = 0;
+        for (size_t n = 1; n <= reversed.size(); n++)
+            if (table.count(ngram_type(reversed.begin(),
+                                       reversed.begin() + n)))
+                expected = n;
+        size_t matched = dict->longest_prefix(&reversed[0], reversed.size(),
+                                              &value);
+        if (matched != expected
+            || (matched && value != table.find(ngram_type(
+                    reversed.begin(), reversed.begin() + matched))->second)) {
+            printf("\nTEST FAILED on longest prefix!\n");
+            return false;
+        }
+    }
+    word_trie::word_type missing[2] = {0, -1};
+    if (dict->search(missing, 2, &value)
+        || dict->children(missing, 2, &children) != 0) {
+        printf("\nTEST FAILED on bad words!\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_word";
+    word_trie *dict = new word_trie();
+    table_type table;
+
+    printf("libxtree regress testing (word)\n");
+    printf("===============================\n");
+
+    make_table(dict, &table);
+    if (!check_table(dict, table))
+        exit(0);
+    printf(".");
+
+    // a word far beyond the others
+    word_trie::word_type large[2] = {kVocabulary * 2, 0};
+    dict->insert(large, 1, 41);
+    dict->insert(large, 2, 42);
+    table[ngram_type(large, large + 1)] = 41;
+    table[ngram_type(large, large + 2)] = 42;
+    try {
+        large[1] = -1;
+        dict->insert(large, 2, 42);
+        printf("\nTEST FAILED on inserting a bad word!\n");
+        exit(0);
+    } catch (const std::runtime_error &e) {
+    }
+    if (!check_table(dict, table))
+        exit(0);
+    printf(".");
+
+    dict->build(archive);
+    delete dict;
+    dict = new word_trie(archive);
+    if (!check_table(dict, table))
+        exit(0);
+    try {
+        dict->insert(large, 1, 0);
+        printf("\nTEST FAILED on read-only trie!\n");
+        exit(0);
+    } catch (const std::runtime_error &e) {
+    }
+    delete dict;
+    unlink(archive);
+    printf(". ok\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et